@@ -0,0 +1,27 @@
+//
+//  alloc.cpp
+//
+//  Replaces the global operator new and delete so bench::allocation_count()
+//  sees every heap allocation. It's kept in its own translation unit so the
+//  replacements aren't inlined into the code being measured.
+//
+
+#include "bench.h"
+
+#include <cstdlib>
+#include <new>
+
+void *operator new(std::size_t size) {
+  bench::allocation_count().fetch_add(1, std::memory_order_relaxed);
+  if (auto p = std::malloc(size ? size : 1)) { return p; }
+  throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size) { return operator new(size); }
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+#ifdef __cpp_sized_deallocation
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::size_t) noexcept { std::free(p); }
+#endif
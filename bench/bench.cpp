@@ -0,0 +1,241 @@
+//
+//  bench.cpp
+//
+//  Microbenchmarks of the request parser, router, JSON and regex helpers.
+//
+//  Usage: bench [--filter=NAME] [--samples=N] [--sample-ms=MS] [--out=FILE]
+//
+//  Results go to stderr as a table, and as JSON to FILE (stdout by default).
+//
+
+#include "bench.h"
+
+#include "../regex/posix_regex.h"
+#include <httplib.h>
+#include <json.h>
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace {
+
+// Serves a request from memory and throws the response away.
+class MemoryStream : public httplib::Stream {
+public:
+  explicit MemoryStream(const std::string &data) : data_(data) {}
+
+  bool is_readable() const override { return true; }
+  bool is_writable() const override { return true; }
+
+  ssize_t read(char *ptr, size_t size) override {
+    auto n = (std::min)(size, data_.size() - pos_);
+    memcpy(ptr, data_.data() + pos_, n);
+    pos_ += n;
+    return static_cast<ssize_t>(n);
+  }
+
+  ssize_t write(const char * /*ptr*/, size_t size) override {
+    return static_cast<ssize_t>(size);
+  }
+
+  std::string get_remote_addr() const override { return "127.0.0.1"; }
+  socket_t socket() const override { return INVALID_SOCKET; }
+
+  void rewind() { pos_ = 0; }
+
+private:
+  const std::string &data_;
+  size_t pos_ = 0;
+};
+
+// Exposes the parts of the server that are measured on their own.
+class BenchServer : public httplib::Server {
+public:
+  using Server::parse_request_line;
+  using Server::process_request;
+};
+
+const char *request_line =
+    "GET /search/items?q=hello+world&lang=en&page=2 HTTP/1.1\r\n";
+
+const std::string headers = "Host: example.com\r\n"
+                            "User-Agent: bench/1.0\r\n"
+                            "Accept: text/html,application/json;q=0.9\r\n"
+                            "Accept-Encoding: gzip, deflate\r\n"
+                            "Accept-Language: en-US,en;q=0.5\r\n"
+                            "Connection: keep-alive\r\n"
+                            "Cookie: session=0123456789abcdef; theme=dark\r\n"
+                            "Cache-Control: no-cache\r\n"
+                            "\r\n";
+
+const char *query = "q=hello+world&lang=en&page=2&sort=desc&filter=a%20b%2Fc"
+                    "&from=2020-01-01&to=2020-12-31";
+
+const std::string boundary = "----bench7MA4YWxkTrZu0gW";
+
+std::string multipart_body() {
+  std::string body;
+  body += "--" + boundary + "\r\n";
+  body += "Content-Disposition: form-data; name=\"title\"\r\n\r\n";
+  body += "A short title\r\n";
+  body += "--" + boundary + "\r\n";
+  body += "Content-Disposition: form-data; name=\"description\"\r\n\r\n";
+  body += std::string(512, 'd') + "\r\n";
+  body += "--" + boundary + "\r\n";
+  body += "Content-Disposition: form-data; name=\"file\"; "
+          "filename=\"data.bin\"\r\n";
+  body += "Content-Type: application/octet-stream\r\n\r\n";
+  body += std::string(4096, 'x') + "\r\n";
+  body += "--" + boundary + "--\r\n";
+  return body;
+}
+
+const char *json_text =
+    "{\"id\": 12345, \"name\": \"cpp-httplib\", \"active\": true, "
+    "\"score\": 98.6, \"tags\": [\"http\", \"server\", \"client\"], "
+    "\"owner\": {\"login\": \"someone\", \"id\": 42, \"site_admin\": false}, "
+    "\"releases\": [{\"tag\": \"v0.1\", \"assets\": 3}, "
+    "{\"tag\": \"v0.2\", \"assets\": 5}, {\"tag\": \"v0.3\", \"assets\": 8}]}";
+
+bool starts_with(const char *arg, const char *prefix, std::string &value) {
+  auto n = strlen(prefix);
+  if (strncmp(arg, prefix, n)) { return false; }
+  value = arg + n;
+  return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  bench::Options options;
+  std::string out_path;
+  for (int i = 1; i < argc; i++) {
+    std::string value;
+    if (starts_with(argv[i], "--filter=", value)) {
+      options.filter = value;
+    } else if (starts_with(argv[i], "--samples=", value)) {
+      options.samples =
+          (std::max)(static_cast<size_t>(std::stoul(value)), size_t(1));
+    } else if (starts_with(argv[i], "--sample-ms=", value)) {
+      options.sample_msec = std::stod(value);
+    } else if (starts_with(argv[i], "--out=", value)) {
+      out_path = value;
+    } else {
+      std::cerr << "usage: " << argv[0]
+                << " [--filter=NAME] [--samples=N] [--sample-ms=MS]"
+                   " [--out=FILE]"
+                << std::endl;
+      return 1;
+    }
+  }
+
+  bench::Runner runner(options);
+
+  // Request parsing
+  BenchServer svr;
+  runner.run("parse_request_line", [&] {
+    httplib::Request req;
+    svr.parse_request_line(request_line, req);
+    bench::do_not_optimize(req);
+  });
+
+  MemoryStream header_strm(headers);
+  runner.run("read_headers", [&] {
+    header_strm.rewind();
+    httplib::Headers h;
+    httplib::detail::read_headers(header_strm, h);
+    bench::do_not_optimize(h);
+  });
+
+  runner.run("parse_query_text", [&] {
+    httplib::Params params;
+    httplib::detail::parse_query_text(query, params);
+    bench::do_not_optimize(params);
+  });
+
+  // Routing. dispatch_request is private, so it's measured through
+  // process_request, with the response written to nowhere.
+  auto handler = [](const httplib::Request & /*req*/, httplib::Response &res) {
+    res.set_content("ok", "text/plain");
+  };
+
+  BenchServer one_route;
+  one_route.Get("/hello", handler);
+  const std::string hello = "GET /hello HTTP/1.1\r\n" + headers;
+  MemoryStream hello_strm(hello);
+  runner.run("process_request/1_route", [&] {
+    hello_strm.rewind();
+    auto connection_close = false;
+    one_route.process_request(hello_strm, false, connection_close, nullptr);
+  });
+
+  BenchServer many_routes;
+  for (int i = 0; i < 50; i++) {
+    auto pattern = "/api/v1/resource" + std::to_string(i) + "/(\\d+)";
+    many_routes.Get(pattern.c_str(), handler);
+  }
+  const std::string last =
+      "GET /api/v1/resource49/12345 HTTP/1.1\r\n" + headers;
+  MemoryStream last_strm(last);
+  runner.run("dispatch_request/50_routes_last", [&] {
+    last_strm.rewind();
+    auto connection_close = false;
+    many_routes.process_request(last_strm, false, connection_close, nullptr);
+  });
+
+  // Multipart
+  const auto body = multipart_body();
+  runner.run("MultipartFormDataParser/3_parts_4k", [&] {
+    httplib::detail::MultipartFormDataParser parser;
+    parser.set_boundary(boundary);
+    size_t parts = 0;
+    parser.parse(
+        body.data(), body.size(),
+        [&](const char * /*buf*/, size_t /*n*/) { return true; },
+        [&](const httplib::MultipartFormData & /*file*/) {
+          parts++;
+          return true;
+        });
+    bench::do_not_optimize(parts);
+  });
+
+  // JSON
+  runner.run("jsonlib::JSON/parse", [&] {
+    jsonlib::JSON json(json_text);
+    json.parse_full();
+    bench::do_not_optimize(json);
+  });
+
+  jsonlib::JSON parsed(json_text);
+  parsed.parse_full();
+  runner.run("jsonlib::JSON/serialize", [&] {
+    auto s = parsed.as_str();
+    bench::do_not_optimize(s);
+  });
+
+  // Regex
+  posixhelper::regex re("([a-z]+)[[:space:]]+([a-z]+)");
+  runner.run("posixhelper::regex::exec/match", [&] {
+    posixhelper::regex::regmatch<3> m("hello world");
+    auto matched = re.exec(m);
+    bench::do_not_optimize(matched);
+  });
+  runner.run("posixhelper::regex::exec/no_match", [&] {
+    auto matched = re.exec("0123456789 !!");
+    bench::do_not_optimize(matched);
+  });
+
+  auto json = runner.to_json();
+  if (out_path.empty()) {
+    std::cout << json;
+  } else {
+    std::ofstream ofs(out_path);
+    ofs << json;
+    if (!ofs) {
+      std::cerr << "can't write " << out_path << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+}
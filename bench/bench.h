@@ -0,0 +1,186 @@
+//
+//  bench.h
+//
+//  A dependency-free microbenchmark harness. Each case is calibrated so a
+//  sample takes about `sample_msec`, warmed up, then timed over `samples`
+//  samples. Results are ns/op (mean, and percentiles over the samples) and
+//  heap allocations per op, and can be written out as JSON.
+//
+
+#ifndef BENCH_BENCH_H
+#define BENCH_BENCH_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+// Heap allocations of the process, counted by the operator new that
+// alloc.cpp replaces. It stays at zero if that file isn't linked in.
+inline std::atomic<uint64_t> &allocation_count() {
+  static std::atomic<uint64_t> count(0);
+  return count;
+}
+
+// Keeps the compiler from optimizing away a value that is otherwise unused.
+template <typename T> inline void do_not_optimize(const T &value) {
+#if defined(__GNUC__) || defined(__clang__)
+  asm volatile("" : : "r,m"(value) : "memory");
+#else
+  static volatile const void *sink;
+  sink = &value;
+#endif
+}
+
+struct Result {
+  std::string name;
+  uint64_t iterations = 0;
+  double ns_per_op = 0;
+  double allocs_per_op = 0;
+  double p50_ns = 0;
+  double p90_ns = 0;
+  double p99_ns = 0;
+  double min_ns = 0;
+};
+
+struct Options {
+  std::string filter; // runs the cases whose name contains it
+  size_t samples = 30;
+  double sample_msec = 10;
+  double warmup_msec = 50;
+};
+
+class Runner {
+public:
+  explicit Runner(Options options) : options_(std::move(options)) {}
+
+  // `fn` runs the operation once.
+  template <typename F> void run(const std::string &name, F fn) {
+    if (!options_.filter.empty() &&
+        name.find(options_.filter) == std::string::npos) {
+      return;
+    }
+
+    using clock = std::chrono::steady_clock;
+    auto elapsed_ns = [](clock::time_point start) {
+      return static_cast<double>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() -
+                                                               start)
+              .count());
+    };
+
+    // Grow the batch until it takes the length of a sample.
+    uint64_t batch = 1;
+    for (;;) {
+      auto start = clock::now();
+      for (uint64_t i = 0; i < batch; i++) {
+        fn();
+      }
+      auto ns = elapsed_ns(start);
+      if (ns >= options_.sample_msec * 1e6 || batch >= (uint64_t(1) << 40)) {
+        break;
+      }
+      auto scale = ns > 0 ? options_.sample_msec * 1e6 / ns : 10.0;
+      scale = (std::min)((std::max)(scale, 1.5), 10.0);
+      batch = static_cast<uint64_t>(static_cast<double>(batch) * scale);
+    }
+
+    auto warmup_start = clock::now();
+    while (elapsed_ns(warmup_start) < options_.warmup_msec * 1e6) {
+      for (uint64_t i = 0; i < batch; i++) {
+        fn();
+      }
+    }
+
+    std::vector<double> per_op;
+    per_op.reserve(options_.samples);
+    double total_ns = 0;
+    auto allocations = allocation_count().load();
+    for (size_t s = 0; s < options_.samples; s++) {
+      auto start = clock::now();
+      for (uint64_t i = 0; i < batch; i++) {
+        fn();
+      }
+      auto ns = elapsed_ns(start);
+      total_ns += ns;
+      per_op.push_back(ns / static_cast<double>(batch));
+    }
+    allocations = allocation_count().load() - allocations;
+
+    Result r;
+    r.name = name;
+    r.iterations = batch * options_.samples;
+    r.ns_per_op = total_ns / static_cast<double>(r.iterations);
+    r.allocs_per_op =
+        static_cast<double>(allocations) / static_cast<double>(r.iterations);
+    std::sort(per_op.begin(), per_op.end());
+    r.min_ns = per_op.front();
+    r.p50_ns = percentile(per_op, 0.50);
+    r.p90_ns = percentile(per_op, 0.90);
+    r.p99_ns = percentile(per_op, 0.99);
+
+    fprintf(stderr, "%-40s %12.1f ns/op %8.2f allocs/op  p50 %.1f  p99 %.1f\n",
+            r.name.c_str(), r.ns_per_op, r.allocs_per_op, r.p50_ns, r.p99_ns);
+    results_.push_back(r);
+  }
+
+  const std::vector<Result> &results() const { return results_; }
+
+  std::string to_json() const {
+    std::string out = "{\n  \"context\": {";
+    out += "\"time\": " + std::to_string(static_cast<long long>(time(nullptr)));
+#ifdef __VERSION__
+    out += ", \"compiler\": \"" + escape(__VERSION__) + "\"";
+#endif
+#ifdef NDEBUG
+    out += ", \"assertions\": false";
+#else
+    out += ", \"assertions\": true";
+#endif
+    out += ", \"samples\": " + std::to_string(options_.samples);
+    out += "},\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results_.size(); i++) {
+      const auto &r = results_[i];
+      char buf[256];
+      snprintf(buf, sizeof(buf),
+               "\"iterations\": %llu, \"ns_per_op\": %.3f, "
+               "\"allocs_per_op\": %.3f, \"min_ns\": %.3f, \"p50_ns\": %.3f, "
+               "\"p90_ns\": %.3f, \"p99_ns\": %.3f}",
+               static_cast<unsigned long long>(r.iterations), r.ns_per_op,
+               r.allocs_per_op, r.min_ns, r.p50_ns, r.p90_ns, r.p99_ns);
+      out += i ? ",\n    " : "\n    ";
+      out += "{\"name\": \"" + escape(r.name) + "\", " + buf;
+    }
+    out += "\n  ]\n}\n";
+    return out;
+  }
+
+private:
+  static double percentile(const std::vector<double> &sorted, double p) {
+    auto i = static_cast<size_t>(p * static_cast<double>(sorted.size() - 1) +
+                                 0.5);
+    return sorted[(std::min)(i, sorted.size() - 1)];
+  }
+
+  static std::string escape(const std::string &s) {
+    std::string out;
+    for (auto c : s) {
+      if (c == '"' || c == '\\') { out += '\\'; }
+      if (static_cast<unsigned char>(c) >= 0x20) { out += c; }
+    }
+    return out;
+  }
+
+  Options options_;
+  std::vector<Result> results_;
+};
+
+} // namespace bench
+
+#endif // BENCH_BENCH_H
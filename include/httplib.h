@@ -48,6 +48,138 @@
 #define CPPHTTPLIB_RECV_BUFSIZ size_t(4096u)
 #endif
 
+#ifndef CPPHTTPLIB_BODY_RESERVE_MAX_LENGTH
+#define CPPHTTPLIB_BODY_RESERVE_MAX_LENGTH size_t(64u * 1024u * 1024u)
+#endif
+
+#ifndef CPPHTTPLIB_HEADER_READ_TIMEOUT_SECOND
+#define CPPHTTPLIB_HEADER_READ_TIMEOUT_SECOND 0
+#endif
+
+#ifndef CPPHTTPLIB_BODY_READ_TIMEOUT_SECOND
+#define CPPHTTPLIB_BODY_READ_TIMEOUT_SECOND 0
+#endif
+
+#ifndef CPPHTTPLIB_WRITE_TIMEOUT_SECOND
+#define CPPHTTPLIB_WRITE_TIMEOUT_SECOND 0
+#endif
+
+#ifndef CPPHTTPLIB_TIMER_WHEEL_TICK_MSEC
+#define CPPHTTPLIB_TIMER_WHEEL_TICK_MSEC 10
+#endif
+
+#ifndef CPPHTTPLIB_LISTEN_BACKLOG
+#define CPPHTTPLIB_LISTEN_BACKLOG 511
+#endif
+
+#ifndef CPPHTTPLIB_TCP_NODELAY
+#define CPPHTTPLIB_TCP_NODELAY false
+#endif
+
+#ifndef CPPHTTPLIB_SEND_BUFSIZ
+#define CPPHTTPLIB_SEND_BUFSIZ size_t(16384u)
+#endif
+
+#ifndef CPPHTTPLIB_IO_URING_QUEUE_DEPTH
+#define CPPHTTPLIB_IO_URING_QUEUE_DEPTH 64
+#endif
+
+#ifndef CPPHTTPLIB_IO_URING_BUFFER_COUNT
+#define CPPHTTPLIB_IO_URING_BUFFER_COUNT 16
+#endif
+
+#ifndef CPPHTTPLIB_CONNECTION_POOL_MAX_PER_HOST
+#define CPPHTTPLIB_CONNECTION_POOL_MAX_PER_HOST 8
+#endif
+
+#ifndef CPPHTTPLIB_CONNECTION_POOL_IDLE_TIMEOUT_SECOND
+#define CPPHTTPLIB_CONNECTION_POOL_IDLE_TIMEOUT_SECOND 4
+#endif
+
+#ifndef CPPHTTPLIB_DNS_CACHE_TTL_SECOND
+#define CPPHTTPLIB_DNS_CACHE_TTL_SECOND 60
+#endif
+
+#ifndef CPPHTTPLIB_DNS_CACHE_NEGATIVE_TTL_SECOND
+#define CPPHTTPLIB_DNS_CACHE_NEGATIVE_TTL_SECOND 5
+#endif
+
+#ifndef CPPHTTPLIB_DNS_CACHE_STALE_SECOND
+#define CPPHTTPLIB_DNS_CACHE_STALE_SECOND 300
+#endif
+
+#ifndef CPPHTTPLIB_DNS_CACHE_MAX_ENTRIES
+#define CPPHTTPLIB_DNS_CACHE_MAX_ENTRIES 1024
+#endif
+
+#ifndef CPPHTTPLIB_DOWNLOAD_CONNECTION_COUNT
+#define CPPHTTPLIB_DOWNLOAD_CONNECTION_COUNT 4
+#endif
+
+#ifndef CPPHTTPLIB_DOWNLOAD_RANGE_SIZE
+#define CPPHTTPLIB_DOWNLOAD_RANGE_SIZE uint64_t(8u * 1024u * 1024u)
+#endif
+
+#ifndef CPPHTTPLIB_HEDGING_SAMPLE_COUNT
+#define CPPHTTPLIB_HEDGING_SAMPLE_COUNT 1000
+#endif
+
+#ifndef CPPHTTPLIB_RESPONSE_CACHE_MAX_SIZE
+#define CPPHTTPLIB_RESPONSE_CACHE_MAX_SIZE size_t(64u * 1024u * 1024u)
+#endif
+
+#ifndef CPPHTTPLIB_SSL_BUFSIZ
+#define CPPHTTPLIB_SSL_BUFSIZ size_t(16384u)
+#endif
+
+#ifndef CPPHTTPLIB_FILE_STREAM_MIN_SIZE
+#define CPPHTTPLIB_FILE_STREAM_MIN_SIZE size_t(64u * 1024u)
+#endif
+
+#ifndef CPPHTTPLIB_SSL_SESSION_CACHE_SIZE
+#define CPPHTTPLIB_SSL_SESSION_CACHE_SIZE 20480
+#endif
+
+#ifndef CPPHTTPLIB_SSL_TICKET_KEY_ROTATION_SECOND
+#define CPPHTTPLIB_SSL_TICKET_KEY_ROTATION_SECOND 3600
+#endif
+
+#ifndef CPPHTTPLIB_TRACE_RING_SIZE
+#define CPPHTTPLIB_TRACE_RING_SIZE 4096
+#endif
+
+#ifndef CPPHTTPLIB_PROFILE_MAX_SECOND
+#define CPPHTTPLIB_PROFILE_MAX_SECOND 60
+#endif
+
+#ifndef CPPHTTPLIB_PROFILE_MAX_SAMPLES
+#define CPPHTTPLIB_PROFILE_MAX_SAMPLES 16384
+#endif
+
+#ifndef CPPHTTPLIB_PROFILE_MAX_DEPTH
+#define CPPHTTPLIB_PROFILE_MAX_DEPTH 64
+#endif
+
+#ifndef CPPHTTPLIB_ACCESS_LOG_RING_SIZE
+#define CPPHTTPLIB_ACCESS_LOG_RING_SIZE 2048
+#endif
+
+#ifndef CPPHTTPLIB_ACCESS_LOG_FLUSH_MSECOND
+#define CPPHTTPLIB_ACCESS_LOG_FLUSH_MSECOND 100
+#endif
+
+#ifndef CPPHTTPLIB_ACCESS_LOG_MAX_FILE_SIZE
+#define CPPHTTPLIB_ACCESS_LOG_MAX_FILE_SIZE 0
+#endif
+
+#ifndef CPPHTTPLIB_ASYNC_CLIENT_MAX_CONNECTIONS
+#define CPPHTTPLIB_ASYNC_CLIENT_MAX_CONNECTIONS 64
+#endif
+
+#ifndef CPPHTTPLIB_ASYNC_CLIENT_HEADER_MAX_LENGTH
+#define CPPHTTPLIB_ASYNC_CLIENT_HEADER_MAX_LENGTH size_t(64u * 1024u)
+#endif
+
 #ifndef CPPHTTPLIB_THREAD_POOL_COUNT
 #define CPPHTTPLIB_THREAD_POOL_COUNT                                           \
   ((std::max)(1u, std::thread::hardware_concurrency() - 1))
@@ -118,12 +250,22 @@ using socket_t = SOCKET;
 #include <ifaddrs.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #ifdef CPPHTTPLIB_USE_POLL
 #include <poll.h>
 #endif
 #include <csignal>
 #include <pthread.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#elif !defined(CPPHTTPLIB_USE_POLL)
+#include <poll.h>
+#endif
 #include <sys/select.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include <dirent.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
@@ -131,30 +273,64 @@ using socket_t = int;
 #define INVALID_SOCKET (-1)
 #endif //_WIN32
 
+#ifdef CPPHTTPLIB_USE_IO_URING
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#else
+#undef CPPHTTPLIB_USE_IO_URING
+#endif
+#endif
+
+#ifdef CPPHTTPLIB_PROFILER
+#ifndef _WIN32
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <sys/time.h>
+#else
+#undef CPPHTTPLIB_PROFILER
+#endif
+#endif
+
 #include <array>
 #include <atomic>
 #include <cassert>
+#include <cmath>
 #include <condition_variable>
+#include <deque>
 #include <errno.h>
 #include <fcntl.h>
 #include <fstream>
 #include <functional>
+#include <future>
 #include <list>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <random>
 #include <regex>
+#include <sstream>
 #include <string>
 #include <sys/stat.h>
 #include <thread>
+#include <unordered_map>
 
 #ifdef CPPHTTPLIB_OPENSSL_SUPPORT
 #include <openssl/err.h>
 #include <openssl/md5.h>
+#include <openssl/rand.h>
 #include <openssl/ssl.h>
 #include <openssl/x509v3.h>
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
 #include <iomanip>
 #include <iostream>
 #include <sstream>
@@ -190,6 +366,12 @@ struct ci {
   }
 };
 
+class canceler;
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+struct ssl_stream_state;
+class SSLSocketStream;
+#endif
+
 } // namespace detail
 
 using Headers = std::multimap<std::string, std::string, detail::ci>;
@@ -211,6 +393,16 @@ struct MultipartFormData {
 using MultipartFormDataItems = std::vector<MultipartFormData>;
 using MultipartFormDataMap = std::multimap<std::string, MultipartFormData>;
 
+// A multipart item whose content is read from the file at `path` as the
+// request is sent.
+struct MultipartFormDataFile {
+  std::string name;
+  std::string path;
+  std::string filename;
+  std::string content_type;
+};
+using MultipartFormDataFiles = std::vector<MultipartFormDataFile>;
+
 class DataSink {
 public:
   DataSink() = default;
@@ -222,6 +414,10 @@ public:
   std::function<void(const char *data, size_t data_len)> write;
   std::function<void()> done;
   std::function<bool()> is_writable;
+  // Sends part of a file straight from the descriptor, if the stream can.
+  // Returns the bytes sent, 0 when the file ended early, or -1 to have the
+  // caller read and write() it.
+  std::function<ssize_t(int fd, uint64_t offset, size_t length)> write_file;
 };
 
 using ContentProvider =
@@ -256,6 +452,35 @@ public:
 using Range = std::pair<ssize_t, ssize_t>;
 using Ranges = std::vector<Range>;
 
+struct SocketOptions {
+  // Listen queue length (server only).
+  int backlog = CPPHTTPLIB_LISTEN_BACKLOG;
+  bool tcp_nodelay = CPPHTTPLIB_TCP_NODELAY;
+  // TCP_DEFER_ACCEPT: wake the acceptor only once data has arrived, waiting
+  // at most this many seconds (server only, Linux).
+  int defer_accept_sec = 0;
+  // TCP_FASTOPEN: the pending TFO queue length on a server, any non-zero
+  // value enables TCP_FASTOPEN_CONNECT on a client.
+  int tcp_fastopen = 0;
+  // SO_SNDBUF / SO_RCVBUF in bytes; 0 keeps the system default.
+  int send_buffer_size = 0;
+  int receive_buffer_size = 0;
+  // Keep a spare descriptor open so that, on EMFILE, pending connections can
+  // be accepted and closed instead of spinning on a full accept queue.
+  bool reserve_fd = true;
+};
+
+struct DownloadOptions {
+  // Ranges fetched at the same time, each over its own connection.
+  size_t connection_count = CPPHTTPLIB_DOWNLOAD_CONNECTION_COUNT;
+  uint64_t range_size = CPPHTTPLIB_DOWNLOAD_RANGE_SIZE;
+  // Bytes per second across all connections; 0 means no limit.
+  size_t bandwidth_limit = 0;
+  // Picks up an interrupted download where it left off, as long as the
+  // server reports the same ETag or Last-Modified as before.
+  bool resume = true;
+};
+
 struct Request {
   std::string method;
   std::string path;
@@ -275,9 +500,14 @@ struct Request {
   ResponseHandler response_handler;
   ContentReceiver content_receiver;
   Progress progress;
+  char *body_buffer = nullptr;
+  size_t body_buffer_size = 0;
 
 #ifdef CPPHTTPLIB_OPENSSL_SUPPORT
   const SSL *ssl;
+  // On the server, the request came at least in part as TLS early data,
+  // which an attacker can replay.
+  bool early_data = false;
 #endif
 
   bool has_header(const char *key) const;
@@ -298,6 +528,7 @@ struct Request {
   // private members...
   size_t content_length;
   ContentProvider content_provider;
+  std::shared_ptr<detail::canceler> canceler;
 };
 
 struct Response {
@@ -353,6 +584,17 @@ public:
   virtual ssize_t read(char *ptr, size_t size) = 0;
   virtual ssize_t write(const char *ptr, size_t size) = 0;
   virtual std::string get_remote_addr() const = 0;
+  virtual socket_t socket() const = 0;
+
+  // Streams that coalesce writes send out whatever they are holding.
+  virtual bool flush() { return true; }
+
+  // Streams that can send from a file descriptor without a copy through user
+  // space do so. -1 means the caller has to read the data and write() it.
+  virtual ssize_t send_file(int /*fd*/, uint64_t /*offset*/,
+                            size_t /*size*/) {
+    return -1;
+  }
 
   template <typename... Args>
   ssize_t write_format(const char *fmt, const Args &... args);
@@ -438,2480 +680,6946 @@ private:
   std::mutex mutex_;
 };
 
-using Logger = std::function<void(const Request &, const Response &)>;
-
-class Server {
+// Hierarchical timer wheel. `add` and `cancel` are O(1); a background thread
+// advances the wheel one tick at a time and cascades timers from the coarse
+// levels down as their expiry approaches. Callbacks run on the wheel thread,
+// so they should be short (e.g. shutting down a socket).
+class TimerWheel {
 public:
-  using Handler = std::function<void(const Request &, Response &)>;
-  using HandlerWithContentReader = std::function<void(
-      const Request &, Response &, const ContentReader &content_reader)>;
-  using Expect100ContinueHandler =
-      std::function<int(const Request &, Response &)>;
+  using TimerId = uint64_t;
 
-  Server();
+  explicit TimerWheel(std::chrono::milliseconds tick =
+                          std::chrono::milliseconds(
+                              CPPHTTPLIB_TIMER_WHEEL_TICK_MSEC))
+      : tick_(tick.count() > 0 ? tick : std::chrono::milliseconds(1)) {}
 
-  virtual ~Server();
+  TimerWheel(const TimerWheel &) = delete;
+  TimerWheel &operator=(const TimerWheel &) = delete;
 
-  virtual bool is_valid() const;
+  ~TimerWheel() { stop(); }
 
-  Server &Get(const char *pattern, Handler handler);
-  Server &Post(const char *pattern, Handler handler);
-  Server &Post(const char *pattern, HandlerWithContentReader handler);
-  Server &Put(const char *pattern, Handler handler);
-  Server &Put(const char *pattern, HandlerWithContentReader handler);
-  Server &Patch(const char *pattern, Handler handler);
-  Server &Patch(const char *pattern, HandlerWithContentReader handler);
-  Server &Delete(const char *pattern, Handler handler);
-  Server &Options(const char *pattern, Handler handler);
+  void start() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (running_) { return; }
+    running_ = true;
+    base_ = std::chrono::steady_clock::now() - tick_ * current_tick_;
+    thread_ = std::thread([this] { run(); });
+  }
 
-  [[deprecated]] bool set_base_dir(const char *dir,
-                                   const char *mount_point = nullptr);
-  bool set_mount_point(const char *mount_point, const char *dir);
-  bool remove_mount_point(const char *mount_point);
-  void set_file_extension_and_mimetype_mapping(const char *ext,
-                                               const char *mime);
-  void set_file_request_handler(Handler handler);
+  void stop() {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (!running_) { return; }
+      running_ = false;
+    }
+    cond_.notify_all();
+    thread_.join();
+  }
 
-  void set_error_handler(Handler handler);
-  void set_logger(Logger logger);
+  TimerId add(std::chrono::milliseconds timeout, std::function<void()> fn) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    sync_idle_clock();
 
-  void set_expect_100_continue_handler(Expect100ContinueHandler handler);
+    auto round_up = tick_ - std::chrono::milliseconds(1);
+    auto ticks = static_cast<uint64_t>((timeout + round_up) / tick_);
+    auto id = next_id_++;
 
-  void set_keep_alive_max_count(size_t count);
-  void set_read_timeout(time_t sec, time_t usec);
-  void set_payload_max_length(size_t length);
+    Slot timer;
+    timer.push_back(Timer{id, current_tick_ + (std::max)(ticks, uint64_t(1)),
+                          std::move(fn)});
+    schedule(timer);
 
-  bool bind_to_port(const char *host, int port, int socket_flags = 0);
-  int bind_to_any_port(const char *host, int socket_flags = 0);
-  bool listen_after_bind();
+    cond_.notify_all();
+    return id;
+  }
 
-  bool listen(const char *host, int port, int socket_flags = 0);
+  // Returns true if the timer was removed before it fired. When the callback
+  // is running on the wheel thread, this waits for it to finish, so the
+  // resources it touches can be released safely after `cancel` returns.
+  bool cancel(TimerId id) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = index_.find(id);
+    if (it != index_.end()) {
+      const auto &loc = it->second;
+      slot_at(loc.level, loc.slot).erase(loc.it);
+      index_.erase(it);
+      return true;
+    }
+    if (std::this_thread::get_id() != thread_.get_id()) {
+      cond_.wait(lock, [&] { return running_id_ != id; });
+    }
+    return false;
+  }
 
-  bool is_running() const;
-  void stop();
+  size_t size() const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return index_.size();
+  }
 
-  std::function<TaskQueue *(void)> new_task_queue;
+private:
+  static const size_t kLevelBits = 6;
+  static const size_t kSlotCount = size_t(1) << kLevelBits;
+  static const size_t kLevelCount = 4;
+
+  struct Timer {
+    TimerId id;
+    uint64_t expires;
+    std::function<void()> fn;
+  };
+  using Slot = std::list<Timer>;
 
-protected:
-  bool process_request(Stream &strm, bool last_connection,
-                       bool &connection_close,
-                       const std::function<void(Request &)> &setup_request);
+  struct Location {
+    size_t level;
+    size_t slot;
+    Slot::iterator it;
+  };
 
-  size_t keep_alive_max_count_;
-  time_t read_timeout_sec_;
-  time_t read_timeout_usec_;
-  size_t payload_max_length_;
+  Slot &slot_at(size_t level, size_t slot) {
+    return level < kLevelCount ? wheels_[level][slot] : expired_;
+  }
 
-private:
-  using Handlers = std::vector<std::pair<std::regex, Handler>>;
-  using HandlersForContentReader =
-      std::vector<std::pair<std::regex, HandlerWithContentReader>>;
+  // Moves the single timer in `from` into the slot matching its expiry.
+  void schedule(Slot &from) {
+    auto it = from.begin();
+    auto delta = it->expires > current_tick_ ? it->expires - current_tick_ : 0;
+    if (delta == 0) { it->expires = current_tick_ + 1; }
 
-  socket_t create_server_socket(const char *host, int port,
-                                int socket_flags) const;
-  int bind_internal(const char *host, int port, int socket_flags);
-  bool listen_internal();
+    size_t level = 0;
+    while (level + 1 < kLevelCount &&
+           delta >= (uint64_t(1) << (kLevelBits * (level + 1)))) {
+      level++;
+    }
 
-  bool routing(Request &req, Response &res, Stream &strm);
-  bool handle_file_request(Request &req, Response &res, bool head = false);
-  bool dispatch_request(Request &req, Response &res, Handlers &handlers);
-  bool dispatch_request_for_content_reader(Request &req, Response &res,
-                                           ContentReader content_reader,
-                                           HandlersForContentReader &handlers);
+    auto expires = it->expires;
+    if (level + 1 == kLevelCount) {
+      // Clamp far-away timers to the horizon of the outermost level; they are
+      // re-cascaded until they come within range.
+      auto horizon = current_tick_ +
+                     (uint64_t(1) << (kLevelBits * kLevelCount)) -
+                     (uint64_t(1) << (kLevelBits * level));
+      expires = (std::min)(expires, horizon);
+    }
 
-  bool parse_request_line(const char *s, Request &req);
-  bool write_response(Stream &strm, bool last_connection, const Request &req,
-                      Response &res);
-  bool write_content_with_provider(Stream &strm, const Request &req,
-                                   Response &res, const std::string &boundary,
-                                   const std::string &content_type);
-  bool read_content(Stream &strm, Request &req, Response &res);
-  bool
-  read_content_with_content_receiver(Stream &strm, Request &req, Response &res,
-                                     ContentReceiver receiver,
-                                     MultipartContentHeader multipart_header,
-                                     ContentReceiver multipart_receiver);
-  bool read_content_core(Stream &strm, Request &req, Response &res,
-                         ContentReceiver receiver,
-                         MultipartContentHeader mulitpart_header,
-                         ContentReceiver multipart_receiver);
+    auto slot = static_cast<size_t>((expires >> (kLevelBits * level)) &
+                                    (kSlotCount - 1));
+    auto &dst = wheels_[level][slot];
+    dst.splice(dst.end(), from, it);
+    index_[dst.back().id] = Location{level, slot, std::prev(dst.end())};
+  }
 
-  virtual bool process_and_close_socket(socket_t sock);
+  void cascade(size_t level) {
+    auto slot = static_cast<size_t>((current_tick_ >> (kLevelBits * level)) &
+                                    (kSlotCount - 1));
+    Slot timers;
+    timers.swap(wheels_[level][slot]);
+    while (!timers.empty()) {
+      schedule(timers);
+    }
+    if (slot == 0 && level + 1 < kLevelCount) { cascade(level + 1); }
+  }
 
-  std::atomic<bool> is_running_;
-  std::atomic<socket_t> svr_sock_;
-  std::vector<std::pair<std::string, std::string>> base_dirs_;
-  std::map<std::string, std::string> file_extension_and_mimetype_map_;
-  Handler file_request_handler_;
-  Handlers get_handlers_;
-  Handlers post_handlers_;
-  HandlersForContentReader post_handlers_for_content_reader_;
-  Handlers put_handlers_;
-  HandlersForContentReader put_handlers_for_content_reader_;
-  Handlers patch_handlers_;
-  HandlersForContentReader patch_handlers_for_content_reader_;
-  Handlers delete_handlers_;
-  Handlers options_handlers_;
-  Handler error_handler_;
-  Logger logger_;
-  Expect100ContinueHandler expect_100_continue_handler_;
-};
+  // Advances one tick and moves due timers to `expired_`.
+  void advance() {
+    current_tick_++;
+    auto slot = static_cast<size_t>(current_tick_ & (kSlotCount - 1));
+    if (slot == 0) { cascade(1); }
 
-class Client {
-public:
-  explicit Client(const std::string &host, int port = 80,
-                  const std::string &client_cert_path = std::string(),
-                  const std::string &client_key_path = std::string());
+    auto &due = wheels_[0][slot];
+    for (auto it = due.begin(); it != due.end(); ++it) {
+      index_[it->id] = Location{kLevelCount, 0, it};
+    }
+    expired_.splice(expired_.end(), due);
+  }
 
-  virtual ~Client();
+  // With no pending timers the wheel thread sleeps, so the tick counter is
+  // brought forward without walking every slot in between.
+  void sync_idle_clock() {
+    if (!running_ || !index_.empty()) { return; }
+    auto elapsed = std::chrono::steady_clock::now() - base_;
+    auto now_tick = static_cast<uint64_t>(elapsed / tick_);
+    if (now_tick > current_tick_) { current_tick_ = now_tick; }
+  }
 
-  virtual bool is_valid() const;
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (running_) {
+      if (index_.empty()) {
+        cond_.wait(lock);
+        continue;
+      }
 
-  std::shared_ptr<Response> Get(const char *path);
+      cond_.wait_until(lock, base_ + tick_ * (current_tick_ + 1));
+      if (!running_) { break; }
 
-  std::shared_ptr<Response> Get(const char *path, const Headers &headers);
+      auto elapsed = std::chrono::steady_clock::now() - base_;
+      auto now_tick = static_cast<uint64_t>(elapsed / tick_);
+      while (current_tick_ < now_tick) {
+        advance();
+      }
 
-  std::shared_ptr<Response> Get(const char *path, Progress progress);
+      while (!expired_.empty()) {
+        auto timer = std::move(expired_.front());
+        expired_.pop_front();
+        index_.erase(timer.id);
+
+        running_id_ = timer.id;
+        lock.unlock();
+        timer.fn();
+        lock.lock();
+        running_id_ = 0;
+        cond_.notify_all();
+      }
+    }
+  }
 
-  std::shared_ptr<Response> Get(const char *path, const Headers &headers,
-                                Progress progress);
+  const std::chrono::milliseconds tick_;
+  std::chrono::steady_clock::time_point base_;
+  uint64_t current_tick_ = 0;
+  TimerId next_id_ = 1;
+  TimerId running_id_ = 0;
 
-  std::shared_ptr<Response> Get(const char *path,
-                                ContentReceiver content_receiver);
+  std::array<std::array<Slot, kSlotCount>, kLevelCount> wheels_;
+  Slot expired_;
+  std::unordered_map<TimerId, Location> index_;
 
-  std::shared_ptr<Response> Get(const char *path, const Headers &headers,
-                                ContentReceiver content_receiver);
+  bool running_ = false;
+  std::thread thread_;
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+};
 
-  std::shared_ptr<Response>
-  Get(const char *path, ContentReceiver content_receiver, Progress progress);
+// Keeps idle keep-alive connections for reuse across requests. A pool can be
+// shared by any number of clients and threads; connections are looked up by
+// a key naming the origin (and proxy) they are connected to.
+class ConnectionPool {
+public:
+  struct Connection {
+    socket_t sock = INVALID_SOCKET;
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+    SSL *ssl = nullptr;
+#endif
+  };
 
-  std::shared_ptr<Response> Get(const char *path, const Headers &headers,
-                                ContentReceiver content_receiver,
-                                Progress progress);
+  explicit ConnectionPool(
+      size_t max_per_host = CPPHTTPLIB_CONNECTION_POOL_MAX_PER_HOST,
+      time_t idle_timeout_sec =
+          CPPHTTPLIB_CONNECTION_POOL_IDLE_TIMEOUT_SECOND);
 
-  std::shared_ptr<Response> Get(const char *path, const Headers &headers,
-                                ResponseHandler response_handler,
-                                ContentReceiver content_receiver);
-
-  std::shared_ptr<Response> Get(const char *path, const Headers &headers,
-                                ResponseHandler response_handler,
-                                ContentReceiver content_receiver,
-                                Progress progress);
+  ~ConnectionPool();
 
-  std::shared_ptr<Response> Head(const char *path);
-
-  std::shared_ptr<Response> Head(const char *path, const Headers &headers);
-
-  std::shared_ptr<Response> Post(const char *path, const std::string &body,
-                                 const char *content_type);
+  ConnectionPool(const ConnectionPool &) = delete;
+  ConnectionPool &operator=(const ConnectionPool &) = delete;
 
-  std::shared_ptr<Response> Post(const char *path, const Headers &headers,
-                                 const std::string &body,
-                                 const char *content_type);
+  // Limits connections per key, idle and checked out together. 0 means no
+  // limit.
+  void set_max_per_host(size_t count);
+  // Idle connections older than this are closed rather than reused.
+  void set_idle_timeout(time_t sec);
 
-  std::shared_ptr<Response> Post(const char *path, size_t content_length,
-                                 ContentProvider content_provider,
-                                 const char *content_type);
+  // Hands out the most recently used idle connection that passes a health
+  // check. Without one, `conn` is left closed and a slot is reserved for a
+  // new connection, waiting up to `timeout_sec` while the key is at its
+  // limit. Returns false when no slot became free in time.
+  bool checkout(const std::string &key, Connection &conn, time_t timeout_sec);
+  // Gives back a connection that can carry another request.
+  void checkin(const std::string &key, const Connection &conn);
+  // Closes a checked out connection (if open) and frees its slot.
+  void discard(const std::string &key, const Connection &conn);
 
-  std::shared_ptr<Response> Post(const char *path, const Headers &headers,
-                                 size_t content_length,
-                                 ContentProvider content_provider,
-                                 const char *content_type);
+  size_t idle_count() const;
+  void clear();
 
-  std::shared_ptr<Response> Post(const char *path, const Params &params);
+private:
+  struct IdleConnection {
+    Connection conn;
+    std::chrono::steady_clock::time_point since;
+  };
 
-  std::shared_ptr<Response> Post(const char *path, const Headers &headers,
-                                 const Params &params);
+  struct Host {
+    std::list<IdleConnection> idle;
+    size_t checked_out = 0;
+  };
 
-  std::shared_ptr<Response> Post(const char *path,
-                                 const MultipartFormDataItems &items);
+  using HostMap = std::map<std::string, Host>;
 
-  std::shared_ptr<Response> Post(const char *path, const Headers &headers,
-                                 const MultipartFormDataItems &items);
+  static bool is_alive(const Connection &conn);
+  static void close(const Connection &conn);
 
-  std::shared_ptr<Response> Put(const char *path, const std::string &body,
-                                const char *content_type);
+  void collect_expired(Host &host, std::vector<Connection> &expired);
+  void sweep(std::vector<Connection> &expired);
+  void erase_if_unused(HostMap::iterator it);
 
-  std::shared_ptr<Response> Put(const char *path, const Headers &headers,
-                                const std::string &body,
-                                const char *content_type);
+  size_t max_per_host_;
+  std::chrono::seconds idle_timeout_;
+  HostMap hosts_;
+  std::chrono::steady_clock::time_point next_sweep_;
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+};
 
-  std::shared_ptr<Response> Put(const char *path, size_t content_length,
-                                ContentProvider content_provider,
-                                const char *content_type);
+// Caches name lookups for client connections. A cache can be shared by any
+// number of clients and threads. Once an entry expires, its addresses are
+// still handed out for a while and refreshed in the background, so the
+// request path only waits on the resolver for names it hasn't seen yet.
+// Threads missing the same name share a single lookup. Failed lookups are
+// cached too, for a shorter time. Entries beyond a count are evicted, least
+// recently used first.
+class DnsCache {
+public:
+  struct Address {
+    int family = 0;
+    int socktype = 0;
+    int protocol = 0;
+    struct sockaddr_storage addr;
+    socklen_t addrlen = 0;
+  };
 
-  std::shared_ptr<Response> Put(const char *path, const Headers &headers,
-                                size_t content_length,
-                                ContentProvider content_provider,
-                                const char *content_type);
+  using Addresses = std::vector<Address>;
+  using Resolver = std::function<bool(const std::string &host, int port,
+                                      Addresses &addrs)>;
 
-  std::shared_ptr<Response> Put(const char *path, const Params &params);
+  explicit DnsCache(
+      time_t ttl_sec = CPPHTTPLIB_DNS_CACHE_TTL_SECOND,
+      time_t negative_ttl_sec = CPPHTTPLIB_DNS_CACHE_NEGATIVE_TTL_SECOND);
 
-  std::shared_ptr<Response> Put(const char *path, const Headers &headers,
-                                const Params &params);
+  ~DnsCache();
 
-  std::shared_ptr<Response> Patch(const char *path, const std::string &body,
-                                  const char *content_type);
+  DnsCache(const DnsCache &) = delete;
+  DnsCache &operator=(const DnsCache &) = delete;
 
-  std::shared_ptr<Response> Patch(const char *path, const Headers &headers,
-                                  const std::string &body,
-                                  const char *content_type);
+  void set_ttl(time_t sec);
+  void set_negative_ttl(time_t sec);
+  // How long past its TTL an entry is still served while it's refreshed. 0
+  // makes expired entries resolve again on the request path.
+  void set_stale_time(time_t sec);
+  // 0 means no limit.
+  void set_max_entries(size_t count);
+  // Replaces getaddrinfo(), say with a stub for tests.
+  void set_resolver(Resolver resolver);
 
-  std::shared_ptr<Response> Patch(const char *path, size_t content_length,
-                                  ContentProvider content_provider,
-                                  const char *content_type);
+  // Returns false when the name doesn't resolve.
+  bool resolve(const std::string &host, int port, Addresses &addrs);
 
-  std::shared_ptr<Response> Patch(const char *path, const Headers &headers,
-                                  size_t content_length,
-                                  ContentProvider content_provider,
-                                  const char *content_type);
+  enum class Lookup { Found, Failed, Missing };
 
-  std::shared_ptr<Response> Delete(const char *path);
+  // Answers from the cache alone, without waiting on the resolver. Failed is
+  // a cached failure, and Missing a name resolve() would have to look up.
+  Lookup lookup(const std::string &host, int port, Addresses &addrs);
 
-  std::shared_ptr<Response> Delete(const char *path, const std::string &body,
-                                   const char *content_type);
+  size_t size() const;
+  void clear();
 
-  std::shared_ptr<Response> Delete(const char *path, const Headers &headers);
+  static bool system_resolve(const std::string &host, int port,
+                             Addresses &addrs);
 
-  std::shared_ptr<Response> Delete(const char *path, const Headers &headers,
-                                   const std::string &body,
-                                   const char *content_type);
+private:
+  struct Entry {
+    std::string host;
+    int port = 0;
+    std::shared_ptr<const Addresses> addrs; // nullptr for a failed lookup
+    std::chrono::steady_clock::time_point expires;
+    std::chrono::steady_clock::time_point retry_after;
+    bool refreshing = false;
+    bool resolving = false;
+    std::list<std::string>::iterator lru;
+  };
 
-  std::shared_ptr<Response> Options(const char *path);
+  static std::string make_key(const std::string &host, int port);
+
+  Lookup find(const std::string &key, Addresses &addrs);
+  Entry &touch(const std::string &key);
+  void evict();
+  void store(const std::string &key, const std::string &host, int port,
+             bool ok, Addresses &&addrs);
+  void refresh();
+
+  std::chrono::seconds ttl_;
+  std::chrono::seconds negative_ttl_;
+  std::chrono::seconds stale_time_;
+  size_t max_entries_;
+  Resolver resolver_;
+  std::unordered_map<std::string, Entry> entries_;
+  std::list<std::string> lru_;
+  std::condition_variable resolved_cond_;
+
+  std::list<std::string> refresh_queue_;
+  bool shutdown_ = false;
+  std::thread refresher_;
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+};
 
-  std::shared_ptr<Response> Options(const char *path, const Headers &headers);
+class Client;
 
-  bool send(const Request &req, Response &res);
+// Hedging and retries for idempotent requests, shared by any number of
+// clients. Once a request has waited longer than a percentile of recent
+// response times, a duplicate goes out, to the next alternate client if
+// there are any, and the first response wins. Requests that fail or get a
+// 502, 503 or 504 are retried. Both are paid from a budget that plain
+// requests refill, so they can't multiply load on a struggling backend.
+class HedgingPolicy {
+public:
+  HedgingPolicy();
 
-  bool send(const std::vector<Request> &requests,
-            std::vector<Response> &responses);
+  HedgingPolicy(const HedgingPolicy &) = delete;
+  HedgingPolicy &operator=(const HedgingPolicy &) = delete;
 
-  void set_timeout_sec(time_t timeout_sec);
+  // 0.95 hedges the slowest 5% of requests.
+  void set_percentile(double percentile);
+  // Hedging waits at least this long, and only starts after enough
+  // response times have been seen.
+  void set_min_delay(time_t msec);
+  // Each request adds `ratio` to the budget, up to `burst`, and each hedge or
+  // retry takes 1.
+  void set_budget(double ratio, double burst);
+  void set_max_retries(size_t count);
+  void add_alternate(std::shared_ptr<Client> cli);
 
-  void set_read_timeout(time_t sec, time_t usec);
+  size_t hedge_count() const;
+  size_t retry_count() const;
 
-  void set_keep_alive_max_count(size_t count);
+private:
+  friend class Client;
+
+  void deposit();
+  bool allow_hedge();
+  bool allow_retry(size_t retries);
+  void record(std::chrono::steady_clock::duration latency);
+  bool hedge_delay(std::chrono::milliseconds &delay) const;
+  std::shared_ptr<Client> next_alternate();
+
+  double percentile_ = 0.95;
+  std::chrono::milliseconds min_delay_ = std::chrono::milliseconds(1);
+  double budget_ratio_ = 0.1;
+  double budget_burst_ = 10;
+  double budget_ = 10;
+  size_t max_retries_ = 1;
+  std::vector<std::shared_ptr<Client>> alternates_;
+  size_t next_alternate_ = 0;
+
+  std::vector<double> samples_; // seconds, as a ring
+  size_t next_sample_ = 0;
+  // The percentile of the samples, worked out again every so many samples
+  // rather than for each request.
+  std::chrono::milliseconds sample_delay_ = std::chrono::milliseconds(0);
+  bool has_sample_delay_ = false;
+  size_t stale_samples_ = 0;
+
+  size_t hedge_count_ = 0;
+  size_t retry_count_ = 0;
+  mutable std::mutex mutex_;
+
+  // Sends the duplicates of requests still waiting when their delay passes.
+  TimerWheel timers_;
+};
 
-  void set_basic_auth(const char *username, const char *password);
+// Keeps GET responses for reuse, shared by any number of clients. Fresh
+// responses (Cache-Control: max-age) are served from memory. Stale ones are
+// revalidated with If-None-Match or If-Modified-Since, and a 304 serves the
+// kept body again. Memory is bounded by size with LRU eviction. An optional
+// disk tier holds more, and survives restarts. Requests with credentials,
+// private responses and responses setting cookies are never cached.
+class ResponseCache {
+public:
+  explicit ResponseCache(size_t max_size = CPPHTTPLIB_RESPONSE_CACHE_MAX_SIZE);
 
-#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
-  void set_digest_auth(const char *username, const char *password);
-#endif
+  ResponseCache(const ResponseCache &) = delete;
+  ResponseCache &operator=(const ResponseCache &) = delete;
 
-  void set_follow_location(bool on);
+  // Also writes responses as files under `dir`, an existing directory, up to
+  // `max_size` bytes. It's read on a memory miss. Files left there by an
+  // earlier run are taken over, the most recently written kept first.
+  void set_disk_tier(const std::string &dir, size_t max_size);
 
-  void set_compress(bool on);
+  size_t size() const;
+  size_t count() const;
+  void clear();
 
-  void set_interface(const char *intf);
+private:
+  friend class Client;
 
-  void set_proxy(const char *host, int port);
+  struct Entry {
+    Response res;
+    std::chrono::system_clock::time_point expires;
+    size_t size = 0;
+  };
 
-  void set_proxy_basic_auth(const char *username, const char *password);
+  using EntryPtr = std::shared_ptr<const Entry>;
+
+  EntryPtr lookup(const std::string &key);
+  void store(const std::string &key, const Response &res,
+             std::chrono::system_clock::time_point expires);
+
+  void insert(const std::string &key, EntryPtr entry);
+  static std::string file_name(const std::string &key);
+  std::string file_path(const std::string &key) const;
+  void evict_files(std::vector<std::string> &evicted);
+  EntryPtr read_file(const std::string &key);
+  void write_file(const std::string &key, const Entry &entry);
+
+  size_t max_size_;
+  size_t size_ = 0;
+  std::list<std::string> lru_;
+  std::unordered_map<
+      std::string, std::pair<EntryPtr, std::list<std::string>::iterator>>
+      entries_;
+
+  std::string dir_;
+  size_t max_disk_size_ = 0;
+  size_t disk_size_ = 0;
+  std::list<std::string> disk_lru_;
+  std::unordered_map<std::string,
+                     std::pair<size_t, std::list<std::string>::iterator>>
+      files_;
+
+  mutable std::mutex mutex_;
+};
 
-#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
-  void set_proxy_digest_auth(const char *username, const char *password);
-#endif
+// Latencies in microseconds, in HDR-style buckets: one per value below 16,
+// then eight per power of two, so a percentile is off by at most 12.5%.
+struct LatencyHistogram {
+  static const size_t bucket_count = 304;
 
-  void set_logger(Logger logger);
+  static size_t bucket_index(uint64_t usec);
+  // Values in the bucket are below this.
+  static uint64_t bucket_upper_bound(size_t index);
 
-protected:
-  bool process_request(Stream &strm, const Request &req, Response &res,
-                       bool last_connection, bool &connection_close);
+  // Upper bound of the bucket holding the percentile, e.g. 0.99.
+  uint64_t percentile(double p) const;
 
-  const std::string host_;
-  const int port_;
-  const std::string host_and_port_;
+  std::vector<uint64_t> buckets = std::vector<uint64_t>(bucket_count);
+  uint64_t count = 0;
+  uint64_t sum_usec = 0;
+};
 
-  // Settings
-  std::string client_cert_path_;
-  std::string client_key_path_;
+// Heap allocations, counted when CPPHTTPLIB_ALLOCATION_STATS is defined.
+struct AllocationStats {
+  uint64_t count = 0;
+  uint64_t bytes = 0;
+};
 
-  time_t timeout_sec_ = 300;
-  time_t read_timeout_sec_ = CPPHTTPLIB_READ_TIMEOUT_SECOND;
-  time_t read_timeout_usec_ = CPPHTTPLIB_READ_TIMEOUT_USECOND;
+// Allocations of requests by phase, split as the latencies are.
+struct RequestAllocations {
+  AllocationStats parse;
+  AllocationStats handler;
+  AllocationStats write;
+};
 
-  size_t keep_alive_max_count_ = CPPHTTPLIB_KEEPALIVE_MAX_COUNT;
+struct RouteMetrics {
+  std::string method;
+  // Pattern of the handler. It's empty for files from mount points and for
+  // requests no handler took.
+  std::string route;
+  std::map<int, uint64_t> status_counts;
+  uint64_t request_body_bytes = 0;
+  uint64_t response_body_bytes = 0;
+  LatencyHistogram parse;   // request line and headers
+  LatencyHistogram handler; // routing, which includes reading the body
+  LatencyHistogram write;   // the response
+  RequestAllocations allocations;
+};
 
-  std::string basic_auth_username_;
-  std::string basic_auth_password_;
-#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
-  std::string digest_auth_username_;
-  std::string digest_auth_password_;
-#endif
+struct MetricsSnapshot {
+  std::vector<RouteMetrics> routes;
+  int64_t active_connections = 0; // being served by a worker
+  int64_t queued_connections = 0; // waiting for a worker
+};
 
-  bool follow_location_ = false;
+// Request metrics of a Server. Each thread records into a shard of its own
+// with plain atomic stores, so requests take no lock; a snapshot adds the
+// shards up.
+class Metrics {
+public:
+  Metrics();
 
-  bool compress_ = false;
+  Metrics(const Metrics &) = delete;
+  Metrics &operator=(const Metrics &) = delete;
 
-  std::string interface_;
+  MetricsSnapshot snapshot() const;
+  // Prometheus text exposition format.
+  std::string to_prometheus() const;
 
-  std::string proxy_host_;
-  int proxy_port_;
+private:
+  friend class Server;
+  friend class SSLServer;
 
-  std::string proxy_basic_auth_username_;
-  std::string proxy_basic_auth_password_;
-#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
-  std::string proxy_digest_auth_username_;
-  std::string proxy_digest_auth_password_;
-#endif
+  struct HistogramShard {
+    std::atomic<uint64_t> buckets[LatencyHistogram::bucket_count];
+    std::atomic<uint64_t> sum_usec;
 
-  Logger logger_;
+    void record(std::chrono::steady_clock::duration d);
+    void add_to(LatencyHistogram &h) const;
+  };
 
-  void copy_settings(const Client &rhs) {
-    client_cert_path_ = rhs.client_cert_path_;
-    client_key_path_ = rhs.client_key_path_;
-    timeout_sec_ = rhs.timeout_sec_;
-    read_timeout_sec_ = rhs.read_timeout_sec_;
-    read_timeout_usec_ = rhs.read_timeout_usec_;
-    keep_alive_max_count_ = rhs.keep_alive_max_count_;
-    basic_auth_username_ = rhs.basic_auth_username_;
-    basic_auth_password_ = rhs.basic_auth_password_;
-#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
-    digest_auth_username_ = rhs.digest_auth_username_;
-    digest_auth_password_ = rhs.digest_auth_password_;
-#endif
-    follow_location_ = rhs.follow_location_;
-    compress_ = rhs.compress_;
-    interface_ = rhs.interface_;
-    proxy_host_ = rhs.proxy_host_;
-    proxy_port_ = rhs.proxy_port_;
-    proxy_basic_auth_username_ = rhs.proxy_basic_auth_username_;
-    proxy_basic_auth_password_ = rhs.proxy_basic_auth_password_;
-#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
-    proxy_digest_auth_username_ = rhs.proxy_digest_auth_username_;
-    proxy_digest_auth_password_ = rhs.proxy_digest_auth_password_;
-#endif
-    logger_ = rhs.logger_;
-  }
+  struct RouteShard {
+    std::string method;
+    const std::string *key; // pattern of the handler, or nullptr
+    std::string route;
+    std::atomic<uint64_t> status_counts[600];
+    std::atomic<uint64_t> request_body_bytes;
+    std::atomic<uint64_t> response_body_bytes;
+    HistogramShard parse;
+    HistogramShard handler;
+    HistogramShard write;
+    std::atomic<uint64_t> allocations[3]; // by phase
+    std::atomic<uint64_t> allocated_bytes[3];
+  };
 
-private:
-  socket_t create_client_socket() const;
-  bool read_response_line(Stream &strm, Response &res);
-  bool write_request(Stream &strm, const Request &req, bool last_connection);
-  bool redirect(const Request &req, Response &res);
-  bool handle_request(Stream &strm, const Request &req, Response &res,
-                      bool last_connection, bool &connection_close);
-#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
-  bool connect(socket_t sock, Response &res, bool &error);
-#endif
+  struct Shard {
+    std::mutex mutex; // taken to add routes, and to read them elsewhere
+    std::vector<std::unique_ptr<RouteShard>> routes;
+  };
 
-  std::shared_ptr<Response> send_with_content_provider(
-      const char *method, const char *path, const Headers &headers,
-      const std::string &body, size_t content_length,
-      ContentProvider content_provider, const char *content_type);
+  Shard &local_shard();
+  void record(const Request &req, const Response &res,
+              const std::string *route,
+              std::chrono::steady_clock::time_point started,
+              std::chrono::steady_clock::time_point parsed,
+              std::chrono::steady_clock::time_point handled,
+              const RequestAllocations &allocations);
+
+  void connection_queued();
+  void connection_started();
+  void connection_finished();
+
+  const uint64_t id_;
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::atomic<int64_t> active_connections_;
+  std::atomic<int64_t> queued_connections_;
+};
 
-  virtual bool process_and_close_socket(
-      socket_t sock, size_t request_count,
-      std::function<bool(Stream &strm, bool last_connection,
-                         bool &connection_close)>
-          callback);
+namespace detail {
 
-  virtual bool is_ssl() const;
+// What an access log keeps of a request. Fixed size, so workers copy it into
+// a ring without allocating.
+struct access_log_record {
+  uint64_t time_usec;     // wall clock when the request began
+  uint64_t duration_usec; // until its response was written
+  uint64_t request_bytes;
+  uint64_t response_bytes;
+  uint32_t route;         // interned pattern, 0 for none
+  uint16_t status;
+  uint8_t method;         // index into access_log_methods
+  uint8_t version;        // minor version of HTTP/1.x
+  char remote_addr[48];
+  char target[112]; // path, truncated
 };
 
-inline void Get(std::vector<Request> &requests, const char *path,
-                const Headers &headers) {
-  Request req;
-  req.method = "GET";
-  req.path = path;
-  req.headers = headers;
-  requests.emplace_back(std::move(req));
-}
+} // namespace detail
 
-inline void Get(std::vector<Request> &requests, const char *path) {
-  Get(requests, path, Headers());
-}
+// Writes an access log line for each request from a background thread. The
+// workers only copy a fixed-size record into a lock-free ring of their own,
+// and the writer drains the rings every CPPHTTPLIB_ACCESS_LOG_FLUSH_MSECOND,
+// or sooner when one fills up, formatting each batch into a single write.
+// When a ring is full its records are dropped and counted, rather than the
+// worker waiting. Lines are in Common Log Format followed by the request body
+// size, the seconds taken and the route:
+//
+//   ::1 - - [10/Oct/2000:13:55:36 +0000] "GET /a HTTP/1.1" 200 9 0 0.0002 "/a"
+//
+// Once a batch would grow the file past `max_file_size` (0 for no limit),
+// it's renamed to `path`.1, older ones shifting up to `path`.`max_files`, and
+// a new one is started. A log can be shared by several servers.
+class AccessLog {
+public:
+  explicit AccessLog(const std::string &path,
+                     size_t max_file_size = CPPHTTPLIB_ACCESS_LOG_MAX_FILE_SIZE,
+                     size_t max_files = 5);
 
-inline void Post(std::vector<Request> &requests, const char *path,
-                 const Headers &headers, const std::string &body,
-                 const char *content_type) {
-  Request req;
-  req.method = "POST";
-  req.path = path;
-  req.headers = headers;
-  req.headers.emplace("Content-Type", content_type);
-  req.body = body;
-  requests.emplace_back(std::move(req));
-}
+  // Writes out what's left.
+  ~AccessLog();
 
-inline void Post(std::vector<Request> &requests, const char *path,
-                 const std::string &body, const char *content_type) {
-  Post(requests, path, Headers(), body, content_type);
-}
+  AccessLog(const AccessLog &) = delete;
+  AccessLog &operator=(const AccessLog &) = delete;
 
-#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
-class SSLServer : public Server {
-public:
-  SSLServer(const char *cert_path, const char *private_key_path,
-            const char *client_ca_cert_file_path = nullptr,
-            const char *client_ca_cert_dir_path = nullptr);
+  bool is_open() const;
+  // Writes out everything recorded so far before returning.
+  void flush();
+  uint64_t dropped() const;
 
-  ~SSLServer() override;
+private:
+  friend class Server;
 
-  bool is_valid() const override;
+  struct InternedRoute {
+    const std::string *key; // pattern of the handler
+    std::string pattern;
+    uint32_t id;
+  };
 
-private:
-  bool process_and_close_socket(socket_t sock) override;
+  struct Ring {
+    std::atomic<size_t> head{0}; // written by the worker
+    std::atomic<size_t> tail{0}; // written by the writer
+    detail::access_log_record records[CPPHTTPLIB_ACCESS_LOG_RING_SIZE];
+    std::vector<InternedRoute> routes; // interned by this worker
+  };
 
-  SSL_CTX *ctx_;
-  std::mutex ctx_mutex_;
+  Ring &local_ring();
+  uint32_t route_id(Ring &ring, const std::string *route);
+  void record(const Request &req, const Response &res,
+              const std::string *route,
+              std::chrono::system_clock::time_point started,
+              std::chrono::steady_clock::duration duration);
+
+  void run();
+  void drain(); // with write_mutex_ held
+  void write_batch(const std::string &data);
+  void rotate();
+
+  const uint64_t id_;
+  const std::string path_;
+  const size_t max_file_size_;
+  const size_t max_files_;
+  std::FILE *file_ = nullptr;
+  size_t file_size_ = 0;
+  std::vector<detail::access_log_record> batch_;
+  std::string buffer_;
+  std::mutex write_mutex_; // one drain at a time, and the file
+
+  mutable std::mutex mutex_; // rings_ and routes_
+  std::vector<std::unique_ptr<Ring>> rings_;
+  std::vector<std::string> routes_;
+  std::atomic<uint64_t> dropped_{0};
+
+  std::atomic<bool> wake_{false};
+  bool shutdown_ = false;
+  std::condition_variable cond_;
+  std::thread writer_;
 };
 
-class SSLClient : public Client {
-public:
-  explicit SSLClient(const std::string &host, int port = 443,
-                     const std::string &client_cert_path = std::string(),
-                     const std::string &client_key_path = std::string());
-
-  ~SSLClient() override;
+#ifdef CPPHTTPLIB_TRACE
+// Chrome trace event JSON (chrome://tracing, Perfetto) of the request phases
+// each thread recorded last, up to CPPHTTPLIB_TRACE_RING_SIZE events per
+// thread. With `min_request_usec`, only requests that took at least that
+// long are included, along with the waits before them.
+std::string dump_trace(uint64_t min_request_usec = 0);
+#endif
 
-  bool is_valid() const override;
+#ifdef CPPHTTPLIB_PROFILER
+// Samples the call stacks of the whole process for `msec` milliseconds, on
+// SIGPROF at `hz` per second of CPU time used, and writes them to
+// `collapsed` in the folded format flame graph tools read: one line per
+// distinct stack, root first, with its sample count. Functions the dynamic
+// symbol table doesn't name (link with -rdynamic) show as module+offset.
+// Returns false if a profile is already running, if SIGPROF or the
+// profiling timer is in use by someone else, or if the timer can't be set.
+bool profile_cpu(uint64_t msec, int hz, std::string &collapsed);
+#endif
 
-  void set_ca_cert_path(const char *ca_ceert_file_path,
-                        const char *ca_cert_dir_path = nullptr);
+#ifdef CPPHTTPLIB_ALLOCATION_STATS
+// With CPPHTTPLIB_ALLOCATION_STATS defined wherever httplib.h is included,
+// and CPPHTTPLIB_ALLOCATION_STATS_IMPLEMENTATION in exactly one of those
+// translation units, the global operator new is replaced to count heap
+// allocations per thread. Each request's allocations go to its route in
+// Server::metrics().
 
-  void enable_server_certificate_verification(bool enabled);
+// Allocations made on the calling thread so far.
+AllocationStats thread_allocations();
 
-  long get_openssl_verify_result() const;
+// Allocations of the request being served on the calling thread, up to now.
+// A Logger can call it to see what its request cost.
+RequestAllocations request_allocations();
+#endif
 
-  SSL_CTX *ssl_context() const noexcept;
+using Logger = std::function<void(const Request &, const Response &)>;
 
-private:
-  bool process_and_close_socket(
-      socket_t sock, size_t request_count,
-      std::function<bool(Stream &strm, bool last_connection,
-                         bool &connection_close)>
-          callback) override;
-  bool is_ssl() const override;
+class Server {
+public:
+  using Handler = std::function<void(const Request &, Response &)>;
+  using HandlerWithContentReader = std::function<void(
+      const Request &, Response &, const ContentReader &content_reader)>;
+  using Expect100ContinueHandler =
+      std::function<int(const Request &, Response &)>;
 
-  bool verify_host(X509 *server_cert) const;
-  bool verify_host_with_subject_alt_name(X509 *server_cert) const;
-  bool verify_host_with_common_name(X509 *server_cert) const;
-  bool check_host_name(const char *pattern, size_t pattern_len) const;
+  Server();
 
-  SSL_CTX *ctx_;
-  std::mutex ctx_mutex_;
-  std::vector<std::string> host_components_;
+  virtual ~Server();
 
-  std::string ca_cert_file_path_;
-  std::string ca_cert_dir_path_;
-  bool server_certificate_verification_ = false;
-  long verify_result_ = 0;
-};
-#endif
+  virtual bool is_valid() const;
 
-// ----------------------------------------------------------------------------
+  Server &Get(const char *pattern, Handler handler);
+  Server &Post(const char *pattern, Handler handler);
+  Server &Post(const char *pattern, HandlerWithContentReader handler);
+  Server &Put(const char *pattern, Handler handler);
+  Server &Put(const char *pattern, HandlerWithContentReader handler);
+  Server &Patch(const char *pattern, Handler handler);
+  Server &Patch(const char *pattern, HandlerWithContentReader handler);
+  Server &Delete(const char *pattern, Handler handler);
+  Server &Options(const char *pattern, Handler handler);
 
-/*
- * Implementation
- */
+  [[deprecated]] bool set_base_dir(const char *dir,
+                                   const char *mount_point = nullptr);
+  bool set_mount_point(const char *mount_point, const char *dir);
+  bool remove_mount_point(const char *mount_point);
+  void set_file_extension_and_mimetype_mapping(const char *ext,
+                                               const char *mime);
+  void set_file_request_handler(Handler handler);
 
-namespace detail {
+  void set_error_handler(Handler handler);
+  void set_logger(Logger logger);
+  // Logs each request to `log` without holding up the worker, unlike a
+  // Logger. nullptr turns it off.
+  void set_access_log(std::shared_ptr<AccessLog> log);
+
+  // Collects request metrics, see Metrics. It should be set before listening.
+  void enable_metrics(bool enabled);
+  // Serves the metrics in Prometheus text format on GET requests matching
+  // `pattern`, and enables them.
+  void set_metrics_route(const char *pattern);
+  const Metrics &metrics() const;
+
+#ifdef CPPHTTPLIB_PROFILER
+  // Serves a CPU profile of the process on GET requests matching `pattern`,
+  // see profile_cpu. The "seconds" (default 10, at most
+  // CPPHTTPLIB_PROFILE_MAX_SECOND) and "hz" (default 99, at most 1000)
+  // parameters set its length and rate. The request holds its worker for
+  // that long; one profile runs at a time, others get 503.
+  void set_profile_route(const char *pattern);
+#endif
 
-inline bool is_hex(char c, int &v) {
-  if (0x20 <= c && isdigit(c)) {
-    v = c - '0';
-    return true;
-  } else if ('A' <= c && c <= 'F') {
-    v = c - 'A' + 10;
-    return true;
-  } else if ('a' <= c && c <= 'f') {
-    v = c - 'a' + 10;
-    return true;
-  }
-  return false;
-}
+  void set_expect_100_continue_handler(Expect100ContinueHandler handler);
 
-inline bool from_hex_to_i(const std::string &s, size_t i, size_t cnt,
-                          int &val) {
-  if (i >= s.size()) { return false; }
+  void set_keep_alive_max_count(size_t count);
+  void set_keep_alive_timeout(time_t sec);
+  void set_read_timeout(time_t sec, time_t usec);
+  void set_header_read_timeout(time_t sec, time_t usec);
+  void set_body_read_timeout(time_t sec, time_t usec);
+  void set_write_timeout(time_t sec, time_t usec);
+  void set_payload_max_length(size_t length);
+  void set_socket_options(const SocketOptions &options);
 
-  val = 0;
-  for (; cnt; i++, cnt--) {
-    if (!s[i]) { return false; }
-    int v = 0;
-    if (is_hex(s[i], v)) {
-      val = val * 16 + v;
-    } else {
-      return false;
-    }
-  }
-  return true;
-}
+  TimerWheel &timer_wheel();
 
-inline std::string from_i_to_hex(size_t n) {
-  const char *charset = "0123456789abcdef";
-  std::string ret;
-  do {
-    ret = charset[n & 15] + ret;
-    n >>= 4;
-  } while (n > 0);
-  return ret;
-}
+  bool bind_to_port(const char *host, int port, int socket_flags = 0);
+  int bind_to_any_port(const char *host, int socket_flags = 0);
+  bool listen_after_bind();
 
-inline size_t to_utf8(int code, char *buff) {
-  if (code < 0x0080) {
-    buff[0] = (code & 0x7F);
-    return 1;
-  } else if (code < 0x0800) {
-    buff[0] = static_cast<char>(0xC0 | ((code >> 6) & 0x1F));
-    buff[1] = static_cast<char>(0x80 | (code & 0x3F));
-    return 2;
-  } else if (code < 0xD800) {
-    buff[0] = static_cast<char>(0xE0 | ((code >> 12) & 0xF));
-    buff[1] = static_cast<char>(0x80 | ((code >> 6) & 0x3F));
-    buff[2] = static_cast<char>(0x80 | (code & 0x3F));
-    return 3;
-  } else if (code < 0xE000) { // D800 - DFFF is invalid...
-    return 0;
-  } else if (code < 0x10000) {
-    buff[0] = static_cast<char>(0xE0 | ((code >> 12) & 0xF));
-    buff[1] = static_cast<char>(0x80 | ((code >> 6) & 0x3F));
-    buff[2] = static_cast<char>(0x80 | (code & 0x3F));
-    return 3;
-  } else if (code < 0x110000) {
-    buff[0] = static_cast<char>(0xF0 | ((code >> 18) & 0x7));
-    buff[1] = static_cast<char>(0x80 | ((code >> 12) & 0x3F));
-    buff[2] = static_cast<char>(0x80 | ((code >> 6) & 0x3F));
-    buff[3] = static_cast<char>(0x80 | (code & 0x3F));
-    return 4;
-  }
+  bool listen(const char *host, int port, int socket_flags = 0);
 
-  // NOTREACHED
-  return 0;
-}
+  bool is_running() const;
+  void stop();
 
-// NOTE: This code came up with the following stackoverflow post:
-// https://stackoverflow.com/questions/180947/base64-decode-snippet-in-c
-inline std::string base64_encode(const std::string &in) {
-  static const auto lookup =
-      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::function<TaskQueue *(void)> new_task_queue;
 
-  std::string out;
-  out.reserve(in.size());
+protected:
+  bool process_request(Stream &strm, bool last_connection,
+                       bool &connection_close,
+                       const std::function<void(Request &)> &setup_request);
+  bool parse_request_line(const char *s, Request &req);
 
-  int val = 0;
-  int valb = -6;
+  // Takes each accepted socket on the listening thread. By default it goes
+  // straight to the task queue.
+  virtual void dispatch_socket(socket_t sock, TaskQueue &task_queue);
+  // Called when the listening loop ends, before the task queue shuts down.
+  virtual void stop_dispatch() {}
+  // Runs a dispatched connection on a worker thread. `queued` is the
+  // trace_clock() time it was handed to the task queue.
+  void serve_socket(socket_t sock, uint64_t queued);
 
-  for (auto c : in) {
-    val = (val << 8) + static_cast<uint8_t>(c);
-    valb += 8;
-    while (valb >= 0) {
-      out.push_back(lookup[(val >> valb) & 0x3F]);
-      valb -= 6;
-    }
-  }
+  size_t keep_alive_max_count_;
+  time_t keep_alive_timeout_sec_;
+  time_t read_timeout_sec_;
+  time_t read_timeout_usec_;
+  time_t header_read_timeout_sec_;
+  time_t header_read_timeout_usec_;
+  time_t body_read_timeout_sec_;
+  time_t body_read_timeout_usec_;
+  time_t write_timeout_sec_;
+  time_t write_timeout_usec_;
+  size_t payload_max_length_;
+  SocketOptions socket_options_;
+  TimerWheel timer_wheel_;
+  bool metrics_enabled_ = false;
+  std::shared_ptr<AccessLog> access_log_;
+  Metrics metrics_;
 
-  if (valb > -6) { out.push_back(lookup[((val << 8) >> (valb + 8)) & 0x3F]); }
+private:
+  template <typename T> struct Route {
+    std::regex regex;
+    std::string pattern;
+    T handler;
+  };
 
-  while (out.size() % 4) {
-    out.push_back('=');
-  }
+  using Handlers = std::vector<Route<Handler>>;
+  using HandlersForContentReader = std::vector<Route<HandlerWithContentReader>>;
 
-  return out;
-}
+  socket_t create_server_socket(const char *host, int port,
+                                int socket_flags) const;
+  int bind_internal(const char *host, int port, int socket_flags);
+  bool listen_internal();
 
-inline bool is_file(const std::string &path) {
-  struct stat st;
-  return stat(path.c_str(), &st) >= 0 && S_ISREG(st.st_mode);
-}
+  bool routing(Request &req, Response &res, Stream &strm,
+               const std::string *&route);
+  bool handle_file_request(Request &req, Response &res, bool head = false);
+  bool dispatch_request(Request &req, Response &res, Handlers &handlers,
+                        const std::string *&route);
+  bool dispatch_request_for_content_reader(Request &req, Response &res,
+                                           ContentReader content_reader,
+                                           HandlersForContentReader &handlers,
+                                           const std::string *&route);
 
-inline bool is_dir(const std::string &path) {
-  struct stat st;
-  return stat(path.c_str(), &st) >= 0 && S_ISDIR(st.st_mode);
-}
+  bool write_response(Stream &strm, bool last_connection, const Request &req,
+                      Response &res);
+  bool write_content_with_provider(Stream &strm, const Request &req,
+                                   Response &res, const std::string &boundary,
+                                   const std::string &content_type);
+  bool read_content(Stream &strm, Request &req, Response &res);
+  bool
+  read_content_with_content_receiver(Stream &strm, Request &req, Response &res,
+                                     ContentReceiver receiver,
+                                     MultipartContentHeader multipart_header,
+                                     ContentReceiver multipart_receiver);
+  bool read_content_core(Stream &strm, Request &req, Response &res,
+                         ContentReceiver receiver,
+                         MultipartContentHeader mulitpart_header,
+                         ContentReceiver multipart_receiver);
 
-inline bool is_valid_path(const std::string &path) {
-  size_t level = 0;
-  size_t i = 0;
+  virtual bool process_and_close_socket(socket_t sock);
 
-  // Skip slash
-  while (i < path.size() && path[i] == '/') {
-    i++;
-  }
+  std::atomic<bool> is_running_;
+  std::atomic<socket_t> svr_sock_;
+  std::vector<std::pair<std::string, std::string>> base_dirs_;
+  std::map<std::string, std::string> file_extension_and_mimetype_map_;
+  Handler file_request_handler_;
+  Handlers get_handlers_;
+  Handlers post_handlers_;
+  HandlersForContentReader post_handlers_for_content_reader_;
+  Handlers put_handlers_;
+  HandlersForContentReader put_handlers_for_content_reader_;
+  Handlers patch_handlers_;
+  HandlersForContentReader patch_handlers_for_content_reader_;
+  Handlers delete_handlers_;
+  Handlers options_handlers_;
+  Handler error_handler_;
+  Logger logger_;
+  Expect100ContinueHandler expect_100_continue_handler_;
+};
 
-  while (i < path.size()) {
-    // Read component
-    auto beg = i;
-    while (i < path.size() && path[i] != '/') {
-      i++;
-    }
+// The settings are meant to be made before the client is used. Requests may
+// then be sent from several threads at once, which hedging and download() do
+// as well; the setters must not run meanwhile. A logger or a progress
+// callback is then called from those threads too.
+class Client {
+public:
+  explicit Client(const std::string &host, int port = 80,
+                  const std::string &client_cert_path = std::string(),
+                  const std::string &client_key_path = std::string());
 
-    auto len = i - beg;
-    assert(len > 0);
+  virtual ~Client();
 
-    if (!path.compare(beg, len, ".")) {
-      ;
-    } else if (!path.compare(beg, len, "..")) {
-      if (level == 0) { return false; }
-      level--;
-    } else {
-      level++;
-    }
+  virtual bool is_valid() const;
 
-    // Skip slash
-    while (i < path.size() && path[i] == '/') {
-      i++;
-    }
-  }
+  std::shared_ptr<Response> Get(const char *path);
 
-  return true;
-}
+  std::shared_ptr<Response> Get(const char *path, const Headers &headers);
 
-inline void read_file(const std::string &path, std::string &out) {
-  std::ifstream fs(path, std::ios_base::binary);
-  fs.seekg(0, std::ios_base::end);
-  auto size = fs.tellg();
-  fs.seekg(0);
-  out.resize(static_cast<size_t>(size));
-  fs.read(&out[0], size);
-}
+  std::shared_ptr<Response> Get(const char *path, Progress progress);
 
-inline std::string file_extension(const std::string &path) {
-  std::smatch m;
-  static auto re = std::regex("\\.([a-zA-Z0-9]+)$");
-  if (std::regex_search(path, m, re)) { return m[1].str(); }
-  return std::string();
-}
+  std::shared_ptr<Response> Get(const char *path, const Headers &headers,
+                                Progress progress);
 
-template <class Fn> void split(const char *b, const char *e, char d, Fn fn) {
-  int i = 0;
-  int beg = 0;
+  std::shared_ptr<Response> Get(const char *path,
+                                ContentReceiver content_receiver);
 
-  while (e ? (b + i != e) : (b[i] != '\0')) {
-    if (b[i] == d) {
-      fn(&b[beg], &b[i]);
-      beg = i + 1;
-    }
-    i++;
-  }
+  std::shared_ptr<Response> Get(const char *path, const Headers &headers,
+                                ContentReceiver content_receiver);
 
-  if (i) { fn(&b[beg], &b[i]); }
-}
+  std::shared_ptr<Response>
+  Get(const char *path, ContentReceiver content_receiver, Progress progress);
 
-// NOTE: until the read size reaches `fixed_buffer_size`, use `fixed_buffer`
-// to store data. The call can set memory on stack for performance.
-class stream_line_reader {
-public:
-  stream_line_reader(Stream &strm, char *fixed_buffer, size_t fixed_buffer_size)
-      : strm_(strm), fixed_buffer_(fixed_buffer),
-        fixed_buffer_size_(fixed_buffer_size) {}
+  std::shared_ptr<Response> Get(const char *path, const Headers &headers,
+                                ContentReceiver content_receiver,
+                                Progress progress);
 
-  const char *ptr() const {
-    if (glowable_buffer_.empty()) {
-      return fixed_buffer_;
-    } else {
-      return glowable_buffer_.data();
-    }
-  }
+  std::shared_ptr<Response> Get(const char *path, const Headers &headers,
+                                ResponseHandler response_handler,
+                                ContentReceiver content_receiver);
 
-  size_t size() const {
-    if (glowable_buffer_.empty()) {
-      return fixed_buffer_used_size_;
-    } else {
-      return glowable_buffer_.size();
-    }
-  }
+  std::shared_ptr<Response> Get(const char *path, const Headers &headers,
+                                ResponseHandler response_handler,
+                                ContentReceiver content_receiver,
+                                Progress progress);
 
-  bool end_with_crlf() const {
-    auto end = ptr() + size();
-    return size() >= 2 && end[-2] == '\r' && end[-1] == '\n';
-  }
+  // Receives the body into `buf` rather than Response::body, and sets
+  // Response::content_length to its size. Fails if it doesn't fit.
+  std::shared_ptr<Response> Get(const char *path, const Headers &headers,
+                                char *buf, size_t size,
+                                Progress progress = Progress());
 
-  bool getline() {
-    fixed_buffer_used_size_ = 0;
-    glowable_buffer_.clear();
+  std::shared_ptr<Response> Head(const char *path);
 
-    for (size_t i = 0;; i++) {
-      char byte;
-      auto n = strm_.read(&byte, 1);
+  std::shared_ptr<Response> Head(const char *path, const Headers &headers);
 
-      if (n < 0) {
-        return false;
-      } else if (n == 0) {
-        if (i == 0) {
-          return false;
-        } else {
-          break;
-        }
-      }
+  std::shared_ptr<Response> Post(const char *path, const std::string &body,
+                                 const char *content_type);
 
-      append(byte);
+  std::shared_ptr<Response> Post(const char *path, const Headers &headers,
+                                 const std::string &body,
+                                 const char *content_type);
 
-      if (byte == '\n') { break; }
-    }
+  std::shared_ptr<Response> Post(const char *path, size_t content_length,
+                                 ContentProvider content_provider,
+                                 const char *content_type);
 
-    return true;
-  }
+  std::shared_ptr<Response> Post(const char *path, const Headers &headers,
+                                 size_t content_length,
+                                 ContentProvider content_provider,
+                                 const char *content_type);
 
-private:
-  void append(char c) {
-    if (fixed_buffer_used_size_ < fixed_buffer_size_ - 1) {
-      fixed_buffer_[fixed_buffer_used_size_++] = c;
-      fixed_buffer_[fixed_buffer_used_size_] = '\0';
-    } else {
-      if (glowable_buffer_.empty()) {
-        assert(fixed_buffer_[fixed_buffer_used_size_] == '\0');
-        glowable_buffer_.assign(fixed_buffer_, fixed_buffer_used_size_);
-      }
-      glowable_buffer_ += c;
-    }
-  }
+  std::shared_ptr<Response> Post(const char *path, const Params &params);
 
-  Stream &strm_;
-  char *fixed_buffer_;
-  const size_t fixed_buffer_size_;
-  size_t fixed_buffer_used_size_ = 0;
-  std::string glowable_buffer_;
-};
+  std::shared_ptr<Response> Post(const char *path, const Headers &headers,
+                                 const Params &params);
 
-inline int close_socket(socket_t sock) {
-#ifdef _WIN32
-  return closesocket(sock);
-#else
-  return close(sock);
-#endif
-}
+  std::shared_ptr<Response> Post(const char *path,
+                                 const MultipartFormDataItems &items);
 
-inline int select_read(socket_t sock, time_t sec, time_t usec) {
-#ifdef CPPHTTPLIB_USE_POLL
-  struct pollfd pfd_read;
-  pfd_read.fd = sock;
-  pfd_read.events = POLLIN;
+  std::shared_ptr<Response> Post(const char *path, const Headers &headers,
+                                 const MultipartFormDataItems &items);
 
-  auto timeout = static_cast<int>(sec * 1000 + usec / 1000);
+  // Streams each file from disk after the in-memory items. Returns nullptr
+  // if a file can't be opened.
+  std::shared_ptr<Response> Post(const char *path, const Headers &headers,
+                                 const MultipartFormDataItems &items,
+                                 const MultipartFormDataFiles &files);
 
-  return poll(&pfd_read, 1, timeout);
-#else
-  fd_set fds;
-  FD_ZERO(&fds);
-  FD_SET(sock, &fds);
+  std::shared_ptr<Response> Put(const char *path, const std::string &body,
+                                const char *content_type);
 
-  timeval tv;
-  tv.tv_sec = static_cast<long>(sec);
-  tv.tv_usec = static_cast<decltype(tv.tv_usec)>(usec);
+  std::shared_ptr<Response> Put(const char *path, const Headers &headers,
+                                const std::string &body,
+                                const char *content_type);
 
-  return select(static_cast<int>(sock + 1), &fds, nullptr, nullptr, &tv);
-#endif
-}
+  std::shared_ptr<Response> Put(const char *path, size_t content_length,
+                                ContentProvider content_provider,
+                                const char *content_type);
 
-inline int select_write(socket_t sock, time_t sec, time_t usec) {
-#ifdef CPPHTTPLIB_USE_POLL
-  struct pollfd pfd_read;
-  pfd_read.fd = sock;
-  pfd_read.events = POLLOUT;
+  std::shared_ptr<Response> Put(const char *path, const Headers &headers,
+                                size_t content_length,
+                                ContentProvider content_provider,
+                                const char *content_type);
 
-  auto timeout = static_cast<int>(sec * 1000 + usec / 1000);
+  std::shared_ptr<Response> Put(const char *path, const Params &params);
 
-  return poll(&pfd_read, 1, timeout);
-#else
-  fd_set fds;
-  FD_ZERO(&fds);
-  FD_SET(sock, &fds);
+  std::shared_ptr<Response> Put(const char *path, const Headers &headers,
+                                const Params &params);
 
-  timeval tv;
-  tv.tv_sec = static_cast<long>(sec);
-  tv.tv_usec = static_cast<decltype(tv.tv_usec)>(usec);
+  std::shared_ptr<Response> Patch(const char *path, const std::string &body,
+                                  const char *content_type);
 
-  return select(static_cast<int>(sock + 1), nullptr, &fds, nullptr, &tv);
-#endif
-}
+  std::shared_ptr<Response> Patch(const char *path, const Headers &headers,
+                                  const std::string &body,
+                                  const char *content_type);
 
-inline bool wait_until_socket_is_ready(socket_t sock, time_t sec, time_t usec) {
-#ifdef CPPHTTPLIB_USE_POLL
-  struct pollfd pfd_read;
-  pfd_read.fd = sock;
-  pfd_read.events = POLLIN | POLLOUT;
+  std::shared_ptr<Response> Patch(const char *path, size_t content_length,
+                                  ContentProvider content_provider,
+                                  const char *content_type);
 
-  auto timeout = static_cast<int>(sec * 1000 + usec / 1000);
+  std::shared_ptr<Response> Patch(const char *path, const Headers &headers,
+                                  size_t content_length,
+                                  ContentProvider content_provider,
+                                  const char *content_type);
 
-  if (poll(&pfd_read, 1, timeout) > 0 &&
-      pfd_read.revents & (POLLIN | POLLOUT)) {
-    int error = 0;
-    socklen_t len = sizeof(error);
-    return getsockopt(sock, SOL_SOCKET, SO_ERROR,
-                      reinterpret_cast<char *>(&error), &len) >= 0 &&
-           !error;
-  }
-  return false;
-#else
-  fd_set fdsr;
-  FD_ZERO(&fdsr);
-  FD_SET(sock, &fdsr);
+  std::shared_ptr<Response> Delete(const char *path);
 
-  auto fdsw = fdsr;
-  auto fdse = fdsr;
+  std::shared_ptr<Response> Delete(const char *path, const std::string &body,
+                                   const char *content_type);
 
-  timeval tv;
-  tv.tv_sec = static_cast<long>(sec);
-  tv.tv_usec = static_cast<decltype(tv.tv_usec)>(usec);
+  std::shared_ptr<Response> Delete(const char *path, const Headers &headers);
 
-  if (select(static_cast<int>(sock + 1), &fdsr, &fdsw, &fdse, &tv) > 0 &&
-      (FD_ISSET(sock, &fdsr) || FD_ISSET(sock, &fdsw))) {
-    int error = 0;
-    socklen_t len = sizeof(error);
-    return getsockopt(sock, SOL_SOCKET, SO_ERROR,
-                      reinterpret_cast<char *>(&error), &len) >= 0 &&
-           !error;
-  }
-  return false;
-#endif
-}
+  std::shared_ptr<Response> Delete(const char *path, const Headers &headers,
+                                   const std::string &body,
+                                   const char *content_type);
 
-class SocketStream : public Stream {
-public:
-  SocketStream(socket_t sock, time_t read_timeout_sec,
-               time_t read_timeout_usec);
-  ~SocketStream() override;
+  std::shared_ptr<Response> Options(const char *path);
 
-  bool is_readable() const override;
-  bool is_writable() const override;
-  ssize_t read(char *ptr, size_t size) override;
-  ssize_t write(const char *ptr, size_t size) override;
-  std::string get_remote_addr() const override;
+  std::shared_ptr<Response> Options(const char *path, const Headers &headers);
 
-private:
-  socket_t sock_;
-  time_t read_timeout_sec_;
-  time_t read_timeout_usec_;
-};
+  bool send(const Request &req, Response &res);
 
-#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
-class SSLSocketStream : public Stream {
-public:
-  SSLSocketStream(socket_t sock, SSL *ssl, time_t read_timeout_sec,
-                  time_t read_timeout_usec);
-  ~SSLSocketStream() override;
-
-  bool is_readable() const override;
-  bool is_writable() const override;
-  ssize_t read(char *ptr, size_t size) override;
-  ssize_t write(const char *ptr, size_t size) override;
-  std::string get_remote_addr() const override;
+  bool send(const std::vector<Request> &requests,
+            std::vector<Response> &responses);
 
-private:
-  socket_t sock_;
-  SSL *ssl_;
-  time_t read_timeout_sec_;
-  time_t read_timeout_usec_;
-};
+#ifndef _WIN32
+  // Fetches `path` into `file_path` as byte ranges over several connections,
+  // when the server supports ranges, and in a single GET otherwise. Finished
+  // ranges are noted in "<file_path>.download" until the whole file is done.
+  bool download(const char *path, const Headers &headers,
+                const char *file_path,
+                const DownloadOptions &options = DownloadOptions(),
+                Progress progress = Progress());
 #endif
 
-class BufferStream : public Stream {
-public:
-  BufferStream() = default;
-  ~BufferStream() override = default;
-
-  bool is_readable() const override;
-  bool is_writable() const override;
-  ssize_t read(char *ptr, size_t size) override;
-  ssize_t write(const char *ptr, size_t size) override;
-  std::string get_remote_addr() const override;
+  void set_timeout_sec(time_t timeout_sec);
 
-  const std::string &get_buffer() const;
+  void set_read_timeout(time_t sec, time_t usec);
 
-private:
-  std::string buffer;
-  size_t position = 0;
-};
+  void set_keep_alive_max_count(size_t count);
 
-template <typename T>
-inline bool process_socket(bool is_client_request, socket_t sock,
-                           size_t keep_alive_max_count, time_t read_timeout_sec,
-                           time_t read_timeout_usec, T callback) {
-  assert(keep_alive_max_count > 0);
+  // Lets send(requests, responses) write up to `depth` requests ahead of the
+  // responses. 0 or 1 keeps one request at a time.
+  void set_pipelining_depth(size_t depth);
 
-  auto ret = false;
+  void set_socket_options(const SocketOptions &options);
 
-  if (keep_alive_max_count > 1) {
-    auto count = keep_alive_max_count;
-    while (count > 0 &&
-           (is_client_request ||
-            select_read(sock, CPPHTTPLIB_KEEPALIVE_TIMEOUT_SECOND,
-                        CPPHTTPLIB_KEEPALIVE_TIMEOUT_USECOND) > 0)) {
-      SocketStream strm(sock, read_timeout_sec, read_timeout_usec);
-      auto last_connection = count == 1;
-      auto connection_close = false;
+  void set_connection_pool(std::shared_ptr<ConnectionPool> pool);
 
-      ret = callback(strm, last_connection, connection_close);
-      if (!ret || connection_close) { break; }
+  void set_dns_cache(std::shared_ptr<DnsCache> cache);
 
-      count--;
-    }
-  } else { // keep_alive_max_count  is 0 or 1
-    SocketStream strm(sock, read_timeout_sec, read_timeout_usec);
-    auto dummy_connection_close = false;
-    ret = callback(strm, true, dummy_connection_close);
-  }
+  void set_hedging_policy(std::shared_ptr<HedgingPolicy> policy);
 
-  return ret;
-}
+  // GET requests without a content receiver or response handler go through
+  // the cache.
+  void set_response_cache(std::shared_ptr<ResponseCache> cache);
 
-template <typename T>
-inline bool process_and_close_socket(bool is_client_request, socket_t sock,
-                                     size_t keep_alive_max_count,
-                                     time_t read_timeout_sec,
-                                     time_t read_timeout_usec, T callback) {
-  auto ret = process_socket(is_client_request, sock, keep_alive_max_count,
-                            read_timeout_sec, read_timeout_usec, callback);
-  close_socket(sock);
-  return ret;
-}
+  // Size of the buffer bodies are received through, when they can't be read
+  // into place directly (chunked, compressed or passed to a receiver).
+  void set_receive_buffer_size(size_t size);
 
-inline int shutdown_socket(socket_t sock) {
-#ifdef _WIN32
-  return shutdown(sock, SD_BOTH);
-#else
-  return shutdown(sock, SHUT_RDWR);
-#endif
-}
+  // Fails responses whose body would grow Response::body past `length`.
+  // Bodies passed to a content receiver or a buffer aren't counted.
+  void set_payload_max_length(size_t length);
 
-template <typename Fn>
-socket_t create_socket(const char *host, int port, Fn fn,
-                       int socket_flags = 0) {
-#ifdef _WIN32
-#define SO_SYNCHRONOUS_NONALERT 0x20
-#define SO_OPENTYPE 0x7008
+  void set_basic_auth(const char *username, const char *password);
 
-  int opt = SO_SYNCHRONOUS_NONALERT;
-  setsockopt(INVALID_SOCKET, SOL_SOCKET, SO_OPENTYPE, (char *)&opt,
-             sizeof(opt));
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+  void set_digest_auth(const char *username, const char *password);
 #endif
 
-  // Get address info
-  struct addrinfo hints;
-  struct addrinfo *result;
+  void set_follow_location(bool on);
 
-  memset(&hints, 0, sizeof(struct addrinfo));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_flags = socket_flags;
-  hints.ai_protocol = 0;
+  void set_compress(bool on);
 
-  auto service = std::to_string(port);
+  void set_interface(const char *intf);
 
-  if (getaddrinfo(host, service.c_str(), &hints, &result)) {
-    return INVALID_SOCKET;
-  }
+  void set_proxy(const char *host, int port);
 
-  for (auto rp = result; rp; rp = rp->ai_next) {
-    // Create a socket
-#ifdef _WIN32
-    auto sock = WSASocketW(rp->ai_family, rp->ai_socktype, rp->ai_protocol,
-                           nullptr, 0, WSA_FLAG_NO_HANDLE_INHERIT);
-    /**
-     * Since the WSA_FLAG_NO_HANDLE_INHERIT is only supported on Windows 7 SP1
-     * and above the socket creation fails on older Windows Systems.
-     *
-     * Let's try to create a socket the old way in this case.
-     *
-     * Reference:
-     * https://docs.microsoft.com/en-us/windows/win32/api/winsock2/nf-winsock2-wsasocketa
-     *
-     * WSA_FLAG_NO_HANDLE_INHERIT:
-     * This flag is supported on Windows 7 with SP1, Windows Server 2008 R2 with
-     * SP1, and later
-     *
-     */
-    if (sock == INVALID_SOCKET) {
-      sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-    }
-#else
-    auto sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-#endif
-    if (sock == INVALID_SOCKET) { continue; }
+  void set_proxy_basic_auth(const char *username, const char *password);
 
-#ifndef _WIN32
-    if (fcntl(sock, F_SETFD, FD_CLOEXEC) == -1) { continue; }
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+  void set_proxy_digest_auth(const char *username, const char *password);
 #endif
 
-    // Make 'reuse address' option available
-    int yes = 1;
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<char *>(&yes),
-               sizeof(yes));
-#ifdef SO_REUSEPORT
-    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, reinterpret_cast<char *>(&yes),
-               sizeof(yes));
-#endif
+  void set_logger(Logger logger);
 
-    // bind or connect
-    if (fn(sock, *rp)) {
-      freeaddrinfo(result);
-      return sock;
-    }
+protected:
+  bool process_request(Stream &strm, const Request &req, Response &res,
+                       bool last_connection, bool &connection_close);
+  bool write_request(Stream &strm, const Request &req, bool last_connection);
+  bool read_response(Stream &strm, const Request &req, Response &res,
+                     bool &connection_close);
+  void wait_for_hedges();
 
-    close_socket(sock);
-  }
+  const std::string host_;
+  const int port_;
+  const std::string host_and_port_;
 
-  freeaddrinfo(result);
-  return INVALID_SOCKET;
-}
+  // Settings
+  std::string client_cert_path_;
+  std::string client_key_path_;
 
-inline void set_nonblocking(socket_t sock, bool nonblocking) {
-#ifdef _WIN32
-  auto flags = nonblocking ? 1UL : 0UL;
-  ioctlsocket(sock, FIONBIO, &flags);
-#else
-  auto flags = fcntl(sock, F_GETFL, 0);
-  fcntl(sock, F_SETFL,
-        nonblocking ? (flags | O_NONBLOCK) : (flags & (~O_NONBLOCK)));
-#endif
-}
+  time_t timeout_sec_ = 300;
+  time_t read_timeout_sec_ = CPPHTTPLIB_READ_TIMEOUT_SECOND;
+  time_t read_timeout_usec_ = CPPHTTPLIB_READ_TIMEOUT_USECOND;
 
-inline bool is_connection_error() {
-#ifdef _WIN32
-  return WSAGetLastError() != WSAEWOULDBLOCK;
-#else
-  return errno != EINPROGRESS;
-#endif
-}
+  size_t keep_alive_max_count_ = CPPHTTPLIB_KEEPALIVE_MAX_COUNT;
+  size_t pipelining_depth_ = 0;
 
-inline bool bind_ip_address(socket_t sock, const char *host) {
-  struct addrinfo hints;
-  struct addrinfo *result;
+  SocketOptions socket_options_;
 
-  memset(&hints, 0, sizeof(struct addrinfo));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_protocol = 0;
+  std::shared_ptr<ConnectionPool> connection_pool_;
 
-  if (getaddrinfo(host, "0", &hints, &result)) { return false; }
+  std::shared_ptr<DnsCache> dns_cache_;
 
-  auto ret = false;
-  for (auto rp = result; rp; rp = rp->ai_next) {
-    const auto &ai = *rp;
-    if (!::bind(sock, ai.ai_addr, static_cast<socklen_t>(ai.ai_addrlen))) {
-      ret = true;
-      break;
-    }
-  }
+  std::shared_ptr<HedgingPolicy> hedging_policy_;
 
-  freeaddrinfo(result);
-  return ret;
-}
+  std::shared_ptr<ResponseCache> response_cache_;
 
-inline std::string if2ip(const std::string &ifn) {
-#ifndef _WIN32
-  struct ifaddrs *ifap;
-  getifaddrs(&ifap);
-  for (auto ifa = ifap; ifa; ifa = ifa->ifa_next) {
-    if (ifa->ifa_addr && ifn == ifa->ifa_name) {
-      if (ifa->ifa_addr->sa_family == AF_INET) {
-        auto sa = reinterpret_cast<struct sockaddr_in *>(ifa->ifa_addr);
-        char buf[INET_ADDRSTRLEN];
-        if (inet_ntop(AF_INET, &sa->sin_addr, buf, INET_ADDRSTRLEN)) {
-          freeifaddrs(ifap);
-          return std::string(buf, INET_ADDRSTRLEN);
-        }
-      }
-    }
-  }
-  freeifaddrs(ifap);
+  size_t receive_buffer_size_ = CPPHTTPLIB_RECV_BUFSIZ;
+
+  size_t payload_max_length_ = CPPHTTPLIB_PAYLOAD_MAX_LENGTH;
+
+  std::string basic_auth_username_;
+  std::string basic_auth_password_;
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+  std::string digest_auth_username_;
+  std::string digest_auth_password_;
 #endif
-  return std::string();
-}
 
-inline socket_t create_client_socket(const char *host, int port,
-                                     time_t timeout_sec,
-                                     const std::string &intf) {
-  return create_socket(
-      host, port, [&](socket_t sock, struct addrinfo &ai) -> bool {
-        if (!intf.empty()) {
-          auto ip = if2ip(intf);
-          if (ip.empty()) { ip = intf; }
-          if (!bind_ip_address(sock, ip.c_str())) { return false; }
-        }
+  bool follow_location_ = false;
 
-        set_nonblocking(sock, true);
+  bool compress_ = false;
 
-        auto ret =
-            ::connect(sock, ai.ai_addr, static_cast<socklen_t>(ai.ai_addrlen));
-        if (ret < 0) {
-          if (is_connection_error() ||
-              !wait_until_socket_is_ready(sock, timeout_sec, 0)) {
-            close_socket(sock);
-            return false;
-          }
-        }
+  std::string interface_;
 
-        set_nonblocking(sock, false);
-        return true;
-      });
-}
+  std::string proxy_host_;
+  int proxy_port_;
 
-inline std::string get_remote_addr(socket_t sock) {
-  struct sockaddr_storage addr;
-  socklen_t len = sizeof(addr);
+  std::string proxy_basic_auth_username_;
+  std::string proxy_basic_auth_password_;
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+  std::string proxy_digest_auth_username_;
+  std::string proxy_digest_auth_password_;
+#endif
 
-  if (!getpeername(sock, reinterpret_cast<struct sockaddr *>(&addr), &len)) {
-    std::array<char, NI_MAXHOST> ipstr{};
+  Logger logger_;
 
-    if (!getnameinfo(reinterpret_cast<struct sockaddr *>(&addr), len,
-                     ipstr.data(), static_cast<socklen_t>(ipstr.size()),
-                     nullptr, 0, NI_NUMERICHOST)) {
-      return ipstr.data();
+  // Hedged attempts still running on this client, such as a canceled loser
+  // still resolving the host name after the caller got its response.
+  size_t running_hedges_ = 0;
+  std::mutex hedge_mutex_;
+  std::condition_variable hedge_cond_;
+
+  void copy_settings(const Client &rhs) {
+    client_cert_path_ = rhs.client_cert_path_;
+    client_key_path_ = rhs.client_key_path_;
+    timeout_sec_ = rhs.timeout_sec_;
+    read_timeout_sec_ = rhs.read_timeout_sec_;
+    read_timeout_usec_ = rhs.read_timeout_usec_;
+    keep_alive_max_count_ = rhs.keep_alive_max_count_;
+    pipelining_depth_ = rhs.pipelining_depth_;
+    socket_options_ = rhs.socket_options_;
+    connection_pool_ = rhs.connection_pool_;
+    dns_cache_ = rhs.dns_cache_;
+    hedging_policy_ = rhs.hedging_policy_;
+    response_cache_ = rhs.response_cache_;
+    receive_buffer_size_ = rhs.receive_buffer_size_;
+    payload_max_length_ = rhs.payload_max_length_;
+    basic_auth_username_ = rhs.basic_auth_username_;
+    basic_auth_password_ = rhs.basic_auth_password_;
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+    digest_auth_username_ = rhs.digest_auth_username_;
+    digest_auth_password_ = rhs.digest_auth_password_;
+#endif
+    follow_location_ = rhs.follow_location_;
+    compress_ = rhs.compress_;
+    interface_ = rhs.interface_;
+    proxy_host_ = rhs.proxy_host_;
+    proxy_port_ = rhs.proxy_port_;
+    proxy_basic_auth_username_ = rhs.proxy_basic_auth_username_;
+    proxy_basic_auth_password_ = rhs.proxy_basic_auth_password_;
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+    proxy_digest_auth_username_ = rhs.proxy_digest_auth_username_;
+    proxy_digest_auth_password_ = rhs.proxy_digest_auth_password_;
+#endif
+    logger_ = rhs.logger_;
+  }
+
+private:
+  socket_t create_client_socket(detail::canceler *canceler = nullptr) const;
+  bool read_response_line(Stream &strm, Response &res);
+  bool redirect(const Request &req, Response &res);
+  bool handle_request(Stream &strm, const Request &req, Response &res,
+                      bool last_connection, bool &connection_close);
+  bool handle_response(const Request &req, Response &res);
+  bool pipeline_requests(Stream &strm, const std::vector<Request> &requests,
+                         size_t &i, std::vector<Response> &responses);
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+  bool connect(socket_t sock, Response &res, bool &error);
+#endif
+
+  std::shared_ptr<Response> send_with_content_provider(
+      const char *method, const char *path, const Headers &headers,
+      const std::string &body, size_t content_length,
+      ContentProvider content_provider, const char *content_type);
+
+  virtual bool process_and_close_socket(
+      socket_t sock, size_t request_count, bool early_data,
+      detail::canceler *canceler,
+      std::function<bool(Stream &strm, bool last_connection,
+                         bool &connection_close)>
+          callback);
+
+  bool send_uncached(const Request &req, Response &res);
+  bool send_with_cache(ResponseCache &cache, const Request &req,
+                       Response &res);
+  bool sends_credentials(const Request &req) const;
+  bool send_once(const Request &req, Response &res);
+  bool send_with_connection_pool(ConnectionPool &pool, const Request &req,
+                                 Response &res);
+  bool send_with_hedging(const std::shared_ptr<HedgingPolicy> &policy,
+                         const Request &req, Response &res);
+  bool send_hedged(const std::shared_ptr<HedgingPolicy> &policy,
+                   const Request &req, Response &res);
+  virtual std::string connection_pool_key() const;
+  virtual bool process_pooled_connection(
+      ConnectionPool::Connection &conn, bool &reusable, bool early_data,
+      detail::canceler *canceler,
+      std::function<bool(Stream &strm, bool last_connection,
+                         bool &connection_close)>
+          callback);
+
+  virtual bool is_ssl() const;
+};
+
+inline void Get(std::vector<Request> &requests, const char *path,
+                const Headers &headers) {
+  Request req;
+  req.method = "GET";
+  req.path = path;
+  req.headers = headers;
+  requests.emplace_back(std::move(req));
+}
+
+inline void Get(std::vector<Request> &requests, const char *path) {
+  Get(requests, path, Headers());
+}
+
+inline void Post(std::vector<Request> &requests, const char *path,
+                 const Headers &headers, const std::string &body,
+                 const char *content_type) {
+  Request req;
+  req.method = "POST";
+  req.path = path;
+  req.headers = headers;
+  req.headers.emplace("Content-Type", content_type);
+  req.body = body;
+  requests.emplace_back(std::move(req));
+}
+
+inline void Post(std::vector<Request> &requests, const char *path,
+                 const std::string &body, const char *content_type) {
+  Post(requests, path, Headers(), body, content_type);
+}
+
+#ifndef _WIN32
+namespace detail {
+
+// Readiness notification for AsyncClient: epoll on Linux, poll elsewhere.
+class event_poller {
+public:
+  enum { Read = 1, Write = 2 };
+
+  event_poller();
+  ~event_poller();
+
+  event_poller(const event_poller &) = delete;
+  event_poller &operator=(const event_poller &) = delete;
+
+  bool is_valid() const;
+  void set(socket_t sock, int events);
+  void remove(socket_t sock);
+  // Errors and hang-ups are reported as readable.
+  int wait(int timeout_msec, std::vector<std::pair<socket_t, int>> &ready);
+
+private:
+#ifdef __linux__
+  int epfd_;
+  std::unordered_map<socket_t, int> events_;
+#else
+  std::vector<struct pollfd> fds_;
+#endif
+};
+
+// Finds where an HTTP/1.x response ends in the bytes received so far, so a
+// complete message can be handed to the stream based parser. A header or
+// body over its limit is an error.
+class response_framer {
+public:
+  explicit response_framer(
+      bool head_request = false,
+      size_t payload_max_length = CPPHTTPLIB_PAYLOAD_MAX_LENGTH);
+
+  // `eof` means the peer has closed, which ends a body without a length.
+  bool is_complete(const std::string &data, bool eof);
+  bool has_error() const;
+  // Length of the response, once it is complete.
+  size_t size() const;
+  // Most bytes the response may take, as far as is known yet.
+  size_t max_size() const;
+
+private:
+  enum class Framing { Header, None, Length, Chunked, Close };
+
+  bool parse_header(const std::string &data);
+  bool scan_chunks(const std::string &data);
+
+  bool head_request_;
+  size_t payload_max_length_;
+  Framing framing_ = Framing::Header;
+  size_t body_begin_ = 0;
+  size_t pos_ = 0;
+  uint64_t length_ = 0;
+  size_t size_ = 0;
+  bool in_trailer_ = false;
+  bool error_ = false;
+};
+
+} // namespace detail
+
+// Keeps many requests to one host in flight from a single event loop thread,
+// over up to `max_connections` keep-alive connections. Settings are shared
+// with Client, whose blocking API remains available. HTTPS, redirects and
+// digest authentication are only handled by the blocking API. Names are
+// resolved on another thread and kept in the DnsCache set on the client, or
+// else in one of its own.
+class AsyncClient : public Client {
+public:
+  // Receives the response, or nullptr when the request failed.
+  using ResponseCallback = std::function<void(std::shared_ptr<Response>)>;
+
+  explicit AsyncClient(const std::string &host, int port = 80);
+
+  ~AsyncClient() override;
+
+  bool is_valid() const override;
+
+  // Queues the request and returns at once. The callback runs on the event
+  // loop thread, so it must not block.
+  void send_async(const Request &req, ResponseCallback callback);
+
+  std::future<std::shared_ptr<Response>> send_async(const Request &req);
+
+  void set_max_connections(size_t count);
+
+  // Requests queued or in flight.
+  size_t pending_count() const;
+
+  // Fails whatever is still pending and ends the event loop.
+  void stop();
+
+private:
+  struct Task {
+    Request req;
+    ResponseCallback callback;
+  };
+
+  enum class ConnectionState { Connecting, Writing, Reading, Idle };
+
+  struct Connection {
+    socket_t sock = INVALID_SOCKET;
+    ConnectionState state = ConnectionState::Connecting;
+    std::unique_ptr<Task> task;
+    std::string out;
+    size_t out_off = 0;
+    std::string in;
+    detail::response_framer framer;
+    bool reused = false;
+    std::chrono::steady_clock::time_point deadline;
+  };
+
+  void run();
+  void wake();
+
+  void dispatch(std::deque<std::unique_ptr<Task>> &tasks);
+  DnsCache::Lookup lookup_address(DnsCache::Addresses &addrs);
+  bool open_connection(Connection &conn, DnsCache::Addresses &addrs);
+  void start_task(Connection &conn, std::unique_ptr<Task> task);
+  void handle_event(Connection &conn,
+                    std::deque<std::unique_ptr<Task>> &tasks);
+  bool handle_write(Connection &conn);
+  bool handle_read(Connection &conn, bool &eof);
+  void complete_task(Connection &conn, bool eof);
+  void fail_task(Connection &conn, std::deque<std::unique_ptr<Task>> &tasks);
+  void close_connection(Connection &conn);
+
+  detail::event_poller poller_;
+  int wake_fds_[2] = {-1, -1};
+
+  std::atomic<size_t> max_connections_;
+  std::atomic<size_t> pending_count_;
+
+  mutable std::mutex mutex_;
+  std::deque<std::unique_ptr<Task>> queue_;
+  bool stopping_ = false;
+  std::thread thread_;
+
+  std::shared_ptr<DnsCache> own_dns_cache_;
+  bool resolving_ = false;
+  bool resolved_ = false;
+  bool resolved_ok_ = false;
+  DnsCache::Addresses resolved_addrs_;
+
+  // Owned by the event loop thread.
+  std::vector<std::unique_ptr<Connection>> connections_;
+  std::thread resolver_;
+};
+#endif
+
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+class SSLServer : public Server {
+public:
+  SSLServer(const char *cert_path, const char *private_key_path,
+            const char *client_ca_cert_file_path = nullptr,
+            const char *client_ca_cert_dir_path = nullptr);
+
+  ~SSLServer() override;
+
+  bool is_valid() const override;
+
+  // Session tickets are encrypted with a key that is replaced every `sec`
+  // seconds. Tickets made with the previous key are still accepted (and
+  // renewed) for one more interval.
+  void set_ticket_key_rotation(time_t sec);
+
+  // Has the kernel encrypt what is sent after the handshake (kTLS), so file
+  // bodies can go out with sendfile. It takes effect where OpenSSL and the
+  // kernel support it and for ciphers the kernel knows. Other connections
+  // carry on as usual.
+  void enable_kernel_tls(bool enabled);
+
+  // Accepts up to `size` bytes of TLS 1.3 early data (0-RTT) from resuming
+  // clients. Early data can be replayed by an attacker, so this should only
+  // be enabled when the handlers of idempotent requests are safe to repeat.
+  // OpenSSL then keeps tickets in the session cache and accepts each once.
+  void set_max_early_data(uint32_t size);
+
+private:
+  struct TicketKey {
+    unsigned char name[16];
+    unsigned char aes_key[32];
+    unsigned char hmac_key[32];
+    std::chrono::steady_clock::time_point created;
+  };
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  using TicketMacContext = EVP_MAC_CTX;
+#else
+  using TicketMacContext = HMAC_CTX;
+#endif
+
+  bool process_and_close_socket(socket_t sock) override;
+  bool accept_ssl(SSL *ssl, std::string &early_data);
+  bool process_request_ssl(SSL *ssl, detail::SSLSocketStream &strm,
+                           bool last_connection, bool &connection_close);
+
+#ifndef _WIN32
+  // An event loop thread waits for handshakes to be able to go on, and each
+  // step, with its crypto, runs on the task queue. The worker that completes
+  // a handshake goes on to serve the connection. A client that is slow to
+  // complete its handshake never holds a worker.
+  struct Handshake {
+    socket_t sock;
+    SSL *ssl;
+    bool reading_early_data;
+    std::string early_data;
+    int events;
+    std::chrono::steady_clock::time_point deadline;
+  };
+
+  void dispatch_socket(socket_t sock, TaskQueue &task_queue) override;
+  void stop_dispatch() override;
+  bool start_handshakes(TaskQueue &task_queue);
+  void wake_handshakes();
+  void run_handshakes();
+  void begin_handshake(socket_t sock);
+  void step_handshake(Handshake &hs);
+  bool continue_handshake(Handshake &hs);
+  void close_handshake(Handshake &hs);
+  void process_handshaken_socket(socket_t sock, SSL *ssl,
+                                 const std::string &early_data,
+                                 uint64_t queued);
+
+  detail::event_poller handshake_poller_;
+  int handshake_wake_fds_[2] = {-1, -1};
+  std::thread handshake_thread_;
+  std::mutex handshake_mutex_;
+  std::vector<Handshake> waiting_handshakes_; // from workers, to be watched
+  bool handshake_stopping_ = false;
+  TaskQueue *task_queue_ = nullptr;
+#endif
+
+  bool current_ticket_key(TicketKey &key);
+  bool find_ticket_key(const unsigned char *name, TicketKey &key,
+                       bool &renew);
+
+  SSL_CTX *ctx_;
+  std::mutex ctx_mutex_;
+
+  std::mutex ticket_keys_mutex_;
+  std::vector<TicketKey> ticket_keys_; // newest last
+  time_t ticket_key_rotation_sec_ = CPPHTTPLIB_SSL_TICKET_KEY_ROTATION_SECOND;
+  uint32_t max_early_data_ = 0;
+
+  static int ticket_key_callback(SSL *ssl, unsigned char *key_name,
+                                 unsigned char *iv, EVP_CIPHER_CTX *cctx,
+                                 TicketMacContext *hctx, int enc);
+};
+
+class SSLClient : public Client {
+public:
+  explicit SSLClient(const std::string &host, int port = 443,
+                     const std::string &client_cert_path = std::string(),
+                     const std::string &client_key_path = std::string());
+
+  ~SSLClient() override;
+
+  bool is_valid() const override;
+
+  void set_ca_cert_path(const char *ca_ceert_file_path,
+                        const char *ca_cert_dir_path = nullptr);
+
+  void enable_server_certificate_verification(bool enabled);
+
+  // With requests going out from several threads, this is the result of
+  // whichever handshake checked its certificate last.
+  long get_openssl_verify_result() const;
+
+  SSL_CTX *ssl_context() const noexcept;
+
+  // The session of the last handshake with the host is kept and offered
+  // again on the next connection, which skips the certificate exchange.
+  void enable_session_resumption(bool enabled);
+
+  // Sends idempotent requests without a body as TLS 1.3 early data (0-RTT)
+  // when resuming a session the server allows it on. If the server rejects
+  // the early data, the request is sent again after the handshake.
+  void enable_early_data(bool enabled);
+
+private:
+  bool process_and_close_socket(
+      socket_t sock, size_t request_count, bool early_data,
+      detail::canceler *canceler,
+      std::function<bool(Stream &strm, bool last_connection,
+                         bool &connection_close)>
+          callback) override;
+  std::string connection_pool_key() const override;
+  bool process_pooled_connection(
+      ConnectionPool::Connection &conn, bool &reusable, bool early_data,
+      detail::canceler *canceler,
+      std::function<bool(Stream &strm, bool last_connection,
+                         bool &connection_close)>
+          callback) override;
+  bool is_ssl() const override;
+
+  bool setup_ssl(SSL *ssl);
+  bool connect_ssl(SSL *ssl, bool early_data, detail::canceler *canceler,
+                   detail::ssl_stream_state &state);
+  bool check_peer(SSL *ssl);
+  bool verify_peer(SSL *ssl);
+  bool verify_host(X509 *server_cert) const;
+  bool verify_host_with_subject_alt_name(X509 *server_cert) const;
+  bool verify_host_with_common_name(X509 *server_cert) const;
+  bool check_host_name(const char *pattern, size_t pattern_len) const;
+
+  SSL_CTX *ctx_;
+  std::mutex ctx_mutex_;
+  std::vector<std::string> host_components_;
+
+  std::string ca_cert_file_path_;
+  std::string ca_cert_dir_path_;
+  bool ca_cert_loaded_ = true;
+  bool server_certificate_verification_ = false;
+  std::atomic<long> verify_result_{0};
+
+  std::mutex session_mutex_;
+  SSL_SESSION *session_ = nullptr;
+  bool session_resumption_ = true;
+  bool early_data_ = false;
+
+  static int new_session_callback(SSL *ssl, SSL_SESSION *session);
+};
+#endif
+
+// ----------------------------------------------------------------------------
+
+/*
+ * Implementation
+ */
+
+namespace detail {
+
+inline bool is_hex(char c, int &v) {
+  if (0x20 <= c && isdigit(c)) {
+    v = c - '0';
+    return true;
+  } else if ('A' <= c && c <= 'F') {
+    v = c - 'A' + 10;
+    return true;
+  } else if ('a' <= c && c <= 'f') {
+    v = c - 'a' + 10;
+    return true;
+  }
+  return false;
+}
+
+inline bool from_hex_to_i(const std::string &s, size_t i, size_t cnt,
+                          int &val) {
+  if (i >= s.size()) { return false; }
+
+  val = 0;
+  for (; cnt; i++, cnt--) {
+    if (!s[i]) { return false; }
+    int v = 0;
+    if (is_hex(s[i], v)) {
+      val = val * 16 + v;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline std::string from_i_to_hex(size_t n) {
+  const char *charset = "0123456789abcdef";
+  std::string ret;
+  do {
+    ret = charset[n & 15] + ret;
+    n >>= 4;
+  } while (n > 0);
+  return ret;
+}
+
+inline size_t to_utf8(int code, char *buff) {
+  if (code < 0x0080) {
+    buff[0] = (code & 0x7F);
+    return 1;
+  } else if (code < 0x0800) {
+    buff[0] = static_cast<char>(0xC0 | ((code >> 6) & 0x1F));
+    buff[1] = static_cast<char>(0x80 | (code & 0x3F));
+    return 2;
+  } else if (code < 0xD800) {
+    buff[0] = static_cast<char>(0xE0 | ((code >> 12) & 0xF));
+    buff[1] = static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+    buff[2] = static_cast<char>(0x80 | (code & 0x3F));
+    return 3;
+  } else if (code < 0xE000) { // D800 - DFFF is invalid...
+    return 0;
+  } else if (code < 0x10000) {
+    buff[0] = static_cast<char>(0xE0 | ((code >> 12) & 0xF));
+    buff[1] = static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+    buff[2] = static_cast<char>(0x80 | (code & 0x3F));
+    return 3;
+  } else if (code < 0x110000) {
+    buff[0] = static_cast<char>(0xF0 | ((code >> 18) & 0x7));
+    buff[1] = static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+    buff[2] = static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+    buff[3] = static_cast<char>(0x80 | (code & 0x3F));
+    return 4;
+  }
+
+  // NOTREACHED
+  return 0;
+}
+
+// NOTE: This code came up with the following stackoverflow post:
+// https://stackoverflow.com/questions/180947/base64-decode-snippet-in-c
+inline std::string base64_encode(const std::string &in) {
+  static const auto lookup =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  std::string out;
+  out.reserve(in.size());
+
+  int val = 0;
+  int valb = -6;
+
+  for (auto c : in) {
+    val = (val << 8) + static_cast<uint8_t>(c);
+    valb += 8;
+    while (valb >= 0) {
+      out.push_back(lookup[(val >> valb) & 0x3F]);
+      valb -= 6;
+    }
+  }
+
+  if (valb > -6) { out.push_back(lookup[((val << 8) >> (valb + 8)) & 0x3F]); }
+
+  while (out.size() % 4) {
+    out.push_back('=');
+  }
+
+  return out;
+}
+
+inline bool is_file(const std::string &path) {
+  struct stat st;
+  return stat(path.c_str(), &st) >= 0 && S_ISREG(st.st_mode);
+}
+
+inline bool is_dir(const std::string &path) {
+  struct stat st;
+  return stat(path.c_str(), &st) >= 0 && S_ISDIR(st.st_mode);
+}
+
+// Calls fn with the name of each entry in the directory.
+template <typename Fn> inline void list_dir(const std::string &dir, Fn fn) {
+#ifdef _WIN32
+  struct _finddata_t data;
+  auto handle = _findfirst((dir + "/*").c_str(), &data);
+  if (handle == -1) { return; }
+  do {
+    fn(std::string(data.name));
+  } while (_findnext(handle, &data) == 0);
+  _findclose(handle);
+#else
+  auto d = opendir(dir.c_str());
+  if (!d) { return; }
+  while (auto entry = readdir(d)) {
+    fn(std::string(entry->d_name));
+  }
+  closedir(d);
+#endif
+}
+
+inline bool is_valid_path(const std::string &path) {
+  size_t level = 0;
+  size_t i = 0;
+
+  // Skip slash
+  while (i < path.size() && path[i] == '/') {
+    i++;
+  }
+
+  while (i < path.size()) {
+    // Read component
+    auto beg = i;
+    while (i < path.size() && path[i] != '/') {
+      i++;
+    }
+
+    auto len = i - beg;
+    assert(len > 0);
+
+    if (!path.compare(beg, len, ".")) {
+      ;
+    } else if (!path.compare(beg, len, "..")) {
+      if (level == 0) { return false; }
+      level--;
+    } else {
+      level++;
+    }
+
+    // Skip slash
+    while (i < path.size() && path[i] == '/') {
+      i++;
+    }
+  }
+
+  return true;
+}
+
+inline void read_file(const std::string &path, std::string &out) {
+  std::ifstream fs(path, std::ios_base::binary);
+  fs.seekg(0, std::ios_base::end);
+  auto size = fs.tellg();
+  fs.seekg(0);
+  out.resize(static_cast<size_t>(size));
+  fs.read(&out[0], size);
+}
+
+inline std::string file_extension(const std::string &path) {
+  std::smatch m;
+  static auto re = std::regex("\\.([a-zA-Z0-9]+)$");
+  if (std::regex_search(path, m, re)) { return m[1].str(); }
+  return std::string();
+}
+
+template <class Fn> void split(const char *b, const char *e, char d, Fn fn) {
+  int i = 0;
+  int beg = 0;
+
+  while (e ? (b + i != e) : (b[i] != '\0')) {
+    if (b[i] == d) {
+      fn(&b[beg], &b[i]);
+      beg = i + 1;
+    }
+    i++;
+  }
+
+  if (i) { fn(&b[beg], &b[i]); }
+}
+
+// NOTE: until the read size reaches `fixed_buffer_size`, use `fixed_buffer`
+// to store data. The call can set memory on stack for performance.
+class stream_line_reader {
+public:
+  stream_line_reader(Stream &strm, char *fixed_buffer, size_t fixed_buffer_size)
+      : strm_(strm), fixed_buffer_(fixed_buffer),
+        fixed_buffer_size_(fixed_buffer_size) {}
+
+  const char *ptr() const {
+    if (glowable_buffer_.empty()) {
+      return fixed_buffer_;
+    } else {
+      return glowable_buffer_.data();
+    }
+  }
+
+  size_t size() const {
+    if (glowable_buffer_.empty()) {
+      return fixed_buffer_used_size_;
+    } else {
+      return glowable_buffer_.size();
+    }
+  }
+
+  bool end_with_crlf() const {
+    auto end = ptr() + size();
+    return size() >= 2 && end[-2] == '\r' && end[-1] == '\n';
+  }
+
+  bool getline() {
+    fixed_buffer_used_size_ = 0;
+    glowable_buffer_.clear();
+
+    for (size_t i = 0;; i++) {
+      char byte;
+      auto n = strm_.read(&byte, 1);
+
+      if (n < 0) {
+        return false;
+      } else if (n == 0) {
+        if (i == 0) {
+          return false;
+        } else {
+          break;
+        }
+      }
+
+      append(byte);
+
+      if (byte == '\n') { break; }
+    }
+
+    return true;
+  }
+
+private:
+  void append(char c) {
+    if (fixed_buffer_used_size_ < fixed_buffer_size_ - 1) {
+      fixed_buffer_[fixed_buffer_used_size_++] = c;
+      fixed_buffer_[fixed_buffer_used_size_] = '\0';
+    } else {
+      if (glowable_buffer_.empty()) {
+        assert(fixed_buffer_[fixed_buffer_used_size_] == '\0');
+        glowable_buffer_.assign(fixed_buffer_, fixed_buffer_used_size_);
+      }
+      glowable_buffer_ += c;
+    }
+  }
+
+  Stream &strm_;
+  char *fixed_buffer_;
+  const size_t fixed_buffer_size_;
+  size_t fixed_buffer_used_size_ = 0;
+  std::string glowable_buffer_;
+};
+
+inline int close_socket(socket_t sock) {
+#ifdef _WIN32
+  return closesocket(sock);
+#else
+  return close(sock);
+#endif
+}
+
+inline int select_read(socket_t sock, time_t sec, time_t usec) {
+#ifdef CPPHTTPLIB_USE_POLL
+  struct pollfd pfd_read;
+  pfd_read.fd = sock;
+  pfd_read.events = POLLIN;
+
+  auto timeout = static_cast<int>(sec * 1000 + usec / 1000);
+
+  return poll(&pfd_read, 1, timeout);
+#else
+  fd_set fds;
+  FD_ZERO(&fds);
+  FD_SET(sock, &fds);
+
+  timeval tv;
+  tv.tv_sec = static_cast<long>(sec);
+  tv.tv_usec = static_cast<decltype(tv.tv_usec)>(usec);
+
+  return select(static_cast<int>(sock + 1), &fds, nullptr, nullptr, &tv);
+#endif
+}
+
+inline int select_write(socket_t sock, time_t sec, time_t usec) {
+#ifdef CPPHTTPLIB_USE_POLL
+  struct pollfd pfd_read;
+  pfd_read.fd = sock;
+  pfd_read.events = POLLOUT;
+
+  auto timeout = static_cast<int>(sec * 1000 + usec / 1000);
+
+  return poll(&pfd_read, 1, timeout);
+#else
+  fd_set fds;
+  FD_ZERO(&fds);
+  FD_SET(sock, &fds);
+
+  timeval tv;
+  tv.tv_sec = static_cast<long>(sec);
+  tv.tv_usec = static_cast<decltype(tv.tv_usec)>(usec);
+
+  return select(static_cast<int>(sock + 1), nullptr, &fds, nullptr, &tv);
+#endif
+}
+
+inline bool wait_until_socket_is_ready(socket_t sock, time_t sec, time_t usec) {
+#ifdef CPPHTTPLIB_USE_POLL
+  struct pollfd pfd_read;
+  pfd_read.fd = sock;
+  pfd_read.events = POLLIN | POLLOUT;
+
+  auto timeout = static_cast<int>(sec * 1000 + usec / 1000);
+
+  if (poll(&pfd_read, 1, timeout) > 0 &&
+      pfd_read.revents & (POLLIN | POLLOUT)) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    return getsockopt(sock, SOL_SOCKET, SO_ERROR,
+                      reinterpret_cast<char *>(&error), &len) >= 0 &&
+           !error;
+  }
+  return false;
+#else
+  fd_set fdsr;
+  FD_ZERO(&fdsr);
+  FD_SET(sock, &fdsr);
+
+  auto fdsw = fdsr;
+  auto fdse = fdsr;
+
+  timeval tv;
+  tv.tv_sec = static_cast<long>(sec);
+  tv.tv_usec = static_cast<decltype(tv.tv_usec)>(usec);
+
+  if (select(static_cast<int>(sock + 1), &fdsr, &fdsw, &fdse, &tv) > 0 &&
+      (FD_ISSET(sock, &fdsr) || FD_ISSET(sock, &fdsw))) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    return getsockopt(sock, SOL_SOCKET, SO_ERROR,
+                      reinterpret_cast<char *>(&error), &len) >= 0 &&
+           !error;
+  }
+  return false;
+#endif
+}
+
+// Closing a socket with unread data makes the kernel reset the connection,
+// which can destroy a response the peer hasn't read yet. That happens when a
+// server ends a connection while the client has pipelined more requests. So
+// send FIN first, and drain what the peer sends until it closes too.
+inline void close_socket_gracefully(socket_t sock) {
+#ifdef _WIN32
+  shutdown(sock, SD_SEND);
+#else
+  shutdown(sock, SHUT_WR);
+#endif
+
+  std::array<char, 4096> buf;
+  auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(1000);
+  while (std::chrono::steady_clock::now() < deadline &&
+         select_read(sock, 0, 100000) > 0 &&
+         recv(sock, buf.data(), buf.size(), 0) > 0) {}
+
+  close_socket(sock);
+}
+
+class SocketStream : public Stream {
+public:
+  SocketStream(socket_t sock, time_t read_timeout_sec,
+               time_t read_timeout_usec);
+  ~SocketStream() override;
+
+  bool is_readable() const override;
+  bool is_writable() const override;
+  ssize_t read(char *ptr, size_t size) override;
+  ssize_t write(const char *ptr, size_t size) override;
+  std::string get_remote_addr() const override;
+  socket_t socket() const override;
+#ifdef __linux__
+  ssize_t send_file(int fd, uint64_t offset, size_t size) override;
+#endif
+
+private:
+  socket_t sock_;
+  time_t read_timeout_sec_;
+  time_t read_timeout_usec_;
+};
+
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+// What a TLS connection keeps between the streams made for its requests.
+struct ssl_stream_state {
+  // Decrypted data not read yet. On the server, this starts out with the
+  // early data that came with the handshake.
+  std::string read_buf;
+  size_t read_off = 0;
+  size_t read_len = 0;
+  size_t early_data_len = 0; // of the read buffer, on the server
+
+  // On the client, what was sent as early data, in case it's rejected.
+  std::string early_data;
+
+  // On the client, checks the peer of a handshake that was put off for
+  // early data, once it completes with a full handshake.
+  std::function<bool(SSL *ssl)> verify_peer;
+};
+
+// Reads are served from whole records, and small writes are gathered into
+// full records until the next read, flush or the end of the stream.
+class SSLSocketStream : public Stream {
+public:
+  SSLSocketStream(socket_t sock, SSL *ssl, time_t read_timeout_sec,
+                  time_t read_timeout_usec,
+                  ssl_stream_state *state = nullptr);
+  ~SSLSocketStream() override;
+
+  bool is_readable() const override;
+  bool is_writable() const override;
+  ssize_t read(char *ptr, size_t size) override;
+  ssize_t write(const char *ptr, size_t size) override;
+  std::string get_remote_addr() const override;
+  socket_t socket() const override;
+  bool flush() override;
+#if defined(__linux__) && OPENSSL_VERSION_NUMBER >= 0x30000000L &&            \
+    !defined(OPENSSL_NO_KTLS)
+  ssize_t send_file(int fd, uint64_t offset, size_t size) override;
+#endif
+
+  // Whether early data from the handshake is still to be read.
+  bool reading_early_data() const;
+
+private:
+  ssize_t write_through(const char *ptr, size_t size);
+  bool finish_handshake();
+
+  socket_t sock_;
+  SSL *ssl_;
+  time_t read_timeout_sec_;
+  time_t read_timeout_usec_;
+
+  ssl_stream_state own_state_;
+  ssl_stream_state &state_;
+  std::string write_buf_;
+};
+#endif
+
+class BufferStream : public Stream {
+public:
+  BufferStream() = default;
+  explicit BufferStream(std::string &&data) : buffer(std::move(data)) {}
+  ~BufferStream() override = default;
+
+  bool is_readable() const override;
+  bool is_writable() const override;
+  ssize_t read(char *ptr, size_t size) override;
+  ssize_t write(const char *ptr, size_t size) override;
+  std::string get_remote_addr() const override;
+  socket_t socket() const override;
+
+  const std::string &get_buffer() const;
+
+private:
+  std::string buffer;
+  size_t position = 0;
+};
+
+#ifdef CPPHTTPLIB_USE_IO_URING
+// A ring driven through the raw system calls, so liburing isn't required.
+// A ring is owned by a single thread.
+class io_uring_ring {
+public:
+  explicit io_uring_ring(unsigned entries);
+  ~io_uring_ring();
+
+  io_uring_ring(const io_uring_ring &) = delete;
+  io_uring_ring &operator=(const io_uring_ring &) = delete;
+
+  bool is_valid() const;
+  unsigned features() const;
+
+  io_uring_sqe *get_sqe();
+  int submit(unsigned wait_nr);
+  bool peek_cqe(io_uring_cqe &cqe);
+  bool wait_cqe(io_uring_cqe &cqe);
+
+private:
+  int fd_ = -1;
+  unsigned features_ = 0;
+
+  void *sq_ptr_ = MAP_FAILED;
+  size_t sq_size_ = 0;
+  void *cq_ptr_ = MAP_FAILED;
+  size_t cq_size_ = 0;
+  io_uring_sqe *sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  unsigned *sq_head_ = nullptr;
+  unsigned *sq_tail_ = nullptr;
+  unsigned *sq_array_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned sqe_head_ = 0;
+  unsigned sqe_tail_ = 0;
+
+  unsigned *cq_head_ = nullptr;
+  unsigned *cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe *cqes_ = nullptr;
+};
+
+// Per-thread ring for server workers, with a group of receive buffers handed
+// to the kernel. A receive picks a buffer only once data has arrived, so idle
+// connections don't pin memory.
+class io_uring_context {
+public:
+  enum Op { Send, Recv, Timeout, Close, ProvideBuffers, OpCount };
+
+  io_uring_context();
+
+  bool is_valid() const;
+  bool can_link_send() const;
+
+  io_uring_sqe *prepare(Op op);
+  bool complete(std::array<io_uring_cqe, OpCount> &cqes);
+
+  char *buffer(unsigned bid);
+  void recycle_buffer(unsigned bid);
+
+private:
+  io_uring_ring ring_;
+  std::vector<char> buffers_;
+  unsigned queued_ = 0;
+  bool valid_ = false;
+};
+
+io_uring_context *io_uring_thread_context();
+
+class IoUringSocketStream : public Stream {
+public:
+  IoUringSocketStream(socket_t sock, io_uring_context &ctx,
+                      time_t read_timeout_sec, time_t read_timeout_usec);
+  ~IoUringSocketStream() override;
+
+  bool is_readable() const override;
+  bool is_writable() const override;
+  ssize_t read(char *ptr, size_t size) override;
+  ssize_t write(const char *ptr, size_t size) override;
+  std::string get_remote_addr() const override;
+  socket_t socket() const override;
+  bool flush() override;
+
+  bool wait_readable(time_t sec, time_t usec);
+  void close(bool linger);
+
+private:
+  ssize_t fill(time_t sec, time_t usec);
+  bool send_all(const char *data, size_t size, bool close_after);
+
+  socket_t sock_;
+  io_uring_context &ctx_;
+  time_t read_timeout_sec_;
+  time_t read_timeout_usec_;
+
+  std::string write_buf_;
+  char *read_buf_ = nullptr;
+  unsigned read_bid_ = 0;
+  size_t read_off_ = 0;
+  size_t read_len_ = 0;
+  bool closed_ = false;
+};
+#endif
+
+// Phases of serving a request, recorded when CPPHTTPLIB_TRACE is defined.
+// Otherwise the tracing calls are empty.
+enum class trace_phase : uint32_t {
+  Queue,         // accepted, waiting for a worker
+  KeepAliveWait, // waiting for the next request on the connection
+  Request,       // the whole of process_request
+  ReadHeaders,   // request line and headers
+  Routing,       // routing, which includes reading the body
+  Handler,
+  WriteResponse,
+};
+
+#ifdef CPPHTTPLIB_TRACE
+inline uint64_t trace_clock() {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count());
+}
+
+struct trace_event {
+  std::atomic<uint64_t> start; // nanoseconds
+  std::atomic<uint64_t> end;
+  std::atomic<uint64_t> request;
+  std::atomic<uint64_t> info;     // phase in the low byte, socket above
+  std::atomic<uint64_t> label[4]; // "METHOD path" of a request, truncated
+};
+
+// Events of one thread, which is the only writer. The writer claims a slot
+// by bumping `begin`, and publishes it by bumping `head`. A reader copies
+// what is published, then drops the slots claimed again in the meantime.
+struct trace_ring {
+  std::atomic<uint64_t> begin;
+  std::atomic<uint64_t> head;
+  std::atomic<bool> in_use;
+  uint64_t id;
+  uint64_t request_seq; // owner thread only
+  trace_event events[CPPHTTPLIB_TRACE_RING_SIZE];
+};
+
+struct trace_registry {
+  std::mutex mutex;
+  std::vector<std::unique_ptr<trace_ring>> rings;
+};
+
+// Never destroyed, since threads may still record while statics go away.
+inline trace_registry &get_trace_registry() {
+  static auto registry = new trace_registry;
+  return *registry;
+}
+
+// The ring of the calling thread. Rings of finished threads are reused.
+inline trace_ring &local_trace_ring() {
+  struct holder {
+    trace_ring *ring = nullptr;
+    ~holder() {
+      if (ring) { ring->in_use.store(false, std::memory_order_release); }
+    }
+  };
+  static thread_local holder local;
+  if (local.ring) { return *local.ring; }
+
+  auto &registry = get_trace_registry();
+  std::lock_guard<std::mutex> guard(registry.mutex);
+  for (const auto &ring : registry.rings) {
+    if (!ring->in_use.load(std::memory_order_acquire)) {
+      ring->in_use = true;
+      local.ring = ring.get();
+      return *local.ring;
+    }
+  }
+
+  std::unique_ptr<trace_ring> ring(new trace_ring());
+  ring->id = registry.rings.size() + 1;
+  ring->in_use = true;
+  local.ring = ring.get();
+  registry.rings.push_back(std::move(ring));
+  return *local.ring;
+}
+
+inline void trace_record(trace_phase phase, socket_t sock, uint64_t start,
+                         uint64_t end, const std::string *label = nullptr) {
+  auto &ring = local_trace_ring();
+
+  // Waits belong to the request that follows them.
+  auto request = ring.request_seq;
+  if (phase == trace_phase::Queue || phase == trace_phase::KeepAliveWait) {
+    request++;
+  }
+
+  uint64_t words[4] = {};
+  if (label) {
+    memcpy(words, label->data(), (std::min)(label->size(), sizeof(words)));
+  }
+
+  auto i = ring.begin.load(std::memory_order_relaxed);
+  ring.begin.store(i + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  auto &e = ring.events[i % CPPHTTPLIB_TRACE_RING_SIZE];
+  e.start.store(start, std::memory_order_relaxed);
+  e.end.store(end, std::memory_order_relaxed);
+  e.request.store(request, std::memory_order_relaxed);
+  e.info.store((static_cast<uint64_t>(sock) << 8) |
+                   static_cast<uint64_t>(phase),
+               std::memory_order_relaxed);
+  for (size_t j = 0; j < 4; j++) {
+    e.label[j].store(words[j], std::memory_order_relaxed);
+  }
+
+  ring.head.store(i + 1, std::memory_order_release);
+}
+
+class trace_span {
+public:
+  trace_span(trace_phase phase, socket_t sock)
+      : phase_(phase), sock_(sock), start_(trace_clock()) {
+    if (phase == trace_phase::Request) { local_trace_ring().request_seq++; }
+  }
+
+  ~trace_span() {
+    if (!canceled_) {
+      trace_record(phase_, sock_, start_, trace_clock(),
+                   label_.empty() ? nullptr : &label_);
+    }
+  }
+
+  void set_label(const std::string &method, const std::string &path) {
+    label_ = method + " " + path;
+  }
+
+  void cancel() { canceled_ = true; }
+
+private:
+  trace_phase phase_;
+  socket_t sock_;
+  uint64_t start_;
+  std::string label_;
+  bool canceled_ = false;
+};
+#else
+inline uint64_t trace_clock() { return 0; }
+
+inline void trace_record(trace_phase /*phase*/, socket_t /*sock*/,
+                         uint64_t /*start*/, uint64_t /*end*/) {}
+
+class trace_span {
+public:
+  trace_span(trace_phase /*phase*/, socket_t /*sock*/) {}
+  void set_label(const std::string & /*method*/,
+                 const std::string & /*path*/) {}
+  void cancel() {}
+};
+#endif
+
+#ifdef CPPHTTPLIB_ALLOCATION_STATS
+// Counters of the thread, bumped by the replaced operator new. Only the
+// owning thread touches them, so they're plain integers.
+inline AllocationStats &local_allocations() {
+  static thread_local AllocationStats stats;
+  return stats;
+}
+
+// Counters as they stood when each phase of the thread's current request
+// began: parse, handler, write.
+struct allocation_marks {
+  AllocationStats at[3];
+  size_t phases = 0;
+};
+
+inline allocation_marks &local_allocation_marks() {
+  static thread_local allocation_marks marks;
+  return marks;
+}
+
+// Phase 0 starts a new request. A skipped phase gets nothing.
+inline void begin_allocation_phase(size_t phase) {
+  auto &marks = local_allocation_marks();
+  if (phase == 0) { marks.phases = 0; }
+  while (marks.phases <= phase) {
+    marks.at[marks.phases++] = local_allocations();
+  }
+}
+
+inline RequestAllocations current_request_allocations() {
+  const auto &marks = local_allocation_marks();
+  const auto &now = local_allocations();
+  AllocationStats by_phase[3];
+  for (size_t i = 0; i < marks.phases; i++) {
+    const auto &end = i + 1 < marks.phases ? marks.at[i + 1] : now;
+    by_phase[i].count = end.count - marks.at[i].count;
+    by_phase[i].bytes = end.bytes - marks.at[i].bytes;
+  }
+  RequestAllocations allocations;
+  allocations.parse = by_phase[0];
+  allocations.handler = by_phase[1];
+  allocations.write = by_phase[2];
+  return allocations;
+}
+#else
+inline void begin_allocation_phase(size_t /*phase*/) {}
+
+inline RequestAllocations current_request_allocations() {
+  return RequestAllocations();
+}
+#endif
+
+// Waits for the next request on a keep-alive connection.
+inline bool wait_keep_alive(socket_t sock, time_t sec) {
+  trace_span span(trace_phase::KeepAliveWait, sock);
+  return select_read(sock, sec, CPPHTTPLIB_KEEPALIVE_TIMEOUT_USECOND) > 0;
+}
+
+template <typename T>
+inline bool process_socket(bool is_client_request, socket_t sock,
+                           size_t keep_alive_max_count,
+                           time_t keep_alive_timeout_sec,
+                           time_t read_timeout_sec, time_t read_timeout_usec,
+                           T callback) {
+  assert(keep_alive_max_count > 0);
+
+  auto ret = false;
+
+  if (keep_alive_max_count > 1) {
+    auto count = keep_alive_max_count;
+    while (count > 0 && (is_client_request ||
+                         wait_keep_alive(sock, keep_alive_timeout_sec))) {
+      SocketStream strm(sock, read_timeout_sec, read_timeout_usec);
+      auto last_connection = count == 1;
+      auto connection_close = false;
+
+      ret = callback(strm, last_connection, connection_close);
+      if (!ret || connection_close) { break; }
+
+      count--;
+    }
+  } else { // keep_alive_max_count  is 0 or 1
+    SocketStream strm(sock, read_timeout_sec, read_timeout_usec);
+    auto dummy_connection_close = false;
+    ret = callback(strm, true, dummy_connection_close);
+  }
+
+  return ret;
+}
+
+template <typename T>
+inline bool process_and_close_socket(bool is_client_request, socket_t sock,
+                                     size_t keep_alive_max_count,
+                                     time_t keep_alive_timeout_sec,
+                                     time_t read_timeout_sec,
+                                     time_t read_timeout_usec, T callback) {
+  // The server ends the connection itself after the last request it allows,
+  // when more may have been pipelined behind it.
+  auto linger = false;
+  auto ret = process_socket(
+      is_client_request, sock, keep_alive_max_count, keep_alive_timeout_sec,
+      read_timeout_sec, read_timeout_usec,
+      [&](Stream &strm, bool last_connection, bool &connection_close) {
+        auto ret = callback(strm, last_connection, connection_close);
+        linger = ret && last_connection && !connection_close;
+        return ret;
+      });
+
+  if (linger && !is_client_request) {
+    close_socket_gracefully(sock);
+  } else {
+    close_socket(sock);
+  }
+  return ret;
+}
+
+#ifdef CPPHTTPLIB_USE_IO_URING
+template <typename T>
+inline bool process_and_close_socket_io_uring(
+    socket_t sock, io_uring_context &ctx, size_t keep_alive_max_count,
+    time_t keep_alive_timeout_sec, time_t read_timeout_sec,
+    time_t read_timeout_usec, T callback) {
+  // One stream serves the whole connection, since it may hold bytes of the
+  // next pipelined request.
+  IoUringSocketStream strm(sock, ctx, read_timeout_sec, read_timeout_usec);
+
+  auto ret = false;
+  auto linger = false;
+  auto count = (std::max)(keep_alive_max_count, size_t(1));
+  while (count > 0) {
+    if (keep_alive_max_count > 1) {
+      trace_span span(trace_phase::KeepAliveWait, sock);
+      if (!strm.wait_readable(keep_alive_timeout_sec,
+                              CPPHTTPLIB_KEEPALIVE_TIMEOUT_USECOND)) {
+        break;
+      }
+    }
+
+    auto last_connection = count == 1;
+    auto connection_close = false;
+
+    ret = callback(strm, last_connection, connection_close);
+    if (!ret || connection_close) { break; }
+
+    // More requests may have been pipelined behind the last one allowed.
+    linger = last_connection;
+    count--;
+  }
+
+  strm.close(linger);
+  return ret;
+}
+#endif
+
+inline int shutdown_socket(socket_t sock) {
+#ifdef _WIN32
+  return shutdown(sock, SD_BOTH);
+#else
+  return shutdown(sock, SHUT_RDWR);
+#endif
+}
+
+// Lets another thread abort a client request while it waits on its socket,
+// connecting, in the TLS handshake or for the response.
+class canceler {
+public:
+  bool attach(socket_t sock) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (canceled_) { return false; }
+    sock_ = sock;
+    attached_ = true;
+    return true;
+  }
+
+  // Returns true when the request was canceled meanwhile.
+  bool detach() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    sock_ = INVALID_SOCKET;
+    return canceled_;
+  }
+
+  void cancel() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    canceled_ = true;
+    if (sock_ != INVALID_SOCKET) { shutdown_socket(sock_); }
+  }
+
+  bool canceled() const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return canceled_;
+  }
+
+  // A request canceled before it was attached never touched its socket.
+  bool attached() const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return attached_;
+  }
+
+private:
+  socket_t sock_ = INVALID_SOCKET;
+  bool canceled_ = false;
+  bool attached_ = false;
+  mutable std::mutex mutex_;
+};
+
+// Tells why a request on a reused connection failed. A connection the
+// server closed while it sat idle ends before anything of the response,
+// without a timeout.
+class response_watch_stream : public Stream {
+public:
+  explicit response_watch_stream(Stream &strm) : strm_(strm) {}
+
+  bool is_readable() const override { return strm_.is_readable(); }
+  bool is_writable() const override { return strm_.is_writable(); }
+
+  ssize_t read(char *ptr, size_t size) override {
+    // What the stream holds back goes out before waiting for the answer.
+    if (!received_ && strm_.flush() && !strm_.is_readable()) {
+      timed_out_ = true;
+      return -1;
+    }
+    auto n = strm_.read(ptr, size);
+    if (n > 0) { received_ = true; }
+    return n;
+  }
+
+  ssize_t write(const char *ptr, size_t size) override {
+    return strm_.write(ptr, size);
+  }
+  std::string get_remote_addr() const override {
+    return strm_.get_remote_addr();
+  }
+  socket_t socket() const override { return strm_.socket(); }
+  bool flush() override { return strm_.flush(); }
+  ssize_t send_file(int fd, uint64_t offset, size_t size) override {
+    return strm_.send_file(fd, offset, size);
+  }
+
+  // Whether the server closed the connection before answering.
+  bool closed_unanswered() const { return !received_ && !timed_out_; }
+
+private:
+  Stream &strm_;
+  bool received_ = false;
+  bool timed_out_ = false;
+};
+
+// Arms a timer that shuts the socket down when a phase (reading headers,
+// reading the body, writing the response) overruns its deadline. The blocked
+// read or write then fails and the connection is closed by its owner.
+class socket_deadline {
+public:
+  socket_deadline(TimerWheel &wheel, socket_t sock, time_t sec, time_t usec)
+      : wheel_(wheel) {
+    if (sock == INVALID_SOCKET || (sec <= 0 && usec <= 0)) { return; }
+    auto timeout = std::chrono::milliseconds(sec * 1000 + usec / 1000);
+    id_ = wheel_.add(timeout, [sock]() { shutdown_socket(sock); });
+  }
+
+  socket_deadline(const socket_deadline &) = delete;
+  socket_deadline &operator=(const socket_deadline &) = delete;
+
+  ~socket_deadline() {
+    if (id_) { wheel_.cancel(id_); }
+  }
+
+private:
+  TimerWheel &wheel_;
+  TimerWheel::TimerId id_ = 0;
+};
+
+template <typename Fn>
+socket_t create_socket(const struct addrinfo *result, Fn fn) {
+#ifdef _WIN32
+#define SO_SYNCHRONOUS_NONALERT 0x20
+#define SO_OPENTYPE 0x7008
+
+  int opt = SO_SYNCHRONOUS_NONALERT;
+  setsockopt(INVALID_SOCKET, SOL_SOCKET, SO_OPENTYPE, (char *)&opt,
+             sizeof(opt));
+#endif
+
+  for (auto rp = result; rp; rp = rp->ai_next) {
+    // Create a socket
+#ifdef _WIN32
+    auto sock = WSASocketW(rp->ai_family, rp->ai_socktype, rp->ai_protocol,
+                           nullptr, 0, WSA_FLAG_NO_HANDLE_INHERIT);
+    /**
+     * Since the WSA_FLAG_NO_HANDLE_INHERIT is only supported on Windows 7 SP1
+     * and above the socket creation fails on older Windows Systems.
+     *
+     * Let's try to create a socket the old way in this case.
+     *
+     * Reference:
+     * https://docs.microsoft.com/en-us/windows/win32/api/winsock2/nf-winsock2-wsasocketa
+     *
+     * WSA_FLAG_NO_HANDLE_INHERIT:
+     * This flag is supported on Windows 7 with SP1, Windows Server 2008 R2 with
+     * SP1, and later
+     *
+     */
+    if (sock == INVALID_SOCKET) {
+      sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+    }
+#elif defined(SOCK_CLOEXEC)
+    auto sock = socket(rp->ai_family, rp->ai_socktype | SOCK_CLOEXEC,
+                       rp->ai_protocol);
+#else
+    auto sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+#endif
+    if (sock == INVALID_SOCKET) { continue; }
+
+#if !defined(_WIN32) && !defined(SOCK_CLOEXEC)
+    if (fcntl(sock, F_SETFD, FD_CLOEXEC) == -1) {
+      close_socket(sock);
+      continue;
+    }
+#endif
+
+    // Make 'reuse address' option available
+    int yes = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<char *>(&yes),
+               sizeof(yes));
+#ifdef SO_REUSEPORT
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, reinterpret_cast<char *>(&yes),
+               sizeof(yes));
+#endif
+
+    // bind or connect
+    if (fn(sock, *const_cast<struct addrinfo *>(rp))) { return sock; }
+
+    close_socket(sock);
+  }
+
+  return INVALID_SOCKET;
+}
+
+inline struct addrinfo *get_address_info(const char *host, int port,
+                                         int socket_flags) {
+  struct addrinfo hints;
+  struct addrinfo *result;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = socket_flags;
+  hints.ai_protocol = 0;
+
+  auto service = std::to_string(port);
+
+  if (getaddrinfo(host, service.c_str(), &hints, &result)) { return nullptr; }
+  return result;
+}
+
+template <typename Fn>
+socket_t create_socket(const char *host, int port, Fn fn,
+                       int socket_flags = 0) {
+  auto result = get_address_info(host, port, socket_flags);
+  if (!result) { return INVALID_SOCKET; }
+
+  auto sock = create_socket(result, fn);
+  freeaddrinfo(result);
+  return sock;
+}
+
+template <typename Fn>
+socket_t create_socket(DnsCache::Addresses &addrs, Fn fn) {
+  std::vector<struct addrinfo> list(addrs.size());
+  for (size_t i = 0; i < addrs.size(); i++) {
+    auto &ai = list[i];
+    memset(&ai, 0, sizeof(ai));
+    ai.ai_family = addrs[i].family;
+    ai.ai_socktype = addrs[i].socktype;
+    ai.ai_protocol = addrs[i].protocol;
+    ai.ai_addr = reinterpret_cast<struct sockaddr *>(&addrs[i].addr);
+    ai.ai_addrlen = addrs[i].addrlen;
+    ai.ai_next = i + 1 < list.size() ? &list[i + 1] : nullptr;
+  }
+  return list.empty() ? INVALID_SOCKET : create_socket(list.data(), fn);
+}
+
+// Same as above, resolving `host` through `dns_cache` when there is one.
+template <typename Fn>
+socket_t create_socket(DnsCache *dns_cache, const char *host, int port,
+                       Fn fn) {
+  if (!dns_cache) { return create_socket(host, port, fn); }
+
+  DnsCache::Addresses addrs;
+  if (!dns_cache->resolve(host, port, addrs)) { return INVALID_SOCKET; }
+  return create_socket(addrs, fn);
+}
+
+inline void set_nonblocking(socket_t sock, bool nonblocking) {
+#ifdef _WIN32
+  auto flags = nonblocking ? 1UL : 0UL;
+  ioctlsocket(sock, FIONBIO, &flags);
+#else
+  auto flags = fcntl(sock, F_GETFL, 0);
+  fcntl(sock, F_SETFL,
+        nonblocking ? (flags | O_NONBLOCK) : (flags & (~O_NONBLOCK)));
+#endif
+}
+
+template <typename T>
+inline void set_socket_option(socket_t sock, int level, int name, T val) {
+  setsockopt(sock, level, name, reinterpret_cast<const char *>(&val),
+             sizeof(val));
+}
+
+// Options that apply to any connected socket, accepted or dialed.
+inline void set_socket_options(socket_t sock, const SocketOptions &opts) {
+  if (opts.tcp_nodelay) {
+    set_socket_option(sock, IPPROTO_TCP, TCP_NODELAY, 1);
+  }
+  if (opts.send_buffer_size > 0) {
+    set_socket_option(sock, SOL_SOCKET, SO_SNDBUF, opts.send_buffer_size);
+  }
+  if (opts.receive_buffer_size > 0) {
+    set_socket_option(sock, SOL_SOCKET, SO_RCVBUF, opts.receive_buffer_size);
+  }
+}
+
+inline bool listen_socket(socket_t sock, const SocketOptions &opts) {
+  // Buffer sizes set on the listener are inherited by accepted sockets and
+  // must be in place before the handshake to affect window scaling.
+  set_socket_options(sock, opts);
+#ifdef TCP_DEFER_ACCEPT
+  if (opts.defer_accept_sec > 0) {
+    set_socket_option(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                      opts.defer_accept_sec);
+  }
+#endif
+#ifdef TCP_FASTOPEN
+  if (opts.tcp_fastopen > 0) {
+    set_socket_option(sock, IPPROTO_TCP, TCP_FASTOPEN, opts.tcp_fastopen);
+  }
+#endif
+  return !::listen(sock, opts.backlog > 0 ? opts.backlog : SOMAXCONN);
+}
+
+inline socket_t accept_socket(socket_t svr_sock) {
+#if defined(__linux__) && defined(SOCK_CLOEXEC)
+  // Accepted sockets stay blocking: streams rely on full blocking sends.
+  return accept4(svr_sock, nullptr, nullptr, SOCK_CLOEXEC);
+#else
+  auto sock = accept(svr_sock, nullptr, nullptr);
+  if (sock != INVALID_SOCKET) {
+    // Non-Linux systems inherit O_NONBLOCK from the listening socket.
+    set_nonblocking(sock, false);
+#ifndef _WIN32
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+#endif
+  }
+  return sock;
+#endif
+}
+
+inline bool is_accept_queue_empty() {
+#ifdef _WIN32
+  return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+// The call was interrupted, or the pending connection went away before it
+// could be accepted.
+inline bool is_accept_retryable() {
+#ifdef _WIN32
+  return WSAGetLastError() == WSAECONNRESET;
+#else
+  return errno == EINTR || errno == ECONNABORTED;
+#endif
+}
+
+inline bool is_fd_limit_error() {
+#ifdef _WIN32
+  return WSAGetLastError() == WSAEMFILE;
+#else
+  return errno == EMFILE || errno == ENFILE;
+#endif
+}
+
+class reserve_fd {
+public:
+  explicit reserve_fd(bool enabled) {
+    if (enabled) { open_fd(); }
+  }
+
+  reserve_fd(const reserve_fd &) = delete;
+  reserve_fd &operator=(const reserve_fd &) = delete;
+
+  ~reserve_fd() {
+#ifndef _WIN32
+    if (fd_ != -1) { close(fd_); }
+#endif
+  }
+
+  // Gives up the spare descriptor to accept one pending connection and close
+  // it right away, so the peer sees a prompt close rather than a hang.
+  bool shed(socket_t svr_sock) {
+#ifndef _WIN32
+    if (fd_ == -1) { return false; }
+    close(fd_);
+    fd_ = -1;
+
+    auto sock = accept(svr_sock, nullptr, nullptr);
+    if (sock != INVALID_SOCKET) { close_socket(sock); }
+
+    open_fd();
+    return sock != INVALID_SOCKET;
+#else
+    (void)svr_sock;
+    return false;
+#endif
+  }
+
+private:
+  void open_fd() {
+#ifndef _WIN32
+    fd_ = open("/dev/null", O_RDONLY);
+    if (fd_ != -1) { fcntl(fd_, F_SETFD, FD_CLOEXEC); }
+#endif
+  }
+
+  int fd_ = -1;
+};
+
+#ifdef CPPHTTPLIB_USE_IO_URING
+// Accepts connections with a single multishot accept request, which keeps
+// posting a completion per connection until it is cancelled. Returns false
+// when the kernel can't do that (multishot accept needs Linux 5.19), so the
+// caller can fall back to polling.
+template <typename T>
+inline bool accept_with_io_uring(const std::atomic<socket_t> &svr_sock,
+                                 reserve_fd &reserve, bool &ret, T on_accept) {
+  io_uring_ring ring(CPPHTTPLIB_IO_URING_QUEUE_DEPTH);
+  if (!ring.is_valid()) { return false; }
+
+  // Wakes the loop up periodically to notice 'stop'.
+  __kernel_timespec tick{0, 100000000};
+
+  auto arm_accept = [&]() {
+    auto sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = svr_sock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = 1;
+  };
+
+  auto arm_tick = [&]() {
+    auto sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = reinterpret_cast<uintptr_t>(&tick);
+    sqe->len = 1;
+    sqe->user_data = 2;
+  };
+
+  arm_accept();
+  arm_tick();
+  if (ring.submit(0) < 0) { return false; }
+
+  auto accepted = false;
+  io_uring_cqe cqe;
+  for (;;) {
+    if (!ring.wait_cqe(cqe)) {
+      ret = false;
+      break;
+    }
+
+    if (svr_sock == INVALID_SOCKET) {
+      // The server socket was closed by 'stop' method.
+      if (cqe.user_data == 1 && cqe.res >= 0) { close_socket(cqe.res); }
+      break;
+    }
+
+    if (cqe.user_data == 2) {
+      arm_tick();
+      ring.submit(0);
+      continue;
+    }
+
+    if (cqe.res >= 0) {
+      accepted = true;
+      on_accept(cqe.res);
+    } else if (cqe.res == -EINVAL && !accepted) {
+      return false;
+    } else if (cqe.res == -EMFILE || cqe.res == -ENFILE) {
+      if (!reserve.shed(svr_sock)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    } else if (cqe.res != -EINTR && cqe.res != -ECONNABORTED &&
+               cqe.res != -EAGAIN) {
+      close_socket(svr_sock);
+      ret = false;
+      break;
+    }
+
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+      arm_accept();
+      ring.submit(0);
+    }
+  }
+
+  // Don't leak connections that completed while the loop was stopping.
+  while (ring.peek_cqe(cqe)) {
+    if (cqe.user_data == 1 && cqe.res >= 0) { close_socket(cqe.res); }
+  }
+  return true;
+}
+#endif
+
+inline bool is_connection_error() {
+#ifdef _WIN32
+  return WSAGetLastError() != WSAEWOULDBLOCK;
+#else
+  return errno != EINPROGRESS;
+#endif
+}
+
+inline bool bind_ip_address(socket_t sock, const char *host) {
+  struct addrinfo hints;
+  struct addrinfo *result;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = 0;
+
+  if (getaddrinfo(host, "0", &hints, &result)) { return false; }
+
+  auto ret = false;
+  for (auto rp = result; rp; rp = rp->ai_next) {
+    const auto &ai = *rp;
+    if (!::bind(sock, ai.ai_addr, static_cast<socklen_t>(ai.ai_addrlen))) {
+      ret = true;
+      break;
+    }
+  }
+
+  freeaddrinfo(result);
+  return ret;
+}
+
+inline std::string if2ip(const std::string &ifn) {
+#ifndef _WIN32
+  struct ifaddrs *ifap;
+  getifaddrs(&ifap);
+  for (auto ifa = ifap; ifa; ifa = ifa->ifa_next) {
+    if (ifa->ifa_addr && ifn == ifa->ifa_name) {
+      if (ifa->ifa_addr->sa_family == AF_INET) {
+        auto sa = reinterpret_cast<struct sockaddr_in *>(ifa->ifa_addr);
+        char buf[INET_ADDRSTRLEN];
+        if (inet_ntop(AF_INET, &sa->sin_addr, buf, INET_ADDRSTRLEN)) {
+          freeifaddrs(ifap);
+          return std::string(buf, INET_ADDRSTRLEN);
+        }
+      }
+    }
+  }
+  freeifaddrs(ifap);
+#endif
+  return std::string();
+}
+
+inline bool prepare_client_socket(socket_t sock, const std::string &intf,
+                                  const SocketOptions &opts) {
+  if (!intf.empty()) {
+    auto ip = if2ip(intf);
+    if (ip.empty()) { ip = intf; }
+    if (!bind_ip_address(sock, ip.c_str())) { return false; }
+  }
+
+  set_socket_options(sock, opts);
+#ifdef TCP_FASTOPEN_CONNECT
+  if (opts.tcp_fastopen) {
+    set_socket_option(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1);
+  }
+#endif
+  return true;
+}
+
+inline socket_t create_client_socket(const char *host, int port,
+                                     time_t timeout_sec,
+                                     const std::string &intf,
+                                     const SocketOptions &opts,
+                                     DnsCache *dns_cache = nullptr,
+                                     canceler *cancel = nullptr) {
+  // create_socket closes the socket of a failed attempt.
+  return create_socket(
+      dns_cache, host, port, [&](socket_t sock, struct addrinfo &ai) -> bool {
+        if (!prepare_client_socket(sock, intf, opts)) { return false; }
+
+        set_nonblocking(sock, true);
+
+        // A cancel shuts the socket down, which ends the wait for the connect.
+        if (cancel && !cancel->attach(sock)) { return false; }
+
+        auto ret =
+            ::connect(sock, ai.ai_addr, static_cast<socklen_t>(ai.ai_addrlen));
+        auto connected = ret == 0 || (!is_connection_error() &&
+                                      wait_until_socket_is_ready(
+                                          sock, timeout_sec, 0));
+
+        if (cancel && cancel->detach()) { return false; }
+        if (!connected) { return false; }
+
+        set_nonblocking(sock, false);
+        return true;
+      });
+}
+
+inline std::string get_remote_addr(socket_t sock) {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+
+  if (!getpeername(sock, reinterpret_cast<struct sockaddr *>(&addr), &len)) {
+    std::array<char, NI_MAXHOST> ipstr{};
+
+    if (!getnameinfo(reinterpret_cast<struct sockaddr *>(&addr), len,
+                     ipstr.data(), static_cast<socklen_t>(ipstr.size()),
+                     nullptr, 0, NI_NUMERICHOST)) {
+      return ipstr.data();
+    }
+  }
+
+  return std::string();
+}
+
+inline const char *
+find_content_type(const std::string &path,
+                  const std::map<std::string, std::string> &user_data) {
+  auto ext = file_extension(path);
+
+  auto it = user_data.find(ext);
+  if (it != user_data.end()) { return it->second.c_str(); }
+
+  if (ext == "txt") {
+    return "text/plain";
+  } else if (ext == "html" || ext == "htm") {
+    return "text/html";
+  } else if (ext == "css") {
+    return "text/css";
+  } else if (ext == "jpeg" || ext == "jpg") {
+    return "image/jpg";
+  } else if (ext == "png") {
+    return "image/png";
+  } else if (ext == "gif") {
+    return "image/gif";
+  } else if (ext == "svg") {
+    return "image/svg+xml";
+  } else if (ext == "ico") {
+    return "image/x-icon";
+  } else if (ext == "json") {
+    return "application/json";
+  } else if (ext == "pdf") {
+    return "application/pdf";
+  } else if (ext == "js") {
+    return "application/javascript";
+  } else if (ext == "wasm") {
+    return "application/wasm";
+  } else if (ext == "xml") {
+    return "application/xml";
+  } else if (ext == "xhtml") {
+    return "application/xhtml+xml";
+  }
+  return nullptr;
+}
+
+inline const char *status_message(int status) {
+  switch (status) {
+  case 100: return "Continue";
+  case 101: return "Switching Protocol";
+  case 102: return "Processing";
+  case 103: return "Early Hints";
+  case 200: return "OK";
+  case 201: return "Created";
+  case 202: return "Accepted";
+  case 203: return "Non-Authoritative Information";
+  case 204: return "No Content";
+  case 205: return "Reset Content";
+  case 206: return "Partial Content";
+  case 207: return "Multi-Status";
+  case 208: return "Already Reported";
+  case 226: return "IM Used";
+  case 300: return "Multiple Choice";
+  case 301: return "Moved Permanently";
+  case 302: return "Found";
+  case 303: return "See Other";
+  case 304: return "Not Modified";
+  case 305: return "Use Proxy";
+  case 306: return "unused";
+  case 307: return "Temporary Redirect";
+  case 308: return "Permanent Redirect";
+  case 400: return "Bad Request";
+  case 401: return "Unauthorized";
+  case 402: return "Payment Required";
+  case 403: return "Forbidden";
+  case 404: return "Not Found";
+  case 405: return "Method Not Allowed";
+  case 406: return "Not Acceptable";
+  case 407: return "Proxy Authentication Required";
+  case 408: return "Request Timeout";
+  case 409: return "Conflict";
+  case 410: return "Gone";
+  case 411: return "Length Required";
+  case 412: return "Precondition Failed";
+  case 413: return "Payload Too Large";
+  case 414: return "URI Too Long";
+  case 415: return "Unsupported Media Type";
+  case 416: return "Range Not Satisfiable";
+  case 417: return "Expectation Failed";
+  case 418: return "I'm a teapot";
+  case 421: return "Misdirected Request";
+  case 422: return "Unprocessable Entity";
+  case 423: return "Locked";
+  case 424: return "Failed Dependency";
+  case 425: return "Too Early";
+  case 426: return "Upgrade Required";
+  case 428: return "Precondition Required";
+  case 429: return "Too Many Requests";
+  case 431: return "Request Header Fields Too Large";
+  case 451: return "Unavailable For Legal Reasons";
+  case 501: return "Not Implemented";
+  case 502: return "Bad Gateway";
+  case 503: return "Service Unavailable";
+  case 504: return "Gateway Timeout";
+  case 505: return "HTTP Version Not Supported";
+  case 506: return "Variant Also Negotiates";
+  case 507: return "Insufficient Storage";
+  case 508: return "Loop Detected";
+  case 510: return "Not Extended";
+  case 511: return "Network Authentication Required";
+
+  default:
+  case 500: return "Internal Server Error";
+  }
+}
+
+#ifdef CPPHTTPLIB_ZLIB_SUPPORT
+inline bool can_compress(const std::string &content_type) {
+  return !content_type.find("text/") || content_type == "image/svg+xml" ||
+         content_type == "application/javascript" ||
+         content_type == "application/json" ||
+         content_type == "application/xml" ||
+         content_type == "application/xhtml+xml";
+}
+
+inline bool compress(std::string &content) {
+  z_stream strm;
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+
+  auto ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 31, 8,
+                          Z_DEFAULT_STRATEGY);
+  if (ret != Z_OK) { return false; }
+
+  strm.avail_in = static_cast<decltype(strm.avail_in)>(content.size());
+  strm.next_in =
+      const_cast<Bytef *>(reinterpret_cast<const Bytef *>(content.data()));
+
+  std::string compressed;
+
+  std::array<char, 16384> buff{};
+  do {
+    strm.avail_out = buff.size();
+    strm.next_out = reinterpret_cast<Bytef *>(buff.data());
+    ret = deflate(&strm, Z_FINISH);
+    assert(ret != Z_STREAM_ERROR);
+    compressed.append(buff.data(), buff.size() - strm.avail_out);
+  } while (strm.avail_out == 0);
+
+  assert(ret == Z_STREAM_END);
+  assert(strm.avail_in == 0);
+
+  content.swap(compressed);
+
+  deflateEnd(&strm);
+  return true;
+}
+
+class decompressor {
+public:
+  decompressor() {
+    std::memset(&strm, 0, sizeof(strm));
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+
+    // 15 is the value of wbits, which should be at the maximum possible value
+    // to ensure that any gzip stream can be decoded. The offset of 32 specifies
+    // that the stream type should be automatically detected either gzip or
+    // deflate.
+    is_valid_ = inflateInit2(&strm, 32 + 15) == Z_OK;
+  }
+
+  ~decompressor() { inflateEnd(&strm); }
+
+  bool is_valid() const { return is_valid_; }
+
+  template <typename T>
+  bool decompress(const char *data, size_t data_length, T callback) {
+    int ret = Z_OK;
+
+    strm.avail_in = static_cast<decltype(strm.avail_in)>(data_length);
+    strm.next_in = const_cast<Bytef *>(reinterpret_cast<const Bytef *>(data));
+
+    std::array<char, 16384> buff{};
+    do {
+      strm.avail_out = buff.size();
+      strm.next_out = reinterpret_cast<Bytef *>(buff.data());
+
+      ret = inflate(&strm, Z_NO_FLUSH);
+      assert(ret != Z_STREAM_ERROR);
+      switch (ret) {
+      case Z_NEED_DICT:
+      case Z_DATA_ERROR:
+      case Z_MEM_ERROR: inflateEnd(&strm); return false;
+      }
+
+      if (!callback(buff.data(), buff.size() - strm.avail_out)) {
+        return false;
+      }
+    } while (strm.avail_out == 0);
+
+    return ret == Z_OK || ret == Z_STREAM_END;
+  }
+
+private:
+  bool is_valid_;
+  z_stream strm;
+};
+#endif
+
+inline bool has_header(const Headers &headers, const char *key) {
+  return headers.find(key) != headers.end();
+}
+
+inline const char *get_header_value(const Headers &headers, const char *key,
+                                    size_t id = 0, const char *def = nullptr) {
+  auto it = headers.find(key);
+  std::advance(it, static_cast<int>(id));
+  if (it != headers.end()) { return it->second.c_str(); }
+  return def;
+}
+
+inline uint64_t get_header_value_uint64(const Headers &headers, const char *key,
+                                        uint64_t def = 0) {
+  auto it = headers.find(key);
+  if (it != headers.end()) {
+    return std::strtoull(it->second.data(), nullptr, 10);
+  }
+  return def;
+}
+
+inline bool read_headers(Stream &strm, Headers &headers) {
+  const auto bufsiz = 2048;
+  char buf[bufsiz];
+  stream_line_reader line_reader(strm, buf, bufsiz);
+
+  for (;;) {
+    if (!line_reader.getline()) { return false; }
+
+    // Check if the line ends with CRLF.
+    if (line_reader.end_with_crlf()) {
+      // Blank line indicates end of headers.
+      if (line_reader.size() == 2) { break; }
+    } else {
+      continue; // Skip invalid line.
+    }
+
+    // Skip trailing spaces and tabs.
+    auto end = line_reader.ptr() + line_reader.size() - 2;
+    while (line_reader.ptr() < end && (end[-1] == ' ' || end[-1] == '\t')) {
+      end--;
+    }
+
+    // Horizontal tab and ' ' are considered whitespace and are ignored when on
+    // the left or right side of the header value:
+    //  - https://stackoverflow.com/questions/50179659/
+    //  - https://www.w3.org/Protocols/rfc2616/rfc2616-sec4.html
+    static const std::regex re(R"(([^:]+):[\t ]*(.+))");
+
+    std::cmatch m;
+    if (std::regex_match(line_reader.ptr(), end, m, re)) {
+      auto key = std::string(m[1]);
+      auto val = std::string(m[2]);
+      headers.emplace(key, val);
+    }
+  }
+
+  return true;
+}
+
+inline bool read_content_with_length(Stream &strm, uint64_t len,
+                                     Progress progress, ContentReceiver out,
+                                     char *buf, size_t bufsiz) {
+  uint64_t r = 0;
+  while (r < len) {
+    auto read_len = static_cast<size_t>(len - r);
+    auto n = strm.read(buf, (std::min)(read_len, bufsiz));
+    if (n <= 0) { return false; }
+
+    if (!out(buf, static_cast<size_t>(n))) { return false; }
+
+    r += static_cast<uint64_t>(n);
+
+    if (progress) {
+      if (!progress(r, len)) { return false; }
+    }
+  }
+
+  return true;
+}
+
+inline void skip_content_with_length(Stream &strm, uint64_t len) {
+  char buf[CPPHTTPLIB_RECV_BUFSIZ];
+  uint64_t r = 0;
+  while (r < len) {
+    auto read_len = static_cast<size_t>(len - r);
+    auto n = strm.read(buf, (std::min)(read_len, CPPHTTPLIB_RECV_BUFSIZ));
+    if (n <= 0) { return; }
+    r += static_cast<uint64_t>(n);
+  }
+}
+
+inline bool read_content_without_length(Stream &strm, ContentReceiver out,
+                                        char *buf, size_t bufsiz) {
+  for (;;) {
+    auto n = strm.read(buf, bufsiz);
+    if (n < 0) {
+      return false;
+    } else if (n == 0) {
+      return true;
+    }
+    if (!out(buf, static_cast<size_t>(n))) { return false; }
+  }
+
+  return true;
+}
+
+inline bool read_content_chunked(Stream &strm, ContentReceiver out,
+                                 char *buf, size_t bufsiz) {
+  const auto line_bufsiz = 16;
+  char line_buf[line_bufsiz];
+
+  stream_line_reader line_reader(strm, line_buf, line_bufsiz);
+
+  if (!line_reader.getline()) { return false; }
+
+  auto chunk_len = std::stoul(line_reader.ptr(), 0, 16);
+
+  while (chunk_len > 0) {
+    if (!read_content_with_length(strm, chunk_len, nullptr, out, buf, bufsiz)) {
+      return false;
+    }
+
+    if (!line_reader.getline()) { return false; }
+
+    if (strcmp(line_reader.ptr(), "\r\n")) { break; }
+
+    if (!line_reader.getline()) { return false; }
+
+    chunk_len = std::stoul(line_reader.ptr(), 0, 16);
+  }
+
+  if (chunk_len == 0) {
+    // Reader terminator after chunks
+    if (!line_reader.getline() || strcmp(line_reader.ptr(), "\r\n"))
+      return false;
+  }
+
+  return true;
+}
+
+inline bool is_chunked_transfer_encoding(const Headers &headers) {
+  return !strcasecmp(get_header_value(headers, "Transfer-Encoding", 0, ""),
+                     "chunked");
+}
+
+// Reads a body of known length into `buf` directly, without going through
+// an intermediate buffer.
+inline bool read_content_into(Stream &strm, char *buf, size_t len,
+                              Progress progress) {
+  const auto max_read_len =
+      static_cast<size_t>((std::numeric_limits<int>::max)());
+
+  size_t r = 0;
+  while (r < len) {
+    auto n = strm.read(buf + r, (std::min)(len - r, max_read_len));
+    if (n <= 0) { return false; }
+
+    r += static_cast<size_t>(n);
+
+    if (progress) {
+      if (!progress(r, len)) { return false; }
+    }
+  }
+  return true;
+}
+
+// Same as above for a string. Content-Length is up to the peer, so the body is
+// sized from it only up to CPPHTTPLIB_BODY_RESERVE_MAX_LENGTH, and grows as
+// data arrives past that.
+inline bool read_content_into(Stream &strm, std::string &body, size_t len,
+                              Progress progress) {
+  if (len > body.max_size()) { return false; }
+
+  const auto max_read_len =
+      static_cast<size_t>((std::numeric_limits<int>::max)());
+
+  size_t r = 0;
+  while (r < len) {
+    if (r == body.size()) {
+      auto size = (std::max)(r * 2, CPPHTTPLIB_BODY_RESERVE_MAX_LENGTH);
+      body.resize((std::min)(len, size));
+    }
+
+    auto n = strm.read(&body[r], (std::min)(body.size() - r, max_read_len));
+    if (n <= 0) {
+      body.clear();
+      return false;
+    }
+
+    r += static_cast<size_t>(n);
+
+    if (progress) {
+      if (!progress(r, len)) {
+        body.clear();
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+template <typename T>
+bool read_content(Stream &strm, T &x, size_t payload_max_length, int &status,
+                  Progress progress, ContentReceiver receiver,
+                  size_t bufsiz = CPPHTTPLIB_RECV_BUFSIZ) {
+
+  ContentReceiver out = [&](const char *buf, size_t n) {
+    return receiver(buf, n);
+  };
+
+#ifdef CPPHTTPLIB_ZLIB_SUPPORT
+  decompressor decompressor;
+
+  std::string content_encoding = x.get_header_value("Content-Encoding");
+  if (content_encoding.find("gzip") != std::string::npos ||
+      content_encoding.find("deflate") != std::string::npos) {
+    if (!decompressor.is_valid()) {
+      status = 500;
+      return false;
+    }
+
+    out = [&](const char *buf, size_t n) {
+      return decompressor.decompress(
+          buf, n, [&](const char *buf, size_t n) { return receiver(buf, n); });
+    };
+  }
+#else
+  if (x.get_header_value("Content-Encoding") == "gzip") {
+    status = 415;
+    return false;
+  }
+#endif
+
+  char stack_buf[CPPHTTPLIB_RECV_BUFSIZ];
+  std::vector<char> heap_buf;
+  auto buf = stack_buf;
+  if (bufsiz > sizeof(stack_buf)) {
+    heap_buf.resize(bufsiz);
+    buf = heap_buf.data();
+  } else if (bufsiz == 0) {
+    bufsiz = sizeof(stack_buf);
+  }
+
+  auto ret = true;
+  auto exceed_payload_max_length = false;
+
+  if (is_chunked_transfer_encoding(x.headers)) {
+    ret = read_content_chunked(strm, out, buf, bufsiz);
+  } else if (!has_header(x.headers, "Content-Length")) {
+    ret = read_content_without_length(strm, out, buf, bufsiz);
+  } else {
+    auto len = get_header_value_uint64(x.headers, "Content-Length", 0);
+    if (len > payload_max_length) {
+      exceed_payload_max_length = true;
+      skip_content_with_length(strm, len);
+      ret = false;
+    } else if (len > 0) {
+      ret = read_content_with_length(strm, len, progress, out, buf, bufsiz);
+    }
+  }
+
+  if (!ret) { status = exceed_payload_max_length ? 413 : 400; }
+
+  return ret;
+}
+
+template <typename T>
+inline ssize_t write_headers(Stream &strm, const T &info,
+                             const Headers &headers) {
+  ssize_t write_len = 0;
+  for (const auto &x : info.headers) {
+    if (x.first == "EXCEPTION_WHAT") { continue; }
+    auto len =
+        strm.write_format("%s: %s\r\n", x.first.c_str(), x.second.c_str());
+    if (len < 0) { return len; }
+    write_len += len;
+  }
+  for (const auto &x : headers) {
+    auto len =
+        strm.write_format("%s: %s\r\n", x.first.c_str(), x.second.c_str());
+    if (len < 0) { return len; }
+    write_len += len;
+  }
+  auto len = strm.write("\r\n");
+  if (len < 0) { return len; }
+  write_len += len;
+  return write_len;
+}
+
+inline ssize_t write_content(Stream &strm, ContentProvider content_provider,
+                             size_t offset, size_t length) {
+  size_t begin_offset = offset;
+  size_t end_offset = offset + length;
+  while (offset < end_offset) {
+    ssize_t written_length = 0;
+
+    DataSink data_sink;
+    data_sink.write = [&](const char *d, size_t l) {
+      offset += l;
+      written_length = strm.write(d, l);
+    };
+    data_sink.done = [&](void) { written_length = -1; };
+    data_sink.is_writable = [&](void) { return strm.is_writable(); };
+    data_sink.write_file = [&](int fd, uint64_t pos, size_t l) {
+      auto n = strm.send_file(fd, pos, l);
+      if (n > 0) {
+        offset += static_cast<size_t>(n);
+        written_length = n;
+      } else if (n == 0) {
+        written_length = -1; // The file is shorter than it was.
+      }
+      return n;
+    };
+
+    content_provider(offset, end_offset - offset, data_sink);
+    if (written_length < 0) { return written_length; }
+  }
+  return static_cast<ssize_t>(offset - begin_offset);
+}
+
+template <typename T>
+inline ssize_t write_content_chunked(Stream &strm,
+                                     ContentProvider content_provider,
+                                     T is_shutting_down) {
+  size_t offset = 0;
+  auto data_available = true;
+  ssize_t total_written_length = 0;
+  while (data_available && !is_shutting_down()) {
+    ssize_t written_length = 0;
+
+    DataSink data_sink;
+    data_sink.write = [&](const char *d, size_t l) {
+      data_available = l > 0;
+      offset += l;
+
+      // Emit chunked response header and footer for each chunk
+      auto chunk = from_i_to_hex(l) + "\r\n" + std::string(d, l) + "\r\n";
+      written_length = strm.write(chunk);
+    };
+    data_sink.done = [&](void) {
+      data_available = false;
+      written_length = strm.write("0\r\n\r\n");
+    };
+    data_sink.is_writable = [&](void) { return strm.is_writable(); };
+
+    content_provider(offset, 0, data_sink);
+
+    // Chunks are meant to reach the peer as they are produced.
+    if (written_length >= 0 && !strm.flush()) { written_length = -1; }
+    if (written_length < 0) { return written_length; }
+    total_written_length += written_length;
+  }
+  return total_written_length;
+}
+
+// Requests that can be sent again without changing the outcome (RFC 7231
+// section 4.2.2).
+inline bool is_idempotent_method(const std::string &method) {
+  return method == "GET" || method == "HEAD" || method == "PUT" ||
+         method == "DELETE" || method == "OPTIONS" || method == "TRACE";
+}
+
+// A request that may be sent as TLS early data, which an attacker can replay.
+inline bool is_replay_safe(const Request &req) {
+  return is_idempotent_method(req.method) && req.body.empty() &&
+         !req.content_provider;
+}
+
+struct cache_control {
+  bool no_store = false;
+  bool no_cache = false;
+  bool is_private = false;
+  long max_age = -1;
+};
+
+inline void parse_cache_control(const std::string &s, cache_control &cc) {
+  if (s.empty()) { return; }
+
+  split(&s[0], &s[s.size()], ',', [&](const char *b, const char *e) {
+    while (b < e && (*b == ' ' || *b == '\t')) {
+      b++;
+    }
+    while (e > b && (e[-1] == ' ' || e[-1] == '\t')) {
+      e--;
+    }
+    std::string directive(b, e);
+    std::transform(directive.begin(), directive.end(), directive.begin(),
+                   ::tolower);
+    if (directive == "no-store") {
+      cc.no_store = true;
+    } else if (directive == "no-cache") {
+      cc.no_cache = true;
+    } else if (directive == "private" ||
+               !directive.compare(0, 8, "private=")) {
+      cc.is_private = true;
+    } else if (!directive.compare(0, 8, "max-age=")) {
+      cc.max_age = std::strtol(directive.c_str() + 8, nullptr, 10);
+    }
+  });
+}
+
+// Paces byte streams to `rate` bytes per second in total, across threads.
+// Taking more than is available puts the bucket in debt, and the taker sleeps
+// until it's paid off.
+class token_bucket {
+public:
+  explicit token_bucket(size_t rate)
+      : rate_(static_cast<double>(rate)), tokens_(rate_),
+        last_(std::chrono::steady_clock::now()) {}
+
+  void take(size_t n) {
+    if (rate_ <= 0) { return; }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed = now - last_;
+    last_ = now;
+    tokens_ = (std::min)(rate_, tokens_ + elapsed.count() * rate_);
+    tokens_ -= static_cast<double>(n);
+    if (tokens_ >= 0) { return; }
+
+    std::chrono::duration<double> wait(-tokens_ / rate_);
+    lock.unlock();
+    std::this_thread::sleep_for(wait);
+  }
+
+private:
+  const double rate_;
+  double tokens_;
+  std::chrono::steady_clock::time_point last_;
+  std::mutex mutex_;
+};
+
+#ifndef _WIN32
+inline bool write_at(int fd, const char *data, size_t size, uint64_t offset) {
+  while (size > 0) {
+    auto n = pwrite(fd, data, size, static_cast<off_t>(offset));
+    if (n < 0 && errno == EINTR) { continue; }
+    if (n <= 0) { return false; }
+    data += n;
+    size -= static_cast<size_t>(n);
+    offset += static_cast<uint64_t>(n);
+  }
+  return true;
+}
+
+// The state file of Client::download holds the length and validator of the
+// object on the first line, then the index of each finished range.
+inline bool read_download_state(const std::string &path, uint64_t length,
+                                const std::string &validator,
+                                std::vector<char> &done) {
+  std::ifstream ifs(path);
+  std::string line;
+  if (!std::getline(ifs, line)) { return false; }
+
+  auto pos = line.find(' ');
+  if (pos == std::string::npos || line.substr(pos + 1) != validator ||
+      line.substr(0, pos) != std::to_string(length)) {
+    return false;
+  }
+
+  while (std::getline(ifs, line)) {
+    char *end = nullptr;
+    auto i = std::strtoull(line.c_str(), &end, 10);
+    if (end == line.c_str() || *end != '\0') { break; }
+    if (i < done.size()) { done[i] = 1; }
+  }
+  return true;
+}
+#endif
+
+template <typename T>
+inline bool redirect(T &cli, const Request &req, Response &res,
+                     const std::string &path) {
+  Request new_req = req;
+  new_req.path = path;
+  new_req.redirect_count -= 1;
+
+  Response new_res;
+
+  auto ret = cli.send(new_req, new_res);
+  if (ret) { res = new_res; }
+  return ret;
+}
+
+inline std::string encode_url(const std::string &s) {
+  std::string result;
+
+  for (size_t i = 0; s[i]; i++) {
+    switch (s[i]) {
+    case ' ': result += "%20"; break;
+    case '+': result += "%2B"; break;
+    case '\r': result += "%0D"; break;
+    case '\n': result += "%0A"; break;
+    case '\'': result += "%27"; break;
+    case ',': result += "%2C"; break;
+    // case ':': result += "%3A"; break; // ok? probably...
+    case ';': result += "%3B"; break;
+    default:
+      auto c = static_cast<uint8_t>(s[i]);
+      if (c >= 0x80) {
+        result += '%';
+        char hex[4];
+        auto len = snprintf(hex, sizeof(hex) - 1, "%02X", c);
+        assert(len == 2);
+        result.append(hex, static_cast<size_t>(len));
+      } else {
+        result += s[i];
+      }
+      break;
+    }
+  }
+
+  return result;
+}
+
+inline std::string decode_url(const std::string &s,
+                              bool convert_plus_to_space) {
+  std::string result;
+
+  for (size_t i = 0; i < s.size(); i++) {
+    if (s[i] == '%' && i + 1 < s.size()) {
+      if (s[i + 1] == 'u') {
+        int val = 0;
+        if (from_hex_to_i(s, i + 2, 4, val)) {
+          // 4 digits Unicode codes
+          char buff[4];
+          size_t len = to_utf8(val, buff);
+          if (len > 0) { result.append(buff, len); }
+          i += 5; // 'u0000'
+        } else {
+          result += s[i];
+        }
+      } else {
+        int val = 0;
+        if (from_hex_to_i(s, i + 1, 2, val)) {
+          // 2 digits hex codes
+          result += static_cast<char>(val);
+          i += 2; // '00'
+        } else {
+          result += s[i];
+        }
+      }
+    } else if (convert_plus_to_space && s[i] == '+') {
+      result += ' ';
+    } else {
+      result += s[i];
+    }
+  }
+
+  return result;
+}
+
+inline std::string params_to_query_str(const Params &params) {
+  std::string query;
+
+  for (auto it = params.begin(); it != params.end(); ++it) {
+    if (it != params.begin()) { query += "&"; }
+    query += it->first;
+    query += "=";
+    query += detail::encode_url(it->second);
+  }
+
+  return query;
+}
+
+inline void parse_query_text(const std::string &s, Params &params) {
+  split(&s[0], &s[s.size()], '&', [&](const char *b, const char *e) {
+    std::string key;
+    std::string val;
+    split(b, e, '=', [&](const char *b2, const char *e2) {
+      if (key.empty()) {
+        key.assign(b2, e2);
+      } else {
+        val.assign(b2, e2);
+      }
+    });
+    params.emplace(decode_url(key, true), decode_url(val, true));
+  });
+}
+
+inline bool parse_multipart_boundary(const std::string &content_type,
+                                     std::string &boundary) {
+  auto pos = content_type.find("boundary=");
+  if (pos == std::string::npos) { return false; }
+
+  boundary = content_type.substr(pos + 9);
+  return true;
+}
+
+inline bool parse_range_header(const std::string &s, Ranges &ranges) {
+  static auto re_first_range = std::regex(R"(bytes=(\d*-\d*(?:,\s*\d*-\d*)*))");
+  std::smatch m;
+  if (std::regex_match(s, m, re_first_range)) {
+    auto pos = static_cast<size_t>(m.position(1));
+    auto len = static_cast<size_t>(m.length(1));
+    bool all_valid_ranges = true;
+    split(&s[pos], &s[pos + len], ',', [&](const char *b, const char *e) {
+      if (!all_valid_ranges) return;
+      static auto re_another_range = std::regex(R"(\s*(\d*)-(\d*))");
+      std::cmatch cm;
+      if (std::regex_match(b, e, cm, re_another_range)) {
+        ssize_t first = -1;
+        if (!cm.str(1).empty()) {
+          first = static_cast<ssize_t>(std::stoll(cm.str(1)));
+        }
+
+        ssize_t last = -1;
+        if (!cm.str(2).empty()) {
+          last = static_cast<ssize_t>(std::stoll(cm.str(2)));
+        }
+
+        if (first != -1 && last != -1 && first > last) {
+          all_valid_ranges = false;
+          return;
+        }
+        ranges.emplace_back(std::make_pair(first, last));
+      }
+    });
+    return all_valid_ranges;
+  }
+  return false;
+}
+
+class MultipartFormDataParser {
+public:
+  MultipartFormDataParser() = default;
+
+  void set_boundary(std::string boundary) { boundary_ = std::move(boundary); }
+
+  bool is_valid() const { return is_valid_; }
+
+  template <typename T, typename U>
+  bool parse(const char *buf, size_t n, T content_callback, U header_callback) {
+    static const std::regex re_content_type(R"(^Content-Type:\s*(.*?)\s*$)",
+                                            std::regex_constants::icase);
+
+    static const std::regex re_content_disposition(
+        "^Content-Disposition:\\s*form-data;\\s*name=\"(.*?)\"(?:;\\s*filename="
+        "\"(.*?)\")?\\s*$",
+        std::regex_constants::icase);
+    static const std::string dash_ = "--";
+    static const std::string crlf_ = "\r\n";
+
+    buf_.append(buf, n); // TODO: performance improvement
+
+    while (!buf_.empty()) {
+      switch (state_) {
+      case 0: { // Initial boundary
+        auto pattern = dash_ + boundary_ + crlf_;
+        if (pattern.size() > buf_.size()) { return true; }
+        auto pos = buf_.find(pattern);
+        if (pos != 0) {
+          is_done_ = true;
+          return false;
+        }
+        buf_.erase(0, pattern.size());
+        off_ += pattern.size();
+        state_ = 1;
+        break;
+      }
+      case 1: { // New entry
+        clear_file_info();
+        state_ = 2;
+        break;
+      }
+      case 2: { // Headers
+        auto pos = buf_.find(crlf_);
+        while (pos != std::string::npos) {
+          // Empty line
+          if (pos == 0) {
+            if (!header_callback(file_)) {
+              is_valid_ = false;
+              is_done_ = false;
+              return false;
+            }
+            buf_.erase(0, crlf_.size());
+            off_ += crlf_.size();
+            state_ = 3;
+            break;
+          }
+
+          auto header = buf_.substr(0, pos);
+          {
+            std::smatch m;
+            if (std::regex_match(header, m, re_content_type)) {
+              file_.content_type = m[1];
+            } else if (std::regex_match(header, m, re_content_disposition)) {
+              file_.name = m[1];
+              file_.filename = m[2];
+            }
+          }
+
+          buf_.erase(0, pos + crlf_.size());
+          off_ += pos + crlf_.size();
+          pos = buf_.find(crlf_);
+        }
+        break;
+      }
+      case 3: { // Body
+        {
+          auto pattern = crlf_ + dash_;
+          if (pattern.size() > buf_.size()) { return true; }
+
+          auto pos = buf_.find(pattern);
+          if (pos == std::string::npos) { pos = buf_.size(); }
+          if (!content_callback(buf_.data(), pos)) {
+            is_valid_ = false;
+            is_done_ = false;
+            return false;
+          }
+
+          off_ += pos;
+          buf_.erase(0, pos);
+        }
+
+        {
+          auto pattern = crlf_ + dash_ + boundary_;
+          if (pattern.size() > buf_.size()) { return true; }
+
+          auto pos = buf_.find(pattern);
+          if (pos != std::string::npos) {
+            if (!content_callback(buf_.data(), pos)) {
+              is_valid_ = false;
+              is_done_ = false;
+              return false;
+            }
+
+            off_ += pos + pattern.size();
+            buf_.erase(0, pos + pattern.size());
+            state_ = 4;
+          } else {
+            if (!content_callback(buf_.data(), pattern.size())) {
+              is_valid_ = false;
+              is_done_ = false;
+              return false;
+            }
+
+            off_ += pattern.size();
+            buf_.erase(0, pattern.size());
+          }
+        }
+        break;
+      }
+      case 4: { // Boundary
+        if (crlf_.size() > buf_.size()) { return true; }
+        if (buf_.find(crlf_) == 0) {
+          buf_.erase(0, crlf_.size());
+          off_ += crlf_.size();
+          state_ = 1;
+        } else {
+          auto pattern = dash_ + crlf_;
+          if (pattern.size() > buf_.size()) { return true; }
+          if (buf_.find(pattern) == 0) {
+            buf_.erase(0, pattern.size());
+            off_ += pattern.size();
+            is_valid_ = true;
+            state_ = 5;
+          } else {
+            is_done_ = true;
+            return true;
+          }
+        }
+        break;
+      }
+      case 5: { // Done
+        is_valid_ = false;
+        return false;
+      }
+      }
+    }
+
+    return true;
+  }
+
+private:
+  void clear_file_info() {
+    file_.name.clear();
+    file_.filename.clear();
+    file_.content_type.clear();
+  }
+
+  std::string boundary_;
+
+  std::string buf_;
+  size_t state_ = 0;
+  size_t is_valid_ = false;
+  size_t is_done_ = false;
+  size_t off_ = 0;
+  MultipartFormData file_;
+};
+
+inline std::string to_lower(const char *beg, const char *end) {
+  std::string out;
+  auto it = beg;
+  while (it != end) {
+    out += static_cast<char>(::tolower(*it));
+    it++;
+  }
+  return out;
+}
+
+inline std::string make_multipart_data_boundary() {
+  static const char data[] =
+      "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+
+  std::random_device seed_gen;
+  std::mt19937 engine(seed_gen());
+
+  std::string result = "--cpp-httplib-multipart-data-";
+
+  for (auto i = 0; i < 16; i++) {
+    result += data[engine() % (sizeof(data) - 1)];
+  }
+
+  return result;
+}
+
+// A body made of data and file parts, such as a multipart request with
+// files or a static file response. Files are opened and sized up front, and
+// read (or sent with sendfile) only as the body goes out.
+class multipart_body {
+public:
+  multipart_body() = default;
+  multipart_body(const multipart_body &) = delete;
+  multipart_body &operator=(const multipart_body &) = delete;
+
+  ~multipart_body() {
+    for (const auto &seg : segments_) {
+      if (seg.fd >= 0) { close_file(seg.fd); }
+    }
+  }
+
+  void append(const std::string &data) {
+    if (segments_.empty() || segments_.back().fd >= 0) {
+      segments_.emplace_back();
+      segments_.back().offset = size_;
+    }
+    segments_.back().data += data;
+    segments_.back().size += data.size();
+    size_ += data.size();
+  }
+
+  bool append_file(const std::string &path) {
+#ifdef _WIN32
+    auto fd = _open(path.c_str(), _O_RDONLY | _O_BINARY);
+#else
+    auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+    if (fd < 0) { return false; }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+      close_file(fd);
+      return false;
+    }
+
+    segments_.emplace_back();
+    auto &seg = segments_.back();
+    seg.fd = fd;
+    seg.offset = size_;
+    seg.size = static_cast<size_t>(st.st_size);
+    size_ += seg.size;
+    return true;
+  }
+
+  size_t size() const { return size_; }
+
+  // A ContentProvider for the whole body
+  void provide(size_t offset, size_t length, DataSink &sink) {
+    auto it = std::upper_bound(
+        segments_.begin(), segments_.end(), offset,
+        [](size_t off, const Segment &seg) { return off < seg.offset; });
+    if (it == segments_.begin()) {
+      sink.done();
+      return;
+    }
+    const auto &seg = *(it - 1);
+    auto pos = offset - seg.offset;
+    auto n = (std::min)(length, seg.size - pos);
+
+    if (seg.fd < 0) {
+      sink.write(seg.data.data() + pos, n);
+      return;
+    }
+
+    if (sink.write_file) {
+      auto w = sink.write_file(seg.fd, pos, n);
+      if (w > 0) { return; }
+      if (w == 0) { // The file is shorter than it was.
+        sink.done();
+        return;
+      }
+    }
+
+    std::array<char, CPPHTTPLIB_SEND_BUFSIZ> buf;
+    auto r = read_at(seg.fd, buf.data(), (std::min)(n, buf.size()), pos);
+    if (r <= 0) {
+      sink.done();
+      return;
+    }
+    sink.write(buf.data(), static_cast<size_t>(r));
+  }
+
+private:
+  struct Segment {
+    std::string data;
+    int fd = -1;
+    size_t offset = 0;
+    size_t size = 0;
+  };
+
+  static ssize_t read_at(int fd, char *buf, size_t size, uint64_t offset) {
+#ifdef _WIN32
+    if (_lseeki64(fd, static_cast<__int64>(offset), SEEK_SET) < 0) {
+      return -1;
+    }
+    return _read(fd, buf, static_cast<unsigned int>(size));
+#else
+    return pread(fd, buf, size, static_cast<off_t>(offset));
+#endif
+  }
+
+  static void close_file(int fd) {
+#ifdef _WIN32
+    _close(fd);
+#else
+    ::close(fd);
+#endif
+  }
+
+  std::vector<Segment> segments_;
+  size_t size_ = 0;
+};
+
+inline std::pair<size_t, size_t>
+get_range_offset_and_length(const Request &req, size_t content_length,
+                            size_t index) {
+  auto r = req.ranges[index];
+
+  if (r.first == -1 && r.second == -1) {
+    return std::make_pair(0, content_length);
+  }
+
+  auto slen = static_cast<ssize_t>(content_length);
+
+  if (r.first == -1) {
+    r.first = slen - r.second;
+    r.second = slen - 1;
+  }
+
+  if (r.second == -1) { r.second = slen - 1; }
+
+  return std::make_pair(r.first, r.second - r.first + 1);
+}
+
+inline std::string make_content_range_header_field(size_t offset, size_t length,
+                                                   size_t content_length) {
+  std::string field = "bytes ";
+  field += std::to_string(offset);
+  field += "-";
+  field += std::to_string(offset + length - 1);
+  field += "/";
+  field += std::to_string(content_length);
+  return field;
+}
+
+template <typename SToken, typename CToken, typename Content>
+bool process_multipart_ranges_data(const Request &req, Response &res,
+                                   const std::string &boundary,
+                                   const std::string &content_type,
+                                   SToken stoken, CToken ctoken,
+                                   Content content) {
+  auto total = res.content_provider ? res.content_length : res.body.size();
+
+  for (size_t i = 0; i < req.ranges.size(); i++) {
+    ctoken("--");
+    stoken(boundary);
+    ctoken("\r\n");
+    if (!content_type.empty()) {
+      ctoken("Content-Type: ");
+      stoken(content_type);
+      ctoken("\r\n");
+    }
+
+    auto offsets = get_range_offset_and_length(req, total, i);
+    auto offset = offsets.first;
+    auto length = offsets.second;
+
+    ctoken("Content-Range: ");
+    stoken(make_content_range_header_field(offset, length, total));
+    ctoken("\r\n");
+    ctoken("\r\n");
+    if (!content(offset, length)) { return false; }
+    ctoken("\r\n");
+  }
+
+  ctoken("--");
+  stoken(boundary);
+  ctoken("--\r\n");
+
+  return true;
+}
+
+inline std::string make_multipart_ranges_data(const Request &req, Response &res,
+                                              const std::string &boundary,
+                                              const std::string &content_type) {
+  std::string data;
+
+  process_multipart_ranges_data(
+      req, res, boundary, content_type,
+      [&](const std::string &token) { data += token; },
+      [&](const char *token) { data += token; },
+      [&](size_t offset, size_t length) {
+        data += res.body.substr(offset, length);
+        return true;
+      });
+
+  return data;
+}
+
+inline size_t
+get_multipart_ranges_data_length(const Request &req, Response &res,
+                                 const std::string &boundary,
+                                 const std::string &content_type) {
+  size_t data_length = 0;
+
+  process_multipart_ranges_data(
+      req, res, boundary, content_type,
+      [&](const std::string &token) { data_length += token.size(); },
+      [&](const char *token) { data_length += strlen(token); },
+      [&](size_t /*offset*/, size_t length) {
+        data_length += length;
+        return true;
+      });
+
+  return data_length;
+}
+
+inline bool write_multipart_ranges_data(Stream &strm, const Request &req,
+                                        Response &res,
+                                        const std::string &boundary,
+                                        const std::string &content_type) {
+  return process_multipart_ranges_data(
+      req, res, boundary, content_type,
+      [&](const std::string &token) { strm.write(token); },
+      [&](const char *token) { strm.write(token); },
+      [&](size_t offset, size_t length) {
+        return write_content(strm, res.content_provider, offset, length) >= 0;
+      });
+}
+
+inline std::pair<size_t, size_t>
+get_range_offset_and_length(const Request &req, const Response &res,
+                            size_t index) {
+  auto r = req.ranges[index];
+
+  if (r.second == -1) {
+    r.second = static_cast<ssize_t>(res.content_length) - 1;
+  }
+
+  return std::make_pair(r.first, r.second - r.first + 1);
+}
+
+inline bool expect_content(const Request &req) {
+  if (req.method == "POST" || req.method == "PUT" || req.method == "PATCH" ||
+      req.method == "PRI") {
+    return true;
+  }
+  // TODO: check if Content-Length is set
+  return false;
+}
+
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+template <typename CTX, typename Init, typename Update, typename Final>
+inline std::string message_digest(const std::string &s, Init init,
+                                  Update update, Final final,
+                                  size_t digest_length) {
+  using namespace std;
+
+  std::vector<unsigned char> md(digest_length, 0);
+  CTX ctx;
+  init(&ctx);
+  update(&ctx, s.data(), s.size());
+  final(md.data(), &ctx);
+
+  stringstream ss;
+  for (auto c : md) {
+    ss << setfill('0') << setw(2) << hex << (unsigned int)c;
+  }
+  return ss.str();
+}
+
+inline std::string MD5(const std::string &s) {
+  return message_digest<MD5_CTX>(s, MD5_Init, MD5_Update, MD5_Final,
+                                 MD5_DIGEST_LENGTH);
+}
+
+inline std::string SHA_256(const std::string &s) {
+  return message_digest<SHA256_CTX>(s, SHA256_Init, SHA256_Update, SHA256_Final,
+                                    SHA256_DIGEST_LENGTH);
+}
+
+inline std::string SHA_512(const std::string &s) {
+  return message_digest<SHA512_CTX>(s, SHA512_Init, SHA512_Update, SHA512_Final,
+                                    SHA512_DIGEST_LENGTH);
+}
+#endif
+
+#ifdef _WIN32
+class WSInit {
+public:
+  WSInit() {
+    WSADATA wsaData;
+    WSAStartup(0x0002, &wsaData);
+  }
+
+  ~WSInit() { WSACleanup(); }
+};
+
+static WSInit wsinit_;
+#endif
+
+} // namespace detail
+
+// Header utilities
+inline std::pair<std::string, std::string> make_range_header(Ranges ranges) {
+  std::string field = "bytes=";
+  auto i = 0;
+  for (auto r : ranges) {
+    if (i != 0) { field += ", "; }
+    if (r.first != -1) { field += std::to_string(r.first); }
+    field += '-';
+    if (r.second != -1) { field += std::to_string(r.second); }
+    i++;
+  }
+  return std::make_pair("Range", field);
+}
+
+inline std::pair<std::string, std::string>
+make_basic_authentication_header(const std::string &username,
+                                 const std::string &password,
+                                 bool is_proxy = false) {
+  auto field = "Basic " + detail::base64_encode(username + ":" + password);
+  auto key = is_proxy ? "Proxy-Authorization" : "Authorization";
+  return std::make_pair(key, field);
+}
+
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+inline std::pair<std::string, std::string> make_digest_authentication_header(
+    const Request &req, const std::map<std::string, std::string> &auth,
+    size_t cnonce_count, const std::string &cnonce, const std::string &username,
+    const std::string &password, bool is_proxy = false) {
+  using namespace std;
+
+  string nc;
+  {
+    stringstream ss;
+    ss << setfill('0') << setw(8) << hex << cnonce_count;
+    nc = ss.str();
+  }
+
+  auto qop = auth.at("qop");
+  if (qop.find("auth-int") != std::string::npos) {
+    qop = "auth-int";
+  } else {
+    qop = "auth";
+  }
+
+  std::string algo = "MD5";
+  if (auth.find("algorithm") != auth.end()) { algo = auth.at("algorithm"); }
+
+  string response;
+  {
+    auto H = algo == "SHA-256"
+                 ? detail::SHA_256
+                 : algo == "SHA-512" ? detail::SHA_512 : detail::MD5;
+
+    auto A1 = username + ":" + auth.at("realm") + ":" + password;
+
+    auto A2 = req.method + ":" + req.path;
+    if (qop == "auth-int") { A2 += ":" + H(req.body); }
+
+    response = H(H(A1) + ":" + auth.at("nonce") + ":" + nc + ":" + cnonce +
+                 ":" + qop + ":" + H(A2));
+  }
+
+  auto field = "Digest username=\"hello\", realm=\"" + auth.at("realm") +
+               "\", nonce=\"" + auth.at("nonce") + "\", uri=\"" + req.path +
+               "\", algorithm=" + algo + ", qop=" + qop + ", nc=\"" + nc +
+               "\", cnonce=\"" + cnonce + "\", response=\"" + response + "\"";
+
+  auto key = is_proxy ? "Proxy-Authorization" : "Authorization";
+  return std::make_pair(key, field);
+}
+#endif
+
+inline bool parse_www_authenticate(const httplib::Response &res,
+                                   std::map<std::string, std::string> &auth,
+                                   bool is_proxy) {
+  auto auth_key = is_proxy ? "Proxy-Authenticate" : "WWW-Authenticate";
+  if (res.has_header(auth_key)) {
+    static auto re = std::regex(R"~((?:(?:,\s*)?(.+?)=(?:"(.*?)"|([^,]*))))~");
+    auto s = res.get_header_value(auth_key);
+    auto pos = s.find(' ');
+    if (pos != std::string::npos) {
+      auto type = s.substr(0, pos);
+      if (type == "Basic") {
+        return false;
+      } else if (type == "Digest") {
+        s = s.substr(pos + 1);
+        auto beg = std::sregex_iterator(s.begin(), s.end(), re);
+        for (auto i = beg; i != std::sregex_iterator(); ++i) {
+          auto m = *i;
+          auto key = s.substr(static_cast<size_t>(m.position(1)),
+                              static_cast<size_t>(m.length(1)));
+          auto val = m.length(2) > 0
+                         ? s.substr(static_cast<size_t>(m.position(2)),
+                                    static_cast<size_t>(m.length(2)))
+                         : s.substr(static_cast<size_t>(m.position(3)),
+                                    static_cast<size_t>(m.length(3)));
+          auth[key] = val;
+        }
+        return true;
+      }
     }
   }
+  return false;
+}
+
+// https://stackoverflow.com/questions/440133/how-do-i-create-a-random-alpha-numeric-string-in-c/440240#answer-440240
+inline std::string random_string(size_t length) {
+  auto randchar = []() -> char {
+    const char charset[] = "0123456789"
+                           "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                           "abcdefghijklmnopqrstuvwxyz";
+    const size_t max_index = (sizeof(charset) - 1);
+    return charset[static_cast<size_t>(rand()) % max_index];
+  };
+  std::string str(length, 0);
+  std::generate_n(str.begin(), length, randchar);
+  return str;
+}
+
+// Request implementation
+inline bool Request::has_header(const char *key) const {
+  return detail::has_header(headers, key);
+}
+
+inline std::string Request::get_header_value(const char *key, size_t id) const {
+  return detail::get_header_value(headers, key, id, "");
+}
+
+inline size_t Request::get_header_value_count(const char *key) const {
+  auto r = headers.equal_range(key);
+  return static_cast<size_t>(std::distance(r.first, r.second));
+}
+
+inline void Request::set_header(const char *key, const char *val) {
+  headers.emplace(key, val);
+}
+
+inline void Request::set_header(const char *key, const std::string &val) {
+  headers.emplace(key, val);
+}
+
+inline bool Request::has_param(const char *key) const {
+  return params.find(key) != params.end();
+}
+
+inline std::string Request::get_param_value(const char *key, size_t id) const {
+  auto it = params.find(key);
+  std::advance(it, static_cast<ssize_t>(id));
+  if (it != params.end()) { return it->second; }
+  return std::string();
+}
+
+inline size_t Request::get_param_value_count(const char *key) const {
+  auto r = params.equal_range(key);
+  return static_cast<size_t>(std::distance(r.first, r.second));
+}
+
+inline bool Request::is_multipart_form_data() const {
+  const auto &content_type = get_header_value("Content-Type");
+  return !content_type.find("multipart/form-data");
+}
+
+inline bool Request::has_file(const char *key) const {
+  return files.find(key) != files.end();
+}
+
+inline MultipartFormData Request::get_file_value(const char *key) const {
+  auto it = files.find(key);
+  if (it != files.end()) { return it->second; }
+  return MultipartFormData();
+}
+
+// Response implementation
+inline bool Response::has_header(const char *key) const {
+  return headers.find(key) != headers.end();
+}
+
+inline std::string Response::get_header_value(const char *key,
+                                              size_t id) const {
+  return detail::get_header_value(headers, key, id, "");
+}
+
+inline size_t Response::get_header_value_count(const char *key) const {
+  auto r = headers.equal_range(key);
+  return static_cast<size_t>(std::distance(r.first, r.second));
+}
 
-  return std::string();
+inline void Response::set_header(const char *key, const char *val) {
+  headers.emplace(key, val);
 }
 
-inline const char *
-find_content_type(const std::string &path,
-                  const std::map<std::string, std::string> &user_data) {
-  auto ext = file_extension(path);
+inline void Response::set_header(const char *key, const std::string &val) {
+  headers.emplace(key, val);
+}
 
-  auto it = user_data.find(ext);
-  if (it != user_data.end()) { return it->second.c_str(); }
+inline void Response::set_redirect(const char *url) {
+  set_header("Location", url);
+  status = 302;
+}
 
-  if (ext == "txt") {
-    return "text/plain";
-  } else if (ext == "html" || ext == "htm") {
-    return "text/html";
-  } else if (ext == "css") {
-    return "text/css";
-  } else if (ext == "jpeg" || ext == "jpg") {
-    return "image/jpg";
-  } else if (ext == "png") {
-    return "image/png";
-  } else if (ext == "gif") {
-    return "image/gif";
-  } else if (ext == "svg") {
-    return "image/svg+xml";
-  } else if (ext == "ico") {
-    return "image/x-icon";
-  } else if (ext == "json") {
-    return "application/json";
-  } else if (ext == "pdf") {
-    return "application/pdf";
-  } else if (ext == "js") {
-    return "application/javascript";
-  } else if (ext == "wasm") {
-    return "application/wasm";
-  } else if (ext == "xml") {
-    return "application/xml";
-  } else if (ext == "xhtml") {
-    return "application/xhtml+xml";
-  }
-  return nullptr;
+inline void Response::set_content(const char *s, size_t n,
+                                  const char *content_type) {
+  body.assign(s, n);
+  set_header("Content-Type", content_type);
 }
 
-inline const char *status_message(int status) {
-  switch (status) {
-  case 100: return "Continue";
-  case 101: return "Switching Protocol";
-  case 102: return "Processing";
-  case 103: return "Early Hints";
-  case 200: return "OK";
-  case 201: return "Created";
-  case 202: return "Accepted";
-  case 203: return "Non-Authoritative Information";
-  case 204: return "No Content";
-  case 205: return "Reset Content";
-  case 206: return "Partial Content";
-  case 207: return "Multi-Status";
-  case 208: return "Already Reported";
-  case 226: return "IM Used";
-  case 300: return "Multiple Choice";
-  case 301: return "Moved Permanently";
-  case 302: return "Found";
-  case 303: return "See Other";
-  case 304: return "Not Modified";
-  case 305: return "Use Proxy";
-  case 306: return "unused";
-  case 307: return "Temporary Redirect";
-  case 308: return "Permanent Redirect";
-  case 400: return "Bad Request";
-  case 401: return "Unauthorized";
-  case 402: return "Payment Required";
-  case 403: return "Forbidden";
-  case 404: return "Not Found";
-  case 405: return "Method Not Allowed";
-  case 406: return "Not Acceptable";
-  case 407: return "Proxy Authentication Required";
-  case 408: return "Request Timeout";
-  case 409: return "Conflict";
-  case 410: return "Gone";
-  case 411: return "Length Required";
-  case 412: return "Precondition Failed";
-  case 413: return "Payload Too Large";
-  case 414: return "URI Too Long";
-  case 415: return "Unsupported Media Type";
-  case 416: return "Range Not Satisfiable";
-  case 417: return "Expectation Failed";
-  case 418: return "I'm a teapot";
-  case 421: return "Misdirected Request";
-  case 422: return "Unprocessable Entity";
-  case 423: return "Locked";
-  case 424: return "Failed Dependency";
-  case 425: return "Too Early";
-  case 426: return "Upgrade Required";
-  case 428: return "Precondition Required";
-  case 429: return "Too Many Requests";
-  case 431: return "Request Header Fields Too Large";
-  case 451: return "Unavailable For Legal Reasons";
-  case 501: return "Not Implemented";
-  case 502: return "Bad Gateway";
-  case 503: return "Service Unavailable";
-  case 504: return "Gateway Timeout";
-  case 505: return "HTTP Version Not Supported";
-  case 506: return "Variant Also Negotiates";
-  case 507: return "Insufficient Storage";
-  case 508: return "Loop Detected";
-  case 510: return "Not Extended";
-  case 511: return "Network Authentication Required";
+inline void Response::set_content(std::string s, const char *content_type) {
+  body = std::move(s);
+  set_header("Content-Type", content_type);
+}
 
-  default:
-  case 500: return "Internal Server Error";
-  }
+inline void Response::set_content_provider(
+    size_t in_length,
+    std::function<void(size_t offset, size_t length, DataSink &sink)> provider,
+    std::function<void()> resource_releaser) {
+  assert(in_length > 0);
+  content_length = in_length;
+  content_provider = [provider](size_t offset, size_t length, DataSink &sink) {
+    provider(offset, length, sink);
+  };
+  content_provider_resource_releaser = resource_releaser;
 }
 
-#ifdef CPPHTTPLIB_ZLIB_SUPPORT
-inline bool can_compress(const std::string &content_type) {
-  return !content_type.find("text/") || content_type == "image/svg+xml" ||
-         content_type == "application/javascript" ||
-         content_type == "application/json" ||
-         content_type == "application/xml" ||
-         content_type == "application/xhtml+xml";
+inline void Response::set_chunked_content_provider(
+    std::function<void(size_t offset, DataSink &sink)> provider,
+    std::function<void()> resource_releaser) {
+  content_length = 0;
+  content_provider = [provider](size_t offset, size_t, DataSink &sink) {
+    provider(offset, sink);
+  };
+  content_provider_resource_releaser = resource_releaser;
 }
 
-inline bool compress(std::string &content) {
-  z_stream strm;
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
+// Rstream implementation
+inline ssize_t Stream::write(const char *ptr) {
+  return write(ptr, strlen(ptr));
+}
 
-  auto ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 31, 8,
-                          Z_DEFAULT_STRATEGY);
-  if (ret != Z_OK) { return false; }
+inline ssize_t Stream::write(const std::string &s) {
+  return write(s.data(), s.size());
+}
 
-  strm.avail_in = static_cast<decltype(strm.avail_in)>(content.size());
-  strm.next_in =
-      const_cast<Bytef *>(reinterpret_cast<const Bytef *>(content.data()));
+template <typename... Args>
+inline ssize_t Stream::write_format(const char *fmt, const Args &... args) {
+  std::array<char, 2048> buf;
 
-  std::string compressed;
+#if defined(_MSC_VER) && _MSC_VER < 1900
+  auto sn = _snprintf_s(buf, bufsiz, buf.size() - 1, fmt, args...);
+#else
+  auto sn = snprintf(buf.data(), buf.size() - 1, fmt, args...);
+#endif
+  if (sn <= 0) { return sn; }
 
-  std::array<char, 16384> buff{};
-  do {
-    strm.avail_out = buff.size();
-    strm.next_out = reinterpret_cast<Bytef *>(buff.data());
-    ret = deflate(&strm, Z_FINISH);
-    assert(ret != Z_STREAM_ERROR);
-    compressed.append(buff.data(), buff.size() - strm.avail_out);
-  } while (strm.avail_out == 0);
+  auto n = static_cast<size_t>(sn);
 
-  assert(ret == Z_STREAM_END);
-  assert(strm.avail_in == 0);
+  if (n >= buf.size() - 1) {
+    std::vector<char> glowable_buf(buf.size());
 
-  content.swap(compressed);
+    while (n >= glowable_buf.size() - 1) {
+      glowable_buf.resize(glowable_buf.size() * 2);
+#if defined(_MSC_VER) && _MSC_VER < 1900
+      n = static_cast<size_t>(_snprintf_s(&glowable_buf[0], glowable_buf.size(),
+                                          glowable_buf.size() - 1, fmt,
+                                          args...));
+#else
+      n = static_cast<size_t>(
+          snprintf(&glowable_buf[0], glowable_buf.size() - 1, fmt, args...));
+#endif
+    }
+    return write(&glowable_buf[0], n);
+  } else {
+    return write(buf.data(), n);
+  }
+}
 
-  deflateEnd(&strm);
-  return true;
+namespace detail {
+
+// Socket stream implementation
+inline SocketStream::SocketStream(socket_t sock, time_t read_timeout_sec,
+                                  time_t read_timeout_usec)
+    : sock_(sock), read_timeout_sec_(read_timeout_sec),
+      read_timeout_usec_(read_timeout_usec) {}
+
+inline SocketStream::~SocketStream() {}
+
+inline bool SocketStream::is_readable() const {
+  return detail::select_read(sock_, read_timeout_sec_, read_timeout_usec_) > 0;
 }
 
-class decompressor {
-public:
-  decompressor() {
-    std::memset(&strm, 0, sizeof(strm));
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
+// A full send buffer is waited out for up to the read timeout, so that data
+// streamed faster than the peer takes it isn't cut off.
+inline bool SocketStream::is_writable() const {
+  return detail::select_write(sock_, read_timeout_sec_, read_timeout_usec_) > 0;
+}
+
+inline ssize_t SocketStream::read(char *ptr, size_t size) {
+  if (is_readable()) { return recv(sock_, ptr, size, 0); }
+  return -1;
+}
+
+inline ssize_t SocketStream::write(const char *ptr, size_t size) {
+  if (is_writable()) { return send(sock_, ptr, size, 0); }
+  return -1;
+}
+
+inline std::string SocketStream::get_remote_addr() const {
+  return detail::get_remote_addr(sock_);
+}
+
+inline socket_t SocketStream::socket() const { return sock_; }
+
+#ifdef __linux__
+inline ssize_t SocketStream::send_file(int fd, uint64_t offset, size_t size) {
+  if (!is_writable()) { return -1; }
+  auto off = static_cast<off_t>(offset);
+  return ::sendfile(sock_, fd, &off, size);
+}
+#endif
+
+// Buffer stream implementation
+inline bool BufferStream::is_readable() const { return true; }
+
+inline bool BufferStream::is_writable() const { return true; }
+
+inline ssize_t BufferStream::read(char *ptr, size_t size) {
+#if defined(_MSC_VER) && _MSC_VER < 1900
+  auto len_read = buffer._Copy_s(ptr, size, size, position);
+#else
+  auto len_read = buffer.copy(ptr, size, position);
+#endif
+  position += static_cast<size_t>(len_read);
+  return static_cast<ssize_t>(len_read);
+}
 
-    // 15 is the value of wbits, which should be at the maximum possible value
-    // to ensure that any gzip stream can be decoded. The offset of 32 specifies
-    // that the stream type should be automatically detected either gzip or
-    // deflate.
-    is_valid_ = inflateInit2(&strm, 32 + 15) == Z_OK;
-  }
+inline ssize_t BufferStream::write(const char *ptr, size_t size) {
+  buffer.append(ptr, size);
+  return static_cast<ssize_t>(size);
+}
 
-  ~decompressor() { inflateEnd(&strm); }
+inline std::string BufferStream::get_remote_addr() const { return ""; }
 
-  bool is_valid() const { return is_valid_; }
+inline socket_t BufferStream::socket() const { return INVALID_SOCKET; }
 
-  template <typename T>
-  bool decompress(const char *data, size_t data_length, T callback) {
-    int ret = Z_OK;
+inline const std::string &BufferStream::get_buffer() const { return buffer; }
 
-    strm.avail_in = static_cast<decltype(strm.avail_in)>(data_length);
-    strm.next_in = const_cast<Bytef *>(reinterpret_cast<const Bytef *>(data));
+#ifdef CPPHTTPLIB_USE_IO_URING
+// io_uring ring implementation
+inline io_uring_ring::io_uring_ring(unsigned entries) {
+  io_uring_params p;
+  memset(&p, 0, sizeof(p));
 
-    std::array<char, 16384> buff{};
-    do {
-      strm.avail_out = buff.size();
-      strm.next_out = reinterpret_cast<Bytef *>(buff.data());
+  fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+  if (fd_ < 0) { return; }
+  features_ = p.features;
 
-      ret = inflate(&strm, Z_NO_FLUSH);
-      assert(ret != Z_STREAM_ERROR);
-      switch (ret) {
-      case Z_NEED_DICT:
-      case Z_DATA_ERROR:
-      case Z_MEM_ERROR: inflateEnd(&strm); return false;
-      }
+  sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  auto single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap) { sq_size_ = cq_size_ = (std::max)(sq_size_, cq_size_); }
 
-      if (!callback(buff.data(), buff.size() - strm.avail_out)) {
-        return false;
-      }
-    } while (strm.avail_out == 0);
+  sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+  if (sq_ptr_ == MAP_FAILED) { return; }
 
-    return ret == Z_OK || ret == Z_STREAM_END;
+  if (single_mmap) {
+    cq_ptr_ = sq_ptr_;
+  } else {
+    cq_ptr_ = mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+    if (cq_ptr_ == MAP_FAILED) { return; }
   }
 
-private:
-  bool is_valid_;
-  z_stream strm;
-};
-#endif
+  sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+  auto sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) { return; }
+  sqes_ = static_cast<io_uring_sqe *>(sqes);
 
-inline bool has_header(const Headers &headers, const char *key) {
-  return headers.find(key) != headers.end();
-}
+  auto sq = static_cast<char *>(sq_ptr_);
+  sq_head_ = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+  sq_array_ = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+  sq_mask_ = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+  sq_entries_ = p.sq_entries;
+  sqe_head_ = sqe_tail_ = *sq_tail_;
 
-inline const char *get_header_value(const Headers &headers, const char *key,
-                                    size_t id = 0, const char *def = nullptr) {
-  auto it = headers.find(key);
-  std::advance(it, static_cast<int>(id));
-  if (it != headers.end()) { return it->second.c_str(); }
-  return def;
+  auto cq = static_cast<char *>(cq_ptr_);
+  cq_head_ = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
 }
 
-inline uint64_t get_header_value_uint64(const Headers &headers, const char *key,
-                                        uint64_t def = 0) {
-  auto it = headers.find(key);
-  if (it != headers.end()) {
-    return std::strtoull(it->second.data(), nullptr, 10);
+inline io_uring_ring::~io_uring_ring() {
+  if (sqes_) { munmap(sqes_, sqes_size_); }
+  if (cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_) {
+    munmap(cq_ptr_, cq_size_);
   }
-  return def;
+  if (sq_ptr_ != MAP_FAILED) { munmap(sq_ptr_, sq_size_); }
+  if (fd_ >= 0) { close(fd_); }
 }
 
-inline bool read_headers(Stream &strm, Headers &headers) {
-  const auto bufsiz = 2048;
-  char buf[bufsiz];
-  stream_line_reader line_reader(strm, buf, bufsiz);
+inline bool io_uring_ring::is_valid() const { return sqes_ != nullptr; }
 
-  for (;;) {
-    if (!line_reader.getline()) { return false; }
+inline unsigned io_uring_ring::features() const { return features_; }
 
-    // Check if the line ends with CRLF.
-    if (line_reader.end_with_crlf()) {
-      // Blank line indicates end of headers.
-      if (line_reader.size() == 2) { break; }
-    } else {
-      continue; // Skip invalid line.
-    }
+inline io_uring_sqe *io_uring_ring::get_sqe() {
+  auto head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  if (sqe_tail_ - head >= sq_entries_) { return nullptr; }
 
-    // Skip trailing spaces and tabs.
-    auto end = line_reader.ptr() + line_reader.size() - 2;
-    while (line_reader.ptr() < end && (end[-1] == ' ' || end[-1] == '\t')) {
-      end--;
-    }
+  auto sqe = &sqes_[sqe_tail_ & sq_mask_];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe_tail_++;
+  return sqe;
+}
 
-    // Horizontal tab and ' ' are considered whitespace and are ignored when on
-    // the left or right side of the header value:
-    //  - https://stackoverflow.com/questions/50179659/
-    //  - https://www.w3.org/Protocols/rfc2616/rfc2616-sec4.html
-    static const std::regex re(R"(([^:]+):[\t ]*(.+))");
+inline int io_uring_ring::submit(unsigned wait_nr) {
+  auto tail = *sq_tail_;
+  auto to_submit = sqe_tail_ - sqe_head_;
+  while (sqe_head_ != sqe_tail_) {
+    sq_array_[tail & sq_mask_] = sqe_head_ & sq_mask_;
+    tail++;
+    sqe_head_++;
+  }
+  __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
 
-    std::cmatch m;
-    if (std::regex_match(line_reader.ptr(), end, m, re)) {
-      auto key = std::string(m[1]);
-      auto val = std::string(m[2]);
-      headers.emplace(key, val);
-    }
+  auto flags = wait_nr ? IORING_ENTER_GETEVENTS : 0u;
+  for (;;) {
+    auto ret = static_cast<int>(syscall(__NR_io_uring_enter, fd_, to_submit,
+                                        wait_nr, flags, nullptr, 0));
+    if (ret >= 0 || errno != EINTR) { return ret; }
+    to_submit = 0;
   }
+}
+
+inline bool io_uring_ring::peek_cqe(io_uring_cqe &cqe) {
+  auto head = *cq_head_;
+  if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) { return false; }
 
+  cqe = cqes_[head & cq_mask_];
+  __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
   return true;
 }
 
-inline bool read_content_with_length(Stream &strm, uint64_t len,
-                                     Progress progress, ContentReceiver out) {
-  char buf[CPPHTTPLIB_RECV_BUFSIZ];
+inline bool io_uring_ring::wait_cqe(io_uring_cqe &cqe) {
+  while (!peek_cqe(cqe)) {
+    if (submit(1) < 0) { return false; }
+  }
+  return true;
+}
 
-  uint64_t r = 0;
-  while (r < len) {
-    auto read_len = static_cast<size_t>(len - r);
-    auto n = strm.read(buf, (std::min)(read_len, CPPHTTPLIB_RECV_BUFSIZ));
-    if (n <= 0) { return false; }
+// io_uring context implementation
+inline io_uring_context::io_uring_context()
+    : ring_(CPPHTTPLIB_IO_URING_QUEUE_DEPTH),
+      buffers_(CPPHTTPLIB_IO_URING_BUFFER_COUNT * CPPHTTPLIB_RECV_BUFSIZ) {
+  if (!ring_.is_valid()) { return; }
 
-    if (!out(buf, static_cast<size_t>(n))) { return false; }
+  auto sqe = prepare(ProvideBuffers);
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = CPPHTTPLIB_IO_URING_BUFFER_COUNT;
+  sqe->addr = reinterpret_cast<uintptr_t>(buffers_.data());
+  sqe->len = CPPHTTPLIB_RECV_BUFSIZ;
 
-    r += static_cast<uint64_t>(n);
+  std::array<io_uring_cqe, OpCount> cqes{};
+  valid_ = complete(cqes) && cqes[ProvideBuffers].res >= 0;
+}
 
-    if (progress) {
-      if (!progress(r, len)) { return false; }
-    }
-  }
+inline bool io_uring_context::is_valid() const { return valid_; }
 
-  return true;
+inline bool io_uring_context::can_link_send() const {
+  // Since Linux 5.18 a short send with MSG_WAITALL fails the chain, so an
+  // operation linked after it never runs on partially sent data.
+#ifdef IORING_FEAT_LINKED_FILE
+  return (ring_.features() & IORING_FEAT_LINKED_FILE) != 0;
+#else
+  return false;
+#endif
 }
 
-inline void skip_content_with_length(Stream &strm, uint64_t len) {
-  char buf[CPPHTTPLIB_RECV_BUFSIZ];
-  uint64_t r = 0;
-  while (r < len) {
-    auto read_len = static_cast<size_t>(len - r);
-    auto n = strm.read(buf, (std::min)(read_len, CPPHTTPLIB_RECV_BUFSIZ));
-    if (n <= 0) { return; }
-    r += static_cast<uint64_t>(n);
+inline io_uring_sqe *io_uring_context::prepare(Op op) {
+  auto sqe = ring_.get_sqe();
+  if (!sqe) {
+    ring_.submit(0);
+    sqe = ring_.get_sqe();
   }
+  sqe->user_data = op;
+  queued_++;
+  return sqe;
 }
 
-inline bool read_content_without_length(Stream &strm, ContentReceiver out) {
-  char buf[CPPHTTPLIB_RECV_BUFSIZ];
-  for (;;) {
-    auto n = strm.read(buf, CPPHTTPLIB_RECV_BUFSIZ);
-    if (n < 0) {
+// Submits the prepared operations and waits for all of them, since a stream
+// never leaves anything in flight between calls.
+inline bool
+io_uring_context::complete(std::array<io_uring_cqe, OpCount> &cqes) {
+  while (queued_ > 0) {
+    io_uring_cqe cqe;
+    if (!ring_.wait_cqe(cqe)) {
+      valid_ = false;
       return false;
-    } else if (n == 0) {
-      return true;
     }
-    if (!out(buf, static_cast<size_t>(n))) { return false; }
+    queued_--;
+    if (cqe.user_data < OpCount) { cqes[cqe.user_data] = cqe; }
   }
-
   return true;
 }
 
-inline bool read_content_chunked(Stream &strm, ContentReceiver out) {
-  const auto bufsiz = 16;
-  char buf[bufsiz];
-
-  stream_line_reader line_reader(strm, buf, bufsiz);
+inline char *io_uring_context::buffer(unsigned bid) {
+  return &buffers_[bid * CPPHTTPLIB_RECV_BUFSIZ];
+}
 
-  if (!line_reader.getline()) { return false; }
+// The buffer goes back to the kernel along with the next submission.
+inline void io_uring_context::recycle_buffer(unsigned bid) {
+  auto sqe = prepare(ProvideBuffers);
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = 1;
+  sqe->addr = reinterpret_cast<uintptr_t>(buffer(bid));
+  sqe->len = CPPHTTPLIB_RECV_BUFSIZ;
+  sqe->off = bid;
+}
 
-  auto chunk_len = std::stoul(line_reader.ptr(), 0, 16);
+inline io_uring_context *io_uring_thread_context() {
+  static thread_local std::unique_ptr<io_uring_context> ctx(
+      new io_uring_context());
+  return ctx->is_valid() ? ctx.get() : nullptr;
+}
 
-  while (chunk_len > 0) {
-    if (!read_content_with_length(strm, chunk_len, nullptr, out)) {
-      return false;
-    }
+// io_uring socket stream implementation
+inline IoUringSocketStream::IoUringSocketStream(socket_t sock,
+                                                io_uring_context &ctx,
+                                                time_t read_timeout_sec,
+                                                time_t read_timeout_usec)
+    : sock_(sock), ctx_(ctx), read_timeout_sec_(read_timeout_sec),
+      read_timeout_usec_(read_timeout_usec) {}
 
-    if (!line_reader.getline()) { return false; }
+inline IoUringSocketStream::~IoUringSocketStream() {}
 
-    if (strcmp(line_reader.ptr(), "\r\n")) { break; }
+inline bool IoUringSocketStream::is_readable() const {
+  return read_off_ < read_len_ ||
+         detail::select_read(sock_, read_timeout_sec_, read_timeout_usec_) > 0;
+}
 
-    if (!line_reader.getline()) { return false; }
+inline bool IoUringSocketStream::is_writable() const {
+  return detail::select_write(sock_, 0, 0) > 0;
+}
 
-    chunk_len = std::stoul(line_reader.ptr(), 0, 16);
+inline ssize_t IoUringSocketStream::read(char *ptr, size_t size) {
+  if (read_off_ == read_len_) {
+    auto n = fill(read_timeout_sec_, read_timeout_usec_);
+    if (n <= 0) { return n; }
   }
 
-  if (chunk_len == 0) {
-    // Reader terminator after chunks
-    if (!line_reader.getline() || strcmp(line_reader.ptr(), "\r\n"))
-      return false;
-  }
+  auto n = (std::min)(size, read_len_ - read_off_);
+  memcpy(ptr, read_buf_ + read_off_, n);
+  read_off_ += n;
 
-  return true;
+  if (read_off_ == read_len_) {
+    ctx_.recycle_buffer(read_bid_);
+    read_buf_ = nullptr;
+    read_off_ = read_len_ = 0;
+  }
+  return static_cast<ssize_t>(n);
 }
 
-inline bool is_chunked_transfer_encoding(const Headers &headers) {
-  return !strcasecmp(get_header_value(headers, "Transfer-Encoding", 0, ""),
-                     "chunked");
+// Small writes are held and go out with the next receive, flush or close.
+inline ssize_t IoUringSocketStream::write(const char *ptr, size_t size) {
+  if (write_buf_.size() + size < CPPHTTPLIB_SEND_BUFSIZ) {
+    write_buf_.append(ptr, size);
+    return static_cast<ssize_t>(size);
+  }
+  return send_all(ptr, size, false) ? static_cast<ssize_t>(size) : -1;
 }
 
-template <typename T>
-bool read_content(Stream &strm, T &x, size_t payload_max_length, int &status,
-                  Progress progress, ContentReceiver receiver) {
+inline std::string IoUringSocketStream::get_remote_addr() const {
+  return detail::get_remote_addr(sock_);
+}
 
-  ContentReceiver out = [&](const char *buf, size_t n) {
-    return receiver(buf, n);
-  };
+inline socket_t IoUringSocketStream::socket() const { return sock_; }
 
-#ifdef CPPHTTPLIB_ZLIB_SUPPORT
-  decompressor decompressor;
+inline bool IoUringSocketStream::flush() {
+  return send_all(nullptr, 0, false);
+}
 
-  std::string content_encoding = x.get_header_value("Content-Encoding");
-  if (content_encoding.find("gzip") != std::string::npos ||
-      content_encoding.find("deflate") != std::string::npos) {
-    if (!decompressor.is_valid()) {
-      status = 500;
-      return false;
-    }
+inline bool IoUringSocketStream::wait_readable(time_t sec, time_t usec) {
+  return read_off_ < read_len_ || fill(sec, usec) > 0;
+}
 
-    out = [&](const char *buf, size_t n) {
-      return decompressor.decompress(
-          buf, n, [&](const char *buf, size_t n) { return receiver(buf, n); });
-    };
-  }
-#else
-  if (x.get_header_value("Content-Encoding") == "gzip") {
-    status = 415;
-    return false;
+// The close is chained to the last response, unless the connection needs a
+// graceful close.
+inline void IoUringSocketStream::close(bool linger) {
+  if (read_buf_) {
+    ctx_.recycle_buffer(read_bid_);
+    read_buf_ = nullptr;
+    read_off_ = read_len_ = 0;
   }
-#endif
-
-  auto ret = true;
-  auto exceed_payload_max_length = false;
 
-  if (is_chunked_transfer_encoding(x.headers)) {
-    ret = read_content_chunked(strm, out);
-  } else if (!has_header(x.headers, "Content-Length")) {
-    ret = read_content_without_length(strm, out);
-  } else {
-    auto len = get_header_value_uint64(x.headers, "Content-Length", 0);
-    if (len > payload_max_length) {
-      exceed_payload_max_length = true;
-      skip_content_with_length(strm, len);
-      ret = false;
-    } else if (len > 0) {
-      ret = read_content_with_length(strm, len, progress, out);
+  send_all(nullptr, 0, !linger);
+  if (!closed_) {
+    if (linger) {
+      close_socket_gracefully(sock_);
+    } else {
+      close_socket(sock_);
     }
+    closed_ = true;
   }
 
-  if (!ret) { status = exceed_payload_max_length ? 413 : 400; }
-
-  return ret;
+  std::array<io_uring_cqe, io_uring_context::OpCount> cqes{};
+  ctx_.complete(cqes);
 }
 
-template <typename T>
-inline ssize_t write_headers(Stream &strm, const T &info,
-                             const Headers &headers) {
-  ssize_t write_len = 0;
-  for (const auto &x : info.headers) {
-    if (x.first == "EXCEPTION_WHAT") { continue; }
-    auto len =
-        strm.write_format("%s: %s\r\n", x.first.c_str(), x.second.c_str());
-    if (len < 0) { return len; }
-    write_len += len;
-  }
-  for (const auto &x : headers) {
-    auto len =
-        strm.write_format("%s: %s\r\n", x.first.c_str(), x.second.c_str());
-    if (len < 0) { return len; }
-    write_len += len;
-  }
-  auto len = strm.write("\r\n");
-  if (len < 0) { return len; }
-  write_len += len;
-  return write_len;
-}
+// Receives into a kernel-selected buffer. Held writes are chained in front of
+// the receive, so a response and the wait for the next request cost a single
+// system call.
+inline ssize_t IoUringSocketStream::fill(time_t sec, time_t usec) {
+  auto link_send = ctx_.can_link_send();
+  if (!link_send && !flush()) { return -1; }
 
-inline ssize_t write_content(Stream &strm, ContentProvider content_provider,
-                             size_t offset, size_t length) {
-  size_t begin_offset = offset;
-  size_t end_offset = offset + length;
-  while (offset < end_offset) {
-    ssize_t written_length = 0;
+  __kernel_timespec ts{sec, usec * 1000};
 
-    DataSink data_sink;
-    data_sink.write = [&](const char *d, size_t l) {
-      offset += l;
-      written_length = strm.write(d, l);
-    };
-    data_sink.done = [&](void) { written_length = -1; };
-    data_sink.is_writable = [&](void) { return strm.is_writable(); };
+  for (;;) {
+    auto sending = link_send && !write_buf_.empty();
+    if (sending) {
+      auto sqe = ctx_.prepare(io_uring_context::Send);
+      sqe->opcode = IORING_OP_SEND;
+      sqe->fd = sock_;
+      sqe->addr = reinterpret_cast<uintptr_t>(write_buf_.data());
+      sqe->len = static_cast<unsigned>(write_buf_.size());
+      sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+      sqe->flags = IOSQE_IO_LINK;
+    }
 
-    content_provider(offset, end_offset - offset, data_sink);
-    if (written_length < 0) { return written_length; }
-  }
-  return static_cast<ssize_t>(offset - begin_offset);
-}
+    auto sqe = ctx_.prepare(io_uring_context::Recv);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sock_;
+    sqe->len = CPPHTTPLIB_RECV_BUFSIZ;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+
+    if (sec > 0 || usec > 0) {
+      sqe->flags |= IOSQE_IO_LINK;
+      auto timeout = ctx_.prepare(io_uring_context::Timeout);
+      timeout->opcode = IORING_OP_LINK_TIMEOUT;
+      timeout->addr = reinterpret_cast<uintptr_t>(&ts);
+      timeout->len = 1;
+    }
+
+    std::array<io_uring_cqe, io_uring_context::OpCount> cqes{};
+    if (!ctx_.complete(cqes)) { return -1; }
+
+    if (sending) {
+      auto res = cqes[io_uring_context::Send].res;
+      if (res < 0) {
+        errno = -res;
+        return -1;
+      }
+      write_buf_.erase(0, static_cast<size_t>(res));
+      // A short send cancelled the receive.
+      if (!write_buf_.empty()) { continue; }
+    }
+
+    const auto &cqe = cqes[io_uring_context::Recv];
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+      read_bid_ = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+      if (cqe.res <= 0) { ctx_.recycle_buffer(read_bid_); }
+    }
+
+    if (cqe.res < 0) {
+      // A receive cut off by the linked timeout reports -ECANCELED.
+      errno = cqe.res == -ECANCELED ? ETIMEDOUT : -cqe.res;
+      return -1;
+    }
+    if (cqe.res == 0) { return 0; }
+
+    read_buf_ = ctx_.buffer(read_bid_);
+    read_off_ = 0;
+    read_len_ = static_cast<size_t>(cqe.res);
+    return cqe.res;
+  }
+}
+
+// Sends the held writes followed by 'data'. When closing, the close is
+// chained to the send so the last response and the close share one system
+// call.
+inline bool IoUringSocketStream::send_all(const char *data, size_t size,
+                                          bool close_after) {
+  auto link_close = close_after && ctx_.can_link_send();
+  size_t off = 0;
+
+  while (!write_buf_.empty() || off < size) {
+    iovec iov[2];
+    size_t iovlen = 0;
+    if (!write_buf_.empty()) {
+      iov[iovlen].iov_base = &write_buf_[0];
+      iov[iovlen].iov_len = write_buf_.size();
+      iovlen++;
+    }
+    if (off < size) {
+      iov[iovlen].iov_base = const_cast<char *>(data + off);
+      iov[iovlen].iov_len = size - off;
+      iovlen++;
+    }
 
-template <typename T>
-inline ssize_t write_content_chunked(Stream &strm,
-                                     ContentProvider content_provider,
-                                     T is_shutting_down) {
-  size_t offset = 0;
-  auto data_available = true;
-  ssize_t total_written_length = 0;
-  while (data_available && !is_shutting_down()) {
-    ssize_t written_length = 0;
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovlen;
+
+    auto sqe = ctx_.prepare(io_uring_context::Send);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sock_;
+    sqe->addr = reinterpret_cast<uintptr_t>(&msg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+
+    if (link_close) {
+      sqe->msg_flags |= MSG_WAITALL;
+      sqe->flags = IOSQE_IO_LINK;
+      auto close_sqe = ctx_.prepare(io_uring_context::Close);
+      close_sqe->opcode = IORING_OP_CLOSE;
+      close_sqe->fd = sock_;
+    }
 
-    DataSink data_sink;
-    data_sink.write = [&](const char *d, size_t l) {
-      data_available = l > 0;
-      offset += l;
+    std::array<io_uring_cqe, io_uring_context::OpCount> cqes{};
+    if (!ctx_.complete(cqes)) { return false; }
 
-      // Emit chunked response header and footer for each chunk
-      auto chunk = from_i_to_hex(l) + "\r\n" + std::string(d, l) + "\r\n";
-      written_length = strm.write(chunk);
-    };
-    data_sink.done = [&](void) {
-      data_available = false;
-      written_length = strm.write("0\r\n\r\n");
-    };
-    data_sink.is_writable = [&](void) { return strm.is_writable(); };
+    if (link_close && cqes[io_uring_context::Close].res != -ECANCELED) {
+      closed_ = true;
+    }
 
-    content_provider(offset, 0, data_sink);
+    auto res = cqes[io_uring_context::Send].res;
+    if (res < 0) {
+      errno = -res;
+      return false;
+    }
 
-    if (written_length < 0) { return written_length; }
-    total_written_length += written_length;
+    auto sent = static_cast<size_t>(res);
+    auto from_buf = (std::min)(sent, write_buf_.size());
+    write_buf_.erase(0, from_buf);
+    off += sent - from_buf;
   }
-  return total_written_length;
+  return true;
 }
+#endif
 
-template <typename T>
-inline bool redirect(T &cli, const Request &req, Response &res,
-                     const std::string &path) {
-  Request new_req = req;
-  new_req.path = path;
-  new_req.redirect_count -= 1;
+} // namespace detail
 
-  Response new_res;
+// Connection pool implementation
+inline ConnectionPool::ConnectionPool(size_t max_per_host,
+                                      time_t idle_timeout_sec)
+    : max_per_host_(max_per_host), idle_timeout_(idle_timeout_sec) {}
 
-  auto ret = cli.send(new_req, new_res);
-  if (ret) { res = new_res; }
-  return ret;
+inline ConnectionPool::~ConnectionPool() { clear(); }
+
+inline void ConnectionPool::set_max_per_host(size_t count) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  max_per_host_ = count;
+  cond_.notify_all();
 }
 
-inline std::string encode_url(const std::string &s) {
-  std::string result;
+inline void ConnectionPool::set_idle_timeout(time_t sec) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  idle_timeout_ = std::chrono::seconds(sec);
+}
 
-  for (size_t i = 0; s[i]; i++) {
-    switch (s[i]) {
-    case ' ': result += "%20"; break;
-    case '+': result += "%2B"; break;
-    case '\r': result += "%0D"; break;
-    case '\n': result += "%0A"; break;
-    case '\'': result += "%27"; break;
-    case ',': result += "%2C"; break;
-    // case ':': result += "%3A"; break; // ok? probably...
-    case ';': result += "%3B"; break;
-    default:
-      auto c = static_cast<uint8_t>(s[i]);
-      if (c >= 0x80) {
-        result += '%';
-        char hex[4];
-        auto len = snprintf(hex, sizeof(hex) - 1, "%02X", c);
-        assert(len == 2);
-        result.append(hex, static_cast<size_t>(len));
+inline bool ConnectionPool::checkout(const std::string &key, Connection &conn,
+                                     time_t timeout_sec) {
+  auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(timeout_sec);
+
+  for (;;) {
+    std::vector<Connection> expired;
+    auto found = false;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      auto it = hosts_.emplace(key, Host()).first;
+      auto &host = it->second;
+      for (;;) {
+        collect_expired(host, expired);
+        if (!host.idle.empty() || max_per_host_ == 0 ||
+            host.idle.size() + host.checked_out < max_per_host_) {
+          break;
+        }
+        if (cond_.wait_until(lock, deadline) == std::cv_status::timeout) {
+          erase_if_unused(it);
+          lock.unlock();
+          for (const auto &c : expired) {
+            close(c);
+          }
+          return false;
+        }
+      }
+
+      if (!host.idle.empty()) {
+        conn = host.idle.back().conn;
+        host.idle.pop_back();
+        found = true;
       } else {
-        result += s[i];
+        conn = Connection();
       }
-      break;
+      host.checked_out++;
     }
-  }
 
-  return result;
-}
+    for (const auto &c : expired) {
+      close(c);
+    }
 
-inline std::string decode_url(const std::string &s,
-                              bool convert_plus_to_space) {
-  std::string result;
+    if (!found || is_alive(conn)) { return true; }
 
-  for (size_t i = 0; i < s.size(); i++) {
-    if (s[i] == '%' && i + 1 < s.size()) {
-      if (s[i + 1] == 'u') {
-        int val = 0;
-        if (from_hex_to_i(s, i + 2, 4, val)) {
-          // 4 digits Unicode codes
-          char buff[4];
-          size_t len = to_utf8(val, buff);
-          if (len > 0) { result.append(buff, len); }
-          i += 5; // 'u0000'
-        } else {
-          result += s[i];
-        }
+    // The peer closed it, or sent something unexpected, while it sat idle.
+    discard(key, conn);
+  }
+}
+
+inline void ConnectionPool::checkin(const std::string &key,
+                                    const Connection &conn) {
+  std::vector<Connection> expired;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = hosts_.find(key);
+    if (it != hosts_.end()) {
+      auto &host = it->second;
+      host.checked_out--;
+      collect_expired(host, expired);
+      if (idle_timeout_.count() > 0) {
+        host.idle.push_back({conn, std::chrono::steady_clock::now()});
       } else {
-        int val = 0;
-        if (from_hex_to_i(s, i + 1, 2, val)) {
-          // 2 digits hex codes
-          result += static_cast<char>(val);
-          i += 2; // '00'
-        } else {
-          result += s[i];
-        }
+        expired.push_back(conn);
+        erase_if_unused(it);
       }
-    } else if (convert_plus_to_space && s[i] == '+') {
-      result += ' ';
     } else {
-      result += s[i];
+      expired.push_back(conn);
     }
+    sweep(expired);
+    cond_.notify_all();
   }
 
-  return result;
+  for (const auto &c : expired) {
+    close(c);
+  }
 }
 
-inline std::string params_to_query_str(const Params &params) {
-  std::string query;
+inline void ConnectionPool::discard(const std::string &key,
+                                    const Connection &conn) {
+  close(conn);
 
-  for (auto it = params.begin(); it != params.end(); ++it) {
-    if (it != params.begin()) { query += "&"; }
-    query += it->first;
-    query += "=";
-    query += detail::encode_url(it->second);
+  std::vector<Connection> expired;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = hosts_.find(key);
+    if (it != hosts_.end()) {
+      it->second.checked_out--;
+      erase_if_unused(it);
+    }
+    sweep(expired);
+    cond_.notify_all();
   }
 
-  return query;
+  for (const auto &c : expired) {
+    close(c);
+  }
 }
 
-inline void parse_query_text(const std::string &s, Params &params) {
-  split(&s[0], &s[s.size()], '&', [&](const char *b, const char *e) {
-    std::string key;
-    std::string val;
-    split(b, e, '=', [&](const char *b2, const char *e2) {
-      if (key.empty()) {
-        key.assign(b2, e2);
-      } else {
-        val.assign(b2, e2);
+inline size_t ConnectionPool::idle_count() const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  size_t count = 0;
+  for (const auto &x : hosts_) {
+    count += x.second.idle.size();
+  }
+  return count;
+}
+
+inline void ConnectionPool::clear() {
+  std::vector<Connection> idle;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    for (auto it = hosts_.begin(); it != hosts_.end();) {
+      for (const auto &c : it->second.idle) {
+        idle.push_back(c.conn);
       }
-    });
-    params.emplace(decode_url(key, true), decode_url(val, true));
-  });
+      it->second.idle.clear();
+      erase_if_unused(it++);
+    }
+  }
+
+  for (const auto &c : idle) {
+    close(c);
+  }
 }
 
-inline bool parse_multipart_boundary(const std::string &content_type,
-                                     std::string &boundary) {
-  auto pos = content_type.find("boundary=");
-  if (pos == std::string::npos) { return false; }
+// An idle connection has nothing to read: any data, EOF or error means it
+// can't carry another request.
+inline bool ConnectionPool::is_alive(const Connection &conn) {
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+  if (conn.ssl && SSL_pending(conn.ssl) > 0) { return false; }
+#endif
+  return detail::select_read(conn.sock, 0, 0) == 0;
+}
 
-  boundary = content_type.substr(pos + 9);
-  return true;
+inline void ConnectionPool::close(const Connection &conn) {
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+  if (conn.ssl) {
+    SSL_shutdown(conn.ssl);
+    SSL_free(conn.ssl);
+  }
+#endif
+  if (conn.sock != INVALID_SOCKET) { detail::close_socket(conn.sock); }
 }
 
-inline bool parse_range_header(const std::string &s, Ranges &ranges) {
-  static auto re_first_range = std::regex(R"(bytes=(\d*-\d*(?:,\s*\d*-\d*)*))");
-  std::smatch m;
-  if (std::regex_match(s, m, re_first_range)) {
-    auto pos = static_cast<size_t>(m.position(1));
-    auto len = static_cast<size_t>(m.length(1));
-    bool all_valid_ranges = true;
-    split(&s[pos], &s[pos + len], ',', [&](const char *b, const char *e) {
-      if (!all_valid_ranges) return;
-      static auto re_another_range = std::regex(R"(\s*(\d*)-(\d*))");
-      std::cmatch cm;
-      if (std::regex_match(b, e, cm, re_another_range)) {
-        ssize_t first = -1;
-        if (!cm.str(1).empty()) {
-          first = static_cast<ssize_t>(std::stoll(cm.str(1)));
-        }
+// Oldest connections sit at the front, so expiry stops at the first fresh one.
+inline void ConnectionPool::collect_expired(Host &host,
+                                            std::vector<Connection> &expired) {
+  auto now = std::chrono::steady_clock::now();
+  while (!host.idle.empty() && now - host.idle.front().since >= idle_timeout_) {
+    expired.push_back(host.idle.front().conn);
+    host.idle.pop_front();
+  }
+}
 
-        ssize_t last = -1;
-        if (!cm.str(2).empty()) {
-          last = static_cast<ssize_t>(std::stoll(cm.str(2)));
-        }
+// Keys that aren't used again would keep their expired connections open, and
+// their entries, forever. Every idle timeout, all keys are checked.
+inline void ConnectionPool::sweep(std::vector<Connection> &expired) {
+  auto now = std::chrono::steady_clock::now();
+  if (now < next_sweep_) { return; }
+  next_sweep_ = now + std::max(idle_timeout_, std::chrono::seconds(1));
 
-        if (first != -1 && last != -1 && first > last) {
-          all_valid_ranges = false;
-          return;
-        }
-        ranges.emplace_back(std::make_pair(first, last));
-      }
-    });
-    return all_valid_ranges;
+  for (auto it = hosts_.begin(); it != hosts_.end();) {
+    collect_expired(it->second, expired);
+    erase_if_unused(it++);
   }
-  return false;
 }
 
-class MultipartFormDataParser {
-public:
-  MultipartFormDataParser() = default;
+inline void ConnectionPool::erase_if_unused(HostMap::iterator it) {
+  if (it->second.idle.empty() && it->second.checked_out == 0) {
+    hosts_.erase(it);
+  }
+}
 
-  void set_boundary(std::string boundary) { boundary_ = std::move(boundary); }
+// DNS cache implementation
+inline DnsCache::DnsCache(time_t ttl_sec, time_t negative_ttl_sec)
+    : ttl_(ttl_sec), negative_ttl_(negative_ttl_sec),
+      stale_time_(CPPHTTPLIB_DNS_CACHE_STALE_SECOND),
+      max_entries_(CPPHTTPLIB_DNS_CACHE_MAX_ENTRIES),
+      resolver_(system_resolve) {}
 
-  bool is_valid() const { return is_valid_; }
+inline DnsCache::~DnsCache() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    shutdown_ = true;
+    cond_.notify_all();
+  }
+  if (refresher_.joinable()) { refresher_.join(); }
+}
 
-  template <typename T, typename U>
-  bool parse(const char *buf, size_t n, T content_callback, U header_callback) {
-    static const std::regex re_content_type(R"(^Content-Type:\s*(.*?)\s*$)",
-                                            std::regex_constants::icase);
+inline void DnsCache::set_ttl(time_t sec) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  ttl_ = std::chrono::seconds(sec);
+}
 
-    static const std::regex re_content_disposition(
-        "^Content-Disposition:\\s*form-data;\\s*name=\"(.*?)\"(?:;\\s*filename="
-        "\"(.*?)\")?\\s*$",
-        std::regex_constants::icase);
-    static const std::string dash_ = "--";
-    static const std::string crlf_ = "\r\n";
+inline void DnsCache::set_negative_ttl(time_t sec) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  negative_ttl_ = std::chrono::seconds(sec);
+}
 
-    buf_.append(buf, n); // TODO: performance improvement
+inline void DnsCache::set_stale_time(time_t sec) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  stale_time_ = std::chrono::seconds(sec);
+}
 
-    while (!buf_.empty()) {
-      switch (state_) {
-      case 0: { // Initial boundary
-        auto pattern = dash_ + boundary_ + crlf_;
-        if (pattern.size() > buf_.size()) { return true; }
-        auto pos = buf_.find(pattern);
-        if (pos != 0) {
-          is_done_ = true;
-          return false;
-        }
-        buf_.erase(0, pattern.size());
-        off_ += pattern.size();
-        state_ = 1;
-        break;
-      }
-      case 1: { // New entry
-        clear_file_info();
-        state_ = 2;
-        break;
-      }
-      case 2: { // Headers
-        auto pos = buf_.find(crlf_);
-        while (pos != std::string::npos) {
-          // Empty line
-          if (pos == 0) {
-            if (!header_callback(file_)) {
-              is_valid_ = false;
-              is_done_ = false;
-              return false;
-            }
-            buf_.erase(0, crlf_.size());
-            off_ += crlf_.size();
-            state_ = 3;
-            break;
-          }
+inline void DnsCache::set_max_entries(size_t count) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  max_entries_ = count;
+  evict();
+}
 
-          auto header = buf_.substr(0, pos);
-          {
-            std::smatch m;
-            if (std::regex_match(header, m, re_content_type)) {
-              file_.content_type = m[1];
-            } else if (std::regex_match(header, m, re_content_disposition)) {
-              file_.name = m[1];
-              file_.filename = m[2];
-            }
-          }
+inline void DnsCache::set_resolver(Resolver resolver) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  resolver_ = std::move(resolver);
+}
 
-          buf_.erase(0, pos + crlf_.size());
-          off_ += pos + crlf_.size();
-          pos = buf_.find(crlf_);
-        }
-        break;
-      }
-      case 3: { // Body
-        {
-          auto pattern = crlf_ + dash_;
-          if (pattern.size() > buf_.size()) { return true; }
+inline bool DnsCache::resolve(const std::string &host, int port,
+                              Addresses &addrs) {
+  auto key = make_key(host, port);
+  Resolver resolver;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      auto cached = find(key, addrs);
+      if (cached != Lookup::Missing) { return cached == Lookup::Found; }
+
+      // Another thread is looking the name up, and its answer serves this
+      // one too.
+      auto it = entries_.find(key);
+      if (it == entries_.end() || !it->second.resolving) { break; }
+      resolved_cond_.wait(lock);
+    }
 
-          auto pos = buf_.find(pattern);
-          if (pos == std::string::npos) { pos = buf_.size(); }
-          if (!content_callback(buf_.data(), pos)) {
-            is_valid_ = false;
-            is_done_ = false;
-            return false;
-          }
+    auto &entry = touch(key);
+    entry.host = host;
+    entry.port = port;
+    entry.resolving = true;
+    resolver = resolver_;
+  }
 
-          off_ += pos;
-          buf_.erase(0, pos);
-        }
+  Addresses found;
+  auto ok = resolver(host, port, found);
+  if (ok) { addrs = found; }
+  store(key, host, port, ok, std::move(found));
+  return ok;
+}
 
-        {
-          auto pattern = crlf_ + dash_ + boundary_;
-          if (pattern.size() > buf_.size()) { return true; }
+inline DnsCache::Lookup DnsCache::lookup(const std::string &host, int port,
+                                         Addresses &addrs) {
+  auto key = make_key(host, port);
+  std::lock_guard<std::mutex> guard(mutex_);
+  return find(key, addrs);
+}
 
-          auto pos = buf_.find(pattern);
-          if (pos != std::string::npos) {
-            if (!content_callback(buf_.data(), pos)) {
-              is_valid_ = false;
-              is_done_ = false;
-              return false;
-            }
+inline size_t DnsCache::size() const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return entries_.size();
+}
 
-            off_ += pos + pattern.size();
-            buf_.erase(0, pos + pattern.size());
-            state_ = 4;
-          } else {
-            if (!content_callback(buf_.data(), pattern.size())) {
-              is_valid_ = false;
-              is_done_ = false;
-              return false;
-            }
+inline void DnsCache::clear() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  entries_.clear();
+  lru_.clear();
+}
 
-            off_ += pattern.size();
-            buf_.erase(0, pattern.size());
-          }
-        }
-        break;
-      }
-      case 4: { // Boundary
-        if (crlf_.size() > buf_.size()) { return true; }
-        if (buf_.find(crlf_) == 0) {
-          buf_.erase(0, crlf_.size());
-          off_ += crlf_.size();
-          state_ = 1;
-        } else {
-          auto pattern = dash_ + crlf_;
-          if (pattern.size() > buf_.size()) { return true; }
-          if (buf_.find(pattern) == 0) {
-            buf_.erase(0, pattern.size());
-            off_ += pattern.size();
-            is_valid_ = true;
-            state_ = 5;
-          } else {
-            is_done_ = true;
-            return true;
-          }
-        }
-        break;
-      }
-      case 5: { // Done
-        is_valid_ = false;
-        return false;
-      }
+inline bool DnsCache::system_resolve(const std::string &host, int port,
+                                     Addresses &addrs) {
+  auto result = detail::get_address_info(host.c_str(), port, 0);
+  if (!result) { return false; }
+
+  for (auto rp = result; rp; rp = rp->ai_next) {
+    if (rp->ai_addrlen > sizeof(Address::addr)) { continue; }
+
+    Address addr;
+    addr.family = rp->ai_family;
+    addr.socktype = rp->ai_socktype;
+    addr.protocol = rp->ai_protocol;
+    memcpy(&addr.addr, rp->ai_addr, rp->ai_addrlen);
+    addr.addrlen = static_cast<socklen_t>(rp->ai_addrlen);
+    addrs.push_back(addr);
+  }
+
+  freeaddrinfo(result);
+  return !addrs.empty();
+}
+
+inline std::string DnsCache::make_key(const std::string &host, int port) {
+  return host + ":" + std::to_string(port);
+}
+
+// Called with the lock held.
+inline DnsCache::Lookup DnsCache::find(const std::string &key,
+                                       Addresses &addrs) {
+  auto now = std::chrono::steady_clock::now();
+  auto it = entries_.find(key);
+  if (it == entries_.end()) { return Lookup::Missing; }
+
+  auto &entry = it->second;
+  lru_.splice(lru_.begin(), lru_, entry.lru);
+
+  if (now < entry.expires) {
+    if (!entry.addrs) { return Lookup::Failed; }
+    addrs = *entry.addrs;
+    return Lookup::Found;
+  }
+
+  if (entry.addrs && now < entry.expires + stale_time_) {
+    if (!entry.refreshing && now >= entry.retry_after) {
+      entry.refreshing = true;
+      refresh_queue_.push_back(key);
+      if (!refresher_.joinable()) {
+        refresher_ = std::thread([&]() { refresh(); });
       }
+      cond_.notify_one();
     }
-
-    return true;
+    addrs = *entry.addrs;
+    return Lookup::Found;
+  }
+  return Lookup::Missing;
+}
+
+// Moves the entry for `key` to the front of the LRU list, adding it if need
+// be. Called with the lock held.
+inline DnsCache::Entry &DnsCache::touch(const std::string &key) {
+  auto it = entries_.find(key);
+  if (it != entries_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second.lru);
+    return it->second;
+  }
+
+  lru_.push_front(key);
+  auto &entry = entries_[key];
+  entry.lru = lru_.begin();
+  evict();
+  return entry;
+}
+
+// Entries being resolved have waiters and stay, as does the most recent one.
+// Called with the lock held.
+inline void DnsCache::evict() {
+  if (max_entries_ == 0 || lru_.empty()) { return; }
+
+  auto it = lru_.end();
+  while (entries_.size() > max_entries_ && --it != lru_.begin()) {
+    auto entry = entries_.find(*it);
+    if (entry->second.resolving) { continue; }
+    entries_.erase(entry);
+    it = lru_.erase(it);
+  }
+}
+
+// A failed refresh keeps the old addresses in use, and the next attempt waits
+// for the negative TTL.
+inline void DnsCache::store(const std::string &key, const std::string &host,
+                            int port, bool ok, Addresses &&addrs) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto now = std::chrono::steady_clock::now();
+  auto &entry = touch(key);
+  entry.host = host;
+  entry.port = port;
+  entry.refreshing = false;
+  entry.resolving = false;
+  if (ok) {
+    entry.addrs = std::make_shared<const Addresses>(std::move(addrs));
+    entry.expires = now + ttl_;
+  } else if (entry.addrs && now < entry.expires + stale_time_) {
+    entry.retry_after = now + negative_ttl_;
+  } else {
+    entry.addrs = nullptr;
+    entry.expires = now + negative_ttl_;
   }
+  resolved_cond_.notify_all();
+}
 
-private:
-  void clear_file_info() {
-    file_.name.clear();
-    file_.filename.clear();
-    file_.content_type.clear();
+inline void DnsCache::refresh() {
+  for (;;) {
+    std::string key, host;
+    int port = 0;
+    Resolver resolver;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [&] { return !refresh_queue_.empty() || shutdown_; });
+      if (shutdown_) { break; }
+
+      key = std::move(refresh_queue_.front());
+      refresh_queue_.pop_front();
+      auto it = entries_.find(key);
+      if (it == entries_.end()) { continue; }
+      host = it->second.host;
+      port = it->second.port;
+      resolver = resolver_;
+    }
+
+    Addresses addrs;
+    auto ok = resolver(host, port, addrs);
+    store(key, host, port, ok, std::move(addrs));
   }
+}
 
-  std::string boundary_;
+// Response cache implementation
+inline ResponseCache::ResponseCache(size_t max_size) : max_size_(max_size) {}
 
-  std::string buf_;
-  size_t state_ = 0;
-  size_t is_valid_ = false;
-  size_t is_done_ = false;
-  size_t off_ = 0;
-  MultipartFormData file_;
-};
+// Files are counted at their size on disk. Leftovers of interrupted writes,
+// and files of a build that hashes keys differently, are removed.
+inline void ResponseCache::set_disk_tier(const std::string &dir,
+                                         size_t max_size) {
+  struct File {
+    std::string key;
+    size_t size;
+    time_t mtime;
+  };
 
-inline std::string to_lower(const char *beg, const char *end) {
-  std::string out;
-  auto it = beg;
-  while (it != end) {
-    out += static_cast<char>(::tolower(*it));
-    it++;
+  std::vector<File> found;
+  std::vector<std::string> evicted;
+  detail::list_dir(dir, [&](const std::string &name) {
+    auto path = dir + '/' + name;
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) { return; }
+
+    if (name.find(".cache.tmp") != std::string::npos) {
+      evicted.push_back(path);
+      return;
+    }
+    auto ext = name.size() >= 6 ? name.substr(name.size() - 6) : std::string();
+    if (ext != ".cache") { return; }
+
+    std::string key;
+    {
+      std::ifstream ifs(path, std::ios_base::binary);
+      std::getline(ifs, key);
+    }
+    if (key.empty() || name != file_name(key)) {
+      evicted.push_back(path);
+      return;
+    }
+    found.push_back({key, static_cast<size_t>(st.st_size), st.st_mtime});
+  });
+
+  std::sort(found.begin(), found.end(), [](const File &a, const File &b) {
+    return a.mtime < b.mtime;
+  });
+
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    dir_ = dir;
+    max_disk_size_ = max_size;
+    files_.clear();
+    disk_lru_.clear();
+    disk_size_ = 0;
+    for (auto &x : found) {
+      disk_lru_.push_front(x.key);
+      files_[x.key] = std::make_pair(x.size, disk_lru_.begin());
+      disk_size_ += x.size;
+    }
+    evict_files(evicted);
+  }
+
+  for (const auto &x : evicted) {
+    std::remove(x.c_str());
   }
-  return out;
 }
 
-inline std::string make_multipart_data_boundary() {
-  static const char data[] =
-      "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+inline size_t ResponseCache::size() const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return size_;
+}
 
-  std::random_device seed_gen;
-  std::mt19937 engine(seed_gen());
+inline size_t ResponseCache::count() const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return entries_.size();
+}
 
-  std::string result = "--cpp-httplib-multipart-data-";
+inline void ResponseCache::clear() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  entries_.clear();
+  lru_.clear();
+  size_ = 0;
+  for (const auto &x : files_) {
+    std::remove(file_path(x.first).c_str());
+  }
+  files_.clear();
+  disk_lru_.clear();
+  disk_size_ = 0;
+}
 
-  for (auto i = 0; i < 16; i++) {
-    result += data[engine() % (sizeof(data) - 1)];
+inline ResponseCache::EntryPtr
+ResponseCache::lookup(const std::string &key) {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second.second);
+      return it->second.first;
+    }
+    if (dir_.empty()) { return nullptr; }
   }
 
-  return result;
+  auto entry = read_file(key);
+  if (entry) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    insert(key, entry);
+  }
+  return entry;
 }
 
-inline std::pair<size_t, size_t>
-get_range_offset_and_length(const Request &req, size_t content_length,
-                            size_t index) {
-  auto r = req.ranges[index];
+inline void
+ResponseCache::store(const std::string &key, const Response &res,
+                     std::chrono::system_clock::time_point expires) {
+  auto entry = std::make_shared<Entry>();
+  entry->res = res;
+  entry->expires = expires;
+  entry->size = key.size() + res.body.size();
+  for (const auto &x : res.headers) {
+    entry->size += x.first.size() + x.second.size();
+  }
 
-  if (r.first == -1 && r.second == -1) {
-    return std::make_pair(0, content_length);
+  std::string dir;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    insert(key, entry);
+    dir = dir_;
   }
 
-  auto slen = static_cast<ssize_t>(content_length);
+  if (!dir.empty()) { write_file(key, *entry); }
+}
 
-  if (r.first == -1) {
-    r.first = slen - r.second;
-    r.second = slen - 1;
+inline void ResponseCache::insert(const std::string &key, EntryPtr entry) {
+  auto it = entries_.find(key);
+  if (it != entries_.end()) {
+    size_ -= it->second.first->size;
+    lru_.erase(it->second.second);
+    entries_.erase(it);
   }
+  if (entry->size > max_size_) { return; }
 
-  if (r.second == -1) { r.second = slen - 1; }
+  lru_.push_front(key);
+  entries_[key] = std::make_pair(entry, lru_.begin());
+  size_ += entry->size;
 
-  return std::make_pair(r.first, r.second - r.first + 1);
+  while (size_ > max_size_) {
+    auto victim = entries_.find(lru_.back());
+    size_ -= victim->second.first->size;
+    entries_.erase(victim);
+    lru_.pop_back();
+  }
 }
 
-inline std::string make_content_range_header_field(size_t offset, size_t length,
-                                                   size_t content_length) {
-  std::string field = "bytes ";
-  field += std::to_string(offset);
-  field += "-";
-  field += std::to_string(offset + length - 1);
-  field += "/";
-  field += std::to_string(content_length);
-  return field;
+inline std::string ResponseCache::file_name(const std::string &key) {
+  std::ostringstream os;
+  os << std::hex << std::hash<std::string>()(key) << ".cache";
+  return os.str();
 }
 
-template <typename SToken, typename CToken, typename Content>
-bool process_multipart_ranges_data(const Request &req, Response &res,
-                                   const std::string &boundary,
-                                   const std::string &content_type,
-                                   SToken stoken, CToken ctoken,
-                                   Content content) {
-  for (size_t i = 0; i < req.ranges.size(); i++) {
-    ctoken("--");
-    stoken(boundary);
-    ctoken("\r\n");
-    if (!content_type.empty()) {
-      ctoken("Content-Type: ");
-      stoken(content_type);
-      ctoken("\r\n");
+inline std::string ResponseCache::file_path(const std::string &key) const {
+  return dir_ + '/' + file_name(key);
+}
+
+// Drops the least recently used files until the tier fits, leaving their
+// paths in `evicted` to be removed once the lock is released. Called with
+// the lock held.
+inline void ResponseCache::evict_files(std::vector<std::string> &evicted) {
+  while (disk_size_ > max_disk_size_) {
+    auto victim = files_.find(disk_lru_.back());
+    disk_size_ -= victim->second.first;
+    evicted.push_back(file_path(victim->first));
+    files_.erase(victim);
+    disk_lru_.pop_back();
+  }
+}
+
+// A cache file holds the key, the expiry time, the status line and headers,
+// then the body.
+inline ResponseCache::EntryPtr
+ResponseCache::read_file(const std::string &key) {
+  std::string path;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    path = file_path(key);
+  }
+
+  std::ifstream ifs(path, std::ios_base::binary);
+  std::string line;
+  if (!std::getline(ifs, line) || line != key) { return nullptr; }
+
+  auto entry = std::make_shared<Entry>();
+  long long expires = 0;
+  size_t header_count = 0;
+  size_t body_size = 0;
+  ifs >> expires >> entry->res.status >> header_count >> body_size;
+  ifs.ignore(1);
+  for (size_t i = 0; ifs && i < header_count; i++) {
+    std::string name, value;
+    std::getline(ifs, name);
+    std::getline(ifs, value);
+    entry->res.headers.emplace(name, value);
+  }
+  entry->res.body.resize(body_size);
+  if (body_size > 0) { ifs.read(&entry->res.body[0], body_size); }
+  if (!ifs) { return nullptr; }
+
+  entry->res.version = "HTTP/1.1";
+  entry->expires = std::chrono::system_clock::time_point(
+      std::chrono::seconds(expires));
+  entry->size = key.size() + body_size;
+  for (const auto &x : entry->res.headers) {
+    entry->size += x.first.size() + x.second.size();
+  }
+
+  // A file another process wrote into the directory counts from now on.
+  std::vector<std::string> evicted;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = files_.find(key);
+    if (it == files_.end()) {
+      disk_lru_.push_front(key);
+      files_[key] = std::make_pair(entry->size, disk_lru_.begin());
+      disk_size_ += entry->size;
+      evict_files(evicted);
+    } else {
+      disk_lru_.splice(disk_lru_.begin(), disk_lru_, it->second.second);
     }
+  }
 
-    auto offsets = get_range_offset_and_length(req, res.body.size(), i);
-    auto offset = offsets.first;
-    auto length = offsets.second;
+  for (const auto &x : evicted) {
+    std::remove(x.c_str());
+  }
+  return entry;
+}
 
-    ctoken("Content-Range: ");
-    stoken(make_content_range_header_field(offset, length, res.body.size()));
-    ctoken("\r\n");
-    ctoken("\r\n");
-    if (!content(offset, length)) { return false; }
-    ctoken("\r\n");
+inline void ResponseCache::write_file(const std::string &key,
+                                      const Entry &entry) {
+  std::vector<std::string> evicted;
+  std::string path;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (entry.size > max_disk_size_) { return; }
+
+    auto it = files_.find(key);
+    if (it != files_.end()) {
+      disk_size_ -= it->second.first;
+      disk_lru_.erase(it->second.second);
+      files_.erase(it);
+    }
+    disk_lru_.push_front(key);
+    files_[key] = std::make_pair(entry.size, disk_lru_.begin());
+    disk_size_ += entry.size;
+
+    evict_files(evicted);
+    path = file_path(key);
   }
 
-  ctoken("--");
-  stoken(boundary);
-  ctoken("--\r\n");
+  for (const auto &x : evicted) {
+    std::remove(x.c_str());
+  }
 
-  return true;
+  // Written aside and renamed, so readers never see half a file
+  auto tmp = path + ".tmp" + std::to_string(std::hash<std::thread::id>()(
+                                 std::this_thread::get_id()));
+  {
+    std::ofstream ofs(tmp, std::ios_base::binary | std::ios_base::trunc);
+    ofs << key << '\n'
+        << std::chrono::duration_cast<std::chrono::seconds>(
+               entry.expires.time_since_epoch())
+               .count()
+        << ' ' << entry.res.status << ' ' << entry.res.headers.size() << ' '
+        << entry.res.body.size() << '\n';
+    for (const auto &x : entry.res.headers) {
+      ofs << x.first << '\n' << x.second << '\n';
+    }
+    ofs.write(entry.res.body.data(),
+              static_cast<std::streamsize>(entry.res.body.size()));
+    if (!ofs) {
+      ofs.close();
+      std::remove(tmp.c_str());
+      return;
+    }
+  }
+  std::rename(tmp.c_str(), path.c_str());
 }
 
-inline std::string make_multipart_ranges_data(const Request &req, Response &res,
-                                              const std::string &boundary,
-                                              const std::string &content_type) {
-  std::string data;
+// Hedging policy implementation
+inline HedgingPolicy::HedgingPolicy() : timers_(std::chrono::milliseconds(1)) {
+  timers_.start();
+}
 
-  process_multipart_ranges_data(
-      req, res, boundary, content_type,
-      [&](const std::string &token) { data += token; },
-      [&](const char *token) { data += token; },
-      [&](size_t offset, size_t length) {
-        data += res.body.substr(offset, length);
-        return true;
-      });
+inline void HedgingPolicy::set_percentile(double percentile) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  percentile_ = percentile;
+  // The next sample works the delay out again.
+  stale_samples_ = CPPHTTPLIB_HEDGING_SAMPLE_COUNT;
+}
+
+inline void HedgingPolicy::set_min_delay(time_t msec) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  min_delay_ = std::chrono::milliseconds(msec);
+}
+
+inline void HedgingPolicy::set_budget(double ratio, double burst) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  budget_ratio_ = ratio;
+  budget_burst_ = burst;
+  budget_ = (std::min)(budget_, burst);
+}
 
-  return data;
+inline void HedgingPolicy::set_max_retries(size_t count) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  max_retries_ = count;
 }
 
-inline size_t
-get_multipart_ranges_data_length(const Request &req, Response &res,
-                                 const std::string &boundary,
-                                 const std::string &content_type) {
-  size_t data_length = 0;
+inline void HedgingPolicy::add_alternate(std::shared_ptr<Client> cli) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  alternates_.push_back(std::move(cli));
+}
 
-  process_multipart_ranges_data(
-      req, res, boundary, content_type,
-      [&](const std::string &token) { data_length += token.size(); },
-      [&](const char *token) { data_length += strlen(token); },
-      [&](size_t /*offset*/, size_t length) {
-        data_length += length;
-        return true;
-      });
+inline size_t HedgingPolicy::hedge_count() const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return hedge_count_;
+}
 
-  return data_length;
+inline size_t HedgingPolicy::retry_count() const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return retry_count_;
 }
 
-inline bool write_multipart_ranges_data(Stream &strm, const Request &req,
-                                        Response &res,
-                                        const std::string &boundary,
-                                        const std::string &content_type) {
-  return process_multipart_ranges_data(
-      req, res, boundary, content_type,
-      [&](const std::string &token) { strm.write(token); },
-      [&](const char *token) { strm.write(token); },
-      [&](size_t offset, size_t length) {
-        return write_content(strm, res.content_provider, offset, length) >= 0;
-      });
+inline void HedgingPolicy::deposit() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  budget_ = (std::min)(budget_burst_, budget_ + budget_ratio_);
 }
 
-inline std::pair<size_t, size_t>
-get_range_offset_and_length(const Request &req, const Response &res,
-                            size_t index) {
-  auto r = req.ranges[index];
+inline bool HedgingPolicy::allow_hedge() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (budget_ < 1) { return false; }
+  budget_ -= 1;
+  hedge_count_++;
+  return true;
+}
 
-  if (r.second == -1) {
-    r.second = static_cast<ssize_t>(res.content_length) - 1;
+inline bool HedgingPolicy::allow_retry(size_t retries) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (retries >= max_retries_ || budget_ < 1) { return false; }
+  budget_ -= 1;
+  retry_count_++;
+  return true;
+}
+
+inline void
+HedgingPolicy::record(std::chrono::steady_clock::duration latency) {
+  std::vector<double> samples;
+  double percentile;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto sec = std::chrono::duration<double>(latency).count();
+    if (samples_.size() < CPPHTTPLIB_HEDGING_SAMPLE_COUNT) {
+      samples_.push_back(sec);
+    } else {
+      samples_[next_sample_] = sec;
+    }
+    next_sample_ = (next_sample_ + 1) % CPPHTTPLIB_HEDGING_SAMPLE_COUNT;
+
+    // Too few samples to tell what's slow
+    if (samples_.size() < 20 ||
+        (has_sample_delay_ &&
+         ++stale_samples_ < CPPHTTPLIB_HEDGING_SAMPLE_COUNT / 16)) {
+      return;
+    }
+    stale_samples_ = 0;
+    samples = samples_;
+    percentile = percentile_;
   }
 
-  return std::make_pair(r.first, r.second - r.first + 1);
+  auto nth = samples.begin() + static_cast<std::ptrdiff_t>(
+                                   percentile * (samples.size() - 1));
+  std::nth_element(samples.begin(), nth, samples.end());
+  auto delay = std::chrono::milliseconds(
+      static_cast<std::chrono::milliseconds::rep>(std::ceil(*nth * 1000)));
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  sample_delay_ = delay;
+  has_sample_delay_ = true;
 }
 
-inline bool expect_content(const Request &req) {
-  if (req.method == "POST" || req.method == "PUT" || req.method == "PATCH" ||
-      req.method == "PRI") {
-    return true;
-  }
-  // TODO: check if Content-Length is set
-  return false;
+inline bool
+HedgingPolicy::hedge_delay(std::chrono::milliseconds &delay) const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (!has_sample_delay_) { return false; }
+  delay = (std::max)(sample_delay_, min_delay_);
+  return true;
 }
 
-#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
-template <typename CTX, typename Init, typename Update, typename Final>
-inline std::string message_digest(const std::string &s, Init init,
-                                  Update update, Final final,
-                                  size_t digest_length) {
-  using namespace std;
+inline std::shared_ptr<Client> HedgingPolicy::next_alternate() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (alternates_.empty()) { return nullptr; }
+  return alternates_[next_alternate_++ % alternates_.size()];
+}
 
-  std::vector<unsigned char> md(digest_length, 0);
-  CTX ctx;
-  init(&ctx);
-  update(&ctx, s.data(), s.size());
-  final(md.data(), &ctx);
+// Metrics implementation
+inline size_t LatencyHistogram::bucket_index(uint64_t usec) {
+  if (usec < 16) { return static_cast<size_t>(usec); }
 
-  stringstream ss;
-  for (auto c : md) {
-    ss << setfill('0') << setw(2) << hex << (unsigned int)c;
+  // Eight buckets for each power of two, by the three bits below the top.
+  size_t shift = 1;
+  while (usec >> (shift + 4)) {
+    shift++;
   }
-  return ss.str();
+  auto index = shift * 8 + static_cast<size_t>(usec >> shift);
+  return index < bucket_count ? index : bucket_count - 1;
 }
 
-inline std::string MD5(const std::string &s) {
-  return message_digest<MD5_CTX>(s, MD5_Init, MD5_Update, MD5_Final,
-                                 MD5_DIGEST_LENGTH);
+inline uint64_t LatencyHistogram::bucket_upper_bound(size_t index) {
+  if (index < 16) { return index + 1; }
+  auto shift = index / 8 - 1;
+  return static_cast<uint64_t>(index % 8 + 9) << shift;
 }
 
-inline std::string SHA_256(const std::string &s) {
-  return message_digest<SHA256_CTX>(s, SHA256_Init, SHA256_Update, SHA256_Final,
-                                    SHA256_DIGEST_LENGTH);
+inline uint64_t LatencyHistogram::percentile(double p) const {
+  if (!count) { return 0; }
+  auto rank = static_cast<uint64_t>(std::ceil(p * static_cast<double>(count)));
+  if (rank < 1) { rank = 1; }
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i < buckets.size(); i++) {
+    seen += buckets[i];
+    if (seen >= rank) { return bucket_upper_bound(i); }
+  }
+  return bucket_upper_bound(buckets.size() - 1);
 }
 
-inline std::string SHA_512(const std::string &s) {
-  return message_digest<SHA512_CTX>(s, SHA512_Init, SHA512_Update, SHA512_Final,
-                                    SHA512_DIGEST_LENGTH);
+namespace detail {
+
+inline uint64_t next_metrics_id() {
+  static std::atomic<uint64_t> id(0);
+  return ++id;
 }
-#endif
 
-#ifdef _WIN32
-class WSInit {
-public:
-  WSInit() {
-    WSADATA wsaData;
-    WSAStartup(0x0002, &wsaData);
-  }
+// Only the owning thread writes a shard, so a load and a store do without a
+// locked instruction.
+inline void add_relaxed(std::atomic<uint64_t> &counter, uint64_t n) {
+  counter.store(counter.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+}
 
-  ~WSInit() { WSACleanup(); }
-};
+inline void append_prometheus_label(std::string &out, const char *name,
+                                    const std::string &value) {
+  out += name;
+  out += "=\"";
+  for (auto c : value) {
+    switch (c) {
+    case '\\': out += "\\\\"; break;
+    case '"': out += "\\\""; break;
+    case '\n': out += "\\n"; break;
+    default: out += c; break;
+    }
+  }
+  out += '"';
+}
 
-static WSInit wsinit_;
-#endif
+inline std::string prometheus_seconds(uint64_t usec) {
+  char buf[32];
+  auto n = snprintf(buf, sizeof(buf), "%.6f",
+                    static_cast<double>(usec) / 1000000.0);
+  return std::string(buf, static_cast<size_t>(n));
+}
 
 } // namespace detail
 
-// Header utilities
-inline std::pair<std::string, std::string> make_range_header(Ranges ranges) {
-  std::string field = "bytes=";
-  auto i = 0;
-  for (auto r : ranges) {
-    if (i != 0) { field += ", "; }
-    if (r.first != -1) { field += std::to_string(r.first); }
-    field += '-';
-    if (r.second != -1) { field += std::to_string(r.second); }
-    i++;
-  }
-  return std::make_pair("Range", field);
+inline void
+Metrics::HistogramShard::record(std::chrono::steady_clock::duration d) {
+  auto usec = static_cast<uint64_t>(
+      (std::max)(std::chrono::duration_cast<std::chrono::microseconds>(d)
+                     .count(),
+                 static_cast<std::chrono::microseconds::rep>(0)));
+  detail::add_relaxed(buckets[LatencyHistogram::bucket_index(usec)], 1);
+  detail::add_relaxed(sum_usec, usec);
 }
 
-inline std::pair<std::string, std::string>
-make_basic_authentication_header(const std::string &username,
-                                 const std::string &password,
-                                 bool is_proxy = false) {
-  auto field = "Basic " + detail::base64_encode(username + ":" + password);
-  auto key = is_proxy ? "Proxy-Authorization" : "Authorization";
-  return std::make_pair(key, field);
+inline void Metrics::HistogramShard::add_to(LatencyHistogram &h) const {
+  for (size_t i = 0; i < LatencyHistogram::bucket_count; i++) {
+    auto n = buckets[i].load(std::memory_order_relaxed);
+    h.buckets[i] += n;
+    h.count += n;
+  }
+  h.sum_usec += sum_usec.load(std::memory_order_relaxed);
 }
 
-#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
-inline std::pair<std::string, std::string> make_digest_authentication_header(
-    const Request &req, const std::map<std::string, std::string> &auth,
-    size_t cnonce_count, const std::string &cnonce, const std::string &username,
-    const std::string &password, bool is_proxy = false) {
-  using namespace std;
+inline Metrics::Metrics()
+    : id_(detail::next_metrics_id()), active_connections_(0),
+      queued_connections_(0) {}
 
-  string nc;
-  {
-    stringstream ss;
-    ss << setfill('0') << setw(8) << hex << cnonce_count;
-    nc = ss.str();
+// Shards of every Metrics the thread has recorded into, by id. Ids aren't
+// reused, so entries left by destroyed instances never match again.
+inline Metrics::Shard &Metrics::local_shard() {
+  static thread_local std::vector<std::pair<uint64_t, Shard *>> shards;
+  for (const auto &x : shards) {
+    if (x.first == id_) { return *x.second; }
   }
 
-  auto qop = auth.at("qop");
-  if (qop.find("auth-int") != std::string::npos) {
-    qop = "auth-int";
-  } else {
-    qop = "auth";
+  std::unique_ptr<Shard> shard(new Shard);
+  auto p = shard.get();
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    shards_.push_back(std::move(shard));
+  }
+  shards.emplace_back(id_, p);
+  return *p;
+}
+
+inline void Metrics::record(const Request &req, const Response &res,
+                            const std::string *route,
+                            std::chrono::steady_clock::time_point started,
+                            std::chrono::steady_clock::time_point parsed,
+                            std::chrono::steady_clock::time_point handled,
+                            const RequestAllocations &allocations) {
+  auto &shard = local_shard();
+
+  // Routes are few, and a shard only grows on its own thread, so it's read
+  // here without the lock.
+  RouteShard *r = nullptr;
+  for (const auto &x : shard.routes) {
+    if (x->key == route && x->method == req.method) {
+      r = x.get();
+      break;
+    }
+  }
+  if (!r) {
+    std::unique_ptr<RouteShard> rs(new RouteShard());
+    rs->method = req.method;
+    rs->key = route;
+    if (route) { rs->route = *route; }
+    r = rs.get();
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    shard.routes.push_back(std::move(rs));
   }
 
-  std::string algo = "MD5";
-  if (auth.find("algorithm") != auth.end()) { algo = auth.at("algorithm"); }
-
-  string response;
-  {
-    auto H = algo == "SHA-256"
-                 ? detail::SHA_256
-                 : algo == "SHA-512" ? detail::SHA_512 : detail::MD5;
+  auto status = (res.status >= 0 && res.status < 600) ? res.status : 0;
+  detail::add_relaxed(r->status_counts[status], 1);
 
-    auto A1 = username + ":" + auth.at("realm") + ":" + password;
+  auto request_bytes =
+      req.has_header("Content-Length")
+          ? detail::get_header_value_uint64(req.headers, "Content-Length", 0)
+          : req.body.size();
+  detail::add_relaxed(r->request_body_bytes, request_bytes);
+  if (req.method != "HEAD") {
+    detail::add_relaxed(r->response_body_bytes, res.content_provider
+                                                    ? res.content_length
+                                                    : res.body.size());
+  }
 
-    auto A2 = req.method + ":" + req.path;
-    if (qop == "auth-int") { A2 += ":" + H(req.body); }
+  r->parse.record(parsed - started);
+  r->handler.record(handled - parsed);
+  r->write.record(std::chrono::steady_clock::now() - handled);
 
-    response = H(H(A1) + ":" + auth.at("nonce") + ":" + nc + ":" + cnonce +
-                 ":" + qop + ":" + H(A2));
+  const AllocationStats *phases[] = {&allocations.parse, &allocations.handler,
+                                     &allocations.write};
+  for (size_t i = 0; i < 3; i++) {
+    detail::add_relaxed(r->allocations[i], phases[i]->count);
+    detail::add_relaxed(r->allocated_bytes[i], phases[i]->bytes);
   }
+}
 
-  auto field = "Digest username=\"hello\", realm=\"" + auth.at("realm") +
-               "\", nonce=\"" + auth.at("nonce") + "\", uri=\"" + req.path +
-               "\", algorithm=" + algo + ", qop=" + qop + ", nc=\"" + nc +
-               "\", cnonce=\"" + cnonce + "\", response=\"" + response + "\"";
+inline void Metrics::connection_queued() { queued_connections_++; }
 
-  auto key = is_proxy ? "Proxy-Authorization" : "Authorization";
-  return std::make_pair(key, field);
+inline void Metrics::connection_started() {
+  queued_connections_--;
+  active_connections_++;
 }
-#endif
 
-inline bool parse_www_authenticate(const httplib::Response &res,
-                                   std::map<std::string, std::string> &auth,
-                                   bool is_proxy) {
-  auto auth_key = is_proxy ? "Proxy-Authenticate" : "WWW-Authenticate";
-  if (res.has_header(auth_key)) {
-    static auto re = std::regex(R"~((?:(?:,\s*)?(.+?)=(?:"(.*?)"|([^,]*))))~");
-    auto s = res.get_header_value(auth_key);
-    auto pos = s.find(' ');
-    if (pos != std::string::npos) {
-      auto type = s.substr(0, pos);
-      if (type == "Basic") {
-        return false;
-      } else if (type == "Digest") {
-        s = s.substr(pos + 1);
-        auto beg = std::sregex_iterator(s.begin(), s.end(), re);
-        for (auto i = beg; i != std::sregex_iterator(); ++i) {
-          auto m = *i;
-          auto key = s.substr(static_cast<size_t>(m.position(1)),
-                              static_cast<size_t>(m.length(1)));
-          auto val = m.length(2) > 0
-                         ? s.substr(static_cast<size_t>(m.position(2)),
-                                    static_cast<size_t>(m.length(2)))
-                         : s.substr(static_cast<size_t>(m.position(3)),
-                                    static_cast<size_t>(m.length(3)));
-          auth[key] = val;
+inline void Metrics::connection_finished() { active_connections_--; }
+
+inline MetricsSnapshot Metrics::snapshot() const {
+  std::map<std::pair<std::string, std::string>, RouteMetrics> routes;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    for (const auto &shard : shards_) {
+      std::lock_guard<std::mutex> shard_guard(shard->mutex);
+      for (const auto &r : shard->routes) {
+        auto &m = routes[std::make_pair(r->method, r->route)];
+        m.method = r->method;
+        m.route = r->route;
+        for (int status = 0; status < 600; status++) {
+          auto n = r->status_counts[status].load(std::memory_order_relaxed);
+          if (n) { m.status_counts[status] += n; }
+        }
+        m.request_body_bytes +=
+            r->request_body_bytes.load(std::memory_order_relaxed);
+        m.response_body_bytes +=
+            r->response_body_bytes.load(std::memory_order_relaxed);
+        r->parse.add_to(m.parse);
+        r->handler.add_to(m.handler);
+        r->write.add_to(m.write);
+        AllocationStats *phases[] = {&m.allocations.parse,
+                                     &m.allocations.handler,
+                                     &m.allocations.write};
+        for (size_t i = 0; i < 3; i++) {
+          phases[i]->count +=
+              r->allocations[i].load(std::memory_order_relaxed);
+          phases[i]->bytes +=
+              r->allocated_bytes[i].load(std::memory_order_relaxed);
         }
-        return true;
       }
     }
   }
-  return false;
+
+  MetricsSnapshot snapshot;
+  for (auto &x : routes) {
+    snapshot.routes.push_back(std::move(x.second));
+  }
+  snapshot.active_connections = active_connections_;
+  snapshot.queued_connections = queued_connections_;
+  return snapshot;
 }
 
-// https://stackoverflow.com/questions/440133/how-do-i-create-a-random-alpha-numeric-string-in-c/440240#answer-440240
-inline std::string random_string(size_t length) {
-  auto randchar = []() -> char {
-    const char charset[] = "0123456789"
-                           "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-                           "abcdefghijklmnopqrstuvwxyz";
-    const size_t max_index = (sizeof(charset) - 1);
-    return charset[static_cast<size_t>(rand()) % max_index];
+inline std::string Metrics::to_prometheus() const {
+  auto snapshot = this->snapshot();
+  std::string out;
+
+  auto labels = [&](const RouteMetrics &m) {
+    detail::append_prometheus_label(out, "method", m.method);
+    out += ',';
+    detail::append_prometheus_label(out, "route", m.route);
   };
-  std::string str(length, 0);
-  std::generate_n(str.begin(), length, randchar);
-  return str;
-}
 
-// Request implementation
-inline bool Request::has_header(const char *key) const {
-  return detail::has_header(headers, key);
-}
+  out += "# HELP httplib_requests_total Requests served.\n"
+         "# TYPE httplib_requests_total counter\n";
+  for (const auto &m : snapshot.routes) {
+    for (const auto &x : m.status_counts) {
+      out += "httplib_requests_total{";
+      labels(m);
+      out += ",status=\"" + std::to_string(x.first) + "\"} " +
+             std::to_string(x.second) + "\n";
+    }
+  }
 
-inline std::string Request::get_header_value(const char *key, size_t id) const {
-  return detail::get_header_value(headers, key, id, "");
-}
+  out += "# HELP httplib_request_body_bytes_total Bytes of request bodies.\n"
+         "# TYPE httplib_request_body_bytes_total counter\n";
+  for (const auto &m : snapshot.routes) {
+    out += "httplib_request_body_bytes_total{";
+    labels(m);
+    out += "} " + std::to_string(m.request_body_bytes) + "\n";
+  }
+
+  out += "# HELP httplib_response_body_bytes_total Bytes of response bodies.\n"
+         "# TYPE httplib_response_body_bytes_total counter\n";
+  for (const auto &m : snapshot.routes) {
+    out += "httplib_response_body_bytes_total{";
+    labels(m);
+    out += "} " + std::to_string(m.response_body_bytes) + "\n";
+  }
+
+  // Buckets are reported at each power of two microseconds from 16us to
+  // about a minute.
+  out += "# HELP httplib_request_duration_seconds Time spent on each phase of "
+         "a request.\n"
+         "# TYPE httplib_request_duration_seconds histogram\n";
+  for (const auto &m : snapshot.routes) {
+    const std::pair<const char *, const LatencyHistogram *> phases[] = {
+        {"parse", &m.parse}, {"handler", &m.handler}, {"write", &m.write}};
+    for (const auto &phase : phases) {
+      const auto &h = *phase.second;
+      auto series = [&](const char *suffix) {
+        out += "httplib_request_duration_seconds";
+        out += suffix;
+        out += '{';
+        labels(m);
+        out += ",phase=\"";
+        out += phase.first;
+        out += '"';
+      };
 
-inline size_t Request::get_header_value_count(const char *key) const {
-  auto r = headers.equal_range(key);
-  return static_cast<size_t>(std::distance(r.first, r.second));
-}
+      uint64_t cumulative = 0;
+      for (size_t i = 0; i < h.buckets.size(); i++) {
+        cumulative += h.buckets[i];
+        auto bound = LatencyHistogram::bucket_upper_bound(i);
+        if (bound < 16 || bound > (uint64_t(1) << 26) ||
+            (bound & (bound - 1))) {
+          continue;
+        }
+        series("_bucket");
+        out += ",le=\"" + detail::prometheus_seconds(bound) + "\"} " +
+               std::to_string(cumulative) + "\n";
+      }
+      series("_bucket");
+      out += ",le=\"+Inf\"} " + std::to_string(h.count) + "\n";
+      series("_sum");
+      out += "} " + detail::prometheus_seconds(h.sum_usec) + "\n";
+      series("_count");
+      out += "} " + std::to_string(h.count) + "\n";
+    }
+  }
 
-inline void Request::set_header(const char *key, const char *val) {
-  headers.emplace(key, val);
-}
+#ifdef CPPHTTPLIB_ALLOCATION_STATS
+  const char *allocation_series[][2] = {
+      {"httplib_request_allocations_total", "Heap allocations of requests."},
+      {"httplib_request_allocated_bytes_total",
+       "Bytes of heap allocations of requests."}};
+  for (size_t kind = 0; kind < 2; kind++) {
+    out += std::string("# HELP ") + allocation_series[kind][0] + " " +
+           allocation_series[kind][1] + "\n# TYPE " +
+           allocation_series[kind][0] + " counter\n";
+    for (const auto &m : snapshot.routes) {
+      const std::pair<const char *, const AllocationStats *> phases[] = {
+          {"parse", &m.allocations.parse},
+          {"handler", &m.allocations.handler},
+          {"write", &m.allocations.write}};
+      for (const auto &phase : phases) {
+        out += allocation_series[kind][0];
+        out += '{';
+        labels(m);
+        out += ",phase=\"";
+        out += phase.first;
+        out += "\"} ";
+        out += std::to_string(kind ? phase.second->bytes
+                                   : phase.second->count);
+        out += '\n';
+      }
+    }
+  }
+#endif
 
-inline void Request::set_header(const char *key, const std::string &val) {
-  headers.emplace(key, val);
+  out += "# HELP httplib_active_connections Connections being served.\n"
+         "# TYPE httplib_active_connections gauge\n"
+         "httplib_active_connections " +
+         std::to_string(snapshot.active_connections) + "\n";
+  out += "# HELP httplib_queued_connections Connections waiting for a "
+         "worker.\n"
+         "# TYPE httplib_queued_connections gauge\n"
+         "httplib_queued_connections " +
+         std::to_string(snapshot.queued_connections) + "\n";
+  return out;
 }
 
-inline bool Request::has_param(const char *key) const {
-  return params.find(key) != params.end();
-}
+#ifdef CPPHTTPLIB_TRACE
+// Trace implementation
+inline std::string dump_trace(uint64_t min_request_usec) {
+  struct Event {
+    uint64_t thread;
+    uint64_t start;
+    uint64_t end;
+    uint64_t request;
+    uint64_t info;
+    char label[33];
+  };
+
+  std::vector<Event> events;
+  {
+    auto &registry = detail::get_trace_registry();
+    std::lock_guard<std::mutex> guard(registry.mutex);
+    const uint64_t size = CPPHTTPLIB_TRACE_RING_SIZE;
+    for (const auto &ring : registry.rings) {
+      auto head = ring->head.load(std::memory_order_acquire);
+      auto first = events.size();
+      for (auto i = head > size ? head - size : 0; i < head; i++) {
+        const auto &e = ring->events[i % size];
+        Event ev;
+        ev.thread = ring->id;
+        ev.start = e.start.load(std::memory_order_relaxed);
+        ev.end = e.end.load(std::memory_order_relaxed);
+        ev.request = e.request.load(std::memory_order_relaxed);
+        ev.info = e.info.load(std::memory_order_relaxed);
+        uint64_t words[4];
+        for (size_t j = 0; j < 4; j++) {
+          words[j] = e.label[j].load(std::memory_order_relaxed);
+        }
+        memcpy(ev.label, words, sizeof(words));
+        ev.label[32] = '\0';
+        events.push_back(ev);
+      }
+
+      // Slots claimed since the copy began may hold torn events.
+      std::atomic_thread_fence(std::memory_order_acquire);
+      auto begin = ring->begin.load(std::memory_order_relaxed);
+      auto valid = begin > size ? begin - size : 0;
+      auto copied = head > size ? head - size : 0;
+      if (valid > copied) {
+        auto drop = (std::min)(static_cast<size_t>(valid - copied),
+                               events.size() - first);
+        events.erase(events.begin() + static_cast<std::ptrdiff_t>(first),
+                     events.begin() +
+                         static_cast<std::ptrdiff_t>(first + drop));
+      }
+    }
+  }
+
+  auto phase_of = [](const Event &ev) {
+    return static_cast<detail::trace_phase>(ev.info & 0xff);
+  };
+  auto socket_of = [](const Event &ev) { return ev.info >> 8; };
+
+  if (min_request_usec > 0) {
+    // Requests by thread and number, with their socket.
+    std::map<std::pair<uint64_t, uint64_t>, uint64_t> slow;
+    for (const auto &ev : events) {
+      if (phase_of(ev) == detail::trace_phase::Request &&
+          ev.end - ev.start >= min_request_usec * 1000) {
+        slow[std::make_pair(ev.thread, ev.request)] = socket_of(ev);
+      }
+    }
 
-inline std::string Request::get_param_value(const char *key, size_t id) const {
-  auto it = params.find(key);
-  std::advance(it, static_cast<ssize_t>(id));
-  if (it != params.end()) { return it->second; }
-  return std::string();
+    events.erase(
+        std::remove_if(events.begin(), events.end(),
+                       [&](const Event &ev) {
+                         auto it =
+                             slow.find(std::make_pair(ev.thread, ev.request));
+                         if (it == slow.end()) { return true; }
+                         auto phase = phase_of(ev);
+                         auto wait =
+                             phase == detail::trace_phase::Queue ||
+                             phase == detail::trace_phase::KeepAliveWait;
+                         return wait && socket_of(ev) != it->second;
+                       }),
+        events.end());
+  }
+
+  static const char *names[] = {"queue",   "keep_alive_wait", "request",
+                                "read_headers", "routing",    "handler",
+                                "write_response"};
+
+  std::string out = "{\"traceEvents\":[";
+  char buf[128];
+  for (size_t i = 0; i < events.size(); i++) {
+    const auto &ev = events[i];
+    auto phase = static_cast<size_t>(phase_of(ev));
+    if (i) { out += ','; }
+    snprintf(buf, sizeof(buf),
+             "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%llu,"
+             "\"ts\":%.3f,\"dur\":%.3f,",
+             phase < sizeof(names) / sizeof(names[0]) ? names[phase] : "",
+             static_cast<unsigned long long>(ev.thread),
+             static_cast<double>(ev.start) / 1000.0,
+             static_cast<double>(ev.end - ev.start) / 1000.0);
+    out += buf;
+    snprintf(buf, sizeof(buf), "\"args\":{\"request\":%llu",
+             static_cast<unsigned long long>(ev.request));
+    out += buf;
+    if (socket_of(ev) != (static_cast<uint64_t>(INVALID_SOCKET) >> 8)) {
+      out += ",\"socket\":" + std::to_string(socket_of(ev));
+    }
+    if (ev.label[0]) {
+      out += ",\"label\":\"";
+      for (auto p = ev.label; *p; p++) {
+        auto c = static_cast<unsigned char>(*p);
+        if (c == '"' || c == '\\') {
+          out += '\\';
+          out += static_cast<char>(c);
+        } else if (c < 0x20 || c >= 0x80) {
+          snprintf(buf, sizeof(buf), "\\u%04x", c);
+          out += buf;
+        } else {
+          out += static_cast<char>(c);
+        }
+      }
+      out += '"';
+    }
+    out += "}}";
+  }
+  out += "]}";
+  return out;
 }
+#endif
 
-inline size_t Request::get_param_value_count(const char *key) const {
-  auto r = params.equal_range(key);
-  return static_cast<size_t>(std::distance(r.first, r.second));
-}
+// AccessLog implementation
+namespace detail {
 
-inline bool Request::is_multipart_form_data() const {
-  const auto &content_type = get_header_value("Content-Type");
-  return !content_type.find("multipart/form-data");
+const char *const access_log_methods[] = {
+    "GET",     "HEAD",  "POST",  "PUT", "DELETE", "CONNECT",
+    "OPTIONS", "TRACE", "PATCH", "PRI", "-"};
+
+inline uint8_t access_log_method(const std::string &method) {
+  const uint8_t n = sizeof(access_log_methods) / sizeof(access_log_methods[0]);
+  for (uint8_t i = 0; i + 1 < n; i++) {
+    if (method == access_log_methods[i]) { return i; }
+  }
+  return n - 1;
+}
+
+inline void copy_truncated(char *dst, size_t size, const std::string &src) {
+  auto n = (std::min)(src.size(), size - 1);
+  memcpy(dst, src.data(), n);
+  dst[n] = '\0';
+}
+
+// Quoted fields come from the client, and must not be able to end the
+// quote or the line. Escapes are as Apache writes them.
+inline void append_access_log_escaped(std::string &out, const char *s,
+                                      size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    auto c = static_cast<unsigned char>(s[i]);
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += static_cast<char>(c);
+    } else if (c < 0x20 || c >= 0x7f) {
+      char hex[8];
+      snprintf(hex, sizeof(hex), "\\x%02x", c);
+      out += hex;
+    } else {
+      out += static_cast<char>(c);
+    }
+  }
 }
 
-inline bool Request::has_file(const char *key) const {
-  return files.find(key) != files.end();
+inline void format_access_log_record(std::string &out,
+                                     const access_log_record &r,
+                                     const std::string &route) {
+  auto sec = static_cast<time_t>(r.time_usec / 1000000);
+  struct tm tm;
+#ifdef _WIN32
+  gmtime_s(&tm, &sec);
+#else
+  gmtime_r(&sec, &tm);
+#endif
+  char date[32];
+  strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+
+  char buf[256];
+  auto n = snprintf(buf, sizeof(buf), "%s - - [%s] \"%s ",
+                    r.remote_addr[0] ? r.remote_addr : "-", date,
+                    access_log_methods[r.method]);
+  out.append(buf, static_cast<size_t>(
+                      (std::min)(n, static_cast<int>(sizeof(buf) - 1))));
+  append_access_log_escaped(out, r.target, strlen(r.target));
+  n = snprintf(buf, sizeof(buf), " HTTP/1.%u\" %u %llu %llu %.6f \"",
+               static_cast<unsigned>(r.version),
+               static_cast<unsigned>(r.status),
+               static_cast<unsigned long long>(r.response_bytes),
+               static_cast<unsigned long long>(r.request_bytes),
+               static_cast<double>(r.duration_usec) / 1000000.0);
+  out.append(buf, static_cast<size_t>(
+                      (std::min)(n, static_cast<int>(sizeof(buf) - 1))));
+  append_access_log_escaped(out, route.data(), route.size());
+  out += "\"\n";
 }
 
-inline MultipartFormData Request::get_file_value(const char *key) const {
-  auto it = files.find(key);
-  if (it != files.end()) { return it->second; }
-  return MultipartFormData();
-}
+} // namespace detail
 
-// Response implementation
-inline bool Response::has_header(const char *key) const {
-  return headers.find(key) != headers.end();
+inline AccessLog::AccessLog(const std::string &path, size_t max_file_size,
+                            size_t max_files)
+    : id_(detail::next_metrics_id()), path_(path),
+      max_file_size_(max_file_size), max_files_(max_files) {
+  routes_.emplace_back(); // id 0, no route
+  file_ = std::fopen(path_.c_str(), "ab");
+  if (file_) {
+    std::setvbuf(file_, nullptr, _IONBF, 0);
+    std::fseek(file_, 0, SEEK_END);
+    auto size = std::ftell(file_);
+    file_size_ = size > 0 ? static_cast<size_t>(size) : 0;
+  }
+  writer_ = std::thread([this] { run(); });
 }
 
-inline std::string Response::get_header_value(const char *key,
-                                              size_t id) const {
-  return detail::get_header_value(headers, key, id, "");
+inline AccessLog::~AccessLog() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    shutdown_ = true;
+  }
+  cond_.notify_one();
+  writer_.join();
+  flush();
+  if (file_) { std::fclose(file_); }
 }
 
-inline size_t Response::get_header_value_count(const char *key) const {
-  auto r = headers.equal_range(key);
-  return static_cast<size_t>(std::distance(r.first, r.second));
-}
+inline bool AccessLog::is_open() const { return file_ != nullptr; }
 
-inline void Response::set_header(const char *key, const char *val) {
-  headers.emplace(key, val);
+inline void AccessLog::flush() {
+  std::lock_guard<std::mutex> guard(write_mutex_);
+  drain();
 }
 
-inline void Response::set_header(const char *key, const std::string &val) {
-  headers.emplace(key, val);
-}
+inline uint64_t AccessLog::dropped() const { return dropped_; }
 
-inline void Response::set_redirect(const char *url) {
-  set_header("Location", url);
-  status = 302;
-}
+// Rings of every AccessLog the thread has written to, by id, as with
+// Metrics::local_shard.
+inline AccessLog::Ring &AccessLog::local_ring() {
+  static thread_local std::vector<std::pair<uint64_t, Ring *>> rings;
+  for (const auto &x : rings) {
+    if (x.first == id_) { return *x.second; }
+  }
 
-inline void Response::set_content(const char *s, size_t n,
-                                  const char *content_type) {
-  body.assign(s, n);
-  set_header("Content-Type", content_type);
+  std::unique_ptr<Ring> ring(new Ring);
+  auto p = ring.get();
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    rings_.push_back(std::move(ring));
+  }
+  rings.emplace_back(id_, p);
+  return *p;
 }
 
-inline void Response::set_content(std::string s, const char *content_type) {
-  body = std::move(s);
-  set_header("Content-Type", content_type);
-}
+// Patterns are interned once per worker. The copy guards against another
+// pattern later living at the same address.
+inline uint32_t AccessLog::route_id(Ring &ring, const std::string *route) {
+  if (!route) { return 0; }
+  for (const auto &x : ring.routes) {
+    if (x.key == route && x.pattern == *route) { return x.id; }
+  }
 
-inline void Response::set_content_provider(
-    size_t in_length,
-    std::function<void(size_t offset, size_t length, DataSink &sink)> provider,
-    std::function<void()> resource_releaser) {
-  assert(in_length > 0);
-  content_length = in_length;
-  content_provider = [provider](size_t offset, size_t length, DataSink &sink) {
-    provider(offset, length, sink);
-  };
-  content_provider_resource_releaser = resource_releaser;
+  uint32_t id = 0;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = std::find(routes_.begin() + 1, routes_.end(), *route);
+    id = static_cast<uint32_t>(it - routes_.begin());
+    if (it == routes_.end()) { routes_.push_back(*route); }
+  }
+  ring.routes.push_back(InternedRoute{route, *route, id});
+  return id;
+}
+
+inline void AccessLog::record(const Request &req, const Response &res,
+                              const std::string *route,
+                              std::chrono::system_clock::time_point started,
+                              std::chrono::steady_clock::duration duration) {
+  auto &ring = local_ring();
+  auto head = ring.head.load(std::memory_order_relaxed);
+  auto tail = ring.tail.load(std::memory_order_acquire);
+  if (head - tail >= CPPHTTPLIB_ACCESS_LOG_RING_SIZE) {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  auto &r = ring.records[head % CPPHTTPLIB_ACCESS_LOG_RING_SIZE];
+  r.time_usec = static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          started.time_since_epoch())
+          .count());
+  r.duration_usec = static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(duration)
+          .count());
+  r.request_bytes =
+      req.has_header("Content-Length")
+          ? detail::get_header_value_uint64(req.headers, "Content-Length", 0)
+          : req.body.size();
+  r.response_bytes = 0;
+  if (req.method != "HEAD") {
+    r.response_bytes =
+        res.content_provider ? res.content_length : res.body.size();
+  }
+  r.route = route_id(ring, route);
+  r.status = static_cast<uint16_t>(res.status > 0 ? res.status : 0);
+  r.method = detail::access_log_method(req.method);
+  r.version = req.version == "HTTP/1.0" ? 0 : 1;
+  detail::copy_truncated(r.remote_addr, sizeof(r.remote_addr),
+                         req.get_header_value("REMOTE_ADDR"));
+  detail::copy_truncated(r.target, sizeof(r.target),
+                         req.target.empty() ? req.path : req.target);
+  ring.head.store(head + 1, std::memory_order_release);
+
+  // Past half full, don't wait for the timer.
+  if (head + 1 - tail >= CPPHTTPLIB_ACCESS_LOG_RING_SIZE / 2 &&
+      !wake_.exchange(true)) {
+    cond_.notify_one();
+  }
 }
 
-inline void Response::set_chunked_content_provider(
-    std::function<void(size_t offset, DataSink &sink)> provider,
-    std::function<void()> resource_releaser) {
-  content_length = 0;
-  content_provider = [provider](size_t offset, size_t, DataSink &sink) {
-    provider(offset, sink);
-  };
-  content_provider_resource_releaser = resource_releaser;
+inline void AccessLog::run() {
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait_for(
+          lock, std::chrono::milliseconds(CPPHTTPLIB_ACCESS_LOG_FLUSH_MSECOND),
+          [&] { return shutdown_ || wake_.load(); });
+      if (shutdown_) { return; }
+    }
+    wake_ = false;
+    flush();
+  }
 }
 
-// Rstream implementation
-inline ssize_t Stream::write(const char *ptr) {
-  return write(ptr, strlen(ptr));
-}
+inline void AccessLog::drain() {
+  std::vector<Ring *> rings;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    for (const auto &ring : rings_) {
+      rings.push_back(ring.get());
+    }
+  }
 
-inline ssize_t Stream::write(const std::string &s) {
-  return write(s.data(), s.size());
-}
+  batch_.clear();
+  for (auto ring : rings) {
+    auto tail = ring->tail.load(std::memory_order_relaxed);
+    auto head = ring->head.load(std::memory_order_acquire);
+    for (; tail != head; tail++) {
+      batch_.push_back(ring->records[tail % CPPHTTPLIB_ACCESS_LOG_RING_SIZE]);
+    }
+    ring->tail.store(tail, std::memory_order_release);
+  }
+  if (batch_.empty()) { return; }
 
-template <typename... Args>
-inline ssize_t Stream::write_format(const char *fmt, const Args &... args) {
-  std::array<char, 2048> buf;
+  // Rings are drained one after another, so order the batch by time.
+  std::stable_sort(batch_.begin(), batch_.end(),
+                   [](const detail::access_log_record &a,
+                      const detail::access_log_record &b) {
+                     return a.time_usec < b.time_usec;
+                   });
 
-#if defined(_MSC_VER) && _MSC_VER < 1900
-  auto sn = _snprintf_s(buf, bufsiz, buf.size() - 1, fmt, args...);
-#else
-  auto sn = snprintf(buf.data(), buf.size() - 1, fmt, args...);
-#endif
-  if (sn <= 0) { return sn; }
+  std::vector<std::string> routes;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    routes = routes_;
+  }
 
-  auto n = static_cast<size_t>(sn);
+  buffer_.clear();
+  for (const auto &r : batch_) {
+    detail::format_access_log_record(buffer_, r, routes[r.route]);
+  }
+  write_batch(buffer_);
+}
 
-  if (n >= buf.size() - 1) {
-    std::vector<char> glowable_buf(buf.size());
+inline void AccessLog::write_batch(const std::string &data) {
+  if (!file_) { return; }
+  if (max_file_size_ && file_size_ &&
+      file_size_ + data.size() > max_file_size_) {
+    rotate();
+  }
+  if (!file_) { return; }
+  file_size_ += std::fwrite(data.data(), 1, data.size(), file_);
+}
 
-    while (n >= glowable_buf.size() - 1) {
-      glowable_buf.resize(glowable_buf.size() * 2);
-#if defined(_MSC_VER) && _MSC_VER < 1900
-      n = static_cast<size_t>(_snprintf_s(&glowable_buf[0], glowable_buf.size(),
-                                          glowable_buf.size() - 1, fmt,
-                                          args...));
-#else
-      n = static_cast<size_t>(
-          snprintf(&glowable_buf[0], glowable_buf.size() - 1, fmt, args...));
-#endif
+inline void AccessLog::rotate() {
+  std::fclose(file_);
+  if (max_files_) {
+    auto name = [&](size_t i) { return path_ + "." + std::to_string(i); };
+    std::remove(name(max_files_).c_str());
+    for (auto i = max_files_; i > 1; i--) {
+      std::rename(name(i - 1).c_str(), name(i).c_str());
     }
-    return write(&glowable_buf[0], n);
+    std::rename(path_.c_str(), name(1).c_str());
   } else {
-    return write(buf.data(), n);
+    std::remove(path_.c_str());
   }
+  file_ = std::fopen(path_.c_str(), "ab");
+  if (file_) { std::setvbuf(file_, nullptr, _IONBF, 0); }
+  file_size_ = 0;
 }
 
+#ifdef CPPHTTPLIB_PROFILER
+// Profiler implementation
 namespace detail {
 
-// Socket stream implementation
-inline SocketStream::SocketStream(socket_t sock, time_t read_timeout_sec,
-                                  time_t read_timeout_usec)
-    : sock_(sock), read_timeout_sec_(read_timeout_sec),
-      read_timeout_usec_(read_timeout_usec) {}
-
-inline SocketStream::~SocketStream() {}
+struct profile_sample {
+  void *frames[CPPHTTPLIB_PROFILE_MAX_DEPTH];
+  int depth;
+  std::atomic<bool> ready;
+};
 
-inline bool SocketStream::is_readable() const {
-  return detail::select_read(sock_, read_timeout_sec_, read_timeout_usec_) > 0;
-}
+// Shared with the signal handler, which only touches atomics and a sample
+// slot it claimed for itself.
+struct profiler_state {
+  std::atomic<bool> running{false};
+  std::atomic<profile_sample *> samples{nullptr};
+  std::atomic<size_t> next{0};
+  std::atomic<uint64_t> dropped{0};
+  std::atomic<int> in_handler{0};
+  bool handler_installed = false; // only changed by the running profile
+};
 
-inline bool SocketStream::is_writable() const {
-  return detail::select_write(sock_, 0, 0) > 0;
+inline profiler_state &get_profiler_state() {
+  static profiler_state state;
+  return state;
+}
+
+inline void profiler_signal_handler(int /*sig*/) {
+  auto saved_errno = errno;
+  auto &state = get_profiler_state();
+  state.in_handler++;
+  if (auto samples = state.samples.load()) {
+    auto i = state.next.fetch_add(1, std::memory_order_relaxed);
+    if (i < CPPHTTPLIB_PROFILE_MAX_SAMPLES) {
+      auto &sample = samples[i];
+      sample.depth = backtrace(sample.frames, CPPHTTPLIB_PROFILE_MAX_DEPTH);
+      sample.ready.store(true, std::memory_order_release);
+    } else {
+      state.dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  state.in_handler--;
+  errno = saved_errno;
 }
 
-inline ssize_t SocketStream::read(char *ptr, size_t size) {
-  if (is_readable()) { return recv(sock_, ptr, size, 0); }
-  return -1;
-}
+inline std::string profile_symbol(void *addr) {
+  // A return address points past the call, maybe into the next function.
+  auto pc = static_cast<char *>(addr) - 1;
+  Dl_info info;
+  if (!dladdr(pc, &info)) { return "[unknown]"; }
 
-inline ssize_t SocketStream::write(const char *ptr, size_t size) {
-  if (is_writable()) { return send(sock_, ptr, size, 0); }
-  return -1;
-}
+  std::string name;
+  if (info.dli_sname) {
+    auto status = 0;
+    auto demangled =
+        abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+    name = status == 0 && demangled ? demangled : info.dli_sname;
+    std::free(demangled);
+  } else {
+    name = info.dli_fname ? info.dli_fname : "[unknown]";
+    auto slash = name.rfind('/');
+    if (slash != std::string::npos) { name.erase(0, slash + 1); }
+    char offset[32];
+    snprintf(offset, sizeof(offset), "+0x%lx",
+             static_cast<unsigned long>(
+                 pc - static_cast<char *>(info.dli_fbase)));
+    name += offset;
+  }
+  // ';' separates the frames of a folded stack.
+  std::replace(name.begin(), name.end(), ';', ':');
+  return name;
+}
+
+// Frames of the handler and of the kernel's signal trampoline come first.
+const int profile_skipped_frames = 2;
+
+inline std::string
+collapse_profile(const std::vector<profile_sample> &samples, size_t count,
+                 uint64_t dropped) {
+  std::map<std::vector<void *>, uint64_t> stacks;
+  for (size_t i = 0; i < count; i++) {
+    const auto &sample = samples[i];
+    if (!sample.ready.load(std::memory_order_acquire) ||
+        sample.depth <= profile_skipped_frames) {
+      continue;
+    }
+    stacks[std::vector<void *>(sample.frames + profile_skipped_frames,
+                               sample.frames + sample.depth)]++;
+  }
+
+  std::map<void *, std::string> symbols;
+  std::map<std::string, uint64_t> folded;
+  for (const auto &x : stacks) {
+    std::string line;
+    for (auto it = x.first.rbegin(); it != x.first.rend(); ++it) {
+      auto sym = symbols.find(*it);
+      if (sym == symbols.end()) {
+        sym = symbols.emplace(*it, profile_symbol(*it)).first;
+      }
+      if (!line.empty()) { line += ';'; }
+      line += sym->second;
+    }
+    folded[line] += x.second;
+  }
+  if (dropped) { folded["[dropped]"] += dropped; }
 
-inline std::string SocketStream::get_remote_addr() const {
-  return detail::get_remote_addr(sock_);
+  std::string out;
+  for (const auto &x : folded) {
+    out += x.first + " " + std::to_string(x.second) + "\n";
+  }
+  return out;
 }
 
-// Buffer stream implementation
-inline bool BufferStream::is_readable() const { return true; }
+} // namespace detail
 
-inline bool BufferStream::is_writable() const { return true; }
+inline bool profile_cpu(uint64_t msec, int hz, std::string &collapsed) {
+  auto &state = detail::get_profiler_state();
+  if (state.running.exchange(true)) { return false; }
 
-inline ssize_t BufferStream::read(char *ptr, size_t size) {
-#if defined(_MSC_VER) && _MSC_VER < 1900
-  auto len_read = buffer._Copy_s(ptr, size, size, position);
-#else
-  auto len_read = buffer.copy(ptr, size, position);
-#endif
-  position += static_cast<size_t>(len_read);
-  return static_cast<ssize_t>(len_read);
-}
+  struct itimerval timer;
+  if (getitimer(ITIMER_PROF, &timer) ||
+      timer.it_value.tv_sec || timer.it_value.tv_usec) {
+    state.running = false;
+    return false;
+  }
 
-inline ssize_t BufferStream::write(const char *ptr, size_t size) {
-  buffer.append(ptr, size);
-  return static_cast<ssize_t>(size);
-}
+  // The handler stays installed once set, since a SIGPROF still in flight
+  // after the timer stops would otherwise end the process.
+  if (!state.handler_installed) {
+    struct sigaction old_action;
+    if (sigaction(SIGPROF, nullptr, &old_action) ||
+        (old_action.sa_handler != SIG_DFL &&
+         old_action.sa_handler != SIG_IGN)) {
+      state.running = false;
+      return false;
+    }
+    // backtrace() loads libgcc on its first call, which isn't safe to do
+    // from the handler.
+    void *frame;
+    backtrace(&frame, 1);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = detail::profiler_signal_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, nullptr);
+    state.handler_installed = true;
+  }
+
+  std::vector<detail::profile_sample> samples(CPPHTTPLIB_PROFILE_MAX_SAMPLES);
+  state.next = 0;
+  state.dropped = 0;
+  state.samples = samples.data();
+
+  hz = (std::min)((std::max)(hz, 1), 1000);
+  auto interval_usec = 1000000 / hz;
+  memset(&timer, 0, sizeof(timer));
+  timer.it_interval.tv_sec = interval_usec / 1000000;
+  timer.it_interval.tv_usec = interval_usec % 1000000;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, nullptr)) {
+    state.samples = nullptr;
+    state.running = false;
+    return false;
+  }
 
-inline std::string BufferStream::get_remote_addr() const { return ""; }
+  std::this_thread::sleep_for(std::chrono::milliseconds(msec));
 
-inline const std::string &BufferStream::get_buffer() const { return buffer; }
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, nullptr);
+  state.samples = nullptr;
+  while (state.in_handler) {
+    std::this_thread::yield();
+  }
 
-} // namespace detail
+  auto count = (std::min)(state.next.load(),
+                          static_cast<size_t>(CPPHTTPLIB_PROFILE_MAX_SAMPLES));
+  collapsed = detail::collapse_profile(samples, count, state.dropped);
+  state.running = false;
+  return true;
+}
+#endif
 
 // HTTP server implementation
 inline Server::Server()
     : keep_alive_max_count_(CPPHTTPLIB_KEEPALIVE_MAX_COUNT),
+      keep_alive_timeout_sec_(CPPHTTPLIB_KEEPALIVE_TIMEOUT_SECOND),
       read_timeout_sec_(CPPHTTPLIB_READ_TIMEOUT_SECOND),
       read_timeout_usec_(CPPHTTPLIB_READ_TIMEOUT_USECOND),
+      header_read_timeout_sec_(CPPHTTPLIB_HEADER_READ_TIMEOUT_SECOND),
+      header_read_timeout_usec_(0),
+      body_read_timeout_sec_(CPPHTTPLIB_BODY_READ_TIMEOUT_SECOND),
+      body_read_timeout_usec_(0),
+      write_timeout_sec_(CPPHTTPLIB_WRITE_TIMEOUT_SECOND),
+      write_timeout_usec_(0),
       payload_max_length_(CPPHTTPLIB_PAYLOAD_MAX_LENGTH), is_running_(false),
       svr_sock_(INVALID_SOCKET) {
 #ifndef _WIN32
@@ -2923,53 +7631,53 @@ inline Server::Server()
 inline Server::~Server() {}
 
 inline Server &Server::Get(const char *pattern, Handler handler) {
-  get_handlers_.push_back(std::make_pair(std::regex(pattern), handler));
+  get_handlers_.push_back({std::regex(pattern), pattern, handler});
   return *this;
 }
 
 inline Server &Server::Post(const char *pattern, Handler handler) {
-  post_handlers_.push_back(std::make_pair(std::regex(pattern), handler));
+  post_handlers_.push_back({std::regex(pattern), pattern, handler});
   return *this;
 }
 
 inline Server &Server::Post(const char *pattern,
                             HandlerWithContentReader handler) {
   post_handlers_for_content_reader_.push_back(
-      std::make_pair(std::regex(pattern), handler));
+      {std::regex(pattern), pattern, handler});
   return *this;
 }
 
 inline Server &Server::Put(const char *pattern, Handler handler) {
-  put_handlers_.push_back(std::make_pair(std::regex(pattern), handler));
+  put_handlers_.push_back({std::regex(pattern), pattern, handler});
   return *this;
 }
 
 inline Server &Server::Put(const char *pattern,
                            HandlerWithContentReader handler) {
   put_handlers_for_content_reader_.push_back(
-      std::make_pair(std::regex(pattern), handler));
+      {std::regex(pattern), pattern, handler});
   return *this;
 }
 
 inline Server &Server::Patch(const char *pattern, Handler handler) {
-  patch_handlers_.push_back(std::make_pair(std::regex(pattern), handler));
+  patch_handlers_.push_back({std::regex(pattern), pattern, handler});
   return *this;
 }
 
 inline Server &Server::Patch(const char *pattern,
                              HandlerWithContentReader handler) {
   patch_handlers_for_content_reader_.push_back(
-      std::make_pair(std::regex(pattern), handler));
+      {std::regex(pattern), pattern, handler});
   return *this;
 }
 
 inline Server &Server::Delete(const char *pattern, Handler handler) {
-  delete_handlers_.push_back(std::make_pair(std::regex(pattern), handler));
+  delete_handlers_.push_back({std::regex(pattern), pattern, handler});
   return *this;
 }
 
 inline Server &Server::Options(const char *pattern, Handler handler) {
-  options_handlers_.push_back(std::make_pair(std::regex(pattern), handler));
+  options_handlers_.push_back({std::regex(pattern), pattern, handler});
   return *this;
 }
 
@@ -3013,6 +7721,45 @@ inline void Server::set_error_handler(Handler handler) {
 
 inline void Server::set_logger(Logger logger) { logger_ = std::move(logger); }
 
+inline void Server::set_access_log(std::shared_ptr<AccessLog> log) {
+  access_log_ = std::move(log);
+}
+
+inline void Server::enable_metrics(bool enabled) { metrics_enabled_ = enabled; }
+
+inline void Server::set_metrics_route(const char *pattern) {
+  metrics_enabled_ = true;
+  Get(pattern, [this](const Request & /*req*/, Response &res) {
+    res.set_content(metrics_.to_prometheus(),
+                    "text/plain; version=0.0.4; charset=utf-8");
+  });
+}
+
+inline const Metrics &Server::metrics() const { return metrics_; }
+
+#ifdef CPPHTTPLIB_PROFILER
+inline void Server::set_profile_route(const char *pattern) {
+  Get(pattern, [](const Request &req, Response &res) {
+    auto param = [&](const char *key, long def, long max) {
+      if (!req.has_param(key)) { return def; }
+      auto n = std::strtol(req.get_param_value(key).c_str(), nullptr, 10);
+      return (std::min)((std::max)(n, 1L), max);
+    };
+    auto sec = param("seconds", 10, CPPHTTPLIB_PROFILE_MAX_SECOND);
+    auto hz = param("hz", 99, 1000);
+
+    std::string collapsed;
+    if (!profile_cpu(static_cast<uint64_t>(sec) * 1000, static_cast<int>(hz),
+                     collapsed)) {
+      res.status = 503;
+      res.set_header("Retry-After", std::to_string(sec));
+      return;
+    }
+    res.set_content(collapsed, "text/plain; charset=utf-8");
+  });
+}
+#endif
+
 inline void
 Server::set_expect_100_continue_handler(Expect100ContinueHandler handler) {
   expect_100_continue_handler_ = std::move(handler);
@@ -3022,15 +7769,40 @@ inline void Server::set_keep_alive_max_count(size_t count) {
   keep_alive_max_count_ = count;
 }
 
+inline void Server::set_keep_alive_timeout(time_t sec) {
+  keep_alive_timeout_sec_ = sec;
+}
+
 inline void Server::set_read_timeout(time_t sec, time_t usec) {
   read_timeout_sec_ = sec;
   read_timeout_usec_ = usec;
 }
 
+inline void Server::set_header_read_timeout(time_t sec, time_t usec) {
+  header_read_timeout_sec_ = sec;
+  header_read_timeout_usec_ = usec;
+}
+
+inline void Server::set_body_read_timeout(time_t sec, time_t usec) {
+  body_read_timeout_sec_ = sec;
+  body_read_timeout_usec_ = usec;
+}
+
+inline void Server::set_write_timeout(time_t sec, time_t usec) {
+  write_timeout_sec_ = sec;
+  write_timeout_usec_ = usec;
+}
+
 inline void Server::set_payload_max_length(size_t length) {
   payload_max_length_ = length;
 }
 
+inline void Server::set_socket_options(const SocketOptions &options) {
+  socket_options_ = options;
+}
+
+inline TimerWheel &Server::timer_wheel() { return timer_wheel_; }
+
 inline bool Server::bind_to_port(const char *host, int port, int socket_flags) {
   if (bind_internal(host, port, socket_flags) < 0) return false;
   return true;
@@ -3082,8 +7854,13 @@ inline bool Server::write_response(Stream &strm, bool last_connection,
                                    const Request &req, Response &res) {
   assert(res.status != -1);
 
+  detail::trace_span span(detail::trace_phase::WriteResponse, strm.socket());
+
   if (400 <= res.status && error_handler_) { error_handler_(req, res); }
 
+  detail::socket_deadline deadline(timer_wheel_, strm.socket(),
+                                   write_timeout_sec_, write_timeout_usec_);
+
   detail::BufferStream bstrm;
 
   // Response line
@@ -3286,6 +8063,10 @@ inline bool Server::read_content_core(Stream &strm, Request &req, Response &res,
                                       ContentReceiver receiver,
                                       MultipartContentHeader mulitpart_header,
                                       ContentReceiver multipart_receiver) {
+  detail::socket_deadline deadline(timer_wheel_, strm.socket(),
+                                   body_read_timeout_sec_,
+                                   body_read_timeout_usec_);
+
   detail::MultipartFormDataParser multipart_form_data_parser;
   ContentReceiver out;
 
@@ -3335,10 +8116,33 @@ inline bool Server::handle_file_request(Request &req, Response &res,
         if (path.back() == '/') { path += "index.html"; }
 
         if (detail::is_file(path)) {
-          detail::read_file(path, res.body);
           auto type =
               detail::find_content_type(path, file_extension_and_mimetype_map_);
           if (type) { res.set_header("Content-Type", type); }
+
+#ifdef CPPHTTPLIB_ZLIB_SUPPORT
+          auto compress =
+              type && detail::can_compress(type) &&
+              req.get_header_value("Accept-Encoding").find("gzip") !=
+                  std::string::npos;
+#else
+          auto compress = false;
+#endif
+
+          // Large files go out from the descriptor (sendfile, or kTLS with
+          // SSLServer) unless they are to be compressed, or a file request
+          // handler may want to see the body.
+          auto body = std::make_shared<detail::multipart_body>();
+          if (!compress && !file_request_handler_ && body->append_file(path) &&
+              body->size() >= CPPHTTPLIB_FILE_STREAM_MIN_SIZE) {
+            res.set_content_provider(
+                body->size(),
+                [body](size_t offset, size_t length, DataSink &sink) {
+                  body->provide(offset, length, sink);
+                });
+          } else {
+            detail::read_file(path, res.body);
+          }
           res.status = 200;
           if (!head && file_request_handler_) {
             file_request_handler_(req, res);
@@ -3355,13 +8159,14 @@ inline socket_t Server::create_server_socket(const char *host, int port,
                                              int socket_flags) const {
   return detail::create_socket(
       host, port,
-      [](socket_t sock, struct addrinfo &ai) -> bool {
+      [this](socket_t sock, struct addrinfo &ai) -> bool {
         if (::bind(sock, ai.ai_addr, static_cast<socklen_t>(ai.ai_addrlen))) {
           return false;
         }
-        if (::listen(sock, 5)) { // Listen through 5 channels
-          return false;
-        }
+        if (!detail::listen_socket(sock, socket_options_)) { return false; }
+
+        // Non-blocking, so that each wakeup can drain the accept queue.
+        detail::set_nonblocking(sock, true);
         return true;
       },
       socket_flags);
@@ -3393,14 +8198,45 @@ inline int Server::bind_internal(const char *host, int port, int socket_flags) {
   }
 }
 
+inline void Server::dispatch_socket(socket_t sock, TaskQueue &task_queue) {
+  if (metrics_enabled_) { metrics_.connection_queued(); }
+  auto queued = detail::trace_clock();
+#if __cplusplus > 201703L
+  task_queue.enqueue([=, this]() { serve_socket(sock, queued); });
+#else
+  task_queue.enqueue([=]() { serve_socket(sock, queued); });
+#endif
+}
+
+inline void Server::serve_socket(socket_t sock, uint64_t queued) {
+  detail::trace_record(detail::trace_phase::Queue, sock, queued,
+                       detail::trace_clock());
+  if (metrics_enabled_) { metrics_.connection_started(); }
+  process_and_close_socket(sock);
+  if (metrics_enabled_) { metrics_.connection_finished(); }
+}
+
 inline bool Server::listen_internal() {
   auto ret = true;
   is_running_ = true;
+  timer_wheel_.start();
 
   {
     std::unique_ptr<TaskQueue> task_queue(new_task_queue());
+    detail::reserve_fd reserve(socket_options_.reserve_fd);
+
+    auto dispatch = [&](socket_t sock) {
+      detail::set_socket_options(sock, socket_options_);
+      dispatch_socket(sock, *task_queue);
+    };
+
+#ifdef CPPHTTPLIB_USE_IO_URING
+    auto done = detail::accept_with_io_uring(svr_sock_, reserve, ret, dispatch);
+#else
+    auto done = false;
+#endif
 
-    for (;;) {
+    while (!done) {
       if (svr_sock_ == INVALID_SOCKET) {
         // The server socket was closed by 'stop' method.
         break;
@@ -3412,15 +8248,30 @@ inline bool Server::listen_internal() {
         continue;
       }
 
-      socket_t sock = accept(svr_sock_, nullptr, nullptr);
-
-      if (sock == INVALID_SOCKET) {
-        if (errno == EMFILE) {
-          // The per-process limit of open file descriptors has been reached.
-          // Try to accept new connections after a short sleep.
-          std::this_thread::sleep_for(std::chrono::milliseconds(1));
-          continue;
+      // Accept every pending connection before polling again.
+      auto accept_error = false;
+      for (;;) {
+        socket_t sock = detail::accept_socket(svr_sock_);
+
+        if (sock == INVALID_SOCKET) {
+          if (detail::is_accept_queue_empty()) { break; }
+          if (detail::is_accept_retryable()) { continue; }
+          if (detail::is_fd_limit_error()) {
+            // The per-process limit of open file descriptors has been reached.
+            // Shed the connection through the spare descriptor, or try again
+            // after a short sleep when there is none.
+            if (reserve.shed(svr_sock_)) { continue; }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            break;
+          }
+          accept_error = true;
+          break;
         }
+
+        dispatch(sock);
+      }
+
+      if (accept_error) {
         if (svr_sock_ != INVALID_SOCKET) {
           detail::close_socket(svr_sock_);
           ret = false;
@@ -3429,22 +8280,19 @@ inline bool Server::listen_internal() {
         }
         break;
       }
-
-#if __cplusplus > 201703L
-      task_queue->enqueue([=, this]() { process_and_close_socket(sock); });
-#else
-      task_queue->enqueue([=]() { process_and_close_socket(sock); });
-#endif
     }
 
+    stop_dispatch();
     task_queue->shutdown();
   }
 
+  timer_wheel_.stop();
   is_running_ = false;
   return ret;
 }
 
-inline bool Server::routing(Request &req, Response &res, Stream &strm) {
+inline bool Server::routing(Request &req, Response &res, Stream &strm,
+                            const std::string *&route) {
   // File handler
   bool is_head_request = req.method == "HEAD";
   if ((req.method == "GET" || is_head_request) &&
@@ -3467,17 +8315,17 @@ inline bool Server::routing(Request &req, Response &res, Stream &strm) {
 
       if (req.method == "POST") {
         if (dispatch_request_for_content_reader(
-                req, res, reader, post_handlers_for_content_reader_)) {
+                req, res, reader, post_handlers_for_content_reader_, route)) {
           return true;
         }
       } else if (req.method == "PUT") {
         if (dispatch_request_for_content_reader(
-                req, res, reader, put_handlers_for_content_reader_)) {
+                req, res, reader, put_handlers_for_content_reader_, route)) {
           return true;
         }
       } else if (req.method == "PATCH") {
         if (dispatch_request_for_content_reader(
-                req, res, reader, patch_handlers_for_content_reader_)) {
+                req, res, reader, patch_handlers_for_content_reader_, route)) {
           return true;
         }
       }
@@ -3489,17 +8337,17 @@ inline bool Server::routing(Request &req, Response &res, Stream &strm) {
 
   // Regular handler
   if (req.method == "GET" || req.method == "HEAD") {
-    return dispatch_request(req, res, get_handlers_);
+    return dispatch_request(req, res, get_handlers_, route);
   } else if (req.method == "POST") {
-    return dispatch_request(req, res, post_handlers_);
+    return dispatch_request(req, res, post_handlers_, route);
   } else if (req.method == "PUT") {
-    return dispatch_request(req, res, put_handlers_);
+    return dispatch_request(req, res, put_handlers_, route);
   } else if (req.method == "DELETE") {
-    return dispatch_request(req, res, delete_handlers_);
+    return dispatch_request(req, res, delete_handlers_, route);
   } else if (req.method == "OPTIONS") {
-    return dispatch_request(req, res, options_handlers_);
+    return dispatch_request(req, res, options_handlers_, route);
   } else if (req.method == "PATCH") {
-    return dispatch_request(req, res, patch_handlers_);
+    return dispatch_request(req, res, patch_handlers_, route);
   }
 
   res.status = 400;
@@ -3507,15 +8355,15 @@ inline bool Server::routing(Request &req, Response &res, Stream &strm) {
 }
 
 inline bool Server::dispatch_request(Request &req, Response &res,
-                                     Handlers &handlers) {
+                                     Handlers &handlers,
+                                     const std::string *&route) {
 
   try {
     for (const auto &x : handlers) {
-      const auto &pattern = x.first;
-      const auto &handler = x.second;
-
-      if (std::regex_match(req.path, req.matches, pattern)) {
-        handler(req, res);
+      if (std::regex_match(req.path, req.matches, x.regex)) {
+        route = &x.pattern;
+        detail::trace_span span(detail::trace_phase::Handler, INVALID_SOCKET);
+        x.handler(req, res);
         return true;
       }
     }
@@ -3531,13 +8379,12 @@ inline bool Server::dispatch_request(Request &req, Response &res,
 
 inline bool Server::dispatch_request_for_content_reader(
     Request &req, Response &res, ContentReader content_reader,
-    HandlersForContentReader &handlers) {
+    HandlersForContentReader &handlers, const std::string *&route) {
   for (const auto &x : handlers) {
-    const auto &pattern = x.first;
-    const auto &handler = x.second;
-
-    if (std::regex_match(req.path, req.matches, pattern)) {
-      handler(req, res, content_reader);
+    if (std::regex_match(req.path, req.matches, x.regex)) {
+      route = &x.pattern;
+      detail::trace_span span(detail::trace_phase::Handler, INVALID_SOCKET);
+      x.handler(req, res, content_reader);
       return true;
     }
   }
@@ -3552,29 +8399,74 @@ Server::process_request(Stream &strm, bool last_connection,
 
   detail::stream_line_reader line_reader(strm, buf.data(), buf.size());
 
-  // Connection has been closed on client
-  if (!line_reader.getline()) { return false; }
-
   Request req;
   Response res;
 
   res.version = "HTTP/1.1";
 
-  // Check if the request URI doesn't exceed the limit
-  if (line_reader.size() > CPPHTTPLIB_REQUEST_URI_MAX_LENGTH) {
-    Headers dummy;
-    detail::read_headers(strm, dummy);
-    res.status = 414;
-    return write_response(strm, last_connection, req, res);
-  }
+  detail::trace_span span(detail::trace_phase::Request, strm.socket());
+
+  using clock = std::chrono::steady_clock;
+  clock::time_point started, parsed;
+  const std::string *route = nullptr;
+  auto measured = metrics_enabled_ || access_log_;
+  std::chrono::system_clock::time_point wall_started;
+  if (measured) { started = clock::now(); }
+  if (access_log_) { wall_started = std::chrono::system_clock::now(); }
+  detail::begin_allocation_phase(0);
+
+  // Every response goes out through here, to be measured.
+  auto respond = [&]() {
+    detail::begin_allocation_phase(2);
+    if (!measured) { return write_response(strm, last_connection, req, res); }
+    auto handled = clock::now();
+    if (parsed == clock::time_point()) { parsed = handled; }
+    auto ret = write_response(strm, last_connection, req, res);
+    if (metrics_enabled_) {
+      metrics_.record(req, res, route, started, parsed, handled,
+                      detail::current_request_allocations());
+    }
+    if (access_log_) {
+      access_log_->record(req, res, route, wall_started,
+                          clock::now() - started);
+    }
+    return ret;
+  };
+
+  {
+    detail::trace_span read_span(detail::trace_phase::ReadHeaders,
+                                 strm.socket());
+    detail::socket_deadline deadline(timer_wheel_, strm.socket(),
+                                     header_read_timeout_sec_,
+                                     header_read_timeout_usec_);
+
+    // Connection has been closed on client
+    if (!line_reader.getline()) {
+      span.cancel();
+      read_span.cancel();
+      return false;
+    }
+
+    // Check if the request URI doesn't exceed the limit
+    if (line_reader.size() > CPPHTTPLIB_REQUEST_URI_MAX_LENGTH) {
+      Headers dummy;
+      detail::read_headers(strm, dummy);
+      res.status = 414;
+      return respond();
+    }
 
-  // Request line and headers
-  if (!parse_request_line(line_reader.ptr(), req) ||
-      !detail::read_headers(strm, req.headers)) {
-    res.status = 400;
-    return write_response(strm, last_connection, req, res);
+    // Request line and headers
+    if (!parse_request_line(line_reader.ptr(), req) ||
+        !detail::read_headers(strm, req.headers)) {
+      res.status = 400;
+      return respond();
+    }
   }
 
+  if (measured) { parsed = clock::now(); }
+  detail::begin_allocation_phase(1);
+  span.set_label(req.method, req.path);
+
   if (req.get_header_value("Connection") == "close") {
     connection_close = true;
   }
@@ -3595,6 +8487,17 @@ Server::process_request(Stream &strm, bool last_connection,
 
   if (setup_request) { setup_request(req); }
 
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+  // Only requests that are safe to repeat are served from early data
+  // (RFC 8470). A client may send others again once the handshake is done.
+  if (req.early_data && !detail::is_idempotent_method(req.method)) {
+    connection_close = true;
+    res.set_header("Connection", "close");
+    res.status = 425;
+    return respond();
+  }
+#endif
+
   if (req.get_header_value("Expect") == "100-continue") {
     auto status = 100;
     if (expect_100_continue_handler_) {
@@ -3606,29 +8509,46 @@ Server::process_request(Stream &strm, bool last_connection,
       strm.write_format("HTTP/1.1 %d %s\r\n\r\n", status,
                         detail::status_message(status));
       break;
-    default: return write_response(strm, last_connection, req, res);
+    default: return respond();
     }
   }
 
   // Rounting
-  if (routing(req, res, strm)) {
+  auto routed = false;
+  {
+    detail::trace_span routing_span(detail::trace_phase::Routing,
+                                    strm.socket());
+    routed = routing(req, res, strm, route);
+  }
+  if (routed) {
     if (res.status == -1) { res.status = req.ranges.empty() ? 200 : 206; }
   } else {
     if (res.status == -1) { res.status = 404; }
   }
 
-  return write_response(strm, last_connection, req, res);
+  return respond();
 }
 
 inline bool Server::is_valid() const { return true; }
 
 inline bool Server::process_and_close_socket(socket_t sock) {
+  auto callback = [this](Stream &strm, bool last_connection,
+                         bool &connection_close) {
+    return process_request(strm, last_connection, connection_close, nullptr);
+  };
+
+#ifdef CPPHTTPLIB_USE_IO_URING
+  // Threads whose ring can't be set up take the plain socket path.
+  if (auto ctx = detail::io_uring_thread_context()) {
+    return detail::process_and_close_socket_io_uring(
+        sock, *ctx, keep_alive_max_count_, keep_alive_timeout_sec_,
+        read_timeout_sec_, read_timeout_usec_, callback);
+  }
+#endif
+
   return detail::process_and_close_socket(
-      false, sock, keep_alive_max_count_, read_timeout_sec_, read_timeout_usec_,
-      [this](Stream &strm, bool last_connection, bool &connection_close) {
-        return process_request(strm, last_connection, connection_close,
-                               nullptr);
-      });
+      false, sock, keep_alive_max_count_, keep_alive_timeout_sec_,
+      read_timeout_sec_, read_timeout_usec_, callback);
 }
 
 // HTTP client implementation
@@ -3639,17 +8559,25 @@ inline Client::Client(const std::string &host, int port,
       host_and_port_(host_ + ":" + std::to_string(port_)),
       client_cert_path_(client_cert_path), client_key_path_(client_key_path) {}
 
-inline Client::~Client() {}
+inline Client::~Client() { wait_for_hedges(); }
+
+inline void Client::wait_for_hedges() {
+  std::unique_lock<std::mutex> lock(hedge_mutex_);
+  hedge_cond_.wait(lock, [&] { return running_hedges_ == 0; });
+}
 
 inline bool Client::is_valid() const { return true; }
 
-inline socket_t Client::create_client_socket() const {
+inline socket_t
+Client::create_client_socket(detail::canceler *canceler) const {
   if (!proxy_host_.empty()) {
-    return detail::create_client_socket(proxy_host_.c_str(), proxy_port_,
-                                        timeout_sec_, interface_);
+    return detail::create_client_socket(
+        proxy_host_.c_str(), proxy_port_, timeout_sec_, interface_,
+        socket_options_, dns_cache_.get(), canceler);
   }
   return detail::create_client_socket(host_.c_str(), port_, timeout_sec_,
-                                      interface_);
+                                      interface_, socket_options_,
+                                      dns_cache_.get(), canceler);
 }
 
 inline bool Client::read_response_line(Stream &strm, Response &res) {
@@ -3671,7 +8599,252 @@ inline bool Client::read_response_line(Stream &strm, Response &res) {
 }
 
 inline bool Client::send(const Request &req, Response &res) {
-  auto sock = create_client_socket();
+  if (response_cache_ && req.method == "GET" && !req.content_receiver &&
+      !req.response_handler && !req.body_buffer) {
+    return send_with_cache(*response_cache_, req, res);
+  }
+  return send_uncached(req, res);
+}
+
+inline bool Client::send_with_cache(ResponseCache &cache, const Request &req,
+                                    Response &res) {
+  detail::cache_control request_cc;
+  detail::parse_cache_control(req.get_header_value("Cache-Control"),
+                              request_cc);
+  if (request_cc.no_store || sends_credentials(req)) {
+    return send_uncached(req, res);
+  }
+
+  // Clients with different certificates may be different users to the
+  // server, so they don't share entries.
+  auto key = (is_ssl() ? "https://" : "http://") + host_and_port_ + req.path;
+  if (!client_cert_path_.empty()) { key += " cert " + client_cert_path_; }
+  auto entry = cache.lookup(key);
+  auto now = std::chrono::system_clock::now();
+  if (entry && now < entry->expires && !request_cc.no_cache) {
+    res = entry->res;
+    return true;
+  }
+
+  Request req2 = req;
+  if (entry) {
+    auto etag = entry->res.get_header_value("ETag");
+    auto last_modified = entry->res.get_header_value("Last-Modified");
+    if (!etag.empty() && !req.has_header("If-None-Match")) {
+      req2.headers.emplace("If-None-Match", etag);
+    }
+    if (!last_modified.empty() && !req.has_header("If-Modified-Since")) {
+      req2.headers.emplace("If-Modified-Since", last_modified);
+    }
+  }
+
+  if (!send_uncached(req2, res)) { return false; }
+
+  if (res.status == 304 && entry && req2.headers.size() > req.headers.size()) {
+    // Headers sent with the 304 update the kept ones
+    auto updated = entry->res;
+    for (const auto &x : res.headers) {
+      if (x.first == "Content-Length" || x.first == "Transfer-Encoding") {
+        continue;
+      }
+      updated.headers.erase(x.first);
+    }
+    for (const auto &x : res.headers) {
+      if (x.first == "Content-Length" || x.first == "Transfer-Encoding") {
+        continue;
+      }
+      updated.headers.insert(x);
+    }
+    res = std::move(updated);
+  } else if (res.status != 200) {
+    return true;
+  }
+
+  // A response setting a cookie starts a session for this user, and would
+  // hand it to everyone sharing the cache.
+  detail::cache_control cc;
+  detail::parse_cache_control(res.get_header_value("Cache-Control"), cc);
+  if (cc.no_store || cc.is_private || res.has_header("Vary") ||
+      res.has_header("Set-Cookie") ||
+      (cc.max_age <= 0 && !res.has_header("ETag") &&
+       !res.has_header("Last-Modified"))) {
+    return true;
+  }
+
+  auto age = static_cast<long>(
+      detail::get_header_value_uint64(res.headers, "Age", 0));
+  auto fresh_for = cc.no_cache ? 0 : (std::max)(cc.max_age - age, 0L);
+  cache.store(key, res, now + std::chrono::seconds(fresh_for));
+  return true;
+}
+
+// The cache is shared between clients, and a response to one user must not
+// be served to another.
+inline bool Client::sends_credentials(const Request &req) const {
+  if (req.has_header("Authorization") || req.has_header("Cookie")) {
+    return true;
+  }
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+  if (!digest_auth_username_.empty()) { return true; }
+#endif
+  return !basic_auth_username_.empty();
+}
+
+inline bool Client::send_uncached(const Request &req, Response &res) {
+  if (hedging_policy_ && detail::is_idempotent_method(req.method)) {
+    return send_with_hedging(hedging_policy_, req, res);
+  }
+  return send_once(req, res);
+}
+
+// Failed requests and gateway errors are retried while the budget allows,
+// unless part of the response already reached a content receiver.
+inline bool
+Client::send_with_hedging(const std::shared_ptr<HedgingPolicy> &policy,
+                          const Request &req, Response &res) {
+  policy->deposit();
+
+  for (size_t retries = 0;; retries++) {
+    auto ret = send_hedged(policy, req, res);
+    if (req.content_receiver && res.status != -1) { return ret; }
+
+    auto retriable =
+        !ret || res.status == 502 || res.status == 503 || res.status == 504;
+    if (!retriable || !policy->allow_retry(retries)) { return ret; }
+
+    res = Response();
+  }
+}
+
+// Sends the request, and a duplicate once the hedge delay passes without a
+// response. The first one to get a response wins and the other is canceled.
+// The request goes out on the calling thread. Only a duplicate gets a thread
+// of its own, started by the policy's timer. Canceling aborts the connect,
+// the TLS handshake and the exchange itself, but a losing duplicate still
+// resolving the host name, waiting for a pooled connection or talking to an
+// HTTPS proxy runs on after the caller returns, for as long as the resolver,
+// the connection timeout or the read timeout allow. The client waits for
+// those when it's destroyed.
+inline bool
+Client::send_hedged(const std::shared_ptr<HedgingPolicy> &policy,
+                    const Request &req, Response &res) {
+  struct Attempt {
+    Request req;
+    Response res;
+    std::chrono::steady_clock::time_point start;
+    bool ret = false;
+    bool done = false;
+  };
+
+  struct State {
+    Attempt attempts[2];
+    int winner = -1;
+    int running = 0;
+    std::mutex mutex;
+    std::condition_variable cond;
+  };
+
+  auto state = std::make_shared<State>();
+  auto handler = req.response_handler;
+
+  // Called with the state locked. The attempt's handler can't hold the
+  // state it's part of, and only runs while the attempt does.
+  auto prepare = [&](int k) {
+    auto s = state.get();
+    auto &a = s->attempts[k];
+    a.req = req;
+    a.req.canceler = std::make_shared<detail::canceler>();
+    a.start = std::chrono::steady_clock::now();
+    a.req.response_handler = [s, policy, handler, k](const Response &r) {
+      {
+        std::lock_guard<std::mutex> guard(s->mutex);
+        if (s->winner == -1) {
+          s->winner = k;
+          policy->record(std::chrono::steady_clock::now() -
+                         s->attempts[k].start);
+          auto &other = s->attempts[1 - k].req.canceler;
+          if (other) { other->cancel(); }
+        } else if (s->winner != k) {
+          return false;
+        }
+      }
+      return !handler || handler(r);
+    };
+    s->running++;
+  };
+
+  auto run = [](const std::shared_ptr<State> &s, int k, Client &cli) {
+    auto &a = s->attempts[k];
+    auto ret = cli.send_once(a.req, a.res);
+
+    std::lock_guard<std::mutex> guard(s->mutex);
+    a.ret = ret;
+    a.done = true;
+    s->running--;
+    s->cond.notify_all();
+  };
+
+  {
+    std::lock_guard<std::mutex> guard(state->mutex);
+    prepare(0);
+  }
+
+  // Canceling the timer waits for it to finish if it's firing, so it may
+  // refer to this frame. The wheel fires up to a tick, 1ms, early.
+  std::chrono::milliseconds delay;
+  TimerWheel::TimerId timer = 0;
+  if (policy->hedge_delay(delay)) {
+    delay += std::chrono::milliseconds(1);
+    timer = policy->timers_.add(delay, [&]() {
+      {
+        std::lock_guard<std::mutex> guard(state->mutex);
+        if (state->winner != -1 || state->attempts[0].done ||
+            !policy->allow_hedge()) {
+          return;
+        }
+        prepare(1);
+      }
+
+      auto alternate = policy->next_alternate();
+      {
+        std::lock_guard<std::mutex> guard(hedge_mutex_);
+        running_hedges_++;
+      }
+      auto s = state;
+      std::thread([this, run, s, alternate]() {
+        run(s, 1, alternate ? *alternate : *this);
+
+        std::lock_guard<std::mutex> guard(hedge_mutex_);
+        if (--running_hedges_ == 0) { hedge_cond_.notify_all(); }
+      }).detach();
+    });
+  }
+
+  run(state, 0, *this);
+  if (timer) { policy->timers_.cancel(timer); }
+
+  std::unique_lock<std::mutex> lock(state->mutex);
+  auto &attempts = state->attempts;
+  state->cond.wait(lock, [&] {
+    return (state->winner != -1 && attempts[state->winner].done) ||
+           state->running == 0;
+  });
+
+  if (state->winner == -1) {
+    res = std::move(attempts[0].res);
+    return false;
+  }
+  auto &winner = attempts[state->winner];
+  res = std::move(winner.res);
+  return winner.ret;
+}
+
+inline bool Client::send_once(const Request &req, Response &res) {
+  if (connection_pool_) {
+    return send_with_connection_pool(*connection_pool_, req, res);
+  }
+
+  auto sock = create_client_socket(req.canceler.get());
   if (sock == INVALID_SOCKET) { return false; }
 
 #ifdef CPPHTTPLIB_OPENSSL_SUPPORT
@@ -3682,7 +8855,8 @@ inline bool Client::send(const Request &req, Response &res) {
 #endif
 
   return process_and_close_socket(
-      sock, 1, [&](Stream &strm, bool last_connection, bool &connection_close) {
+      sock, 1, detail::is_replay_safe(req), req.canceler.get(),
+      [&](Stream &strm, bool last_connection, bool &connection_close) {
         return handle_request(strm, req, res, last_connection,
                               connection_close);
       });
@@ -3703,31 +8877,112 @@ inline bool Client::send(const std::vector<Request> &requests,
     }
 #endif
 
-    if (!process_and_close_socket(sock, requests.size() - i,
-                                  [&](Stream &strm, bool last_connection,
-                                      bool &connection_close) -> bool {
-                                    auto &req = requests[i++];
-                                    auto res = Response();
-                                    auto ret = handle_request(strm, req, res,
-                                                              last_connection,
-                                                              connection_close);
-                                    if (ret) {
-                                      responses.emplace_back(std::move(res));
-                                    }
-                                    return ret;
-                                  })) {
-      return false;
+    auto ret = false;
+    if (pipelining_depth_ > 1) {
+      ret = process_and_close_socket(
+          sock, 1, false, nullptr,
+          [&](Stream &strm, bool /*last_connection*/,
+              bool & /*connection_close*/) {
+            return pipeline_requests(strm, requests, i, responses);
+          });
+    } else {
+      ret = process_and_close_socket(
+          sock, requests.size() - i, false, nullptr,
+          [&](Stream &strm, bool last_connection,
+              bool &connection_close) -> bool {
+            auto &req = requests[i++];
+            auto res = Response();
+            auto ret = handle_request(strm, req, res, last_connection,
+                                      connection_close);
+            if (ret) { responses.emplace_back(std::move(res)); }
+            return ret;
+          });
     }
+
+    if (!ret) { return false; }
   }
 
   return true;
 }
 
+// Writes up to pipelining_depth_ requests ahead and reads the responses in
+// order. A request that isn't safe to repeat, or that has a body, goes out
+// alone once every earlier response has arrived. If the server closes the
+// connection, the requests it left unanswered stay from `i` on and are sent
+// again on a new connection.
+inline bool Client::pipeline_requests(Stream &strm,
+                                      const std::vector<Request> &requests,
+                                      size_t &i,
+                                      std::vector<Response> &responses) {
+  auto budget = (std::min)(keep_alive_max_count_, requests.size() - i);
+  auto next = i;
+  size_t sent = 0;
+
+  for (;;) {
+    // Requests are coalesced into one write.
+    detail::BufferStream bstrm;
+
+    while (next < requests.size() && next - i < pipelining_depth_ &&
+           sent < budget) {
+      const auto &req = requests[next];
+      if (req.path.empty()) { return false; }
+
+      auto pipelinable = detail::is_idempotent_method(req.method) &&
+                         req.body.empty() && !req.content_provider;
+      if (!pipelinable && next > i) { break; }
+
+      auto &out = pipelinable ? static_cast<Stream &>(bstrm) : strm;
+      auto last_connection = sent + 1 == budget;
+      auto ret = false;
+      if (!is_ssl() && !proxy_host_.empty()) {
+        auto req2 = req;
+        req2.path = "http://" + host_and_port_ + req.path;
+        ret = write_request(out, req2, last_connection);
+      } else {
+        ret = write_request(out, req, last_connection);
+      }
+      if (!ret) { return false; }
+
+      next++;
+      sent++;
+      if (!pipelinable) { break; }
+    }
+
+    const auto &buf = bstrm.get_buffer();
+    if (!buf.empty() && strm.write(buf.data(), buf.size()) !=
+                            static_cast<ssize_t>(buf.size())) {
+      return false;
+    }
+
+    if (next == i) { return true; }
+
+    const auto &req = requests[i];
+    Response res;
+    auto connection_close = false;
+    auto ret = false;
+    if (!is_ssl() && !proxy_host_.empty()) {
+      auto req2 = req;
+      req2.path = "http://" + host_and_port_ + req.path;
+      ret = read_response(strm, req2, res, connection_close);
+    } else {
+      ret = read_response(strm, req, res, connection_close);
+    }
+    if (!ret || !handle_response(req, res)) { return false; }
+
+    responses.emplace_back(std::move(res));
+    i++;
+
+    if (connection_close) { return true; }
+  }
+}
+
 inline bool Client::handle_request(Stream &strm, const Request &req,
                                    Response &res, bool last_connection,
                                    bool &connection_close) {
   if (req.path.empty()) { return false; }
 
+  if (req.canceler && !req.canceler->attach(strm.socket())) { return false; }
+
   bool ret;
 
   if (!is_ssl() && !proxy_host_.empty()) {
@@ -3738,8 +8993,16 @@ inline bool Client::handle_request(Stream &strm, const Request &req,
     ret = process_request(strm, req, res, last_connection, connection_close);
   }
 
+  if (req.canceler && req.canceler->detach()) { return false; }
   if (!ret) { return false; }
 
+  return handle_response(req, res);
+}
+
+// Follows redirects and answers digest authentication challenges.
+inline bool Client::handle_response(const Request &req, Response &res) {
+  auto ret = true;
+
   if (300 < res.status && res.status < 400 && follow_location_) {
     ret = redirect(req, res);
   }
@@ -3779,7 +9042,7 @@ inline bool Client::connect(socket_t sock, Response &res, bool &error) {
   Response res2;
 
   if (!detail::process_socket(
-          true, sock, 1, read_timeout_sec_, read_timeout_usec_,
+          true, sock, 1, 0, read_timeout_sec_, read_timeout_usec_,
           [&](Stream &strm, bool /*last_connection*/, bool &connection_close) {
             Request req2;
             req2.method = "CONNECT";
@@ -3798,7 +9061,7 @@ inline bool Client::connect(socket_t sock, Response &res, bool &error) {
       if (parse_www_authenticate(res2, auth, true)) {
         Response res3;
         if (!detail::process_socket(
-                true, sock, 1, read_timeout_sec_, read_timeout_usec_,
+                true, sock, 1, 0, read_timeout_sec_, read_timeout_usec_,
                 [&](Stream &strm, bool /*last_connection*/,
                     bool &connection_close) {
                   Request req3;
@@ -3943,16 +9206,33 @@ inline bool Client::write_request(Stream &strm, const Request &req,
       size_t offset = 0;
       size_t end_offset = req.content_length;
 
+      auto ok = true;
+
       DataSink data_sink;
       data_sink.write = [&](const char *d, size_t l) {
         auto written_length = strm.write(d, l);
-        offset += static_cast<size_t>(written_length);
+        if (written_length < 0) {
+          ok = false;
+        } else {
+          offset += static_cast<size_t>(written_length);
+        }
       };
+      data_sink.done = [&](void) { ok = false; };
       data_sink.is_writable = [&](void) { return strm.is_writable(); };
+      data_sink.write_file = [&](int fd, uint64_t pos, size_t l) {
+        auto written_length = strm.send_file(fd, pos, l);
+        if (written_length > 0) {
+          offset += static_cast<size_t>(written_length);
+        } else if (written_length == 0) {
+          ok = false; // The file is shorter than it was.
+        }
+        return written_length;
+      };
 
-      while (offset < end_offset) {
+      while (ok && offset < end_offset) {
         req.content_provider(offset, end_offset - offset, data_sink);
       }
+      if (!ok) { return false; }
     }
   } else {
     strm.write(req.body);
@@ -4015,6 +9295,11 @@ inline bool Client::process_request(Stream &strm, const Request &req,
   // Send request
   if (!write_request(strm, req, last_connection)) { return false; }
 
+  return read_response(strm, req, res, connection_close);
+}
+
+inline bool Client::read_response(Stream &strm, const Request &req,
+                                  Response &res, bool &connection_close) {
   // Receive response and headers
   if (!read_response_line(strm, res) ||
       !detail::read_headers(strm, res.headers)) {
@@ -4032,8 +9317,35 @@ inline bool Client::process_request(Stream &strm, const Request &req,
 
   // Body
   if (req.method != "HEAD" && req.method != "CONNECT") {
+    // A plain body of known length goes straight where it belongs
+    if (!req.content_receiver && res.has_header("Content-Length") &&
+        !res.has_header("Content-Encoding") &&
+        !detail::is_chunked_transfer_encoding(res.headers)) {
+      auto len =
+          detail::get_header_value_uint64(res.headers, "Content-Length", 0);
+      if (req.body_buffer) {
+        if (len > req.body_buffer_size) { return false; }
+        res.content_length = static_cast<size_t>(len);
+        if (!detail::read_content_into(strm, req.body_buffer,
+                                       res.content_length, req.progress)) {
+          return false;
+        }
+      } else if (len > payload_max_length_ ||
+                 !detail::read_content_into(strm, res.body,
+                                            static_cast<size_t>(len),
+                                            req.progress)) {
+        return false;
+      }
+
+      if (logger_) { logger_(req, res); }
+      return true;
+    }
+
     ContentReceiver out = [&](const char *buf, size_t n) {
-      if (res.body.size() + n > res.body.max_size()) { return false; }
+      if (res.body.size() + n > res.body.max_size() ||
+          n > payload_max_length_ - res.body.size()) {
+        return false;
+      }
       res.body.append(buf, n);
       return true;
     };
@@ -4042,11 +9354,20 @@ inline bool Client::process_request(Stream &strm, const Request &req,
       out = [&](const char *buf, size_t n) {
         return req.content_receiver(buf, n);
       };
+    } else if (req.body_buffer) {
+      res.content_length = 0;
+      out = [&](const char *buf, size_t n) {
+        if (n > req.body_buffer_size - res.content_length) { return false; }
+        memcpy(req.body_buffer + res.content_length, buf, n);
+        res.content_length += n;
+        return true;
+      };
     }
 
     int dummy_status;
     if (!detail::read_content(strm, res, (std::numeric_limits<size_t>::max)(),
-                              dummy_status, req.progress, out)) {
+                              dummy_status, req.progress, out,
+                              receive_buffer_size_)) {
       return false;
     }
   }
@@ -4058,16 +9379,279 @@ inline bool Client::process_request(Stream &strm, const Request &req,
 }
 
 inline bool Client::process_and_close_socket(
-    socket_t sock, size_t request_count,
+    socket_t sock, size_t request_count, bool /*early_data*/,
+    detail::canceler * /*canceler*/,
     std::function<bool(Stream &strm, bool last_connection,
                        bool &connection_close)>
         callback) {
   request_count = (std::min)(request_count, keep_alive_max_count_);
-  return detail::process_and_close_socket(true, sock, request_count,
+  return detail::process_and_close_socket(true, sock, request_count, 0,
                                           read_timeout_sec_, read_timeout_usec_,
                                           callback);
 }
 
+inline bool Client::send_with_connection_pool(ConnectionPool &pool,
+                                              const Request &req,
+                                              Response &res) {
+  auto key = connection_pool_key();
+
+  for (;;) {
+    if (req.canceler && req.canceler->canceled()) { return false; }
+
+    ConnectionPool::Connection conn;
+    if (!pool.checkout(key, conn, timeout_sec_)) { return false; }
+
+    auto reused = conn.sock != INVALID_SOCKET;
+    if (!reused) {
+      conn.sock = create_client_socket(req.canceler.get());
+      if (conn.sock == INVALID_SOCKET) {
+        pool.discard(key, conn);
+        return false;
+      }
+
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+      if (is_ssl() && !proxy_host_.empty()) {
+        bool error;
+        if (!connect(conn.sock, res, error)) {
+          pool.discard(key, conn);
+          return error;
+        }
+      }
+#endif
+    }
+
+    auto reusable = false;
+    auto closed_unanswered = false;
+    auto ret = process_pooled_connection(
+        conn, reusable, !reused && detail::is_replay_safe(req),
+        req.canceler.get(),
+        [&](Stream &strm, bool last_connection, bool &connection_close) {
+          detail::response_watch_stream watch(strm);
+          auto ret = handle_request(watch, req, res, last_connection,
+                                    connection_close);
+          closed_unanswered = !ret && watch.closed_unanswered();
+          return ret;
+        });
+
+    // A canceled request, e.g. a hedge that lost, may not have used the
+    // connection at all.
+    auto canceled = req.canceler && req.canceler->canceled();
+    if (reusable || (canceled && reused && !req.canceler->attached())) {
+      pool.checkin(key, conn);
+    } else {
+      pool.discard(key, conn);
+    }
+
+    // The server may have closed a pooled connection just as it was picked
+    // up. Such a failure, with nothing of the response read, is retried on
+    // another connection when it's safe to send the request twice.
+    if (ret || canceled || !reused || !closed_unanswered ||
+        !detail::is_idempotent_method(req.method)) {
+      return ret;
+    }
+    res = Response();
+  }
+}
+
+inline std::string Client::connection_pool_key() const {
+  auto key = "http://" + host_and_port_;
+  if (!proxy_host_.empty()) {
+    key += " via " + proxy_host_ + ":" + std::to_string(proxy_port_);
+  }
+  if (!interface_.empty()) { key += " on " + interface_; }
+  return key;
+}
+
+inline bool Client::process_pooled_connection(
+    ConnectionPool::Connection &conn, bool &reusable, bool /*early_data*/,
+    detail::canceler * /*canceler*/,
+    std::function<bool(Stream &strm, bool last_connection,
+                       bool &connection_close)>
+        callback) {
+  detail::SocketStream strm(conn.sock, read_timeout_sec_, read_timeout_usec_);
+  auto connection_close = false;
+  auto ret = callback(strm, false, connection_close);
+  reusable = ret && !connection_close;
+  return ret;
+}
+
+#ifndef _WIN32
+inline bool Client::download(const char *path, const Headers &headers,
+                             const char *file_path,
+                             const DownloadOptions &options,
+                             Progress progress) {
+  Request probe;
+  probe.method = "HEAD";
+  probe.path = path;
+  probe.headers = headers;
+
+  Response head;
+  if (!send(probe, head)) { return false; }
+
+  auto length =
+      detail::get_header_value_uint64(head.headers, "Content-Length", 0);
+  auto etag = head.get_header_value("ETag");
+  auto last_modified = head.get_header_value("Last-Modified");
+
+  // Any ETag tells a resumed download whether the object is still the same,
+  // but If-Range only takes a strong one (RFC 7233 3.2).
+  auto validator = etag.empty() ? last_modified : etag;
+  auto if_range = etag.compare(0, 2, "W/") != 0 ? validator : last_modified;
+
+  detail::token_bucket bucket(options.bandwidth_limit);
+
+  auto fetch_whole = [&]() {
+    auto fd = ::open(file_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) { return false; }
+
+    uint64_t offset = 0;
+    Request req;
+    req.method = "GET";
+    req.path = path;
+    req.headers = headers;
+    req.response_handler = [&](const Response &res) {
+      offset = 0;
+      return res.status == 200;
+    };
+    req.content_receiver = [&](const char *data, size_t n) {
+      bucket.take(n);
+      if (!detail::write_at(fd, data, n, offset)) { return false; }
+      offset += n;
+      return true;
+    };
+    req.progress = progress;
+
+    Response res;
+    auto ret = send(req, res) && ftruncate(fd, static_cast<off_t>(offset)) == 0;
+    ::close(fd);
+    return ret;
+  };
+
+  // Without ranges, the object comes down in one piece
+  if (head.status != 200 || length == 0 ||
+      head.get_header_value("Accept-Ranges") != "bytes") {
+    return fetch_whole();
+  }
+
+  const auto range_size = (std::max)(options.range_size, uint64_t(1));
+  const auto range_count = (length + range_size - 1) / range_size;
+  const auto state_path = std::string(file_path) + ".download";
+
+  auto fd = ::open(file_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) { return false; }
+
+  std::vector<char> done(static_cast<size_t>(range_count), 0);
+  struct stat st;
+  auto resumed = options.resume && !validator.empty() && fstat(fd, &st) == 0 &&
+                 static_cast<uint64_t>(st.st_size) == length &&
+                 detail::read_download_state(state_path, length, validator,
+                                             done);
+
+  std::ofstream state;
+  if (resumed) {
+    state.open(state_path, std::ios_base::app);
+  } else {
+    std::fill(done.begin(), done.end(), 0);
+    if (ftruncate(fd, 0) != 0 ||
+        ftruncate(fd, static_cast<off_t>(length)) != 0) {
+      ::close(fd);
+      return false;
+    }
+    state.open(state_path, std::ios_base::trunc);
+    state << length << ' ' << validator << std::endl;
+  }
+
+  std::atomic<uint64_t> received(0);
+  for (size_t i = 0; i < done.size(); i++) {
+    if (done[i]) {
+      received += (std::min)(length, (i + 1) * range_size) - i * range_size;
+    }
+  }
+
+  std::atomic<size_t> next(0);
+  std::atomic<bool> failed(false);
+  std::atomic<bool> whole(false);
+  std::mutex mutex;
+
+  auto pool = connection_pool_;
+  if (!pool) { pool = std::make_shared<ConnectionPool>(0); }
+
+  auto fetch_ranges = [&]() {
+    for (;;) {
+      auto i = next++;
+      if (failed || i >= done.size()) { return; }
+      if (done[i]) { continue; }
+
+      auto first = i * range_size;
+      auto size = (std::min)(length, first + range_size) - first;
+
+      Request req;
+      req.method = "GET";
+      req.path = path;
+      req.headers = headers;
+      req.headers.insert(make_range_header(
+          {{static_cast<ssize_t>(first),
+            static_cast<ssize_t>(first + size - 1)}}));
+      // A changed object, or a server ignoring ranges after all, sends the
+      // whole object, which is then fetched in one piece
+      if (!if_range.empty()) { req.headers.emplace("If-Range", if_range); }
+
+      uint64_t written = 0;
+      req.response_handler = [&](const Response &res) {
+        received -= written;
+        written = 0;
+        if (res.status == 200) { whole = true; }
+        return res.status == 206;
+      };
+      req.content_receiver = [&](const char *data, size_t n) {
+        if (failed || n > size - written) { return false; }
+        bucket.take(n);
+        if (!detail::write_at(fd, data, n, first + written)) { return false; }
+        written += n;
+        auto total = received += n;
+        if (progress) {
+          std::lock_guard<std::mutex> guard(mutex);
+          if (!progress(total, length)) { return false; }
+        }
+        return true;
+      };
+
+      Response res;
+      if (!send_with_connection_pool(*pool, req, res) || written != size) {
+        failed = true;
+        return;
+      }
+
+      std::lock_guard<std::mutex> guard(mutex);
+      state << i << std::endl;
+    }
+  };
+
+  std::vector<std::thread> threads;
+  auto thread_count = (std::min)((std::max)(options.connection_count,
+                                            size_t(1)),
+                                 done.size());
+  for (size_t i = 1; i < thread_count; i++) {
+    threads.emplace_back(fetch_ranges);
+  }
+  fetch_ranges();
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  ::close(fd);
+  state.close();
+
+  if (whole) {
+    std::remove(state_path.c_str());
+    return fetch_whole();
+  }
+  if (failed) { return false; }
+  std::remove(state_path.c_str());
+  return true;
+}
+#endif
+
 inline bool Client::is_ssl() const { return false; }
 
 inline std::shared_ptr<Response> Client::Get(const char *path) {
@@ -4131,16 +9715,31 @@ inline std::shared_ptr<Response> Client::Get(const char *path,
 }
 
 inline std::shared_ptr<Response> Client::Get(const char *path,
-                                             const Headers &headers,
-                                             ResponseHandler response_handler,
-                                             ContentReceiver content_receiver,
-                                             Progress progress) {
+                                             const Headers &headers,
+                                             ResponseHandler response_handler,
+                                             ContentReceiver content_receiver,
+                                             Progress progress) {
+  Request req;
+  req.method = "GET";
+  req.path = path;
+  req.headers = headers;
+  req.response_handler = std::move(response_handler);
+  req.content_receiver = std::move(content_receiver);
+  req.progress = std::move(progress);
+
+  auto res = std::make_shared<Response>();
+  return send(req, *res) ? res : nullptr;
+}
+
+inline std::shared_ptr<Response> Client::Get(const char *path,
+                                             const Headers &headers, char *buf,
+                                             size_t size, Progress progress) {
   Request req;
   req.method = "GET";
   req.path = path;
   req.headers = headers;
-  req.response_handler = std::move(response_handler);
-  req.content_receiver = std::move(content_receiver);
+  req.body_buffer = buf;
+  req.body_buffer_size = size;
   req.progress = std::move(progress);
 
   auto res = std::make_shared<Response>();
@@ -4235,6 +9834,49 @@ Client::Post(const char *path, const Headers &headers,
   return Post(path, headers, body, content_type.c_str());
 }
 
+inline std::shared_ptr<Response>
+Client::Post(const char *path, const Headers &headers,
+             const MultipartFormDataItems &items,
+             const MultipartFormDataFiles &files) {
+  auto boundary = detail::make_multipart_data_boundary();
+  auto body = std::make_shared<detail::multipart_body>();
+
+  auto append_part_header = [&](const std::string &name,
+                                const std::string &filename,
+                                const std::string &content_type) {
+    std::string header = "--" + boundary + "\r\n";
+    header += "Content-Disposition: form-data; name=\"" + name + "\"";
+    if (!filename.empty()) { header += "; filename=\"" + filename + "\""; }
+    header += "\r\n";
+    if (!content_type.empty()) {
+      header += "Content-Type: " + content_type + "\r\n";
+    }
+    header += "\r\n";
+    body->append(header);
+  };
+
+  for (const auto &item : items) {
+    append_part_header(item.name, item.filename, item.content_type);
+    body->append(item.content + "\r\n");
+  }
+
+  for (const auto &file : files) {
+    append_part_header(file.name, file.filename, file.content_type);
+    if (!body->append_file(file.path)) { return nullptr; }
+    body->append("\r\n");
+  }
+
+  body->append("--" + boundary + "--\r\n");
+
+  std::string content_type = "multipart/form-data; boundary=" + boundary;
+  return send_with_content_provider(
+      "POST", path, headers, std::string(), body->size(),
+      [body](size_t offset, size_t length, DataSink &sink) {
+        body->provide(offset, length, sink);
+      },
+      content_type.c_str());
+}
+
 inline std::shared_ptr<Response> Client::Put(const char *path,
                                              const std::string &body,
                                              const char *content_type) {
@@ -4296,134 +9938,914 @@ inline std::shared_ptr<Response> Client::Patch(const char *path,
   return Patch(path, Headers(), content_length, content_provider, content_type);
 }
 
-inline std::shared_ptr<Response>
-Client::Patch(const char *path, const Headers &headers, size_t content_length,
-              ContentProvider content_provider, const char *content_type) {
-  return send_with_content_provider("PATCH", path, headers, std::string(),
-                                    content_length, content_provider,
-                                    content_type);
+inline std::shared_ptr<Response>
+Client::Patch(const char *path, const Headers &headers, size_t content_length,
+              ContentProvider content_provider, const char *content_type) {
+  return send_with_content_provider("PATCH", path, headers, std::string(),
+                                    content_length, content_provider,
+                                    content_type);
+}
+
+inline std::shared_ptr<Response> Client::Delete(const char *path) {
+  return Delete(path, Headers(), std::string(), nullptr);
+}
+
+inline std::shared_ptr<Response> Client::Delete(const char *path,
+                                                const std::string &body,
+                                                const char *content_type) {
+  return Delete(path, Headers(), body, content_type);
+}
+
+inline std::shared_ptr<Response> Client::Delete(const char *path,
+                                                const Headers &headers) {
+  return Delete(path, headers, std::string(), nullptr);
+}
+
+inline std::shared_ptr<Response> Client::Delete(const char *path,
+                                                const Headers &headers,
+                                                const std::string &body,
+                                                const char *content_type) {
+  Request req;
+  req.method = "DELETE";
+  req.headers = headers;
+  req.path = path;
+
+  if (content_type) { req.headers.emplace("Content-Type", content_type); }
+  req.body = body;
+
+  auto res = std::make_shared<Response>();
+
+  return send(req, *res) ? res : nullptr;
+}
+
+inline std::shared_ptr<Response> Client::Options(const char *path) {
+  return Options(path, Headers());
+}
+
+inline std::shared_ptr<Response> Client::Options(const char *path,
+                                                 const Headers &headers) {
+  Request req;
+  req.method = "OPTIONS";
+  req.path = path;
+  req.headers = headers;
+
+  auto res = std::make_shared<Response>();
+
+  return send(req, *res) ? res : nullptr;
+}
+
+inline void Client::set_timeout_sec(time_t timeout_sec) {
+  timeout_sec_ = timeout_sec;
+}
+
+inline void Client::set_read_timeout(time_t sec, time_t usec) {
+  read_timeout_sec_ = sec;
+  read_timeout_usec_ = usec;
+}
+
+inline void Client::set_keep_alive_max_count(size_t count) {
+  keep_alive_max_count_ = count;
+}
+
+inline void Client::set_pipelining_depth(size_t depth) {
+  pipelining_depth_ = depth;
+}
+
+inline void Client::set_socket_options(const SocketOptions &options) {
+  socket_options_ = options;
+}
+
+inline void
+Client::set_connection_pool(std::shared_ptr<ConnectionPool> pool) {
+  connection_pool_ = std::move(pool);
+}
+
+inline void Client::set_dns_cache(std::shared_ptr<DnsCache> cache) {
+  dns_cache_ = std::move(cache);
+}
+
+inline void
+Client::set_hedging_policy(std::shared_ptr<HedgingPolicy> policy) {
+  hedging_policy_ = std::move(policy);
+}
+
+inline void
+Client::set_response_cache(std::shared_ptr<ResponseCache> cache) {
+  response_cache_ = std::move(cache);
+}
+
+inline void Client::set_receive_buffer_size(size_t size) {
+  receive_buffer_size_ = size;
+}
+
+inline void Client::set_payload_max_length(size_t length) {
+  payload_max_length_ = length;
+}
+
+inline void Client::set_basic_auth(const char *username, const char *password) {
+  basic_auth_username_ = username;
+  basic_auth_password_ = password;
+}
+
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+inline void Client::set_digest_auth(const char *username,
+                                    const char *password) {
+  digest_auth_username_ = username;
+  digest_auth_password_ = password;
+}
+#endif
+
+inline void Client::set_follow_location(bool on) { follow_location_ = on; }
+
+inline void Client::set_compress(bool on) { compress_ = on; }
+
+inline void Client::set_interface(const char *intf) { interface_ = intf; }
+
+inline void Client::set_proxy(const char *host, int port) {
+  proxy_host_ = host;
+  proxy_port_ = port;
+}
+
+inline void Client::set_proxy_basic_auth(const char *username,
+                                         const char *password) {
+  proxy_basic_auth_username_ = username;
+  proxy_basic_auth_password_ = password;
+}
+
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+inline void Client::set_proxy_digest_auth(const char *username,
+                                          const char *password) {
+  proxy_digest_auth_username_ = username;
+  proxy_digest_auth_password_ = password;
+}
+#endif
+
+inline void Client::set_logger(Logger logger) { logger_ = std::move(logger); }
+
+#ifndef _WIN32
+namespace detail {
+
+// Event poller implementation
+#ifdef __linux__
+inline event_poller::event_poller() : epfd_(epoll_create1(EPOLL_CLOEXEC)) {}
+
+inline event_poller::~event_poller() {
+  if (epfd_ != -1) { close(epfd_); }
+}
+
+inline bool event_poller::is_valid() const { return epfd_ != -1; }
+
+inline void event_poller::set(socket_t sock, int events) {
+  epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  if (events & Read) { ev.events |= EPOLLIN | EPOLLRDHUP; }
+  if (events & Write) { ev.events |= EPOLLOUT; }
+  ev.data.fd = sock;
+
+  auto it = events_.find(sock);
+  if (it == events_.end()) {
+    epoll_ctl(epfd_, EPOLL_CTL_ADD, sock, &ev);
+    events_[sock] = events;
+  } else if (it->second != events) {
+    epoll_ctl(epfd_, EPOLL_CTL_MOD, sock, &ev);
+    it->second = events;
+  }
+}
+
+inline void event_poller::remove(socket_t sock) {
+  if (events_.erase(sock)) { epoll_ctl(epfd_, EPOLL_CTL_DEL, sock, nullptr); }
+}
+
+inline int event_poller::wait(int timeout_msec,
+                              std::vector<std::pair<socket_t, int>> &ready) {
+  std::array<epoll_event, 64> evs;
+  auto n = epoll_wait(epfd_, evs.data(), static_cast<int>(evs.size()),
+                      timeout_msec);
+  if (n < 0) { return errno == EINTR ? 0 : -1; }
+
+  for (auto i = 0; i < n; i++) {
+    auto events = 0;
+    if (evs[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+      events |= Read;
+    }
+    if (evs[i].events & EPOLLOUT) { events |= Write; }
+    ready.emplace_back(static_cast<socket_t>(evs[i].data.fd), events);
+  }
+  return n;
+}
+#else
+inline event_poller::event_poller() {}
+
+inline event_poller::~event_poller() {}
+
+inline bool event_poller::is_valid() const { return true; }
+
+inline void event_poller::set(socket_t sock, int events) {
+  short pev = 0;
+  if (events & Read) { pev |= POLLIN; }
+  if (events & Write) { pev |= POLLOUT; }
+
+  for (auto &pfd : fds_) {
+    if (pfd.fd == sock) {
+      pfd.events = pev;
+      return;
+    }
+  }
+
+  struct pollfd pfd;
+  pfd.fd = sock;
+  pfd.events = pev;
+  pfd.revents = 0;
+  fds_.push_back(pfd);
+}
+
+inline void event_poller::remove(socket_t sock) {
+  for (auto it = fds_.begin(); it != fds_.end(); ++it) {
+    if (it->fd == sock) {
+      fds_.erase(it);
+      return;
+    }
+  }
+}
+
+inline int event_poller::wait(int timeout_msec,
+                              std::vector<std::pair<socket_t, int>> &ready) {
+  auto n = poll(fds_.data(), static_cast<nfds_t>(fds_.size()), timeout_msec);
+  if (n < 0) { return errno == EINTR ? 0 : -1; }
+
+  for (const auto &pfd : fds_) {
+    auto events = 0;
+    if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) { events |= Read; }
+    if (pfd.revents & POLLOUT) { events |= Write; }
+    if (events) { ready.emplace_back(pfd.fd, events); }
+  }
+  return n;
+}
+#endif
+
+// Response framer implementation
+inline response_framer::response_framer(bool head_request,
+                                        size_t payload_max_length)
+    : head_request_(head_request), payload_max_length_(payload_max_length) {}
+
+inline bool response_framer::is_complete(const std::string &data, bool eof) {
+  if (error_) { return false; }
+
+  if (framing_ == Framing::Header) {
+    auto end = data.find("\r\n\r\n", pos_ > 3 ? pos_ - 3 : 0);
+    if (end == std::string::npos) {
+      pos_ = data.size();
+      error_ = eof || data.size() > CPPHTTPLIB_ASYNC_CLIENT_HEADER_MAX_LENGTH;
+      return false;
+    }
+
+    body_begin_ = end + 4;
+    pos_ = body_begin_;
+    if (!parse_header(data)) {
+      error_ = true;
+      return false;
+    }
+  }
+
+  switch (framing_) {
+  case Framing::None: size_ = body_begin_; return true;
+  case Framing::Length:
+    if (data.size() - body_begin_ >= length_) {
+      size_ = body_begin_ + static_cast<size_t>(length_);
+      return true;
+    }
+    break;
+  case Framing::Chunked:
+    if (scan_chunks(data)) { return true; }
+    break;
+  case Framing::Close:
+    if (eof) {
+      size_ = data.size();
+      return true;
+    }
+    break;
+  case Framing::Header: break;
+  }
+
+  error_ = eof || data.size() > max_size();
+  return false;
+}
+
+inline bool response_framer::has_error() const { return error_; }
+
+inline size_t response_framer::size() const { return size_; }
+
+inline size_t response_framer::max_size() const {
+  auto header = framing_ == Framing::Header
+                    ? CPPHTTPLIB_ASYNC_CLIENT_HEADER_MAX_LENGTH
+                    : body_begin_;
+  auto limit = (std::numeric_limits<size_t>::max)();
+  return payload_max_length_ < limit - header ? header + payload_max_length_
+                                              : limit;
+}
+
+inline bool response_framer::parse_header(const std::string &data) {
+  BufferStream strm;
+  strm.write(data.data(), body_begin_);
+
+  // Status line
+  std::array<char, 2048> buf;
+  stream_line_reader line_reader(strm, buf.data(), buf.size());
+  if (!line_reader.getline()) { return false; }
+
+  auto sp = strchr(line_reader.ptr(), ' ');
+  if (!sp) { return false; }
+  auto status = atoi(sp + 1);
+
+  Headers headers;
+  if (!read_headers(strm, headers)) { return false; }
+
+  if (head_request_ || (status >= 100 && status < 200) || status == 204 ||
+      status == 304) {
+    framing_ = Framing::None;
+  } else if (is_chunked_transfer_encoding(headers)) {
+    framing_ = Framing::Chunked;
+  } else if (has_header(headers, "Content-Length")) {
+    framing_ = Framing::Length;
+    length_ = get_header_value_uint64(headers, "Content-Length", 0);
+    if (length_ > payload_max_length_) { return false; }
+  } else {
+    framing_ = Framing::Close;
+  }
+  return true;
+}
+
+inline bool response_framer::scan_chunks(const std::string &data) {
+  for (;;) {
+    auto eol = data.find("\r\n", pos_);
+    if (eol == std::string::npos) { return false; }
+
+    if (in_trailer_) {
+      // A blank line ends the trailer.
+      auto blank = eol == pos_;
+      pos_ = eol + 2;
+      if (blank) {
+        size_ = pos_;
+        return true;
+      }
+      continue;
+    }
+
+    if (!isxdigit(static_cast<unsigned char>(data[pos_]))) {
+      error_ = true;
+      return false;
+    }
+
+    auto len = std::strtoull(data.c_str() + pos_, nullptr, 16);
+    if (len == 0) {
+      in_trailer_ = true;
+      pos_ = eol + 2;
+      continue;
+    }
+
+    auto next = eol + 2 + len + 2;
+    if (data.size() < next) { return false; }
+    pos_ = static_cast<size_t>(next);
+  }
+}
+
+} // namespace detail
+
+// Async client implementation
+inline AsyncClient::AsyncClient(const std::string &host, int port)
+    : Client(host, port),
+      max_connections_(CPPHTTPLIB_ASYNC_CLIENT_MAX_CONNECTIONS),
+      pending_count_(0), own_dns_cache_(std::make_shared<DnsCache>()) {
+  if (!poller_.is_valid() || pipe(wake_fds_) == -1) { return; }
+
+  for (auto fd : wake_fds_) {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    detail::set_nonblocking(fd, true);
+  }
+  poller_.set(wake_fds_[0], detail::event_poller::Read);
+
+  thread_ = std::thread([this]() { run(); });
+}
+
+inline AsyncClient::~AsyncClient() {
+  stop();
+  for (auto fd : wake_fds_) {
+    if (fd != -1) { close(fd); }
+  }
+}
+
+inline bool AsyncClient::is_valid() const {
+  return Client::is_valid() && thread_.joinable();
+}
+
+inline void AsyncClient::send_async(const Request &req,
+                                    ResponseCallback callback) {
+  std::unique_ptr<Task> task(new Task{req, std::move(callback)});
+  if (!proxy_host_.empty()) {
+    task->req.path = "http://" + host_and_port_ + task->req.path;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (!stopping_ && thread_.joinable()) {
+      pending_count_++;
+      queue_.push_back(std::move(task));
+    }
+  }
+
+  if (task) {
+    task->callback(nullptr);
+    return;
+  }
+  wake();
+}
+
+inline std::future<std::shared_ptr<Response>>
+AsyncClient::send_async(const Request &req) {
+  auto promise = std::make_shared<std::promise<std::shared_ptr<Response>>>();
+  auto future = promise->get_future();
+  send_async(req, [promise](std::shared_ptr<Response> res) {
+    promise->set_value(std::move(res));
+  });
+  return future;
 }
 
-inline std::shared_ptr<Response> Client::Delete(const char *path) {
-  return Delete(path, Headers(), std::string(), nullptr);
+inline void AsyncClient::set_max_connections(size_t count) {
+  max_connections_ = (std::max)(count, size_t(1));
+  wake();
 }
 
-inline std::shared_ptr<Response> Client::Delete(const char *path,
-                                                const std::string &body,
-                                                const char *content_type) {
-  return Delete(path, Headers(), body, content_type);
+inline size_t AsyncClient::pending_count() const { return pending_count_; }
+
+inline void AsyncClient::stop() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stopping_ = true;
+  }
+  wake();
+
+  // A callback may call this on the loop thread, which then just winds down.
+  if (thread_.joinable() && thread_.get_id() != std::this_thread::get_id()) {
+    thread_.join();
+  }
 }
 
-inline std::shared_ptr<Response> Client::Delete(const char *path,
-                                                const Headers &headers) {
-  return Delete(path, headers, std::string(), nullptr);
+inline void AsyncClient::wake() {
+  if (wake_fds_[1] == -1) { return; }
+  char c = 0;
+  auto ret = ::write(wake_fds_[1], &c, 1);
+  (void)ret;
 }
 
-inline std::shared_ptr<Response> Client::Delete(const char *path,
-                                                const Headers &headers,
-                                                const std::string &body,
-                                                const char *content_type) {
-  Request req;
-  req.method = "DELETE";
-  req.headers = headers;
-  req.path = path;
+inline void AsyncClient::run() {
+  // Requests taken from the queue, waiting for a connection.
+  std::deque<std::unique_ptr<Task>> tasks;
+  std::vector<std::pair<socket_t, int>> ready;
 
-  if (content_type) { req.headers.emplace("Content-Type", content_type); }
-  req.body = body;
+  for (;;) {
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      if (stopping_) { break; }
+      while (!queue_.empty()) {
+        tasks.push_back(std::move(queue_.front()));
+        queue_.pop_front();
+      }
+    }
 
-  auto res = std::make_shared<Response>();
+    dispatch(tasks);
 
-  return send(req, *res) ? res : nullptr;
+    // Deadlines are checked at a tenth of a second granularity.
+    ready.clear();
+    auto timeout = connections_.empty() ? -1 : 100;
+    if (poller_.wait(timeout, ready) < 0) { break; }
+
+    for (const auto &ev : ready) {
+      if (ev.first == wake_fds_[0]) {
+        char buf[64];
+        while (::read(wake_fds_[0], buf, sizeof(buf)) > 0) {}
+        continue;
+      }
+
+      for (auto &conn : connections_) {
+        if (conn->sock == ev.first) {
+          handle_event(*conn, tasks);
+          break;
+        }
+      }
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    for (auto &conn : connections_) {
+      if (conn->sock != INVALID_SOCKET && now >= conn->deadline) {
+        fail_task(*conn, tasks);
+      }
+    }
+
+    connections_.erase(
+        std::remove_if(connections_.begin(), connections_.end(),
+                       [](const std::unique_ptr<Connection> &conn) {
+                         return conn->sock == INVALID_SOCKET;
+                       }),
+        connections_.end());
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stopping_ = true;
+    while (!queue_.empty()) {
+      tasks.push_back(std::move(queue_.front()));
+      queue_.pop_front();
+    }
+  }
+
+  for (auto &conn : connections_) {
+    close_connection(*conn);
+    if (conn->task) { tasks.push_back(std::move(conn->task)); }
+  }
+  connections_.clear();
+
+  for (auto &task : tasks) {
+    pending_count_--;
+    task->callback(nullptr);
+  }
+
+  // It wakes the loop when done, through a pipe that must stay open till then.
+  if (resolver_.joinable()) { resolver_.join(); }
 }
 
-inline std::shared_ptr<Response> Client::Options(const char *path) {
-  return Options(path, Headers());
+// Hands waiting requests to idle connections, opening new ones up to the
+// limit.
+inline void
+AsyncClient::dispatch(std::deque<std::unique_ptr<Task>> &tasks) {
+  while (!tasks.empty()) {
+    Connection *conn = nullptr;
+    size_t open_count = 0;
+    for (auto &c : connections_) {
+      if (c->sock == INVALID_SOCKET) { continue; }
+      open_count++;
+      if (!conn && c->state == ConnectionState::Idle) { conn = c.get(); }
+    }
+
+    if (!conn) {
+      if (open_count >= max_connections_) { return; }
+
+      DnsCache::Addresses addrs;
+      auto found = lookup_address(addrs);
+      if (found == DnsCache::Lookup::Missing) { return; }
+
+      std::unique_ptr<Connection> c(new Connection);
+      if (found == DnsCache::Lookup::Failed || !open_connection(*c, addrs)) {
+        auto task = std::move(tasks.front());
+        tasks.pop_front();
+        pending_count_--;
+        task->callback(nullptr);
+        continue;
+      }
+      conn = c.get();
+      connections_.push_back(std::move(c));
+    }
+
+    auto task = std::move(tasks.front());
+    tasks.pop_front();
+    start_task(*conn, std::move(task));
+  }
 }
 
-inline std::shared_ptr<Response> Client::Options(const char *path,
-                                                 const Headers &headers) {
-  Request req;
-  req.method = "OPTIONS";
-  req.path = path;
-  req.headers = headers;
+// A name that isn't cached is resolved on a thread of its own, which hands
+// the result back and wakes the loop, so a slow resolver doesn't hold up
+// requests already in flight. Missing means dispatching has to wait.
+inline DnsCache::Lookup
+AsyncClient::lookup_address(DnsCache::Addresses &addrs) {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (resolving_) { return DnsCache::Lookup::Missing; }
+    if (resolved_) {
+      resolved_ = false;
+      addrs = std::move(resolved_addrs_);
+      resolved_addrs_.clear();
+      return resolved_ok_ ? DnsCache::Lookup::Found : DnsCache::Lookup::Failed;
+    }
+  }
 
-  auto res = std::make_shared<Response>();
+  auto host = proxy_host_.empty() ? host_ : proxy_host_;
+  auto port = proxy_host_.empty() ? port_ : proxy_port_;
+  auto cache = dns_cache_ ? dns_cache_ : own_dns_cache_;
 
-  return send(req, *res) ? res : nullptr;
+  auto found = cache->lookup(host, port, addrs);
+  if (found != DnsCache::Lookup::Missing) { return found; }
+
+  if (resolver_.joinable()) { resolver_.join(); }
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    resolving_ = true;
+  }
+  resolver_ = std::thread([this, cache, host, port]() {
+    DnsCache::Addresses resolved;
+    auto ok = cache->resolve(host, port, resolved);
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      resolving_ = false;
+      resolved_ = true;
+      resolved_ok_ = ok;
+      resolved_addrs_ = std::move(resolved);
+    }
+    wake();
+  });
+  return DnsCache::Lookup::Missing;
 }
 
-inline void Client::set_timeout_sec(time_t timeout_sec) {
-  timeout_sec_ = timeout_sec;
+inline bool AsyncClient::open_connection(Connection &conn,
+                                         DnsCache::Addresses &addrs) {
+  conn.sock = detail::create_socket(
+      addrs, [&](socket_t sock, struct addrinfo &ai) -> bool {
+        if (!detail::prepare_client_socket(sock, interface_,
+                                           socket_options_)) {
+          return false;
+        }
+
+        detail::set_nonblocking(sock, true);
+
+        auto ret =
+            ::connect(sock, ai.ai_addr, static_cast<socklen_t>(ai.ai_addrlen));
+        if (ret < 0 && detail::is_connection_error()) {
+          detail::close_socket(sock);
+          return false;
+        }
+        return true;
+      });
+  if (conn.sock == INVALID_SOCKET) { return false; }
+
+  conn.state = ConnectionState::Connecting;
+  conn.deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(timeout_sec_);
+  poller_.set(conn.sock, detail::event_poller::Write);
+  return true;
 }
 
-inline void Client::set_read_timeout(time_t sec, time_t usec) {
-  read_timeout_sec_ = sec;
-  read_timeout_usec_ = usec;
+inline void AsyncClient::start_task(Connection &conn,
+                                    std::unique_ptr<Task> task) {
+  detail::BufferStream bstrm;
+  if (!write_request(bstrm, task->req, false)) {
+    pending_count_--;
+    task->callback(nullptr);
+    return;
+  }
+
+  conn.task = std::move(task);
+  conn.out = bstrm.get_buffer();
+  conn.out_off = 0;
+  conn.in.clear();
+  conn.framer = detail::response_framer(conn.task->req.method == "HEAD",
+                                        payload_max_length_);
+
+  if (conn.state == ConnectionState::Idle) {
+    conn.state = ConnectionState::Writing;
+    conn.reused = true;
+    // Most requests fit in the socket buffer and go out right away.
+    if (!handle_write(conn)) {
+      std::deque<std::unique_ptr<Task>> retry;
+      fail_task(conn, retry);
+      if (!retry.empty()) { dispatch(retry); }
+    }
+  }
 }
 
-inline void Client::set_keep_alive_max_count(size_t count) {
-  keep_alive_max_count_ = count;
+inline void
+AsyncClient::handle_event(Connection &conn,
+                          std::deque<std::unique_ptr<Task>> &tasks) {
+  switch (conn.state) {
+  case ConnectionState::Connecting: {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(conn.sock, SOL_SOCKET, SO_ERROR,
+                   reinterpret_cast<char *>(&error), &len) < 0 ||
+        error) {
+      fail_task(conn, tasks);
+      return;
+    }
+    conn.state = ConnectionState::Writing;
+    if (!handle_write(conn)) { fail_task(conn, tasks); }
+    break;
+  }
+  case ConnectionState::Writing:
+    if (!handle_write(conn)) { fail_task(conn, tasks); }
+    break;
+  case ConnectionState::Reading: {
+    auto eof = false;
+    if (!handle_read(conn, eof)) {
+      fail_task(conn, tasks);
+    } else if (conn.framer.is_complete(conn.in, eof)) {
+      complete_task(conn, eof);
+    } else if (eof || conn.framer.has_error()) {
+      fail_task(conn, tasks);
+    }
+    break;
+  }
+  case ConnectionState::Idle:
+    // The server closed it, or sent something unasked for.
+    close_connection(conn);
+    break;
+  }
 }
 
-inline void Client::set_basic_auth(const char *username, const char *password) {
-  basic_auth_username_ = username;
-  basic_auth_password_ = password;
+inline bool AsyncClient::handle_write(Connection &conn) {
+#ifdef MSG_NOSIGNAL
+  const auto flags = MSG_NOSIGNAL;
+#else
+  const auto flags = 0;
+#endif
+
+  while (conn.out_off < conn.out.size()) {
+    auto n = ::send(conn.sock, conn.out.data() + conn.out_off,
+                    conn.out.size() - conn.out_off, flags);
+    if (n < 0) {
+      if (errno == EINTR) { continue; }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+      return false;
+    }
+    conn.out_off += static_cast<size_t>(n);
+  }
+
+  conn.deadline = std::chrono::steady_clock::now() +
+                  std::chrono::seconds(read_timeout_sec_) +
+                  std::chrono::microseconds(read_timeout_usec_);
+
+  if (conn.out_off < conn.out.size()) {
+    poller_.set(conn.sock, detail::event_poller::Write);
+  } else {
+    std::string().swap(conn.out);
+    conn.state = ConnectionState::Reading;
+    poller_.set(conn.sock, detail::event_poller::Read);
+  }
+  return true;
 }
 
-#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
-inline void Client::set_digest_auth(const char *username,
-                                    const char *password) {
-  digest_auth_username_ = username;
-  digest_auth_password_ = password;
+inline bool AsyncClient::handle_read(Connection &conn, bool &eof) {
+  std::array<char, CPPHTTPLIB_RECV_BUFSIZ> buf;
+  for (;;) {
+    auto n = recv(conn.sock, buf.data(), buf.size(), 0);
+    if (n > 0) {
+      conn.in.append(buf.data(), static_cast<size_t>(n));
+      if (conn.in.size() > conn.framer.max_size()) { return false; }
+      continue;
+    }
+    if (n == 0) {
+      eof = true;
+      break;
+    }
+    if (errno == EINTR) { continue; }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+    return false;
+  }
+
+  conn.deadline = std::chrono::steady_clock::now() +
+                  std::chrono::seconds(read_timeout_sec_) +
+                  std::chrono::microseconds(read_timeout_usec_);
+  return true;
 }
-#endif
 
-inline void Client::set_follow_location(bool on) { follow_location_ = on; }
+// Runs the regular response parser over the complete message.
+inline void AsyncClient::complete_task(Connection &conn, bool eof) {
+  auto task = std::move(conn.task);
 
-inline void Client::set_compress(bool on) { compress_ = on; }
+  // Anything after the response, which nothing asked for, closes the
+  // connection, so the received bytes can be handed over as they are.
+  auto keep_alive = !eof && conn.in.size() == conn.framer.size();
+  conn.in.resize(conn.framer.size());
+  detail::BufferStream strm(std::move(conn.in));
+  conn.in.clear();
 
-inline void Client::set_interface(const char *intf) { interface_ = intf; }
+  auto res = std::make_shared<Response>();
+  auto connection_close = false;
+  auto ret = read_response(strm, task->req, *res, connection_close);
+
+  if (ret && keep_alive && !connection_close) {
+    conn.state = ConnectionState::Idle;
+    conn.deadline = std::chrono::steady_clock::now() +
+                    std::chrono::seconds(
+                        CPPHTTPLIB_CONNECTION_POOL_IDLE_TIMEOUT_SECOND);
+  } else {
+    close_connection(conn);
+  }
 
-inline void Client::set_proxy(const char *host, int port) {
-  proxy_host_ = host;
-  proxy_port_ = port;
+  pending_count_--;
+  task->callback(ret ? res : nullptr);
 }
 
-inline void Client::set_proxy_basic_auth(const char *username,
-                                         const char *password) {
-  proxy_basic_auth_username_ = username;
-  proxy_basic_auth_password_ = password;
+// A request that failed on a reused connection before any response arrived
+// is put back to be sent again, when that is safe.
+inline void AsyncClient::fail_task(Connection &conn,
+                                   std::deque<std::unique_ptr<Task>> &tasks) {
+  auto task = std::move(conn.task);
+  auto retry = task && conn.reused && conn.in.empty() &&
+               detail::is_idempotent_method(task->req.method);
+  close_connection(conn);
+
+  if (!task) { return; }
+  if (retry) {
+    tasks.push_front(std::move(task));
+    return;
+  }
+
+  pending_count_--;
+  task->callback(nullptr);
 }
 
-#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
-inline void Client::set_proxy_digest_auth(const char *username,
-                                          const char *password) {
-  proxy_digest_auth_username_ = username;
-  proxy_digest_auth_password_ = password;
+inline void AsyncClient::close_connection(Connection &conn) {
+  if (conn.sock == INVALID_SOCKET) { return; }
+  poller_.remove(conn.sock);
+  detail::close_socket(conn.sock);
+  conn.sock = INVALID_SOCKET;
 }
 #endif
 
-inline void Client::set_logger(Logger logger) { logger_ = std::move(logger); }
-
 /*
  * SSL Implementation
  */
 #ifdef CPPHTTPLIB_OPENSSL_SUPPORT
 namespace detail {
 
+// OpenSSL before 1.1 can't create and free SSL objects of one context on
+// several threads at once.
+inline SSL *ssl_new(SSL_CTX *ctx, std::mutex &ctx_mutex) {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  std::lock_guard<std::mutex> guard(ctx_mutex);
+#else
+  (void)ctx_mutex;
+#endif
+  return SSL_new(ctx);
+}
+
+inline void ssl_free(SSL *ssl, std::mutex &ctx_mutex) {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  std::lock_guard<std::mutex> guard(ctx_mutex);
+#else
+  (void)ctx_mutex;
+#endif
+  SSL_free(ssl);
+}
+
+// Runs the requests of a connection whose handshake is done, then shuts it
+// down and closes the socket.
+template <typename T>
+inline bool process_ssl_connection(bool is_client_request, socket_t sock,
+                                   SSL *ssl, ssl_stream_state &state,
+                                   size_t keep_alive_max_count,
+                                   time_t keep_alive_timeout_sec,
+                                   time_t read_timeout_sec,
+                                   time_t read_timeout_usec,
+                                   std::mutex &ctx_mutex, T callback) {
+  auto ret = false;
+  auto linger = false;
+
+  if (keep_alive_max_count > 1) {
+    auto count = keep_alive_max_count;
+    while (count > 0 &&
+           (is_client_request || state.read_off < state.read_len ||
+            SSL_pending(ssl) > 0 ||
+            detail::wait_keep_alive(sock, keep_alive_timeout_sec))) {
+      SSLSocketStream strm(sock, ssl, read_timeout_sec, read_timeout_usec,
+                           &state);
+      auto last_connection = count == 1;
+      auto connection_close = false;
+
+      ret = callback(ssl, strm, last_connection, connection_close);
+      if (!ret || connection_close) { break; }
+
+      linger = last_connection;
+      count--;
+    }
+  } else {
+    SSLSocketStream strm(sock, ssl, read_timeout_sec, read_timeout_usec,
+                         &state);
+    auto connection_close = false;
+    ret = callback(ssl, strm, true, connection_close);
+    linger = ret && !connection_close;
+  }
+
+  SSL_shutdown(ssl);
+  ssl_free(ssl, ctx_mutex);
+
+  if (linger && !is_client_request) {
+    close_socket_gracefully(sock);
+  } else {
+    close_socket(sock);
+  }
+
+  return ret;
+}
+
 template <typename U, typename V, typename T>
 inline bool process_and_close_socket_ssl(
     bool is_client_request, socket_t sock, size_t keep_alive_max_count,
-    time_t read_timeout_sec, time_t read_timeout_usec, SSL_CTX *ctx,
+    time_t keep_alive_timeout_sec, time_t read_timeout_sec,
+    time_t read_timeout_usec, SSL_CTX *ctx,
     std::mutex &ctx_mutex, U SSL_connect_or_accept, V setup, T callback) {
+  // SSL_connect_or_accept is given the state of the connection. The server
+  // puts TLS 1.3 early data in its read buffer.
   assert(keep_alive_max_count > 0);
 
-  SSL *ssl = nullptr;
-  {
-    std::lock_guard<std::mutex> guard(ctx_mutex);
-    ssl = SSL_new(ctx);
-  }
-
+  auto ssl = ssl_new(ctx, ctx_mutex);
   if (!ssl) {
     close_socket(sock);
     return false;
@@ -4434,49 +10856,27 @@ inline bool process_and_close_socket_ssl(
 
   if (!setup(ssl)) {
     SSL_shutdown(ssl);
-    {
-      std::lock_guard<std::mutex> guard(ctx_mutex);
-      SSL_free(ssl);
-    }
+    ssl_free(ssl, ctx_mutex);
 
     close_socket(sock);
     return false;
   }
 
-  auto ret = false;
-
-  if (SSL_connect_or_accept(ssl) == 1) {
-    if (keep_alive_max_count > 1) {
-      auto count = keep_alive_max_count;
-      while (count > 0 &&
-             (is_client_request ||
-              detail::select_read(sock, CPPHTTPLIB_KEEPALIVE_TIMEOUT_SECOND,
-                                  CPPHTTPLIB_KEEPALIVE_TIMEOUT_USECOND) > 0)) {
-        SSLSocketStream strm(sock, ssl, read_timeout_sec, read_timeout_usec);
-        auto last_connection = count == 1;
-        auto connection_close = false;
-
-        ret = callback(ssl, strm, last_connection, connection_close);
-        if (!ret || connection_close) { break; }
-
-        count--;
-      }
-    } else {
-      SSLSocketStream strm(sock, ssl, read_timeout_sec, read_timeout_usec);
-      auto dummy_connection_close = false;
-      ret = callback(ssl, strm, true, dummy_connection_close);
-    }
-  }
+  ssl_stream_state state;
+  if (!SSL_connect_or_accept(ssl, state)) {
+    SSL_shutdown(ssl);
+    ssl_free(ssl, ctx_mutex);
 
-  SSL_shutdown(ssl);
-  {
-    std::lock_guard<std::mutex> guard(ctx_mutex);
-    SSL_free(ssl);
+    close_socket(sock);
+    return false;
   }
+  state.read_len = state.read_buf.size();
+  state.early_data_len = is_client_request ? 0 : state.read_len;
 
-  close_socket(sock);
-
-  return ret;
+  return process_ssl_connection(is_client_request, sock, ssl, state,
+                                keep_alive_max_count, keep_alive_timeout_sec,
+                                read_timeout_sec, read_timeout_usec, ctx_mutex,
+                                callback);
 }
 
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
@@ -4533,37 +10933,144 @@ private:
 // SSL socket stream implementation
 inline SSLSocketStream::SSLSocketStream(socket_t sock, SSL *ssl,
                                         time_t read_timeout_sec,
-                                        time_t read_timeout_usec)
+                                        time_t read_timeout_usec,
+                                        ssl_stream_state *state)
     : sock_(sock), ssl_(ssl), read_timeout_sec_(read_timeout_sec),
-      read_timeout_usec_(read_timeout_usec) {}
+      read_timeout_usec_(read_timeout_usec),
+      state_(state ? *state : own_state_) {}
 
-inline SSLSocketStream::~SSLSocketStream() {}
+inline SSLSocketStream::~SSLSocketStream() { flush(); }
 
 inline bool SSLSocketStream::is_readable() const {
-  return detail::select_read(sock_, read_timeout_sec_, read_timeout_usec_) > 0;
+  return state_.read_off < state_.read_len || SSL_pending(ssl_) > 0 ||
+         detail::select_read(sock_, read_timeout_sec_, read_timeout_usec_) > 0;
+}
+
+inline bool SSLSocketStream::is_writable() const {
+  return detail::select_write(sock_, read_timeout_sec_, read_timeout_usec_) > 0;
+}
+
+inline ssize_t SSLSocketStream::read(char *ptr, size_t size) {
+  if (!flush()) { return -1; }
+  if (!SSL_is_init_finished(ssl_) && !finish_handshake()) { return -1; }
+
+  if (state_.read_off == state_.read_len) {
+    if (SSL_pending(ssl_) <= 0 &&
+        select_read(sock_, read_timeout_sec_, read_timeout_usec_) <= 0) {
+      return -1;
+    }
+
+    // A read as large as a record needs no copy through the buffer.
+    if (size >= CPPHTTPLIB_SSL_BUFSIZ) {
+      return SSL_read(ssl_, ptr, static_cast<int>(size));
+    }
+
+    auto &buf = state_.read_buf;
+    if (buf.size() < CPPHTTPLIB_SSL_BUFSIZ) {
+      buf.resize(CPPHTTPLIB_SSL_BUFSIZ);
+    }
+    auto n = SSL_read(ssl_, &buf[0], static_cast<int>(buf.size()));
+    if (n <= 0) { return n; }
+    state_.read_off = 0;
+    state_.read_len = static_cast<size_t>(n);
+    state_.early_data_len = 0;
+  }
+
+  auto n = (std::min)(size, state_.read_len - state_.read_off);
+  memcpy(ptr, state_.read_buf.data() + state_.read_off, n);
+  state_.read_off += n;
+  return static_cast<ssize_t>(n);
+}
+
+inline ssize_t SSLSocketStream::write(const char *ptr, size_t size) {
+  if (write_buf_.size() + size > CPPHTTPLIB_SSL_BUFSIZ) {
+    if (!flush()) { return -1; }
+    if (size >= CPPHTTPLIB_SSL_BUFSIZ) { return write_through(ptr, size); }
+  }
+  write_buf_.append(ptr, size);
+  return static_cast<ssize_t>(size);
+}
+
+inline bool SSLSocketStream::flush() {
+  if (write_buf_.empty()) { return true; }
+  auto n = write_through(write_buf_.data(), write_buf_.size());
+  auto ret = n == static_cast<ssize_t>(write_buf_.size());
+  write_buf_.clear();
+  return ret;
 }
 
-inline bool SSLSocketStream::is_writable() const {
-  return detail::select_write(sock_, 0, 0) > 0;
+inline ssize_t SSLSocketStream::write_through(const char *ptr, size_t size) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  // The client put off the handshake to send the request as early data.
+  // What doesn't fit in the server's limit waits for the handshake.
+  if (!SSL_is_init_finished(ssl_) && !SSL_is_server(ssl_)) {
+    auto &early_data = state_.early_data;
+    auto max = SSL_SESSION_get_max_early_data(SSL_get_session(ssl_));
+    if (early_data.size() + size <= max) {
+      size_t written = 0;
+      if (!is_writable() ||
+          SSL_write_early_data(ssl_, ptr, size, &written) != 1) {
+        return -1;
+      }
+      early_data.append(ptr, written);
+      return static_cast<ssize_t>(written);
+    }
+    if (!finish_handshake()) { return -1; }
+  }
+#endif
+
+  if (is_writable()) { return SSL_write(ssl_, ptr, static_cast<int>(size)); }
+  return -1;
 }
 
-inline ssize_t SSLSocketStream::read(char *ptr, size_t size) {
-  if (SSL_pending(ssl_) > 0 ||
-      select_read(sock_, read_timeout_sec_, read_timeout_usec_) > 0) {
-    return SSL_read(ssl_, ptr, static_cast<int>(size));
+inline bool SSLSocketStream::finish_handshake() {
+  if (SSL_do_handshake(ssl_) != 1) { return false; }
+  if (!SSL_session_reused(ssl_) && state_.verify_peer &&
+      !state_.verify_peer(ssl_)) {
+    return false;
   }
-  return -1;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  auto &early_data = state_.early_data;
+  if (!early_data.empty()) {
+    if (SSL_get_early_data_status(ssl_) != SSL_EARLY_DATA_ACCEPTED) {
+      size_t offset = 0;
+      while (offset < early_data.size()) {
+        auto n = SSL_write(ssl_, early_data.data() + offset,
+                           static_cast<int>(early_data.size() - offset));
+        if (n <= 0) { return false; }
+        offset += static_cast<size_t>(n);
+      }
+    }
+    early_data.clear();
+  }
+#endif
+  return true;
 }
 
-inline ssize_t SSLSocketStream::write(const char *ptr, size_t size) {
-  if (is_writable()) { return SSL_write(ssl_, ptr, static_cast<int>(size)); }
-  return -1;
+inline bool SSLSocketStream::reading_early_data() const {
+  return state_.read_off < state_.early_data_len;
 }
 
 inline std::string SSLSocketStream::get_remote_addr() const {
   return detail::get_remote_addr(sock_);
 }
 
+inline socket_t SSLSocketStream::socket() const { return sock_; }
+
+#if defined(__linux__) && OPENSSL_VERSION_NUMBER >= 0x30000000L &&            \
+    !defined(OPENSSL_NO_KTLS)
+// Only a connection where the kernel does the encryption can send a file
+// without reading it into user space.
+inline ssize_t SSLSocketStream::send_file(int fd, uint64_t offset,
+                                          size_t size) {
+  if (!BIO_get_ktls_send(SSL_get_wbio(ssl_)) || !flush() || !is_writable()) {
+    return -1;
+  }
+  return SSL_sendfile(ssl_, fd, static_cast<off_t>(offset), size, 0);
+}
+#endif
+
 static SSLInit sslinit_;
 
 } // namespace detail
@@ -4580,6 +11087,21 @@ inline SSLServer::SSLServer(const char *cert_path, const char *private_key_path,
                             SSL_OP_NO_COMPRESSION |
                             SSL_OP_NO_SESSION_RESUMPTION_ON_RENEGOTIATION);
 
+    // Sessions are resumed from the cache (TLS 1.2 session IDs) or from
+    // tickets encrypted with our own rotating keys.
+    static const unsigned char sid_ctx[] = "cpp-httplib";
+    SSL_CTX_set_app_data(ctx_, this);
+    SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx_, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_sess_set_cache_size(ctx_, CPPHTTPLIB_SSL_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx_,
+                        static_cast<long>(ticket_key_rotation_sec_ * 2));
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx_, ticket_key_callback);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx_, ticket_key_callback);
+#endif
+
     // auto ecdh = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
     // SSL_CTX_set_tmp_ecdh(ctx_, ecdh);
     // EC_KEY_free(ecdh);
@@ -4608,21 +11130,429 @@ inline SSLServer::SSLServer(const char *cert_path, const char *private_key_path,
 }
 
 inline SSLServer::~SSLServer() {
+#ifndef _WIN32
+  stop_dispatch();
+#endif
   if (ctx_) { SSL_CTX_free(ctx_); }
+  for (auto &key : ticket_keys_) {
+    OPENSSL_cleanse(&key, sizeof(key));
+  }
 }
 
 inline bool SSLServer::is_valid() const { return ctx_; }
 
+inline void SSLServer::set_ticket_key_rotation(time_t sec) {
+  {
+    std::lock_guard<std::mutex> guard(ticket_keys_mutex_);
+    ticket_key_rotation_sec_ = sec;
+  }
+  if (ctx_) { SSL_CTX_set_timeout(ctx_, static_cast<long>(sec * 2)); }
+}
+
+inline void SSLServer::enable_kernel_tls(bool enabled) {
+#ifdef SSL_OP_ENABLE_KTLS
+  if (!ctx_) { return; }
+  if (enabled) {
+    SSL_CTX_set_options(ctx_, SSL_OP_ENABLE_KTLS);
+  } else {
+    SSL_CTX_clear_options(ctx_, SSL_OP_ENABLE_KTLS);
+  }
+#else
+  (void)enabled;
+#endif
+}
+
+inline void SSLServer::set_max_early_data(uint32_t size) {
+  max_early_data_ = size;
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  if (ctx_) { SSL_CTX_set_max_early_data(ctx_, size); }
+#endif
+}
+
+inline bool SSLServer::current_ticket_key(TicketKey &key) {
+  std::lock_guard<std::mutex> guard(ticket_keys_mutex_);
+
+  auto now = std::chrono::steady_clock::now();
+  auto interval = std::chrono::seconds(ticket_key_rotation_sec_);
+  if (ticket_keys_.empty() || now - ticket_keys_.back().created >= interval) {
+    TicketKey next;
+    if (RAND_bytes(next.name, sizeof(next.name)) != 1 ||
+        RAND_bytes(next.aes_key, sizeof(next.aes_key)) != 1 ||
+        RAND_bytes(next.hmac_key, sizeof(next.hmac_key)) != 1) {
+      return false;
+    }
+    next.created = now;
+    ticket_keys_.push_back(next);
+
+    if (ticket_keys_.size() > 2) {
+      OPENSSL_cleanse(&ticket_keys_.front(), sizeof(TicketKey));
+      ticket_keys_.erase(ticket_keys_.begin());
+    }
+  }
+
+  key = ticket_keys_.back();
+  return true;
+}
+
+inline bool SSLServer::find_ticket_key(const unsigned char *name,
+                                       TicketKey &key, bool &renew) {
+  std::lock_guard<std::mutex> guard(ticket_keys_mutex_);
+
+  auto now = std::chrono::steady_clock::now();
+  auto interval = std::chrono::seconds(ticket_key_rotation_sec_);
+  for (size_t i = 0; i < ticket_keys_.size(); i++) {
+    const auto &k = ticket_keys_[i];
+    if (memcmp(k.name, name, sizeof(k.name))) { continue; }
+
+    auto age = now - k.created;
+    if (age >= interval * 2) { return false; }
+
+    key = k;
+    renew = i + 1 < ticket_keys_.size() || age >= interval;
+    return true;
+  }
+  return false;
+}
+
+inline int SSLServer::ticket_key_callback(SSL *ssl, unsigned char *key_name,
+                                          unsigned char *iv,
+                                          EVP_CIPHER_CTX *cctx,
+                                          TicketMacContext *hctx, int enc) {
+  auto svr =
+      static_cast<SSLServer *>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+
+  TicketKey key;
+  auto renew = false;
+  if (enc) {
+    if (!svr->current_ticket_key(key) || RAND_bytes(iv, 16) != 1) {
+      return -1;
+    }
+    memcpy(key_name, key.name, sizeof(key.name));
+    if (EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, key.aes_key,
+                           iv) != 1) {
+      return -1;
+    }
+  } else {
+    // An unknown or expired key makes for a full handshake.
+    if (!svr->find_ticket_key(key_name, key, renew)) { return 0; }
+    if (EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, key.aes_key,
+                           iv) != 1) {
+      return -1;
+    }
+  }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  char digest[] = "SHA256";
+  OSSL_PARAM params[] = {
+      OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac_key,
+                                        sizeof(key.hmac_key)),
+      OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+      OSSL_PARAM_construct_end()};
+  if (EVP_MAC_CTX_set_params(hctx, params) != 1) { return -1; }
+#else
+  if (HMAC_Init_ex(hctx, key.hmac_key, sizeof(key.hmac_key), EVP_sha256(),
+                   nullptr) != 1) {
+    return -1;
+  }
+#endif
+
+  OPENSSL_cleanse(&key, sizeof(key));
+  return renew ? 2 : 1;
+}
+
+// With early data enabled, whatever a resuming client sent ahead of the
+// handshake is collected first and served to the request reader.
+inline bool SSLServer::accept_ssl(SSL *ssl, std::string &early_data) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  if (max_early_data_ > 0) {
+    char buf[CPPHTTPLIB_RECV_BUFSIZ];
+    for (;;) {
+      size_t n = 0;
+      auto ret = SSL_read_early_data(ssl, buf, sizeof(buf), &n);
+      if (ret == SSL_READ_EARLY_DATA_ERROR) { return false; }
+      early_data.append(buf, n);
+      if (ret == SSL_READ_EARLY_DATA_FINISH) { break; }
+    }
+  }
+#else
+  (void)early_data;
+#endif
+  return SSL_accept(ssl) == 1;
+}
+
 inline bool SSLServer::process_and_close_socket(socket_t sock) {
   return detail::process_and_close_socket_ssl(
-      false, sock, keep_alive_max_count_, read_timeout_sec_, read_timeout_usec_,
-      ctx_, ctx_mutex_, SSL_accept, [](SSL * /*ssl*/) { return true; },
-      [this](SSL *ssl, Stream &strm, bool last_connection,
+      false, sock, keep_alive_max_count_, keep_alive_timeout_sec_,
+      read_timeout_sec_, read_timeout_usec_, ctx_, ctx_mutex_,
+      [this](SSL *ssl, detail::ssl_stream_state &state) {
+        return accept_ssl(ssl, state.read_buf);
+      },
+      [](SSL * /*ssl*/) { return true; },
+      [this](SSL *ssl, detail::SSLSocketStream &strm, bool last_connection,
+             bool &connection_close) {
+        return process_request_ssl(ssl, strm, last_connection,
+                                   connection_close);
+      });
+}
+
+inline bool SSLServer::process_request_ssl(SSL *ssl,
+                                           detail::SSLSocketStream &strm,
+                                           bool last_connection,
+                                           bool &connection_close) {
+  auto early_data = strm.reading_early_data();
+  return process_request(strm, last_connection, connection_close,
+                         [&](Request &req) {
+                           req.ssl = ssl;
+                           req.early_data = early_data;
+                         });
+}
+
+#ifndef _WIN32
+inline void SSLServer::dispatch_socket(socket_t sock, TaskQueue &task_queue) {
+  if (!handshake_thread_.joinable() && !start_handshakes(task_queue)) {
+    Server::dispatch_socket(sock, task_queue);
+    return;
+  }
+
+#if __cplusplus > 201703L
+  task_queue.enqueue([=, this]() { begin_handshake(sock); });
+#else
+  task_queue.enqueue([=]() { begin_handshake(sock); });
+#endif
+}
+
+inline void SSLServer::stop_dispatch() {
+  if (!handshake_thread_.joinable()) { return; }
+
+  {
+    std::lock_guard<std::mutex> guard(handshake_mutex_);
+    handshake_stopping_ = true;
+  }
+  wake_handshakes();
+  handshake_thread_.join();
+
+  handshake_poller_.remove(handshake_wake_fds_[0]);
+  for (auto &fd : handshake_wake_fds_) {
+    close(fd);
+    fd = -1;
+  }
+  task_queue_ = nullptr;
+}
+
+inline bool SSLServer::start_handshakes(TaskQueue &task_queue) {
+  if (!ctx_ || !handshake_poller_.is_valid() ||
+      pipe(handshake_wake_fds_) == -1) {
+    return false;
+  }
+
+  for (auto fd : handshake_wake_fds_) {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    detail::set_nonblocking(fd, true);
+  }
+  handshake_poller_.set(handshake_wake_fds_[0], detail::event_poller::Read);
+
+  task_queue_ = &task_queue;
+  handshake_stopping_ = false;
+  handshake_thread_ = std::thread([this]() { run_handshakes(); });
+  return true;
+}
+
+inline void SSLServer::wake_handshakes() {
+  char c = 0;
+  auto ret = ::write(handshake_wake_fds_[1], &c, 1);
+  (void)ret;
+}
+
+// Only this thread touches the poller. A handshake that's ready is taken
+// off it and handed to a worker, which gives it back if it has to wait
+// again.
+inline void SSLServer::run_handshakes() {
+  std::unordered_map<socket_t, Handshake> handshakes;
+  std::vector<Handshake> waiting;
+  std::vector<std::pair<socket_t, int>> ready;
+  auto next_sweep = std::chrono::steady_clock::now();
+
+  for (;;) {
+    {
+      std::lock_guard<std::mutex> guard(handshake_mutex_);
+      if (handshake_stopping_) { break; }
+      waiting.swap(waiting_handshakes_);
+    }
+
+    for (auto &hs : waiting) {
+      handshake_poller_.set(hs.sock, hs.events);
+      auto sock = hs.sock;
+      handshakes.emplace(sock, std::move(hs));
+    }
+    waiting.clear();
+
+    // Deadlines are checked at a tenth of a second granularity.
+    ready.clear();
+    auto timeout = handshakes.empty() ? -1 : 100;
+    if (handshake_poller_.wait(timeout, ready) < 0) { break; }
+
+    for (const auto &ev : ready) {
+      if (ev.first == handshake_wake_fds_[0]) {
+        char buf[64];
+        while (::read(handshake_wake_fds_[0], buf, sizeof(buf)) > 0) {}
+        continue;
+      }
+
+      auto it = handshakes.find(ev.first);
+      if (it == handshakes.end()) { continue; }
+      handshake_poller_.remove(it->first);
+      auto hs = std::move(it->second);
+      handshakes.erase(it);
+      hs.events = 0;
+#if __cplusplus > 201703L
+      task_queue_->enqueue([=, this]() mutable { step_handshake(hs); });
+#else
+      task_queue_->enqueue([=]() mutable { step_handshake(hs); });
+#endif
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (now >= next_sweep) {
+      for (auto it = handshakes.begin(); it != handshakes.end();) {
+        if (now >= it->second.deadline) {
+          handshake_poller_.remove(it->first);
+          close_handshake(it->second);
+          it = handshakes.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      next_sweep = now + std::chrono::milliseconds(100);
+    }
+  }
+
+  for (auto &x : handshakes) {
+    handshake_poller_.remove(x.first);
+    close_handshake(x.second);
+  }
+
+  std::lock_guard<std::mutex> guard(handshake_mutex_);
+  for (auto &hs : waiting_handshakes_) {
+    close_handshake(hs);
+  }
+  waiting_handshakes_.clear();
+}
+
+inline void SSLServer::begin_handshake(socket_t sock) {
+  auto ssl = detail::ssl_new(ctx_, ctx_mutex_);
+  if (!ssl) {
+    detail::close_socket(sock);
+    return;
+  }
+
+  detail::set_nonblocking(sock, true);
+  auto bio = BIO_new_socket(static_cast<int>(sock), BIO_NOCLOSE);
+  SSL_set_bio(ssl, bio, bio);
+
+  Handshake hs;
+  hs.sock = sock;
+  hs.ssl = ssl;
+  hs.reading_early_data = max_early_data_ > 0;
+  hs.events = 0;
+  hs.deadline = std::chrono::steady_clock::now() +
+                std::chrono::seconds(read_timeout_sec_) +
+                std::chrono::microseconds(read_timeout_usec_);
+  step_handshake(hs);
+}
+
+// Runs on a worker. A handshake that has to wait goes back to the event
+// loop, and one that's done is served right here.
+inline void SSLServer::step_handshake(Handshake &hs) {
+  if (!continue_handshake(hs)) {
+    close_handshake(hs);
+    return;
+  }
+
+  if (hs.events) {
+    // The loop closes the pipe only after it has stopped.
+    std::unique_lock<std::mutex> lock(handshake_mutex_);
+    if (handshake_stopping_) {
+      lock.unlock();
+      close_handshake(hs);
+      return;
+    }
+    waiting_handshakes_.push_back(std::move(hs));
+    wake_handshakes();
+    return;
+  }
+
+  detail::set_nonblocking(hs.sock, false);
+  if (metrics_enabled_) { metrics_.connection_queued(); }
+  process_handshaken_socket(hs.sock, hs.ssl, hs.early_data,
+                            detail::trace_clock());
+}
+
+// Goes as far as the socket allows, and leaves the events to wait for in
+// `hs.events`, none once the handshake is done.
+inline bool SSLServer::continue_handshake(Handshake &hs) {
+  // SSL_get_error looks at the error queue of the thread, which is shared by
+  // everything the worker runs.
+  ERR_clear_error();
+
+  int ret = 1;
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  while (hs.reading_early_data) {
+    char buf[CPPHTTPLIB_RECV_BUFSIZ];
+    size_t n = 0;
+    ret = SSL_read_early_data(hs.ssl, buf, sizeof(buf), &n);
+    if (ret == SSL_READ_EARLY_DATA_ERROR) { break; }
+    hs.early_data.append(buf, n);
+    if (ret == SSL_READ_EARLY_DATA_FINISH) { hs.reading_early_data = false; }
+  }
+  if (!hs.reading_early_data) { ret = SSL_accept(hs.ssl); }
+#else
+  ret = SSL_accept(hs.ssl);
+#endif
+
+  hs.events = 0;
+  if (ret != 1) {
+    switch (SSL_get_error(hs.ssl, ret)) {
+    case SSL_ERROR_WANT_READ: hs.events = detail::event_poller::Read; break;
+    case SSL_ERROR_WANT_WRITE: hs.events = detail::event_poller::Write; break;
+    default: return false;
+    }
+  }
+  return true;
+}
+
+// The handshake must not be on the poller.
+inline void SSLServer::close_handshake(Handshake &hs) {
+  if (hs.sock == INVALID_SOCKET) { return; }
+  detail::ssl_free(hs.ssl, ctx_mutex_);
+  detail::close_socket(hs.sock);
+  hs.sock = INVALID_SOCKET;
+  hs.ssl = nullptr;
+}
+
+inline void
+SSLServer::process_handshaken_socket(socket_t sock, SSL *ssl,
+                                     const std::string &early_data,
+                                     uint64_t queued) {
+  detail::trace_record(detail::trace_phase::Queue, sock, queued,
+                       detail::trace_clock());
+
+  detail::ssl_stream_state state;
+  state.read_buf = early_data;
+  state.read_len = state.read_buf.size();
+  state.early_data_len = state.read_len;
+
+  if (metrics_enabled_) { metrics_.connection_started(); }
+  detail::process_ssl_connection(
+      false, sock, ssl, state, keep_alive_max_count_, keep_alive_timeout_sec_,
+      read_timeout_sec_, read_timeout_usec_, ctx_mutex_,
+      [this](SSL *ssl, detail::SSLSocketStream &strm, bool last_connection,
              bool &connection_close) {
-        return process_request(strm, last_connection, connection_close,
-                               [&](Request &req) { req.ssl = ssl; });
+        return process_request_ssl(ssl, strm, last_connection,
+                                   connection_close);
       });
+  if (metrics_enabled_) { metrics_.connection_finished(); }
 }
+#endif
 
 // SSL HTTP client implementation
 inline SSLClient::SSLClient(const std::string &host, int port,
@@ -4644,18 +11574,40 @@ inline SSLClient::SSLClient(const std::string &host, int port,
       ctx_ = nullptr;
     }
   }
+
+  // New sessions are handed to us instead of OpenSSL's internal cache. With
+  // TLS 1.3 they arrive after the handshake, along with the first response.
+  if (ctx_) {
+    SSL_CTX_set_app_data(ctx_, this);
+    SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_CLIENT |
+                                             SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx_, new_session_callback);
+  }
 }
 
 inline SSLClient::~SSLClient() {
+  wait_for_hedges();
   if (ctx_) { SSL_CTX_free(ctx_); }
+  if (session_) { SSL_SESSION_free(session_); }
 }
 
 inline bool SSLClient::is_valid() const { return ctx_; }
 
+// The context is set up here rather than on each connection, as connections
+// are made from several threads without a lock.
 inline void SSLClient::set_ca_cert_path(const char *ca_cert_file_path,
                                         const char *ca_cert_dir_path) {
   if (ca_cert_file_path) { ca_cert_file_path_ = ca_cert_file_path; }
   if (ca_cert_dir_path) { ca_cert_dir_path_ = ca_cert_dir_path; }
+
+  const char *file = nullptr;
+  const char *dir = nullptr;
+  if (!ca_cert_file_path_.empty()) { file = ca_cert_file_path_.c_str(); }
+  if (!ca_cert_dir_path_.empty()) { dir = ca_cert_dir_path_.c_str(); }
+  if (!ctx_ || (!file && !dir)) { return; }
+
+  ca_cert_loaded_ = SSL_CTX_load_verify_locations(ctx_, file, dir) == 1;
+  SSL_CTX_set_verify(ctx_, SSL_VERIFY_PEER, nullptr);
 }
 
 inline void SSLClient::enable_server_certificate_verification(bool enabled) {
@@ -4668,8 +11620,28 @@ inline long SSLClient::get_openssl_verify_result() const {
 
 inline SSL_CTX *SSLClient::ssl_context() const noexcept { return ctx_; }
 
+inline void SSLClient::enable_session_resumption(bool enabled) {
+  session_resumption_ = enabled;
+}
+
+inline void SSLClient::enable_early_data(bool enabled) {
+  early_data_ = enabled;
+}
+
+inline int SSLClient::new_session_callback(SSL *ssl, SSL_SESSION *session) {
+  auto cli =
+      static_cast<SSLClient *>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+  if (!cli->session_resumption_) { return 0; }
+
+  std::lock_guard<std::mutex> guard(cli->session_mutex_);
+  if (cli->session_) { SSL_SESSION_free(cli->session_); }
+  cli->session_ = session;
+  return 1;
+}
+
 inline bool SSLClient::process_and_close_socket(
-    socket_t sock, size_t request_count,
+    socket_t sock, size_t request_count, bool early_data,
+    detail::canceler *canceler,
     std::function<bool(Stream &strm, bool last_connection,
                        bool &connection_close)>
         callback) {
@@ -4678,51 +11650,148 @@ inline bool SSLClient::process_and_close_socket(
 
   return is_valid() &&
          detail::process_and_close_socket_ssl(
-             true, sock, request_count, read_timeout_sec_, read_timeout_usec_,
-             ctx_, ctx_mutex_,
-             [&](SSL *ssl) {
-               if (ca_cert_file_path_.empty()) {
-                 SSL_CTX_set_verify(ctx_, SSL_VERIFY_NONE, nullptr);
-               } else {
-                 if (!SSL_CTX_load_verify_locations(
-                         ctx_, ca_cert_file_path_.c_str(), nullptr)) {
-                   return false;
-                 }
-                 SSL_CTX_set_verify(ctx_, SSL_VERIFY_PEER, nullptr);
-               }
-
-               if (SSL_connect(ssl) != 1) { return false; }
-
-               if (server_certificate_verification_) {
-                 verify_result_ = SSL_get_verify_result(ssl);
-
-                 if (verify_result_ != X509_V_OK) { return false; }
-
-                 auto server_cert = SSL_get_peer_certificate(ssl);
-
-                 if (server_cert == nullptr) { return false; }
-
-                 if (!verify_host(server_cert)) {
-                   X509_free(server_cert);
-                   return false;
-                 }
-                 X509_free(server_cert);
-               }
-
-               return true;
-             },
-             [&](SSL *ssl) {
-               SSL_set_tlsext_host_name(ssl, host_.c_str());
-               return true;
+             true, sock, request_count, 0, read_timeout_sec_,
+             read_timeout_usec_, ctx_, ctx_mutex_,
+             [&](SSL *ssl, detail::ssl_stream_state &state) {
+               return connect_ssl(ssl, early_data, canceler, state);
              },
+             [&](SSL *ssl) { return setup_ssl(ssl); },
              [&](SSL * /*ssl*/, Stream &strm, bool last_connection,
                  bool &connection_close) {
                return callback(strm, last_connection, connection_close);
              });
 }
 
+// Connections made with different contexts (certificates, verification
+// settings) must never be handed to each other.
+inline std::string SSLClient::connection_pool_key() const {
+  std::ostringstream key;
+  key << "https://" << host_and_port_;
+  if (!proxy_host_.empty()) {
+    key << " via " << proxy_host_ << ":" << proxy_port_;
+  }
+  if (!interface_.empty()) { key << " on " << interface_; }
+  key << " ctx " << static_cast<const void *>(ctx_);
+  return key.str();
+}
+
+inline bool SSLClient::process_pooled_connection(
+    ConnectionPool::Connection &conn, bool &reusable, bool early_data,
+    detail::canceler *canceler,
+    std::function<bool(Stream &strm, bool last_connection,
+                       bool &connection_close)>
+        callback) {
+  reusable = false;
+  if (!is_valid()) { return false; }
+
+  detail::ssl_stream_state state;
+
+  if (!conn.ssl) {
+    conn.ssl = detail::ssl_new(ctx_, ctx_mutex_);
+    if (!conn.ssl) { return false; }
+
+    auto bio = BIO_new_socket(static_cast<int>(conn.sock), BIO_NOCLOSE);
+    SSL_set_bio(conn.ssl, bio, bio);
+
+    if (!setup_ssl(conn.ssl) ||
+        !connect_ssl(conn.ssl, early_data, canceler, state)) {
+      return false;
+    }
+  }
+
+  detail::SSLSocketStream strm(conn.sock, conn.ssl, read_timeout_sec_,
+                               read_timeout_usec_, &state);
+  auto connection_close = false;
+  auto ret = callback(strm, false, connection_close);
+
+  // Anything read past the response would be lost with the buffer.
+  reusable = ret && !connection_close && state.read_off == state.read_len;
+  return ret;
+}
+
 inline bool SSLClient::is_ssl() const { return true; }
 
+inline bool SSLClient::setup_ssl(SSL *ssl) {
+  SSL_set_tlsext_host_name(ssl, host_.c_str());
+
+  if (session_resumption_) {
+    std::lock_guard<std::mutex> guard(session_mutex_);
+    if (session_) { SSL_set_session(ssl, session_); }
+  }
+  return true;
+}
+
+inline bool SSLClient::connect_ssl(SSL *ssl, bool early_data,
+                                   detail::canceler *canceler,
+                                   detail::ssl_stream_state &state) {
+  if (!ca_cert_loaded_) { return false; }
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  // The stream completes the handshake once the request is out. The server
+  // may decline the session and present its certificate after all, which is
+  // then checked as here.
+  auto session = SSL_get_session(ssl);
+  if (early_data && early_data_ && session &&
+      SSL_SESSION_get_max_early_data(session) > 0) {
+    state.verify_peer = [this](SSL *ssl) { return check_peer(ssl); };
+    SSL_set_connect_state(ssl);
+    return true;
+  }
+#else
+  (void)early_data;
+  (void)state;
+#endif
+
+  // A cancel shuts the socket down, which ends the handshake as well.
+  auto sock = static_cast<socket_t>(SSL_get_fd(ssl));
+  if (canceler && !canceler->attach(sock)) { return false; }
+  auto connected = SSL_connect(ssl) == 1;
+  if (canceler && canceler->detach()) { return false; }
+
+  if (!connected || !check_peer(ssl)) { return false; }
+
+  // A resumed TLS 1.2 handshake ends with our Finished message, and Nagle's
+  // algorithm would hold the request back until the server's delayed ACK.
+  if (SSL_session_reused(ssl) && SSL_version(ssl) <= TLS1_2_VERSION) {
+    detail::set_socket_option(sock, IPPROTO_TCP, TCP_NODELAY, 1);
+  }
+
+  return true;
+}
+
+// Sessions are only kept from handshakes that passed verification.
+inline bool SSLClient::check_peer(SSL *ssl) {
+  if (!server_certificate_verification_ || verify_peer(ssl)) { return true; }
+
+  // With TLS 1.2 the session has been handed over already.
+  std::lock_guard<std::mutex> guard(session_mutex_);
+  if (session_ && session_ == SSL_get_session(ssl)) {
+    SSL_SESSION_free(session_);
+    session_ = nullptr;
+  }
+  return false;
+}
+
+inline bool SSLClient::verify_peer(SSL *ssl) {
+  // Handshakes on other threads may publish their results meanwhile.
+  auto verify_result = SSL_get_verify_result(ssl);
+  verify_result_ = verify_result;
+
+  if (verify_result != X509_V_OK) { return false; }
+
+  auto server_cert = SSL_get_peer_certificate(ssl);
+
+  if (server_cert == nullptr) { return false; }
+
+  if (!verify_host(server_cert)) {
+    X509_free(server_cert);
+    return false;
+  }
+  X509_free(server_cert);
+
+  return true;
+}
+
 inline bool SSLClient::verify_host(X509 *server_cert) const {
   /* Quote from RFC2818 section 3.1 "Server Identity"
 
@@ -4852,8 +11921,85 @@ inline bool SSLClient::check_host_name(const char *pattern,
 }
 #endif
 
+#ifdef CPPHTTPLIB_ALLOCATION_STATS
+inline AllocationStats thread_allocations() {
+  return detail::local_allocations();
+}
+
+inline RequestAllocations request_allocations() {
+  return detail::current_request_allocations();
+}
+#endif
+
 // ----------------------------------------------------------------------------
 
 } // namespace httplib
 
+#if defined(CPPHTTPLIB_ALLOCATION_STATS) &&                                    \
+    defined(CPPHTTPLIB_ALLOCATION_STATS_IMPLEMENTATION)
+// Replacements of the global allocation functions, counting each allocation
+// against the calling thread. Over-aligned allocations aren't counted.
+#include <cstdlib>
+#include <new>
+
+void *operator new(std::size_t size) {
+  auto &stats = httplib::detail::local_allocations();
+  stats.count++;
+  stats.bytes += size;
+  if (auto p = std::malloc(size ? size : 1)) { return p; }
+  throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size) { return operator new(size); }
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  auto &stats = httplib::detail::local_allocations();
+  stats.count++;
+  stats.bytes += size;
+  return std::malloc(size ? size : 1);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &tag) noexcept {
+  return operator new(size, tag);
+}
+
+// Kept out of line so GCC doesn't pair an inlined free() with the
+// operator new of the caller and warn about a mismatch.
+#if defined(__GNUC__) || defined(__clang__)
+#define CPPHTTPLIB_ALLOCATION_NOINLINE __attribute__((noinline))
+#else
+#define CPPHTTPLIB_ALLOCATION_NOINLINE
+#endif
+
+CPPHTTPLIB_ALLOCATION_NOINLINE void operator delete(void *p) noexcept {
+  std::free(p);
+}
+
+CPPHTTPLIB_ALLOCATION_NOINLINE void operator delete[](void *p) noexcept {
+  std::free(p);
+}
+
+CPPHTTPLIB_ALLOCATION_NOINLINE void
+operator delete(void *p, const std::nothrow_t &) noexcept {
+  std::free(p);
+}
+
+CPPHTTPLIB_ALLOCATION_NOINLINE void
+operator delete[](void *p, const std::nothrow_t &) noexcept {
+  std::free(p);
+}
+
+#ifdef __cpp_sized_deallocation
+CPPHTTPLIB_ALLOCATION_NOINLINE void operator delete(void *p,
+                                                   std::size_t) noexcept {
+  std::free(p);
+}
+
+CPPHTTPLIB_ALLOCATION_NOINLINE void operator delete[](void *p,
+                                                     std::size_t) noexcept {
+  std::free(p);
+}
+#endif
+#endif
+
 #endif // CPPHTTPLIB_HTTPLIB_H
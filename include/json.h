@@ -228,6 +228,7 @@ namespace jsonlib {
     // forward declarations
     class JSONparsedData;
     class JSON;
+    class JSONparser;
 
     // Objet and array typedefs
     typedef std::unordered_map <std::string,JSON>    JSONobject;
@@ -240,6 +241,8 @@ namespace jsonlib {
     /* Use: JSON("JSON_string_data").as<JSONobject>()["keyName"].as<JSONarray>()[2].as<int>()
             JSON("JSON_string_data")["keyName"][2].as<int>()  */
     private:
+        friend class JSONparser;
+        
         // main data
         std::string data; // can be object, vector or leaf data
         bool _exists;      // whether the JSON resource exists.
@@ -247,6 +250,10 @@ namespace jsonlib {
         // parsed data
         JSONparsedData* parsed_data_p;
         
+        // raw text; regenerated for objects and arrays parsed out of a larger text, which don't keep a copy.
+        // Forced reparses read it, so such a node is rebuilt from its own contents.
+        std::string& text (void);
+        
     public:
         // constructor
         JSON () : _exists (false), parsed_data_p (NULL) { } // no data field.
@@ -273,13 +280,18 @@ namespace jsonlib {
         // deep copy
         JSON (const JSON& r);
         JSON& operator= (const JSON& r);
+        // move
+        JSON (JSON&& r) noexcept;
+        JSON& operator= (JSON&& r) noexcept;
         
         // ------------------------------------
         // parsers (old)
         JSONType parse (bool force=false);
         void parse_full (bool force=false, int max_depth=INT_MAX, int* parse_count_for_verbose_p=NULL); // recursively parse the entire JSON text
-        // parser (new)
-        void fast_parse (std::string* str_p=NULL, bool copy_string=false, int max_depth=INT_MAX, size_t* parse_start_str_pos=NULL); // TODO: finish.
+        // parser (new): one pass over the text, building every node down to max_depth. Parses *str_p (default: own data)
+        // from *parse_start_str_pos (default: 0) and advances it past the value. With copy_string, objects and arrays keep
+        // a copy of their raw text; otherwise only leaves do.
+        void fast_parse (std::string* str_p=NULL, bool copy_string=false, int max_depth=INT_MAX, size_t* parse_start_str_pos=NULL);
         
         JSONobject& as_object (bool force=false);
         JSONarray& as_array (bool force=false);
@@ -288,7 +300,7 @@ namespace jsonlib {
         
         // access raw data and other attributes
         int size(void);
-        std::string& raw_data (void) { return (data); }
+        std::string& raw_data (void) { return (text()); }
         bool exists (void) { return (_exists); }
         bool is_parsed (void) { return (parsed_data_p!=NULL); }
         JSONType type (void);
@@ -307,7 +319,7 @@ namespace jsonlib {
         template <class dataType>
         dataType as (const dataType& def = dataType()) { // specialized outside class declaration
             if (!exists()) return (def);
-            return dataType (data); // default behavior for unknown types: invoke 'dataType(std::string)'
+            return dataType (text()); // default behavior for unknown types: invoke 'dataType(std::string)'
         }
         
         // as_vector
@@ -329,46 +341,8 @@ namespace jsonlib {
         JSONType type;
         JSONparsedData() : type(JSON_UNKNOWN) {}
         
-        // parser
-        void parse (const std::string& data, JSONType typ = JSON_UNKNOWN) {
-            std::string content = strtrim(data);
-            
-            if (typ==JSON_OBJECT || typ==JSON_UNKNOWN) {
-                // parse as object:
-                content = strtrim (strtrim (content, "{", 1, STRTRIM_L ), "}", 1, STRTRIM_R );
-                if (content.length() != data.length()) { // a valid object
-                    std::vector<std::string> nvPairs = split_JSON_array (content);
-                    for (size_t a=0; a<nvPairs.size(); ++a) {
-                        std::size_t assignmentPos = nvPairs[a].find (JSONobjectassignment);
-                        object.insert (make_pair( 
-                                            strip_outer_quotes (nvPairs[a].substr (0,assignmentPos) ) ,
-                                            JSON (strtrim (nvPairs[a].substr (assignmentPos+1) ) )
-                                   ) );
-                    }
-                    if (object.size() > 0) {
-                        type = JSON_OBJECT;
-                        return;
-                    }
-                }
-            }
-            
-            if (typ==JSON_ARRAY || typ==JSON_UNKNOWN) {
-                // parse as array
-                content = strtrim (strtrim (content, "[", 1, STRTRIM_L ), "]", 1, STRTRIM_R );
-                if (content.length() != data.length()) { // a valid array
-                    std::vector<std::string> nvPairs = split_JSON_array (content);
-                    for (size_t a=0; a<nvPairs.size(); ++a) 
-                        array.push_back (JSON (strtrim (nvPairs[a]) ) );
-                    if (array.size() > 0) {
-                        type = JSON_ARRAY;
-                        return;
-                    }
-                }
-            }
-            
-            if (typ==JSON_UNKNOWN)
-                type = JSON_LEAF;
-        }
+        // parser: builds the whole tree under this node in one pass (see JSONparser)
+        void parse (const std::string& data, JSONType typ = JSON_UNKNOWN);
         
         
         // remove non-existing items inserted due to accessing
@@ -389,7 +363,7 @@ namespace jsonlib {
             }
             
             if (type==JSON_ARRAY) { // erases only the non-existent elements at the tail
-                while (!(array[array.size()-1].exists()))
+                while (!array.empty() && !(array.back().exists()))
                     array.pop_back();
                 return (array.size());
             }
@@ -427,6 +401,29 @@ namespace jsonlib {
         return *this;
     }
     inline 
+    JSON::JSON (JSON&& r) noexcept : data (std::move(r.data)), _exists (r._exists), parsed_data_p (r.parsed_data_p) {
+        r._exists = false;
+        r.parsed_data_p = NULL;
+    }
+    inline 
+    JSON& JSON::operator= (JSON&& r) noexcept {
+        if (this != &r) {
+            if (parsed_data_p) delete parsed_data_p;
+            data = std::move(r.data);
+            _exists = r._exists;
+            parsed_data_p = r.parsed_data_p;
+            r._exists = false;
+            r.parsed_data_p = NULL;
+        }
+        return *this;
+    }
+    inline 
+    std::string& JSON::text (void) {
+        if (data.empty() && parsed_data_p && (parsed_data_p->type==JSON_OBJECT || parsed_data_p->type==JSON_ARRAY))
+            as_str();
+        return (data);
+    }
+    inline 
     int JSON::size (void) {
         parse();
         return (parsed_data_p->size());
@@ -518,158 +515,254 @@ namespace jsonlib {
     inline 
     JSONType JSON::parse (bool force) {
         if (!parsed_data_p)  parsed_data_p = new JSONparsedData;
-        if (parsed_data_p->type==JSON_UNKNOWN || force)  parsed_data_p->parse (data, JSON_UNKNOWN);
+        if (parsed_data_p->type==JSON_UNKNOWN || force)  parsed_data_p->parse (text(), JSON_UNKNOWN);
         return (parsed_data_p->type);
     }
     inline 
     void JSON::parse_full (bool force, int max_depth, int* parse_count_for_verbose_p) { // recursive parsing (slow)
         if (max_depth==0) return;
         if (!parsed_data_p)  parsed_data_p = new JSONparsedData;
-        if (parsed_data_p->type==JSON_UNKNOWN || force)  parsed_data_p->parse (data, JSON_UNKNOWN);
+        if (parsed_data_p->type==JSON_UNKNOWN || force)  parsed_data_p->parse (text(), JSON_UNKNOWN);
         // verbose
         if (parse_count_for_verbose_p) {
             (*parse_count_for_verbose_p)++;
             if ( (*parse_count_for_verbose_p) % 100 == 0)
                 std::cout << "parse_full: " << (*parse_count_for_verbose_p) << " calls." << std::endl;
         }
-        // recursive parse children if not already parsed
+        // recursive parse children if not already parsed; a forced parse above has just rebuilt them
         if (parsed_data_p->type==JSON_OBJECT) 
             for (auto it=parsed_data_p->object.begin(); it!=parsed_data_p->object.end(); ++it)
-                it->second.parse_full (force, max_depth-1, parse_count_for_verbose_p);
+                it->second.parse_full (false, max_depth-1, parse_count_for_verbose_p);
         else if (parsed_data_p->type==JSON_ARRAY)
             for (auto it=parsed_data_p->array.begin(); it!=parsed_data_p->array.end(); ++it) 
-                it->parse_full (force, max_depth-1, parse_count_for_verbose_p);
+                it->parse_full (false, max_depth-1, parse_count_for_verbose_p);
     }
 
     // ------------------------------------------------------------
     // ============================================================
-    // FAST PARSER (Under construction. DO NOT use the following functions in your application.)
-    inline 
-    void JSON::fast_parse (std::string* str_p, bool copy_string, int max_depth, size_t* parse_start_str_pos) {
-        // TODO: UNDER CONSTRUCTION...
-        
-        if (!str_p)
-            str_p = &data;
-        std::string& str = *str_p;
-        
-        // splits, while respecting brackets and escapes
-        //std::vector<std::string> ret;
-        
-        //std::string current;
-        std::vector<int> bracket_stack;
-        std::vector<int> quote_stack;
-        bool escape_active = false;
-        int bi;
-        
-        bool initial_whitespaces = true;
-        bool isroot = false;
-        
-        if (!parse_start_str_pos) {
-            parse_start_str_pos = new size_t;
-            *parse_start_str_pos = 0;
-            isroot = true;
+    // FAST PARSER
+    // A recursive-descent parser that walks the text once. Nodes are built in place, and only leaves copy their text,
+    // so a document costs O(size) however deep it nests. It is as lenient as split_JSON_array: single or double quoted
+    // strings, unquoted keys and values, '//' comments, trailing commas, and empty array elements.
+    class JSONparser {
+    public:
+        JSONparser (const std::string& str, bool copy_string=false, int max_depth=INT_MAX, size_t pos=0) 
+            : str (str), pos (pos), copy_string (copy_string), max_depth (max_depth) { }
+        
+        const std::string& str;
+        size_t pos;
+        bool copy_string;
+        int max_depth;
+        
+        // skips whitespace and comments
+        void skip_space (void) {
+            while (pos < str.length()) {
+                char c = str[pos];
+                if (c==' ' || c=='\n' || c=='\r' || c=='\t')
+                    ++pos;
+                else if (str.compare (pos, JSONlinecommentstart.length(), JSONlinecommentstart) == 0) {
+                    size_t newline_pos = str.find_first_of ("\n\r", pos);
+                    pos = (newline_pos == std::string::npos) ? str.length() : newline_pos;
+                }
+                else
+                    break;
+            }
         }
         
-        size_t a = *parse_start_str_pos;
+        // position after the string starting at a (which is a quote)
+        size_t string_end (size_t a) {
+            char quote = str[a];
+            bool escape_active = false;
+            for (++a; a < str.length(); ++a) {
+                if (escape_active)
+                    escape_active = false;
+                else if (str[a]==JSONcharescape)
+                    escape_active = true;
+                else if (str[a]==quote)
+                    return (a+1);
+            }
+            return (a);
+        }
         
-        while (*parse_start_str_pos < str_p->length()) { // *
-            
-            // initial whitespace characters
-            if (initial_whitespaces) {
-                if (str[a] == ' ' || str[a] == '\n' || str[a] == '\r' || str[a] == '\t' ) {
-                    ++a;
+        // position after the object or array starting at a, respecting strings and comments
+        size_t container_end (size_t a) {
+            int level = 0;
+            while (a < str.length()) {
+                char c = str[a];
+                if (is_bracket (c, JSONstringquotes) >= 0) {
+                    a = string_end (a);
                     continue;
                 }
-                else {
-                    if (str[a] == '{') // start of object
-                        // ... TODO: seek_next ':'
-                    
-                    initial_whitespaces = false;
+                if (str.compare (a, JSONlinecommentstart.length(), JSONlinecommentstart) == 0) {
+                    size_t newline_pos = str.find_first_of ("\n\r", a);
+                    a = (newline_pos == std::string::npos) ? str.length() : newline_pos;
+                    continue;
                 }
+                if (c=='{' || c=='[')
+                    ++level;
+                else if (c=='}' || c==']') {
+                    if (--level == 0) return (a+1);
+                }
+                ++a;
             }
-            
-            
-            // delimiter
-            if ( bracket_stack.size()==0  &&  quote_stack.size()==0  &&  str[a]==JSONarraydelimiter ) {
-                //ret.push_back (current);
-                
-                //current.clear();
-                bracket_stack.clear(); quote_stack.clear(); escape_active = false;
-                continue; // to *
+            return (a);
+        }
+        
+        // end of an unquoted token: the next delimiter, closing bracket or comment
+        size_t token_end (size_t a, char stop='\0') {
+            while (a < str.length()) {
+                char c = str[a];
+                if (c==JSONarraydelimiter || c=='}' || c==']' || c==stop)
+                    break;
+                if (str.compare (a, JSONlinecommentstart.length(), JSONlinecommentstart) == 0)
+                    break;
+                ++a;
             }
-            
-            // ------------------------------------
-            // checks for string
-            
-            if (quote_stack.size() > 0) { // already inside string
-                if (str[a]==JSONcharescape)  // an escape character
-                    escape_active = !escape_active;
-                else if (!escape_active  &&  str[a]==JSONstringquotes[quote_stack.back()][1] ) { // close quote
-                    quote_stack.pop_back();
-                    escape_active = false;
-                }
+            return (a);
+        }
+        
+        std::string trimmed (size_t a, size_t b) {
+            while (a < b && (str[a]==' ' || str[a]=='\n' || str[a]=='\r' || str[a]=='\t')) ++a;
+            while (b > a && (str[b-1]==' ' || str[b-1]=='\n' || str[b-1]=='\r' || str[b-1]=='\t')) --b;
+            return (str.substr (a, b-a));
+        }
+        
+        // skips anything between a value and the next delimiter or closing bracket
+        void skip_to_delimiter (void) {
+            skip_space();
+            while (pos < str.length() && str[pos]!=JSONarraydelimiter && str[pos]!='}' && str[pos]!=']') {
+                if (is_bracket (str[pos], JSONstringquotes) >= 0)
+                    pos = string_end (pos);
+                else if (str[pos]=='{' || str[pos]=='[')
+                    pos = container_end (pos);
                 else
-                    escape_active = false;
-                
-                //current.push_back (str[a]);
-                continue; // to *
+                    ++pos;
+                skip_space();
             }
-            
-            if (quote_stack.size()==0) { // check for start of string
-                if ((bi = is_bracket (str[a], JSONstringquotes)) >= 0) {
-                    quote_stack.push_back (bi);
-                    //current.push_back (str[a]);
-                    continue; // to *
-                }
+        }
+        
+        // parses the value at pos into node. The text of the root node (keep_data) is left alone.
+        void parse_value (JSON& node, int depth, bool keep_data=false) {
+            skip_space();
+            node._exists = true;
+            if (pos >= str.length()) {
+                if (!keep_data) node.data.clear();
+                return;
             }
             
-            // ------------------------------------
-            // checks for comments
-            
-            if (quote_stack.size()==0) { // comment cannot start inside string
-                
-                // single-line commenst
-                if (str.compare (a, JSONlinecommentstart.length(), JSONlinecommentstart) == 0) {
-                    // ignore until end of line
-                    size_t newline_pos = str.find ("\n", a);
-                    if (newline_pos == std::string::npos)
-                        newline_pos = str.find ("\r", a);
-                    
-                    if (newline_pos != std::string::npos)
-                        a = newline_pos; // point to the newline character (a will be incremented)
-                    else // the comment continues until EOF
-                        a = str.length();
-                    continue;
+            char c = str[pos];
+            if ((c=='{' || c=='[') && depth < max_depth) {
+                size_t start = pos;
+                if (!node.parsed_data_p) node.parsed_data_p = new JSONparsedData;
+                parse_container (*node.parsed_data_p, depth);
+                if (!keep_data) {
+                    if (copy_string) node.data = str.substr (start, pos-start);
+                    else node.data.clear();
                 }
+                return;
             }
             
-            // ------------------------------------
-            // checks for brackets
-            
-            if ( bracket_stack.size()>0  &&  str[a]==JSONbrackets[bracket_stack.back()][1] ) { // check for closing bracket
-                bracket_stack.pop_back();
-                //current.push_back (str[a]);
-                continue;
+            size_t start = pos;
+            if (c=='{' || c=='[')  // beyond max_depth: kept as text, parsed on access
+                pos = container_end (pos);
+            else if (is_bracket (c, JSONstringquotes) >= 0)
+                pos = string_end (pos);
+            else
+                pos = token_end (pos);
+            if (!keep_data) node.data = trimmed (start, pos);
+            if (node.parsed_data_p) {
+                node.parsed_data_p->object.clear();
+                node.parsed_data_p->array.clear();
+                node.parsed_data_p->type = JSON_LEAF;
             }
+        }
+        
+        // parses the object or array at pos into pd
+        void parse_container (JSONparsedData& pd, int depth) {
+            pd.object.clear();
+            pd.array.clear();
+            bool is_object = (str[pos]=='{');
+            pd.type = is_object ? JSON_OBJECT : JSON_ARRAY;
+            char close = is_object ? '}' : ']';
+            ++pos;
             
-            if ((bi = is_bracket (str[a], JSONbrackets)) >= 0) {
-                bracket_stack.push_back (bi);
-                //current.push_back (str[a]);
-                continue; // to *
+            bool after_delimiter = false;
+            while (true) {
+                skip_space();
+                if (pos >= str.length()) return;
+                char c = str[pos];
+                if (c=='}' || c==']') {
+                    ++pos;
+                    if (c==close) return;
+                    continue; // mismatched bracket
+                }
+                if (c==JSONarraydelimiter) {
+                    if (!is_object && (after_delimiter || pd.array.empty()))
+                        pd.array.push_back (JSON (std::string())); // empty element, as split_JSON_array gives
+                    ++pos;
+                    after_delimiter = true;
+                    continue;
+                }
+                after_delimiter = false;
+                
+                if (is_object) {
+                    std::string key;
+                    if (is_bracket (c, JSONstringquotes) >= 0) {
+                        size_t end = string_end (pos);
+                        key = str.substr (pos+1, (end > pos+1 && str[end-1]==c) ? end-pos-2 : end-pos-1);
+                        pos = end;
+                        skip_space();
+                    }
+                    else {
+                        size_t end = token_end (pos, JSONobjectassignment);
+                        key = trimmed (pos, end);
+                        pos = end;
+                    }
+                    if (pos >= str.length() || str[pos]!=JSONobjectassignment) { // no value
+                        skip_to_delimiter();
+                        continue;
+                    }
+                    ++pos;
+                    auto inserted = pd.object.emplace (std::move(key), JSON());
+                    if (inserted.second)
+                        parse_value (inserted.first->second, depth+1);
+                    else { // the first of repeated keys is kept
+                        JSON ignored;
+                        parse_value (ignored, depth+1);
+                    }
+                }
+                else {
+                    pd.array.emplace_back();
+                    parse_value (pd.array.back(), depth+1);
+                }
+                skip_to_delimiter();
             }
-            
-            // ------------------------------------
-            // otherwise
-            //current.push_back (str[a]);
         }
-        
-        /*if (current.length() > 0)
-            ret.push_back (current); */
-        
-        if (isroot)
-            delete parse_start_str_pos;
-        
-        // return (ret);
+    };
+
+    inline 
+    void JSONparsedData::parse (const std::string& data, JSONType typ) {
+        JSONparser parser (data);
+        parser.skip_space();
+        char c = (parser.pos < data.length()) ? data[parser.pos] : '\0';
+        if ( (c=='{' && (typ==JSON_OBJECT || typ==JSON_UNKNOWN)) || (c=='[' && (typ==JSON_ARRAY || typ==JSON_UNKNOWN)) )
+            parser.parse_container (*this, 0);
+        else if (typ==JSON_UNKNOWN) {
+            object.clear(); // left from an earlier parse
+            array.clear();
+            type = JSON_LEAF;
+        }
+    }
+
+    inline 
+    void JSON::fast_parse (std::string* str_p, bool copy_string, int max_depth, size_t* parse_start_str_pos) {
+        bool own = (!str_p || str_p==&data);
+        JSONparser parser (own ? data : *str_p, copy_string, max_depth, parse_start_str_pos ? *parse_start_str_pos : 0);
+        if (max_depth > 0) {
+            if (own && !parsed_data_p) parsed_data_p = new JSONparsedData;
+            parser.parse_value (*this, 0, own);
+        }
+        if (parse_start_str_pos) *parse_start_str_pos = parser.pos;
     }
 
     // ============================================================
@@ -678,7 +771,7 @@ namespace jsonlib {
     inline 
     JSONobject& JSON::as_object (bool force) {
         if (!parsed_data_p)  parsed_data_p = new JSONparsedData;
-        if (parsed_data_p->type==JSON_UNKNOWN || force)  parsed_data_p->parse (data, JSON_OBJECT);
+        if (parsed_data_p->type==JSON_UNKNOWN || force)  parsed_data_p->parse (text(), JSON_OBJECT);
         return (parsed_data_p->object);
     }
     inline 
@@ -689,7 +782,7 @@ namespace jsonlib {
     inline 
     JSONarray& JSON::as_array (bool force) {
         if (!parsed_data_p)  parsed_data_p = new JSONparsedData;
-        if (parsed_data_p->type==JSON_UNKNOWN || force)  parsed_data_p->parse (data, JSON_ARRAY);
+        if (parsed_data_p->type==JSON_UNKNOWN || force)  parsed_data_p->parse (text(), JSON_ARRAY);
         return (parsed_data_p->array);
     }
     inline 
@@ -750,7 +843,7 @@ namespace jsonlib {
     std::string  JSON::as<std::string> (const std::string& def) {
         if (!exists()) return (def);
         char qq = '\0';
-        std::string ret = strip_outer_quotes (data, &qq);
+        std::string ret = strip_outer_quotes (text(), &qq);
         std::vector< std::vector<std::string> > escapes = { {"\\n","\n"}, {"\\r","\r"}, {"\\t","\t"}, {"\\\\","\\"} };
         if (qq=='"') {
             escapes.push_back ({"\\\"","\""});
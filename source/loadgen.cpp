@@ -0,0 +1,436 @@
+//
+//  loadgen.cpp
+//
+//  Drives an HTTP server with httplib::Client and reports throughput and
+//  latency percentiles.
+//
+//  Usage: loadgen [options] [URL]    (URL defaults to http://127.0.0.1:9600/)
+//
+//  Latencies are corrected for coordinated omission. With --rate, every
+//  request has a scheduled send time and its latency is measured from that
+//  time, so a stalled server is charged for the requests that queued up
+//  behind the stall. Without --rate, each connection sends as fast as it is
+//  answered, and a response slower than the median is backfilled with the
+//  requests that would have been sent meanwhile.
+//
+
+#include <httplib.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using httplib::LatencyHistogram;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct RequestSpec {
+    std::string method;
+    std::string path;
+    size_t weight = 1;
+};
+
+struct Options {
+    std::string scheme = "http";
+    std::string host = "127.0.0.1";
+    int port = 9600;
+    std::string path = "/";
+    size_t connections = 8;
+    double duration_sec = 10;
+    double warmup_sec = 1;
+    double rate = 0; // requests per second over all connections, 0 is closed
+    bool keep_alive = true;
+    size_t pipelining = 1;
+    std::vector<RequestSpec> requests;
+    std::string body;
+    std::string content_type = "application/x-www-form-urlencoded";
+    time_t timeout_sec = 5;
+};
+
+struct WorkerStats {
+    LatencyHistogram uncorrected;
+    LatencyHistogram corrected;
+    uint64_t requests = 0;
+    uint64_t errors = 0;     // no response
+    uint64_t non_2xx = 0;
+    uint64_t body_bytes = 0;
+};
+
+void record(LatencyHistogram &h, uint64_t usec, uint64_t count = 1) {
+    h.buckets[LatencyHistogram::bucket_index(usec)] += count;
+    h.count += count;
+    h.sum_usec += usec * count;
+}
+
+void merge(LatencyHistogram &to, const LatencyHistogram &from) {
+    for (size_t i = 0; i < LatencyHistogram::bucket_count; i++) {
+        to.buckets[i] += from.buckets[i];
+    }
+    to.count += from.count;
+    to.sum_usec += from.sum_usec;
+}
+
+// Adds the samples a connection would have seen had it kept sending every
+// `interval_usec` while a slow response held it up, as HdrHistogram's
+// recordValueWithExpectedInterval does.
+void backfill(LatencyHistogram &h, uint64_t interval_usec) {
+    if (!interval_usec) { return; }
+    auto raw = h;
+    for (size_t i = 0; i < LatencyHistogram::bucket_count; i++) {
+        auto n = raw.buckets[i];
+        if (!n) { continue; }
+        auto usec = i ? LatencyHistogram::bucket_upper_bound(i - 1) : 0;
+        for (auto v = usec; v > 2 * interval_usec;) {
+            v -= interval_usec;
+            record(h, v, n);
+        }
+    }
+}
+
+bool parse_url(const std::string &url, Options &opts) {
+    auto rest = url;
+    auto pos = rest.find("://");
+    if (pos != std::string::npos) {
+        opts.scheme = rest.substr(0, pos);
+        rest = rest.substr(pos + 3);
+    }
+    if (opts.scheme == "https") {
+#ifndef CPPHTTPLIB_OPENSSL_SUPPORT
+        std::cerr << "https needs a build with CPPHTTPLIB_OPENSSL_SUPPORT"
+                  << std::endl;
+        return false;
+#endif
+        opts.port = 443;
+    } else if (opts.scheme == "http") {
+        opts.port = 80;
+    } else {
+        return false;
+    }
+
+    pos = rest.find('/');
+    opts.path = pos == std::string::npos ? "/" : rest.substr(pos);
+    auto host = rest.substr(0, pos);
+    pos = host.rfind(':');
+    if (pos != std::string::npos && host.find(']', pos) == std::string::npos) {
+        opts.port = std::atoi(host.c_str() + pos + 1);
+        host = host.substr(0, pos);
+    }
+    if (host.size() > 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+    opts.host = host;
+    return !host.empty() && opts.port > 0;
+}
+
+// METHOD:PATH[@WEIGHT], e.g. "GET:/@9" and "POST:/@1".
+bool parse_request_spec(const std::string &s, RequestSpec &spec) {
+    auto colon = s.find(':');
+    if (colon == std::string::npos || colon == 0) { return false; }
+    spec.method = s.substr(0, colon);
+    spec.path = s.substr(colon + 1);
+    auto at = spec.path.rfind('@');
+    if (at != std::string::npos) {
+        spec.weight = std::strtoul(spec.path.c_str() + at + 1, nullptr, 10);
+        spec.path = spec.path.substr(0, at);
+    }
+    return !spec.path.empty() && spec.path[0] == '/' && spec.weight > 0;
+}
+
+std::unique_ptr<httplib::Client> make_client(const Options &opts) {
+    std::unique_ptr<httplib::Client> cli;
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+    if (opts.scheme == "https") {
+        cli.reset(new httplib::SSLClient(opts.host, opts.port));
+    }
+#endif
+    if (!cli) { cli.reset(new httplib::Client(opts.host, opts.port)); }
+    cli->set_timeout_sec(opts.timeout_sec);
+    cli->set_read_timeout(opts.timeout_sec, 0);
+    if (opts.pipelining > 1) {
+        cli->set_pipelining_depth(opts.pipelining);
+        cli->set_keep_alive_max_count(opts.pipelining);
+    } else if (opts.keep_alive) {
+        // A pool of its own keeps the connection open between requests.
+        cli->set_connection_pool(std::make_shared<httplib::ConnectionPool>(1));
+    }
+    return cli;
+}
+
+httplib::Request make_request(const Options &opts, const RequestSpec &spec) {
+    httplib::Request req;
+    req.method = spec.method;
+    req.path = spec.path;
+    if (!opts.body.empty() &&
+        (spec.method == "POST" || spec.method == "PUT" ||
+         spec.method == "PATCH")) {
+        req.headers.emplace("Content-Type", opts.content_type);
+        req.body = opts.body;
+    }
+    return req;
+}
+
+// Each connection walks the weighted request mix in the same order, from its
+// own offset, so runs are repeatable.
+std::vector<httplib::Request> expand_mix(const Options &opts) {
+    std::vector<httplib::Request> mix;
+    for (const auto &spec : opts.requests) {
+        for (size_t i = 0; i < spec.weight; i++) {
+            mix.push_back(make_request(opts, spec));
+        }
+    }
+    return mix;
+}
+
+uint64_t usec_between(Clock::time_point from, Clock::time_point to) {
+    if (to <= from) { return 0; }
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(to - from)
+            .count());
+}
+
+void run_worker(const Options &opts, size_t id,
+                const std::vector<httplib::Request> &mix,
+                Clock::time_point start, Clock::time_point measure_from,
+                Clock::time_point end, WorkerStats &stats) {
+    auto cli = make_client(opts);
+
+    // Requests per batch: a pipelined batch goes out on one connection and
+    // completes as a whole, so its requests share a latency.
+    auto batch = opts.pipelining > 1 ? opts.pipelining : size_t(1);
+    std::chrono::nanoseconds interval(0);
+    if (opts.rate > 0) {
+        auto per_connection = opts.rate / static_cast<double>(opts.connections);
+        interval = std::chrono::nanoseconds(static_cast<int64_t>(
+            1e9 * static_cast<double>(batch) / per_connection));
+    }
+
+    auto next = id;
+    auto intended = start;
+    std::vector<httplib::Request> requests;
+    std::vector<httplib::Response> responses;
+    for (;;) {
+        if (interval.count()) {
+            // Never skip ahead: if the server fell behind, the requests
+            // scheduled meanwhile go out at once and are charged the wait.
+            std::this_thread::sleep_until(intended);
+        } else {
+            intended = Clock::now();
+        }
+        if (intended >= end) { break; }
+
+        auto sent = Clock::now();
+        responses.clear();
+        if (batch == 1) {
+            httplib::Response res;
+            if (cli->send(mix[next++ % mix.size()], res)) {
+                responses.push_back(std::move(res));
+            }
+        } else {
+            requests.clear();
+            for (size_t i = 0; i < batch; i++) {
+                requests.push_back(mix[next++ % mix.size()]);
+            }
+            cli->send(requests, responses);
+        }
+        auto done = Clock::now();
+        auto ok = responses.size();
+
+        if (intended >= measure_from) {
+            stats.requests += ok;
+            stats.errors += batch - ok;
+            for (const auto &res : responses) {
+                if (res.status < 200 || res.status >= 300) { stats.non_2xx++; }
+                stats.body_bytes += res.body.size();
+            }
+            if (ok) {
+                record(stats.uncorrected, usec_between(sent, done), ok);
+                record(stats.corrected, usec_between(intended, done), ok);
+            }
+        }
+
+        if (interval.count()) { intended += interval; }
+    }
+}
+
+void print_histogram(const char *title, const LatencyHistogram &h) {
+    printf("  %s\n", title);
+    if (!h.count) {
+        printf("    (no samples)\n");
+        return;
+    }
+    printf("    mean %10.3f ms\n",
+           static_cast<double>(h.sum_usec) / static_cast<double>(h.count) /
+               1000.0);
+    const double ps[] = {0.5, 0.75, 0.9, 0.99, 0.999, 0.9999, 1.0};
+    for (auto p : ps) {
+        printf("    %7.3f%% %10.3f ms\n", p * 100,
+               static_cast<double>(h.percentile(p)) / 1000.0);
+    }
+}
+
+void usage(const char *prog) {
+    std::cerr
+        << "usage: " << prog << " [options] [URL]\n"
+        << "  -c, --connections=N   concurrent connections (8)\n"
+        << "  -d, --duration=SEC    measured time (10)\n"
+        << "  -w, --warmup=SEC      time before measuring starts (1)\n"
+        << "  -R, --rate=N          requests/s over all connections; 0 sends\n"
+        << "                        as fast as responses come back (0)\n"
+        << "  -k, --keep-alive=0|1  reuse connections (1)\n"
+        << "  -p, --pipeline=N      requests written ahead per connection;\n"
+        << "                        each batch of N uses a new connection (1)\n"
+        << "  -r, --request=METHOD:PATH[@WEIGHT]\n"
+        << "                        adds to the request mix, repeatable\n"
+        << "                        (GET on the URL's path)\n"
+        << "  -b, --body=DATA       body of POST, PUT and PATCH requests\n"
+        << "  -T, --content-type=T  its Content-Type\n"
+        << "  -t, --timeout=SEC     connect and read timeout (5)\n";
+}
+
+// Accepts "--name=value", "-x value" and "-xvalue".
+bool take_arg(int argc, char **argv, int &i, const char *shrt,
+              const char *lng, std::string &value) {
+    std::string arg = argv[i];
+    auto prefix = std::string("--") + lng + "=";
+    if (arg.compare(0, prefix.size(), prefix) == 0) {
+        value = arg.substr(prefix.size());
+        return true;
+    }
+    auto flag = std::string("-") + shrt;
+    if (arg == flag && i + 1 < argc) {
+        value = argv[++i];
+        return true;
+    }
+    if (arg.size() > flag.size() && arg.compare(0, flag.size(), flag) == 0 &&
+        arg[1] != '-') {
+        value = arg.substr(flag.size());
+        return true;
+    }
+    return false;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    Options opts;
+    std::string url = "http://127.0.0.1:9600/";
+
+    for (int i = 1; i < argc; i++) {
+        std::string v;
+        if (take_arg(argc, argv, i, "c", "connections", v)) {
+            opts.connections = std::strtoul(v.c_str(), nullptr, 10);
+        } else if (take_arg(argc, argv, i, "d", "duration", v)) {
+            opts.duration_sec = std::atof(v.c_str());
+        } else if (take_arg(argc, argv, i, "w", "warmup", v)) {
+            opts.warmup_sec = std::atof(v.c_str());
+        } else if (take_arg(argc, argv, i, "R", "rate", v)) {
+            opts.rate = std::atof(v.c_str());
+        } else if (take_arg(argc, argv, i, "k", "keep-alive", v)) {
+            opts.keep_alive = v != "0";
+        } else if (take_arg(argc, argv, i, "p", "pipeline", v)) {
+            opts.pipelining = std::strtoul(v.c_str(), nullptr, 10);
+        } else if (take_arg(argc, argv, i, "r", "request", v)) {
+            RequestSpec spec;
+            if (!parse_request_spec(v, spec)) {
+                std::cerr << "bad request: " << v << std::endl;
+                return 1;
+            }
+            opts.requests.push_back(spec);
+        } else if (take_arg(argc, argv, i, "b", "body", v)) {
+            opts.body = v;
+        } else if (take_arg(argc, argv, i, "T", "content-type", v)) {
+            opts.content_type = v;
+        } else if (take_arg(argc, argv, i, "t", "timeout", v)) {
+            opts.timeout_sec = std::atol(v.c_str());
+        } else if (argv[i][0] != '-') {
+            url = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!parse_url(url, opts)) {
+        std::cerr << "bad URL: " << url << std::endl;
+        return 1;
+    }
+    if (!opts.connections || opts.duration_sec <= 0 || !opts.pipelining) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (opts.requests.empty()) {
+        RequestSpec spec;
+        spec.method = "GET";
+        spec.path = opts.path;
+        opts.requests.push_back(spec);
+    }
+    auto mix = expand_mix(opts);
+
+    printf("%s://%s:%d, %zu connections, %.1fs (+%.1fs warmup), ",
+           opts.scheme.c_str(), opts.host.c_str(), opts.port, opts.connections,
+           opts.duration_sec, opts.warmup_sec);
+    if (opts.rate > 0) {
+        printf("%.0f req/s", opts.rate);
+    } else {
+        printf("closed loop");
+    }
+    printf(", keep-alive %s, pipelining %zu\n", opts.keep_alive ? "on" : "off",
+           opts.pipelining);
+
+    auto to_duration = [](double sec) {
+        return std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(sec));
+    };
+    auto start = Clock::now();
+    auto measure_from = start + to_duration(opts.warmup_sec);
+    auto end = measure_from + to_duration(opts.duration_sec);
+
+    std::vector<WorkerStats> stats(opts.connections);
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < opts.connections; i++) {
+        workers.emplace_back(run_worker, std::cref(opts), i, std::cref(mix),
+                             start, measure_from, end, std::ref(stats[i]));
+    }
+    for (auto &t : workers) {
+        t.join();
+    }
+    auto elapsed = std::chrono::duration<double>(
+                       (std::max)(Clock::now(), end) - measure_from)
+                       .count();
+
+    WorkerStats total;
+    for (auto &s : stats) {
+        if (opts.rate <= 0 && s.uncorrected.count) {
+            // The median response time stands in for the send interval a
+            // connection would have kept up without the slow responses.
+            backfill(s.corrected, s.uncorrected.percentile(0.5));
+        }
+        merge(total.uncorrected, s.uncorrected);
+        merge(total.corrected, s.corrected);
+        total.requests += s.requests;
+        total.errors += s.errors;
+        total.non_2xx += s.non_2xx;
+        total.body_bytes += s.body_bytes;
+    }
+
+    printf("\n  requests   %llu in %.2fs, %.1f req/s, %.2f MB/s (bodies)\n",
+           static_cast<unsigned long long>(total.requests), elapsed,
+           static_cast<double>(total.requests) / elapsed,
+           static_cast<double>(total.body_bytes) / elapsed / 1e6);
+    printf("  errors     %llu failed, %llu non-2xx\n\n",
+           static_cast<unsigned long long>(total.errors),
+           static_cast<unsigned long long>(total.non_2xx));
+    print_histogram("latency, corrected for coordinated omission",
+                    total.corrected);
+    print_histogram("latency, service time only", total.uncorrected);
+
+    return total.requests && !total.errors ? 0 : 2;
+}